@@ -218,6 +218,7 @@ typedef struct {
   psync_socket_t sock;
   int pending;
   uint32_t misc;
+  uint32_t minrtt;
 } psync_socket;
 
 typedef uint64_t psync_inode_t;
@@ -322,6 +323,9 @@ int psync_socket_read_thread(psync_socket *sock, void *buff, int num);
 int psync_socket_write(psync_socket *sock, const void *buff, int num);
 int psync_socket_readall(psync_socket *sock, void *buff, int num);
 int psync_socket_writeall(psync_socket *sock, const void *buff, int num);
+int psync_socket_can_sendfile(psync_socket *sock);
+int psync_socket_sendfile(psync_socket *sock, psync_file_t fd, uint64_t offset, int num);
+int psync_socket_get_rtt(psync_socket *sock, int recv, uint32_t *rttus);
 int psync_socket_readall_thread(psync_socket *sock, void *buff, int num);
 int psync_socket_writeall_thread(psync_socket *sock, const void *buff, int num);
 
@@ -340,6 +344,19 @@ int psync_wait_socket_read_timeout(psync_socket_t sock);
 int psync_socket_is_broken(psync_socket_t sock);
 int psync_select_in(psync_socket_t *sockets, int cnt, int64_t timeoutmillisec);
 
+#define PSYNC_REACTOR_READ    1
+#define PSYNC_REACTOR_WRITE   2
+#define PSYNC_REACTOR_TIMEOUT 4
+#define PSYNC_REACTOR_ERROR   8
+
+typedef struct _psync_reactor_watch psync_reactor_watch;
+typedef void (*psync_reactor_callback)(psync_reactor_watch *, void *, uint32_t);
+
+/* timeoutms<0 means no timeout */
+psync_reactor_watch *psync_reactor_add(psync_socket_t sock, uint32_t events, int64_t timeoutms, psync_reactor_callback cb, void *ptr);
+void psync_reactor_rearm(psync_reactor_watch *w, uint32_t events, int64_t timeoutms);
+void psync_reactor_del(psync_reactor_watch *w);
+
 int psync_list_dir(const char *path, psync_list_dir_callback callback,
                    void *ptr);
 int psync_list_dir_fast(const char *path, psync_list_dir_callback_fast callback,
@@ -41,10 +41,23 @@ typedef int (*poverlay_callback)(const char *path, void *rep);
  */
 int psync_overlay_add_callback(int id, poverlay_callback callback);
 
-/*! \brief Process a \a request. */
+/*! \brief Process a \a request.
+ *
+ * The \a response must point to a buffer of POVERLAY_BUFSIZE bytes.  A reply
+ * returned by a callback is copied into it and truncated to fit.
+ */
 void psync_overlay_process_request(poverlay_message_t *request,
                                    poverlay_message_t *response);
 
+/*! \brief Process a \a request, passing callback replies of any size.
+ *
+ * The \a response must point to a psync_malloc'ed message of at least
+ * POVERLAY_BUFSIZE bytes.  A callback may replace it with its own reply, in
+ * which case the original message is freed and \a response is updated.
+ */
+void psync_overlay_process_request2(poverlay_message_t *request,
+                                    poverlay_message_t **response);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
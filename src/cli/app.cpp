@@ -83,6 +83,7 @@ int pcloud::cli::App::run() {
     Bridge::get_lib().newuser_ = newuser_;
     Bridge::get_lib().set_savepass(savepassword_);
     Bridge::get_lib().set_daemon(daemonize_);
+    psync_set_database_read_connections(dbreaders_);
 
     if (daemonize_)
       daemonize(commands_);
@@ -151,6 +152,10 @@ void pcloud::cli::App::setup_options() {
 
   app_->add_flag("--savepassword,-s", savepassword_,
                  "Save password in database");
+
+  app_->add_option("--dbreaders", dbreaders_,
+                   "Read the database on this many read-only connections\n"
+                   "(off by default, the database is then not locked exclusively)");
 }
 
 void pcloud::cli::App::print_version(std::size_t /* count */) {
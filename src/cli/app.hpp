@@ -70,6 +70,7 @@ class App {
   bool newuser_ = false;
   bool commands_ = false;
   bool savepassword_ = false;
+  unsigned int dbreaders_ = 0;
   std::string username_;
   std::string mountpoint_;
 };
@@ -11,6 +11,8 @@
 #include <unistd.h>
 
 #include <array>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <memory>
@@ -269,6 +271,60 @@ int pcloud::cli::Bridge::list_sync_folders(const char *path, void *rep) {
   return 0;
 }
 
+// Takes "on" or "off" to switch the database lock profiler, anything else is
+// the number of call sites to report and the report is sent back as reply.
+int pcloud::cli::Bridge::lock_stats(const char *arg, void *rep) {
+  const char *text;
+  char *report = nullptr;
+  poverlay_message_t *msg;
+  size_t len;
+
+  if (!strcmp(arg, "on")) {
+    psync_set_lock_profiling(1);
+    text = "Lock profiling enabled";
+  } else if (!strcmp(arg, "off")) {
+    psync_set_lock_profiling(0);
+    text = "Lock profiling disabled";
+  } else {
+    int topn = atoi(arg);
+    report = psync_get_lock_profile(topn > 0 ? topn : 20);
+    text = report;
+  }
+
+  len = strlen(text) + 1;
+  msg = (poverlay_message_t *)psync_malloc(sizeof(poverlay_message_t) + len);
+  msg->type = 0;
+  msg->length = sizeof(poverlay_message_t) + len;
+  memcpy(msg->value, text, len);
+  *(poverlay_message_t **)rep = msg;
+
+  if (report) psync_free(report);
+  return 0;
+}
+
+// Sends back the number of full and resumed TLS handshakes as reply.
+int pcloud::cli::Bridge::tls_stats(const char *arg, void *rep) {
+  uint64_t full, resumed;
+  poverlay_message_t *msg;
+  char text[128];
+  size_t len;
+
+  psync_get_ssl_handshake_counts(&full, &resumed);
+  snprintf(text, sizeof(text),
+           "TLS handshakes: %llu full, %llu resumed (%llu%% resumed)",
+           (unsigned long long)full, (unsigned long long)resumed,
+           (unsigned long long)(full + resumed ? resumed * 100 / (full + resumed)
+                                               : 0));
+
+  len = strlen(text) + 1;
+  msg = (poverlay_message_t *)psync_malloc(sizeof(poverlay_message_t) + len);
+  msg->type = 0;
+  msg->length = sizeof(poverlay_message_t) + len;
+  memcpy(msg->value, text, len);
+  *(poverlay_message_t **)rep = msg;
+  return 0;
+}
+
 // Has to be static
 static const char *software_string = PCLOUD_VERSION_FULL;
 
@@ -314,6 +370,8 @@ int pcloud::cli::Bridge::init() {
   psync_overlay_add_callback(20, &start_crypto);
   psync_overlay_add_callback(21, &stop_crypto);
   psync_overlay_add_callback(22, &list_sync_folders);
+  psync_overlay_add_callback(25, &lock_stats);
+  psync_overlay_add_callback(26, &tls_stats);
 
   return 0;
 }
@@ -62,6 +62,8 @@ class Bridge {
   static int start_crypto(const char* pass, void* rep);
   static int stop_crypto(const char* path, void* rep);
   static int list_sync_folders(const char* path, void* rep);
+  static int lock_stats(const char* arg, void* rep);
+  static int tls_stats(const char* arg, void* rep);
 
   // Singleton
   static Bridge& get_lib();
@@ -62,6 +62,40 @@ void pcloud::cli::stop_crypto() {
   if (errm) free(errm);
 }
 
+void pcloud::cli::lock_stats(const char *arg) {
+  int ret;
+  char *errm = nullptr;
+  int status = send_call(LOCKSTATS, arg, &ret, &errm);
+
+  /* -1 can only be returned from overlay_client */
+  if (status == -1) {
+    std::cout << "Failed to get lock statistics: " << errm << std::endl;
+  } else if (status == 0) {
+    std::cout << errm << std::endl;
+  } else {
+    std::cout << "Failed to get lock statistics: unknown status" << std::endl;
+  }
+
+  if (errm) free(errm);
+}
+
+void pcloud::cli::tls_stats() {
+  int ret;
+  char *errm = nullptr;
+  int status = send_call(TLSSTATS, "", &ret, &errm);
+
+  /* -1 can only be returned from overlay_client */
+  if (status == -1) {
+    std::cout << "Failed to get TLS statistics: " << errm << std::endl;
+  } else if (status == 0) {
+    std::cout << errm << std::endl;
+  } else {
+    std::cout << "Failed to get TLS statistics: unknown status" << std::endl;
+  }
+
+  if (errm) free(errm);
+}
+
 void static print_menu() {
   std::cout << std::endl << "Help:" << std::endl << std::endl;
 
@@ -72,6 +106,14 @@ void static print_menu() {
             << "Stop a crypto session" << std::endl
             << std::endl;
 
+  std::cout << "  Diagnostics" << std::endl;
+  std::cout << "   lockstats [on|off|N]        "
+            << "Switch database lock profiling or show the top N lock sites"
+            << std::endl;
+  std::cout << "   tlsstats                    "
+            << "Show how many TLS handshakes resumed a session" << std::endl
+            << std::endl;
+
   std::cout << "  Misc" << std::endl;
   std::cout << "   m, menu                     "
             << "Print this menu" << std::endl
@@ -92,6 +134,11 @@ void pcloud::cli::process_commands() {
       start_crypto(line.c_str() + 12);
     } else if (line == "stopcrypto") {
       stop_crypto();
+    } else if (!line.compare(0, 9, "lockstats", 0, 9) &&
+               (line.length() == 9 || line[9] == ' ')) {
+      lock_stats(line.length() > 10 ? line.c_str() + 10 : "");
+    } else if (line == "tlsstats") {
+      tls_stats();
     } else if (line == "menu" || line == "m") {
       print_menu();
     } else if (line == "quit" || line == "q") {
@@ -16,6 +16,8 @@ namespace pcloud {
 namespace cli {
 void start_crypto(const char *pass);
 void stop_crypto();
+void lock_stats(const char *arg);
+void tls_stats();
 PSYNC_NO_RETURN void daemonize(bool do_commands);
 void process_commands();
 }  // namespace cli
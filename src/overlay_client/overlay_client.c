@@ -93,6 +93,10 @@ static const char *cmd2str(const overlay_command_t cmd) {
       return "addsync";
     case STOPSYNC:
       return "stopsync";
+    case LOCKSTATS:
+      return "lockstats";
+    case TLSSTATS:
+      return "tlsstats";
     default:
       return "unknown";
   }
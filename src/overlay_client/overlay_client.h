@@ -27,7 +27,9 @@ typedef enum overlay_command_ {
   STOPCRYPTO,
   LISTSYNC,
   ADDSYNC,
-  STOPSYNC
+  STOPSYNC,
+  LOCKSTATS,
+  TLSSTATS
 } overlay_command_t;
 
 int query_state(overlay_file_state_t *state, char *path);
@@ -137,292 +137,554 @@ void psync_api_conn_fail_reset() {
     connfailures = 0;
 }
 
-#define _NEED_DATA(cnt) if (unlikely_log(*datalen<(cnt))) return -1
 #define ALIGN_BYTES psync_alignof(uint64_t)
 
-static ssize_t calc_ret_len(unsigned char **restrict data, size_t *restrict datalen, size_t *restrict strcnt) {
-  size_t type, len;
-  long cond;
-  _NEED_DATA(1);
-  type=**data;
-  (*data)++;
-  (*datalen)--;
-  if ((cond=(type>=RPARAM_SHORT_STR_BASE && type<RPARAM_SHORT_STR_BASE+VSHORT_STR_LEN)) || (type>=RPARAM_STR1 && type<=RPARAM_STR4)) {
-    if (cond)
-      len=type-RPARAM_SHORT_STR_BASE;
-    else {
-      size_t l=type-RPARAM_STR1+1;
-      _NEED_DATA(l);
-      len=0;
-      memcpy(&len, *data, l);
-      *data+=l;
-      *datalen-=l;
-    }
-    _NEED_DATA(len);
-    *data+=len;
-    *datalen-=len;
-    len=((len+ALIGN_BYTES)/ALIGN_BYTES)*ALIGN_BYTES;
-    (*strcnt)++;
-    return offsetof(binresult, str)+len;
-  }
-  else if ((cond=(type>=RPARAM_RSTR1 && type<=RPARAM_RSTR4)) || (type>=RPARAM_SHORT_RSTR_BASE && type<RPARAM_SHORT_RSTR_BASE+VSHORT_RSTR_CNT)) {
-    if (cond) {
-      size_t l=type-RPARAM_RSTR1+1;
-      _NEED_DATA(l);
-      len=0;
-      memcpy(&len, *data, l);
-      *data+=l;
-      *datalen-=l;
-    }
-    else
-      len=type-RPARAM_SHORT_RSTR_BASE;
-    if (len<*strcnt)
-      return 0;
-    else
+/*
+ * The result is parsed in one pass while it is read from the socket through a
+ * buffer of at most PSYNC_RESULT_READ_BUFFER bytes, long strings are read
+ * straight into their place in the result. The nodes are appended to an arena
+ * which grows with realloc, so until the arena is complete nodes refer to each
+ * other by offset (odd values, nodes are aligned) while pointers to the static
+ * constants are stored as they are. fix_result() converts the offsets to
+ * pointers once the arena no longer moves. The result is still a single
+ * allocation rooted at its start, freed with psync_free().
+ *
+ * In streaming mode the array under a given key of the top level hash is cut
+ * into batches, each of them a separate arena handed to a callback as soon as
+ * it is complete. Reused strings may refer to strings of an earlier batch, so
+ * the parser keeps its own copy of all strings and copies them again in the
+ * first batch that uses them.
+ */
+
+typedef struct {
+  unsigned char *data;
+  size_t used;
+  size_t alloc;
+  uint32_t gen;
+} result_arena;
+
+typedef struct {
+  uintptr_t ref;
+  size_t storeoff;
+  uint32_t len;
+  uint32_t gen;
+} result_string;
+
+typedef struct {
+  psync_socket *sock;
+  unsigned char *buff;
+  size_t pos;
+  size_t end;
+  size_t size;
+  size_t remaining;
+  int thread;
+  result_arena *arena;
+  result_arena top;
+  result_arena batch;
+  result_string *strings;
+  size_t strcnt;
+  size_t stralloc;
+  char *store;
+  size_t storeused;
+  size_t storealloc;
+  uintptr_t *stack;
+  size_t stackcnt;
+  size_t stackalloc;
+  const char *streamkey;
+  psync_result_batch_callback streamcb;
+  void *streamptr;
+  size_t batchalloc;
+  uint32_t batchsize;
+  uint32_t depth;
+  uint32_t gens;
+  int aborted;
+} result_parser;
+
+#define NODE(a, ref) ((binresult *)((a)->data+((ref)-1)))
+#define IS_ARENA_REF(ref) ((ref)&1)
+
+static int parser_fill(result_parser *p, size_t need) {
+  size_t avail, rd;
+  int r;
+  avail=p->end-p->pos;
+  if (unlikely(need-avail>p->remaining)) {
+    log_warn("truncated response, need %lu more bytes, only %lu left",
+             (unsigned long)(need-avail), (unsigned long)p->remaining);
+    return -1;
+  }
+  if (avail)
+    memmove(p->buff, p->buff+p->pos, avail);
+  p->pos=0;
+  p->end=avail;
+  rd=p->size-avail;
+  if (rd>p->remaining)
+    rd=p->remaining;
+  if (p->thread)
+    r=psync_socket_readall_thread(p->sock, p->buff+avail, rd);
+  else
+    r=psync_socket_readall(p->sock, p->buff+avail, rd);
+  if (unlikely(r!=(int)rd)) {
+    log_warn("failed to read %lu bytes of the response from the socket", (unsigned long)rd);
+    p->remaining=0;
+    return -1;
+  }
+  p->end+=rd;
+  p->remaining-=rd;
+  return 0;
+}
+
+#define parser_need(p, n) (likely((p)->end-(p)->pos>=(n)) || !parser_fill(p, n))
+
+static int parser_read(result_parser *p, void *dst, size_t len) {
+  size_t avail;
+  int r;
+  avail=p->end-p->pos;
+  if (avail>=len) {
+    memcpy(dst, p->buff+p->pos, len);
+    p->pos+=len;
+    return 0;
+  }
+  memcpy(dst, p->buff+p->pos, avail);
+  p->pos=p->end;
+  dst=(char *)dst+avail;
+  len-=avail;
+  if (len<p->size/2) {
+    if (parser_fill(p, len))
       return -1;
+    memcpy(dst, p->buff, len);
+    p->pos=len;
+    return 0;
   }
-  else if (type>=RPARAM_NUM1 && type<=RPARAM_NUM8) {
-    len=type-RPARAM_NUM1+1;
-    _NEED_DATA(len);
-    *data+=len;
-    *datalen-=len;
-    return sizeof(binresult);
+  if (unlikely(len>p->remaining)) {
+    log_warn("truncated response, need %lu more bytes, only %lu left",
+             (unsigned long)len, (unsigned long)p->remaining);
+    return -1;
   }
-  else if (type>=RPARAM_SMALL_NUM_BASE && type<RPARAM_SMALL_NUM_BASE+VSMALL_NUMBER_NUM)
+  if (p->thread)
+    r=psync_socket_readall_thread(p->sock, dst, len);
+  else
+    r=psync_socket_readall(p->sock, dst, len);
+  if (unlikely(r!=(int)len)) {
+    log_warn("failed to read %lu bytes of the response from the socket", (unsigned long)len);
+    p->remaining=0;
+    return -1;
+  }
+  p->remaining-=len;
+  return 0;
+}
+
+static uint64_t parser_read_num(result_parser *p, size_t len) {
+  uint64_t num;
+  num=0;
+  memcpy(&num, p->buff+p->pos, len);
+  p->pos+=len;
+  return num;
+}
+
+static uintptr_t arena_alloc(result_arena *a, size_t size) {
+  uintptr_t ret;
+  if (unlikely(a->used+size>a->alloc)) {
+    do {
+      a->alloc*=2;
+    } while (a->used+size>a->alloc);
+    a->data=(unsigned char *)psync_realloc(a->data, a->alloc);
+  }
+  ret=a->used+1;
+  a->used+=size;
+  return ret;
+}
+
+static void arena_init(result_parser *p, result_arena *a, size_t size) {
+  a->data=psync_new_cnt(unsigned char, size);
+  a->used=0;
+  a->alloc=size;
+  a->gen=++p->gens;
+}
+
+static void parser_push(result_parser *p, uintptr_t ref) {
+  if (unlikely(p->stackcnt==p->stackalloc)) {
+    p->stackalloc*=2;
+    p->stack=(uintptr_t *)psync_realloc(p->stack, sizeof(uintptr_t)*p->stackalloc);
+  }
+  p->stack[p->stackcnt++]=ref;
+}
+
+static uintptr_t new_string(result_parser *p, const char *src, size_t len) {
+  binresult *str;
+  uintptr_t ref;
+  ref=arena_alloc(p->arena, offsetof(binresult, str)+((len+ALIGN_BYTES)/ALIGN_BYTES)*ALIGN_BYTES);
+  str=NODE(p->arena, ref);
+  str->type=PARAM_STR;
+  str->length=len;
+  if (src)
+    memcpy((char *)str->str, src, len);
+  else if (parser_read(p, (char *)str->str, len))
     return 0;
-  else if (type==RPARAM_BFALSE || type==RPARAM_BTRUE)
+  ((char *)str->str)[len]=0;
+  return ref;
+}
+
+static uintptr_t parse_string(result_parser *p, size_t len) {
+  result_string *s;
+  uintptr_t ref;
+  ref=new_string(p, NULL, len);
+  if (unlikely(!ref))
     return 0;
-  else if (type==RPARAM_ARRAY) {
-    ssize_t ret, r;
-    int unsigned cnt;
-    cnt=0;
-    ret=sizeof(binresult);
-    while (**data!=RPARAM_END) {
-      r=calc_ret_len(data, datalen, strcnt);
-      if (r==-1)
-        return -1;
-      ret+=r;
-      cnt++;
-      _NEED_DATA(1);
+  if (unlikely(p->strcnt==p->stralloc)) {
+    p->stralloc*=2;
+    p->strings=(result_string *)psync_realloc(p->strings, sizeof(result_string)*p->stralloc);
+  }
+  s=&p->strings[p->strcnt++];
+  s->ref=ref;
+  s->len=len;
+  s->gen=p->arena->gen;
+  if (p->streamkey) {
+    if (p->storeused+len>p->storealloc) {
+      do {
+        p->storealloc*=2;
+      } while (p->storeused+len>p->storealloc);
+      p->store=(char *)psync_realloc(p->store, p->storealloc);
     }
-    (*data)++;
-    (*datalen)--;
-    ret+=sizeof(binresult *)*cnt;
-    return ret;
+    memcpy(p->store+p->storeused, NODE(p->arena, ref)->str, len);
+    s->storeoff=p->storeused;
+    p->storeused+=len;
   }
-  else if (type==RPARAM_HASH) {
-    ssize_t ret, r;
-    int unsigned cnt;
-    cnt=0;
-    ret=sizeof(binresult);
-    while (**data!=RPARAM_END) {
-      r=calc_ret_len(data, datalen, strcnt);
-      if (r==-1)
-        return -1;
-      ret+=r;
-      r=calc_ret_len(data, datalen, strcnt);
-      if (r==-1)
-        return -1;
-      ret+=r;
-      cnt++;
-      _NEED_DATA(1);
+  return ref;
+}
+
+static uintptr_t reuse_string(result_parser *p, size_t id) {
+  result_string *s;
+  if (unlikely(id>=p->strcnt)) {
+    log_warn("reference to string %lu, only %lu strings defined", (unsigned long)id, (unsigned long)p->strcnt);
+    return 0;
+  }
+  s=&p->strings[id];
+  if (likely(s->gen==p->arena->gen))
+    return s->ref;
+  // the string is in a batch that was already handed over, copy it in the current one
+  s->ref=new_string(p, p->store+s->storeoff, s->len);
+  s->gen=p->arena->gen;
+  return s->ref;
+}
+
+static uintptr_t parse_value(result_parser *p);
+
+static uintptr_t parse_array_items(result_parser *p, uintptr_t ref) {
+  binresult *arr;
+  uintptr_t slots, r;
+  size_t base, cnt;
+  base=p->stackcnt;
+  while (1) {
+    if (unlikely(!parser_need(p, 1)))
+      return 0;
+    if (p->buff[p->pos]==RPARAM_END)
+      break;
+    r=parse_value(p);
+    if (unlikely(!r))
+      return 0;
+    parser_push(p, r);
+  }
+  p->pos++;
+  cnt=p->stackcnt-base;
+  slots=arena_alloc(p->arena, sizeof(binresult *)*cnt);
+  memcpy(p->arena->data+slots-1, p->stack+base, sizeof(uintptr_t)*cnt);
+  p->stackcnt=base;
+  arr=NODE(p->arena, ref);
+  arr->length=cnt;
+  arr->array=(binresult **)(slots-1);
+  return ref;
+}
+
+static void fix_result(unsigned char *base, binresult *res) {
+  binresult *child;
+  uintptr_t r;
+  uint32_t i;
+  if (res->type==PARAM_ARRAY) {
+    res->array=(binresult **)(base+(uintptr_t)res->array);
+    for (i=0; i<res->length; i++) {
+      r=(uintptr_t)res->array[i];
+      if (IS_ARENA_REF(r)) {
+        child=(binresult *)(base+r-1);
+        res->array[i]=child;
+        if (child->type==PARAM_ARRAY || child->type==PARAM_HASH)
+          fix_result(base, child);
+      }
     }
-    (*data)++;
-    (*datalen)--;
-    ret+=sizeof(hashpair)*cnt;
-    return ret;
   }
-  else if (type==RPARAM_DATA) {
-    _NEED_DATA(8);
-    *data+=8;
-    *datalen-=8;
-    return sizeof(binresult);
+  else if (res->type==PARAM_HASH) {
+    res->hash=(hashpair *)(base+(uintptr_t)res->hash);
+    for (i=0; i<res->length; i++) {
+      res->hash[i].key=((binresult *)(base+(uintptr_t)res->hash[i].key-1))->str;
+      r=(uintptr_t)res->hash[i].value;
+      if (IS_ARENA_REF(r)) {
+        child=(binresult *)(base+r-1);
+        res->hash[i].value=child;
+        if (child->type==PARAM_ARRAY || child->type==PARAM_HASH)
+          fix_result(base, child);
+      }
+    }
   }
-  else
+}
+
+static binresult *finish_arena(result_arena *a) {
+  binresult *res;
+  res=(binresult *)psync_realloc(a->data, a->used);
+  a->data=NULL;
+  fix_result((unsigned char *)res, res);
+  return res;
+}
+
+static int flush_batch(result_parser *p, size_t base) {
+  binresult *batch;
+  uintptr_t slots;
+  size_t cnt;
+  cnt=p->stackcnt-base;
+  slots=arena_alloc(&p->batch, sizeof(binresult *)*cnt);
+  memcpy(p->batch.data+slots-1, p->stack+base, sizeof(uintptr_t)*cnt);
+  p->stackcnt=base;
+  // batches are alike, the next one starts with the size of this one
+  p->batchalloc=p->batch.used;
+  batch=NODE(&p->batch, 1);
+  batch->length=cnt;
+  batch->array=(binresult **)(slots-1);
+  batch=finish_arena(&p->batch);
+  if (p->streamcb(p->streamptr, batch)) {
+    p->aborted=1;
     return -1;
+  }
+  return 0;
 }
 
-static binresult *do_parse_result(unsigned char **restrict indata, unsigned char **restrict odata, binresult **restrict strings, size_t *restrict nextstrid) {
-  binresult *ret;
-  long cond;
-  psync_uint_t type, len;
-  type=**indata;
-  (*indata)++;
-  if ((cond=(type>=RPARAM_SHORT_STR_BASE && type<RPARAM_SHORT_STR_BASE+VSHORT_STR_LEN)) || (type>=RPARAM_STR1 && type<=RPARAM_STR4)) {
-    if (cond)
-      len=type-RPARAM_SHORT_STR_BASE;
-    else {
-      size_t l=type-RPARAM_STR1+1;
-      len=0;
-      memcpy(&len, *indata, l);
-      *indata+=l;
+static uintptr_t parse_stream_array(result_parser *p) {
+  binresult *arr;
+  uintptr_t r, ref;
+  size_t base;
+  base=p->stackcnt;
+  p->pos++;
+  while (1) {
+    if (unlikely(!parser_need(p, 1)))
+      return 0;
+    if (p->buff[p->pos]==RPARAM_END)
+      break;
+    if (!p->batch.data) {
+      arena_init(p, &p->batch, p->batchalloc);
+      p->arena=&p->batch;
+      r=arena_alloc(&p->batch, sizeof(binresult));
+      NODE(&p->batch, r)->type=PARAM_ARRAY;
     }
-    ret=(binresult *)(*odata);
-    *odata+=offsetof(binresult, str);
-    ret->type=PARAM_STR;
-    strings[*nextstrid]=ret;
-    (*nextstrid)++;
-    ret->length=len;
-    memcpy(*odata, *indata, len);
-    (*odata)[len]=0;
-    *odata+=((len+ALIGN_BYTES)/ALIGN_BYTES)*ALIGN_BYTES;
-    *indata+=len;
-    return ret;
-  }
-  else if ((cond=(type>=RPARAM_RSTR1 && type<=RPARAM_RSTR4)) || (type>=RPARAM_SHORT_RSTR_BASE && type<RPARAM_SHORT_RSTR_BASE+VSHORT_RSTR_CNT)) {
-    size_t id;
-    if (cond) {
-      len=type-RPARAM_RSTR1+1;
-      id=0;
-      memcpy(&id, *indata, len);
-      *indata+=len;
+    r=parse_value(p);
+    if (unlikely(!r))
+      return 0;
+    parser_push(p, r);
+    if (p->stackcnt-base==p->batchsize) {
+      p->arena=&p->top;
+      if (flush_batch(p, base))
+        return 0;
     }
+  }
+  p->pos++;
+  p->arena=&p->top;
+  if (p->batch.data && flush_batch(p, base))
+    return 0;
+  ref=arena_alloc(&p->top, sizeof(binresult));
+  arr=NODE(&p->top, ref);
+  arr->type=PARAM_ARRAY;
+  arr->length=0;
+  arr->array=(binresult **)(p->top.used);
+  return ref;
+}
+
+static uintptr_t parse_hash_items(result_parser *p, uintptr_t ref) {
+  binresult *hash, *key;
+  uintptr_t slots, k, v;
+  size_t base, cnt;
+  base=p->stackcnt;
+  while (1) {
+    if (unlikely(!parser_need(p, 1)))
+      return 0;
+    if (p->buff[p->pos]==RPARAM_END)
+      break;
+    k=parse_value(p);
+    if (unlikely(!k) || unlikely(!parser_need(p, 1)))
+      return 0;
+    key=IS_ARENA_REF(k)?NODE(p->arena, k):NULL;
+    if (p->streamkey && p->depth==1 && key && key->type==PARAM_STR &&
+        p->buff[p->pos]==RPARAM_ARRAY && !strcmp(key->str, p->streamkey))
+      v=parse_stream_array(p);
     else
-      id=type-RPARAM_SHORT_RSTR_BASE;
-    return strings[id];
+      v=parse_value(p);
+    if (unlikely(!v))
+      return 0;
+    // keys are always strings, anything else is skipped
+    if (key && NODE(p->arena, k)->type==PARAM_STR) {
+      parser_push(p, k);
+      parser_push(p, v);
+    }
+  }
+  p->pos++;
+  cnt=(p->stackcnt-base)/2;
+  slots=arena_alloc(p->arena, sizeof(hashpair)*cnt);
+  memcpy(p->arena->data+slots-1, p->stack+base, sizeof(hashpair)*cnt);
+  p->stackcnt=base;
+  hash=NODE(p->arena, ref);
+  hash->length=cnt;
+  hash->hash=(hashpair *)(slots-1);
+  return ref;
+}
+
+static uintptr_t parse_value(result_parser *p) {
+  binresult *res;
+  uintptr_t ref;
+  size_t type, len;
+  if (unlikely(!parser_need(p, 1)))
+    return 0;
+  type=p->buff[p->pos++];
+  if (type>=RPARAM_SHORT_STR_BASE && type<RPARAM_SHORT_STR_BASE+VSHORT_STR_LEN)
+    return parse_string(p, type-RPARAM_SHORT_STR_BASE);
+  else if (type>=RPARAM_SHORT_RSTR_BASE && type<RPARAM_SHORT_RSTR_BASE+VSHORT_RSTR_CNT)
+    return reuse_string(p, type-RPARAM_SHORT_RSTR_BASE);
+  else if (type>=RPARAM_SMALL_NUM_BASE && type<RPARAM_SMALL_NUM_BASE+VSMALL_NUMBER_NUM)
+    return (uintptr_t)&NUM_SMALL[type-RPARAM_SMALL_NUM_BASE];
+  else if (type>=RPARAM_STR1 && type<=RPARAM_STR4) {
+    len=type-RPARAM_STR1+1;
+    if (unlikely(!parser_need(p, len)))
+      return 0;
+    return parse_string(p, parser_read_num(p, len));
+  }
+  else if (type>=RPARAM_RSTR1 && type<=RPARAM_RSTR4) {
+    len=type-RPARAM_RSTR1+1;
+    if (unlikely(!parser_need(p, len)))
+      return 0;
+    return reuse_string(p, parser_read_num(p, len));
   }
   else if (type>=RPARAM_NUM1 && type<=RPARAM_NUM8) {
-    ret=(binresult *)(*odata);
-    *odata+=sizeof(binresult);
-    ret->type=PARAM_NUM;
     len=type-RPARAM_NUM1+1;
-    ret->num=0;
-    memcpy(&ret->num, *indata, len);
-    *indata+=len;
-    return ret;
+    if (unlikely(!parser_need(p, len)))
+      return 0;
+    ref=arena_alloc(p->arena, sizeof(binresult));
+    res=NODE(p->arena, ref);
+    res->type=PARAM_NUM;
+    res->num=parser_read_num(p, len);
+    return ref;
   }
-  else if (type>=RPARAM_SMALL_NUM_BASE && type<RPARAM_SMALL_NUM_BASE+VSMALL_NUMBER_NUM)
-    return (binresult *)&NUM_SMALL[type-RPARAM_SMALL_NUM_BASE];
   else if (type==RPARAM_BTRUE)
-    return (binresult *)&BOOL_TRUE;
+    return (uintptr_t)&BOOL_TRUE;
   else if (type==RPARAM_BFALSE)
-    return (binresult *)&BOOL_FALSE;
-  else if (type==RPARAM_ARRAY) {
-    binresult **arr;
-    psync_uint_t cnt, alloc;
-    ret=(binresult *)(*odata);
-    *odata+=sizeof(binresult);
-    ret->type=PARAM_ARRAY;
-    arr=NULL;
-    cnt=0;
-    alloc=128;
-    arr=(binresult **)psync_malloc(sizeof(binresult *)*alloc);
-    while (**indata!=RPARAM_END) {
-      if (cnt==alloc) {
-        alloc*=2;
-        arr=(binresult **)psync_realloc(arr, sizeof(binresult *)*alloc);
-      }
-      arr[cnt++]=do_parse_result(indata, odata, strings, nextstrid);
-    }
-    (*indata)++;
-    ret->length=cnt;
-    ret->array=(struct _binresult **)*odata;
-    *odata+=sizeof(struct _binresult *)*cnt;
-    memcpy(ret->array, arr, sizeof(struct _binresult *)*cnt);
-    psync_free(arr);
-    return ret;
-  }
-  else if (type==RPARAM_HASH) {
-    struct _hashpair *arr;
-    psync_uint_t cnt, alloc;
-    binresult *key;
-    ret=(binresult *)(*odata);
-    *odata+=sizeof(binresult);
-    ret->type=PARAM_HASH;
-    arr=NULL;
-    cnt=0;
-    alloc=32;
-    arr=(struct _hashpair *)psync_malloc(sizeof(struct _hashpair)*alloc);
-    while (**indata!=RPARAM_END) {
-      if (cnt==alloc) {
-        alloc*=2;
-        arr=(struct _hashpair *)psync_realloc(arr, sizeof(struct _hashpair)*alloc);
-      }
-      key=do_parse_result(indata, odata, strings, nextstrid);
-      arr[cnt].value=do_parse_result(indata, odata, strings, nextstrid);
-      if (key->type==PARAM_STR) {
-        arr[cnt].key=key->str;
-        cnt++;
-      }
-    }
-    (*indata)++;
-    ret->length=cnt;
-    ret->hash=(struct _hashpair *)*odata;
-    *odata+=sizeof(struct _hashpair)*cnt;
-    memcpy(ret->hash, arr, sizeof(struct _hashpair)*cnt);
-    psync_free(arr);
-    return ret;
+    return (uintptr_t)&BOOL_FALSE;
+  else if (type==RPARAM_ARRAY || type==RPARAM_HASH) {
+    ref=arena_alloc(p->arena, sizeof(binresult));
+    NODE(p->arena, ref)->type=type==RPARAM_ARRAY?PARAM_ARRAY:PARAM_HASH;
+    p->depth++;
+    if (type==RPARAM_ARRAY)
+      ref=parse_array_items(p, ref);
+    else
+      ref=parse_hash_items(p, ref);
+    p->depth--;
+    return ref;
   }
   else if (type==RPARAM_DATA) {
-    ret=(binresult *)(*odata);
-    *odata+=sizeof(binresult);
-    ret->type=PARAM_DATA;
-    memcpy(&ret->num, *indata, 8);
-    *indata+=8;
-    return ret;
+    if (unlikely(!parser_need(p, 8)))
+      return 0;
+    ref=arena_alloc(p->arena, sizeof(binresult));
+    res=NODE(p->arena, ref);
+    res->type=PARAM_DATA;
+    res->num=parser_read_num(p, 8);
+    return ref;
   }
-  return NULL;
+  log_warn("unknown type %u in response", (unsigned)type);
+  return 0;
 }
 
-static binresult *parse_result(unsigned char *data, size_t datalen) {
-  unsigned char *datac;
-  binresult **strings;
+static binresult *parse_result(psync_socket *sock, int thread, unsigned char *data, size_t datalen,
+                               const char *streamkey, uint32_t batchsize, psync_result_batch_callback cb, void *ptr) {
+  result_parser p;
   binresult *res;
-  ssize_t retlen;
-  size_t datalenc, strcnt;
-  datac=data;
-  datalenc=datalen;
-  strcnt=0;
-  retlen=calc_ret_len(&datac, &datalenc, &strcnt);
-  if (retlen==-1)
-    return NULL;
-  datac=psync_new_cnt(unsigned char, retlen);
-  strings=psync_new_cnt(binresult *, strcnt);
-  strcnt=0;
-  res=do_parse_result(&data, &datac, strings, &strcnt);
-  psync_free(strings);
+  uintptr_t ref;
+  memset(&p, 0, sizeof(p));
+  p.sock=sock;
+  p.thread=thread;
+  if (data) {
+    p.buff=data;
+    p.end=p.size=datalen;
+  }
+  else {
+    p.size=datalen<PSYNC_RESULT_READ_BUFFER?datalen:PSYNC_RESULT_READ_BUFFER;
+    p.buff=psync_new_cnt(unsigned char, p.size);
+    p.remaining=datalen;
+  }
+  // the result is rarely more than twice the size of the response, when streaming most of it goes to the batches
+  if (streamkey)
+    arena_init(&p, &p.top, PSYNC_RESULT_READ_BUFFER);
+  else
+    arena_init(&p, &p.top, datalen<64?128:datalen*2);
+  p.arena=&p.top;
+  p.stralloc=PSYNC_RESULT_STACK;
+  p.strings=psync_new_cnt(result_string, p.stralloc);
+  p.stackalloc=PSYNC_RESULT_STACK;
+  p.stack=psync_new_cnt(uintptr_t, p.stackalloc);
+  if (streamkey) {
+    p.streamkey=streamkey;
+    p.streamcb=cb;
+    p.streamptr=ptr;
+    p.batchsize=batchsize;
+    p.batchalloc=PSYNC_RESULT_READ_BUFFER;
+    p.storealloc=PSYNC_RESULT_READ_BUFFER;
+    p.store=psync_new_cnt(char, p.storealloc);
+  }
+  ref=parse_value(&p);
+  if (likely(ref) && !IS_ARENA_REF(ref)) {
+    // a constant, the caller still expects to be able to free the result
+    res=NODE(&p.top, arena_alloc(&p.top, sizeof(binresult)));
+    memcpy(res, (binresult *)ref, sizeof(binresult));
+  }
+  if (likely(ref))
+    res=finish_arena(&p.top);
+  else {
+    psync_free(p.top.data);
+    res=NULL;
+  }
+  psync_free(p.batch.data);
+  // keep the connection in sync, unless we are giving up on it anyway
+  if (sock && !p.aborted && (p.remaining || p.pos!=p.end)) {
+    if (res)
+      log_warn("%lu bytes after the end of the response", (unsigned long)(p.remaining+p.end-p.pos));
+    while (p.remaining && !parser_fill(&p, p.end-p.pos+1))
+      p.pos=p.end;
+  }
+  if (!data)
+    psync_free(p.buff);
+  psync_free(p.strings);
+  psync_free(p.stack);
+  psync_free(p.store);
   return res;
 }
 
-binresult *get_result(psync_socket *sock) {
-  unsigned char *data;
-  binresult *res;
+static binresult *read_result(psync_socket *sock, int thread, const char *streamkey,
+                              uint32_t batchsize, psync_result_batch_callback cb, void *ptr) {
   uint32_t ressize;
-  size_t ret;
-
-  ret = psync_socket_readall(sock, &ressize, sizeof(uint32_t));
-  if (unlikely(ret != sizeof(uint32_t))) {
-    log_warn("failed to read from socket %lu bytes", sizeof(uint32_t));
-    return NULL;
-  }
-
-  data = (unsigned char *)psync_malloc(ressize);
-  ret = psync_socket_readall(sock, data, (int)ressize);
-  if (unlikely(ret != ressize)) {
+  int ret;
+  if (thread)
+    ret=psync_socket_readall_thread(sock, &ressize, sizeof(uint32_t));
+  else
+    ret=psync_socket_readall(sock, &ressize, sizeof(uint32_t));
+  if (unlikely(ret!=sizeof(uint32_t))) {
     log_warn("failed to read from socket %lu bytes", sizeof(uint32_t));
-    psync_free(data);
     return NULL;
   }
+  return parse_result(sock, thread, NULL, ressize, streamkey, batchsize, cb, ptr);
+}
 
-  res = parse_result(data, ressize);
-  psync_free(data);
-  return res;
+binresult *get_result(psync_socket *sock) {
+  return read_result(sock, 0, NULL, 0, NULL, NULL);
 }
 
 binresult *get_result_thread(psync_socket *sock) {
-  unsigned char *data;
-  binresult *res;
-  uint32_t ressize;
-  if (unlikely_log(psync_socket_readall_thread(sock, &ressize, sizeof(uint32_t))!=sizeof(uint32_t)))
-    return NULL;
-  data=(unsigned char *)psync_malloc(ressize);
-  if (unlikely_log(psync_socket_readall_thread(sock, data, ressize)!=ressize)) {
-    psync_free(data);
-    return NULL;
-  }
-  res=parse_result(data, ressize);
-  psync_free(data);
-  return res;
+  return read_result(sock, 1, NULL, 0, NULL, NULL);
+}
+
+binresult *get_result_stream(psync_socket *sock, const char *key, uint32_t batchsize,
+                             psync_result_batch_callback cb, void *ptr) {
+  return read_result(sock, 0, key, batchsize, cb, ptr);
 }
 
 void async_result_reader_init(async_result_reader *reader) {
@@ -461,7 +723,7 @@ again:
     }
     else {
       assert(reader->state==1);
-      reader->result=parse_result(reader->data, reader->respsize);
+      reader->result=parse_result(NULL, 0, reader->data, reader->respsize, NULL, 0, NULL, NULL);
       psync_free(reader->data);
       async_result_reader_init(reader);
       return ASYNC_RES_READY;
@@ -577,10 +839,45 @@ binresult *do_send_command(psync_socket *sock, const char *command,
   return PTR_OK;
 }
 
-const binresult *psync_do_find_result(const binresult *res, const char *name,
-                                      uint32_t type, const char *file,
-                                      const char *function, int unsigned line) {
-  uint32_t i;
+/*
+ * Keys of the hashes in a response come in the same order for every object of
+ * a kind (every metadata, every diff entry), so each call site remembers the
+ * position at which it last found its key. The guess is verified with strcmp,
+ * so a wrong or stale hint (or one updated concurrently by another thread)
+ * only costs the scan it would have done anyway. The scan starts right after
+ * the hint, as the next key asked for is usually the next one in the hash.
+ */
+static inline int32_t find_key(const binresult *res, const char *name,
+                               uint32_t *hint) {
+  uint32_t i, h, len;
+
+  len = res->length;
+  if (!hint) {
+    for (i = 0; i < len; i++)
+      if (!strcmp(res->hash[i].key, name)) return i;
+    return -1;
+  }
+
+  h = *hint;
+  if (h < len && res->hash[h].key[0] == name[0] &&
+      !strcmp(res->hash[h].key, name))
+    return h;
+  if (++h >= len) h = 0;
+  for (i = 0; i < len; i++) {
+    if (res->hash[h].key[0] == name[0] && !strcmp(res->hash[h].key, name)) {
+      *hint = h;
+      return h;
+    }
+    if (++h == len) h = 0;
+  }
+  return -1;
+}
+
+static const binresult *find_result(const binresult *res, const char *name,
+                                    uint32_t type, uint32_t *hint,
+                                    const char *file, const char *function,
+                                    int unsigned line) {
+  int32_t i;
 
   if (unlikely(!res || res->type != PARAM_HASH)) {
     const char *nm = res ? type_names[res->type] : "NULL";
@@ -589,22 +886,20 @@ const binresult *psync_do_find_result(const binresult *res, const char *name,
     return empty_types[type];
   }
 
-  for (i = 0; i < res->length; i++)
-    if (!strcmp(res->hash[i].key, name)) {
-      if (likely(res->hash[i].value->type == type))
-        return res->hash[i].value;
-      else {
-        log_log(LOG_FATAL, file, (int)line,
-                "type error in %s for key %s, expected %s got %s", function,
-                name, type_names[type], type_names[res->hash[i].value->type]);
-        return empty_types[type];
-      }
-    }
+  i = find_key(res, name, hint);
+  if (likely(i >= 0)) {
+    if (likely(res->hash[i].value->type == type))
+      return res->hash[i].value;
+    log_log(LOG_FATAL, file, (int)line,
+            "type error in %s for key %s, expected %s got %s", function,
+            name, type_names[type], type_names[res->hash[i].value->type]);
+    return empty_types[type];
+  }
   log_fatal("could not find key %s", name);
 #if IS_DEBUG
   log_log(LOG_DEBUG, file, (int)line, "%s: dumping existing fields of the hash",
           function);
-  for (i = 0; i < res->length; i++) switch (res->hash[i].value->type) {
+  for (i = 0; i < (int32_t)res->length; i++) switch (res->hash[i].value->type) {
       case PARAM_HASH:
         log_debug("  %s=[hash]", res->hash[i].key);
         break;
@@ -634,11 +929,11 @@ const binresult *psync_do_find_result(const binresult *res, const char *name,
   return empty_types[type];
 }
 
-const binresult *psync_do_check_result(const binresult *res, const char *name,
-                                       uint32_t type, const char *file,
-                                       const char *function,
-                                       int unsigned line) {
-  uint32_t i;
+static const binresult *check_result(const binresult *res, const char *name,
+                                     uint32_t type, uint32_t *hint,
+                                     const char *file, const char *function,
+                                     int unsigned line) {
+  int32_t i;
 
   if (unlikely(!res || res->type != PARAM_HASH)) {
     const char *nm = res ? type_names[res->type] : "NULL";
@@ -647,15 +942,14 @@ const binresult *psync_do_check_result(const binresult *res, const char *name,
     return NULL;
   }
 
-  for (i = 0; i < res->length; i++) {
-    if (strcmp(res->hash[i].key, name) == 0) {
-      if (likely(res->hash[i].value->type == type)) return res->hash[i].value;
+  i = find_key(res, name, hint);
+  if (likely(i >= 0)) {
+    if (likely(res->hash[i].value->type == type)) return res->hash[i].value;
 
-      log_log(LOG_FATAL, file, (int)line,
-              "type error in %s for key \"%s\", expected %s got %s", function,
-              name, type_names[type], type_names[res->hash[i].value->type]);
-      return NULL;
-    }
+    log_log(LOG_FATAL, file, (int)line,
+            "type error in %s for key \"%s\", expected %s got %s", function,
+            name, type_names[type], type_names[res->hash[i].value->type]);
+    return NULL;
   }
 
   log_log(LOG_WARN, file, (int)line,
@@ -663,3 +957,32 @@ const binresult *psync_do_check_result(const binresult *res, const char *name,
           name);
   return NULL;
 }
+
+const binresult *psync_do_find_result(const binresult *res, const char *name,
+                                      uint32_t type, const char *file,
+                                      const char *function, int unsigned line) {
+  return find_result(res, name, type, NULL, file, function, line);
+}
+
+const binresult *psync_do_check_result(const binresult *res, const char *name,
+                                       uint32_t type, const char *file,
+                                       const char *function,
+                                       int unsigned line) {
+  return check_result(res, name, type, NULL, file, function, line);
+}
+
+const binresult *psync_do_find_result_hint(const binresult *res,
+                                           const char *name, uint32_t type,
+                                           uint32_t *hint, const char *file,
+                                           const char *function,
+                                           int unsigned line) {
+  return find_result(res, name, type, hint, file, function, line);
+}
+
+const binresult *psync_do_check_result_hint(const binresult *res,
+                                            const char *name, uint32_t type,
+                                            uint32_t *hint, const char *file,
+                                            const char *function,
+                                            int unsigned line) {
+  return check_result(res, name, type, hint, file, function, line);
+}
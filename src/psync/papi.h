@@ -86,16 +86,21 @@ typedef struct {
 #define prepare_command_data_alloc(cmd, params, datalen, alloclen, retlen) \
   do_prepare_command(cmd, strlen(cmd), params, sizeof(params)/sizeof(binparam), datalen, alloclen, retlen)
 
-#define psync_find_result(res, name, type) \
-  psync_do_find_result(res, name, type, __FILENAME__, __FUNCTION__, __LINE__)
-#define psync_check_result(res, name, type) \
-  psync_do_check_result(res, name, type, __FILENAME__, __FUNCTION__, __LINE__)
+#define psync_find_result(res, name, type) ({static uint32_t psync_key_hint__=0; \
+  psync_do_find_result_hint(res, name, type, &psync_key_hint__, __FILENAME__, __FUNCTION__, __LINE__);})
+#define psync_check_result(res, name, type) ({static uint32_t psync_key_hint__=0; \
+  psync_do_check_result_hint(res, name, type, &psync_key_hint__, __FILENAME__, __FUNCTION__, __LINE__);})
 
 psync_socket *psync_api_connect(const char *hostname, int usessl);
 void psync_api_conn_fail_inc();
 void psync_api_conn_fail_reset();
 
+/* Takes ownership of batch, which is freed with psync_free(). Returning non-zero aborts the parsing. */
+typedef int (*psync_result_batch_callback)(void *ptr, binresult *batch);
+
 binresult *get_result(psync_socket *sock) PSYNC_NONNULL(1);
+binresult *get_result_stream(psync_socket *sock, const char *key, uint32_t batchsize,
+                             psync_result_batch_callback cb, void *ptr) PSYNC_NONNULL(1, 2, 4);
 binresult *get_result_thread(psync_socket *sock) PSYNC_NONNULL(1);
 void async_result_reader_init(async_result_reader *reader) PSYNC_NONNULL(1);
 void async_result_reader_destroy(async_result_reader *reader) PSYNC_NONNULL(1);
@@ -104,5 +109,10 @@ unsigned char *do_prepare_command(const char *command, size_t cmdlen, const binp
 binresult *do_send_command(psync_socket *sock, const char *command, size_t cmdlen, const binparam *params, size_t paramcnt, int64_t datalen, int readres) PSYNC_NONNULL(1, 2);
 const binresult *psync_do_find_result(const binresult *res, const char *name, uint32_t type, const char *file, const char *function, int unsigned line) PSYNC_NONNULL(2) PSYNC_PURE;
 const binresult *psync_do_check_result(const binresult *res, const char *name, uint32_t type, const char *file, const char *function, int unsigned line)  PSYNC_NONNULL(2) PSYNC_PURE;
+/* Not PSYNC_PURE: they store the index the key was found at in *hint, and the compiler is free to drop or merge calls to
+ * pure functions together with their stores.
+ */
+const binresult *psync_do_find_result_hint(const binresult *res, const char *name, uint32_t type, uint32_t *hint, const char *file, const char *function, int unsigned line) PSYNC_NONNULL(2, 4);
+const binresult *psync_do_check_result_hint(const binresult *res, const char *name, uint32_t type, uint32_t *hint, const char *file, const char *function, int unsigned line) PSYNC_NONNULL(2, 4);
 
 #endif  /* PCLOUD_PSYNC_PAPI_H_ */
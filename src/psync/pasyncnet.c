@@ -19,6 +19,7 @@
 #include "papi.h"
 #include "pcompression.h"
 #include "ptree.h"
+#include "plist.h"
 #include "pssl.h"
 #include "logger.h"
 
@@ -32,6 +33,19 @@
 #define TASK_TYPE_EXIT        0
 #define TASK_TYPE_FILE_DWL    1
 #define TASK_TYPE_FILE_DWL_NM 2
+#define TASK_TYPE_FILE_UPL    3
+#define TASK_TYPE_FILE_SUM    4
+#define TASK_TYPE_FILE_META   5
+#define TASK_TYPE_FILE_READ   6
+
+/* Every shard is a connection of its own, so that a batch of large downloads does not hold back the small requests
+ * queued behind it. Downloads are split by size at PSYNC_ASYNC_LARGE_DOWNLOAD_SIZE. */
+#define SHARD_DOWNLOAD_SMALL 0
+#define SHARD_DOWNLOAD_LARGE 1
+#define SHARD_UPLOAD         2
+#define SHARD_SMALL          3
+
+#define SHARDS 4
 
 #define STREAM_FLAG_ACTIVE 1
 
@@ -69,10 +83,78 @@ typedef struct {
   unsigned char sha1hex[PSYNC_SHA1_DIGEST_HEXLEN];
 } task_file_download_resp_t;
 
+typedef struct {
+  psync_folderid_t folderid;
+  const char *name;
+  const char *data;
+  uint64_t size;
+  unsigned char sha1hex[PSYNC_SHA1_DIGEST_HEXLEN];
+  psync_async_callback_t cb;
+  void *cbext;
+} task_file_upload_t;
+
+typedef struct {
+  uint32_t error;
+  uint32_t errorflags;
+  uint64_t fileid;
+  uint64_t hash;
+  uint64_t size;
+} task_file_upload_resp_t;
+
+typedef struct {
+  psync_fileid_t fileid;
+  psync_async_callback_t cb;
+  void *cbext;
+} task_file_info_t;
+
+typedef struct {
+  uint32_t error;
+  uint32_t errorflags;
+  uint64_t size;
+  uint64_t hash;
+  unsigned char sha1hex[PSYNC_SHA1_DIGEST_HEXLEN];
+} task_file_checksum_resp_t;
+
+typedef struct {
+  uint32_t error;
+  uint32_t errorflags;
+  uint64_t fileid;
+  uint64_t parentfolderid;
+  uint64_t size;
+  uint64_t hash;
+  uint64_t ctime;
+  uint64_t mtime;
+} task_file_meta_resp_t;
+
+typedef struct {
+  psync_fileid_t fileid;
+  uint64_t hash;
+  uint64_t offset;
+  uint32_t length;
+  void *buff;
+  psync_async_callback_t cb;
+  void *cbext;
+} task_file_read_t;
+
+typedef struct {
+  uint32_t error;
+  uint32_t errorflags;
+  uint64_t size;
+} task_file_read_resp_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  psync_socket_t sock;
+  int running;
+} async_shard_t;
+
 typedef struct _async_thread_params_t {
-  psync_deflate_t *enc;
-  psync_deflate_t *dec;
+  async_shard_t *shard;
+  psync_compressor_t *enc;
+  psync_compressor_t *dec;
   psync_socket *api;
+  psync_reactor_watch *apiwatch;
+  psync_reactor_watch *cmdwatch;
   psync_tree *streams;
   uint64_t datapendingsince;
   int (*process_buf)(struct _async_thread_params_t *);
@@ -96,43 +178,145 @@ typedef struct _stream_t {
   int (*process_data)(struct _stream_t *, async_thread_params_t *, const char *, uint32_t);
 } stream_t;
 
+/* Everything that may block, the database, local files and the callbacks of the callers, runs in the order it was
+ * queued on a thread of its own, so the reactor thread only moves bytes between the sockets and the (de)compressors. */
+typedef struct _async_job_t {
+  psync_list list;
+  void (*run)(struct _async_job_t *);
+} async_job_t;
+
+typedef struct {
+  async_job_t job;
+  psync_async_callback_t cb;
+  void *cbext;
+  psync_async_result_t res;
+} async_result_job_t;
+
+/* The reactor thread fills in what the headers say before queueing the first job of the file, the rest belongs to the
+ * job thread, which also frees it. */
 typedef struct {
   const char *localpath;
   uint64_t fileid;
   uint64_t size;
   uint64_t hash;
-  unsigned char osize;
+  uint64_t osize;
+  uint64_t oldhash;
+  uint64_t oldmtime;
+  uint64_t mtime;
   unsigned char sha1hex[PSYNC_SHA1_DIGEST_HEXLEN];
   unsigned char osha1hex[PSYNC_SHA1_DIGEST_HEXLEN];
   psync_sha1_ctx sha1ctx;
-  uint64_t remsize;
   psync_file_t fd;
+  uint32_t error;
+} file_download_t;
+
+typedef struct {
+  async_job_t job;
+  file_download_t *dwl;
+  uint32_t len;
+  char data[];
+} file_download_job_t;
+
+typedef struct {
+  async_job_t job;
+  file_download_t *dwl;
+  psync_async_callback_t cb;
+  void *cbext;
+  uint32_t error;
+  uint32_t errorflags;
+} file_download_done_job_t;
+
+typedef struct {
+  file_download_t *dwl;
+  uint64_t remsize;
 } file_download_add_t;
 
+typedef struct {
+  char *buff;
+  uint64_t offset;
+  uint64_t size;
+  uint64_t remsize;
+  uint32_t length;
+} file_read_add_t;
+
 TASK_WITH_HEADER(task_hdr_file_download_t, task_file_download_t);
 TASK_WITH_HEADER(task_hdr_file_download_if_not_mod_t, task_file_download_if_not_mod_t);
+TASK_WITH_HEADER(task_hdr_file_upload_t, task_file_upload_t);
+TASK_WITH_HEADER(task_hdr_file_info_t, task_file_info_t);
+TASK_WITH_HEADER(task_hdr_file_read_t, task_file_read_t);
+
+static async_shard_t shards[SHARDS]={
+  {PTHREAD_MUTEX_INITIALIZER, INVALID_SOCKET, 0},
+  {PTHREAD_MUTEX_INITIALIZER, INVALID_SOCKET, 0},
+  {PTHREAD_MUTEX_INITIALIZER, INVALID_SOCKET, 0},
+  {PTHREAD_MUTEX_INITIALIZER, INVALID_SOCKET, 0}
+};
+
+static pthread_mutex_t job_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond=PTHREAD_COND_INITIALIZER;
+static psync_list job_list=PSYNC_LIST_STATIC_INIT(job_list);
+static int job_thread_running=0;
+
+static void async_job_thread() {
+  async_job_t *j;
+  while (1) {
+    pthread_mutex_lock(&job_mutex);
+    while (psync_list_isempty(&job_list))
+      pthread_cond_wait(&job_cond, &job_mutex);
+    j=psync_list_remove_head_element(&job_list, async_job_t, list);
+    pthread_mutex_unlock(&job_mutex);
+    j->run(j);
+  }
+}
+
+static void queue_job(async_job_t *j, void (*run)(async_job_t *)) {
+  j->run=run;
+  pthread_mutex_lock(&job_mutex);
+  if (!job_thread_running) {
+    job_thread_running=1;
+    psync_run_thread("async jobs", async_job_thread);
+  }
+  psync_list_add_tail(&job_list, &j->list);
+  pthread_cond_signal(&job_cond);
+  pthread_mutex_unlock(&job_mutex);
+}
+
+static void run_result_job(async_job_t *j) {
+  async_result_job_t *r;
+  r=(async_result_job_t *)j;
+  r->cb(r->cbext, &r->res);
+  psync_free(r);
+}
 
-static pthread_mutex_t amutex=PTHREAD_MUTEX_INITIALIZER;
-static int running=0;
-static psync_socket_t at_sock=INVALID_SOCKET;
+static void send_result(psync_async_callback_t cb, void *cbext, const psync_async_result_t *res) {
+  async_result_job_t *r;
+  r=psync_new(async_result_job_t);
+  r->cb=cb;
+  r->cbext=cbext;
+  r->res=*res;
+  queue_job(&r->job, run_result_job);
+}
 
+/* The API socket is write buffered, so writes never wait for the server. Whatever the socket does not take at once
+ * stays in the buffer and is written when the reactor reports the socket writable. */
 static int send_pending_data(async_thread_params_t *prms) {
   char buff[4096];
   int ret;
+  psync_socket_set_write_buffered(prms->api);
   while (1) {
-    ret=psync_deflate_read(prms->enc, buff, sizeof(buff));
+    ret=psync_compressor_read(prms->enc, buff, sizeof(buff));
     if (ret==PSYNC_DEFLATE_NODATA || ret==PSYNC_DEFLATE_EOF)
-      return 0;
+      return psync_socket_try_write_buffer(prms->api)<0?-1:0;
     if (ret>0) {
       if (psync_socket_writeall(prms->api, buff, ret)!=ret) {
         log_warn("write of %d bytes to socket failed", ret);
         return -1;
       }
       else
-        log_info("sent %d bytes of compressed data to socket", ret);
+        log_info("queued %d bytes of compressed data to socket", ret);
     }
     else {
-      log_error("read from deflate compressor returned %d", ret);
+      log_error("read from compressor returned %d", ret);
       return -1;
     }
   }
@@ -140,9 +324,9 @@ static int send_pending_data(async_thread_params_t *prms) {
 
 static int flush_pending_data(async_thread_params_t *prms) {
   int ret;
-  ret=psync_deflate_write(prms->enc, "", 0, PSYNC_DEFLATE_FLUSH);
+  ret=psync_compressor_write(prms->enc, "", 0, PSYNC_DEFLATE_FLUSH);
   if (ret!=0) {
-    log_warn("psync_deflate_write returned %d when flushing", ret);
+    log_warn("psync_compressor_write returned %d when flushing", ret);
     return -1;
   }
   prms->pendingrequests=0;
@@ -205,21 +389,28 @@ static stream_t *create_stream(async_thread_params_t *prms, size_t addsize) {
   return ret;
 }
 
-static int send_data(async_thread_params_t *prms, const void *data, int len) {
+static int compress_data(async_thread_params_t *prms, const void *data, int len) {
   int wr;
   while (len) {
-    wr=psync_deflate_write(prms->enc, data, len, PSYNC_DEFLATE_NOFLUSH);
+    wr=psync_compressor_write(prms->enc, data, len, PSYNC_DEFLATE_NOFLUSH);
     if (wr>0) {
       len-=wr;
       data=(const char *)data+wr;
     }
     else if (wr!=PSYNC_DEFLATE_FULL) {
-      log_error("write to deflate compressor of %d bytes returned %d", len, wr);
+      log_error("write to compressor of %d bytes returned %d", len, wr);
       return -1;
     }
     if (send_pending_data(prms))
       return -1;
   }
+  return 0;
+}
+
+/* Queues the last part of a request, requests are grouped until the next flush. */
+static int send_data(async_thread_params_t *prms, const void *data, int len) {
+  if (compress_data(prms, data, len))
+    return -1;
   if (!prms->pendingrequests)
     prms->datapendingsince=psync_millitime();
   prms->pendingrequests++;
@@ -234,74 +425,171 @@ static void close_stream(stream_t *s, async_thread_params_t *prms, uint32_t erro
   psync_free(s);
 }
 
-static void file_download_free(stream_t *s, uint32_t error) {
-  file_download_add_t *fda;
-  fda=(file_download_add_t *)(s+1);
-  if (fda->fd!=INVALID_HANDLE_VALUE) {
-    psync_file_close(fda->fd);
-    if (error)
-      psync_file_delete(fda->localpath);
+static void run_file_download_headers(async_job_t *j) {
+  file_download_t *dwl;
+  psync_sql_res *res;
+  dwl=((file_download_job_t *)j)->dwl;
+  psync_free(j);
+  psync_sql_start_transaction();
+  res=psync_sql_prep_statement("REPLACE INTO hashchecksum (hash, size, checksum) VALUES (?, ?, ?)");
+  psync_sql_bind_uint(res, 1, dwl->hash);
+  psync_sql_bind_uint(res, 2, dwl->size);
+  psync_sql_bind_lstring(res, 3, (const char *)dwl->sha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
+  if (dwl->oldmtime) {
+    psync_sql_run(res);
+    psync_sql_bind_uint(res, 1, dwl->oldhash);
+    psync_sql_bind_uint(res, 2, dwl->osize);
+    psync_sql_bind_lstring(res, 3, (const char *)dwl->osha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
+    psync_sql_run_free(res);
   }
+  else
+    psync_sql_run_free(res);
+  res=psync_sql_prep_statement("REPLACE INTO filerevision (fileid, hash, ctime, size) VALUES (?, ?, ?, ?)");
+  psync_sql_bind_uint(res, 1, dwl->fileid);
+  psync_sql_bind_uint(res, 2, dwl->hash);
+  psync_sql_bind_uint(res, 3, dwl->mtime);
+  psync_sql_bind_uint(res, 4, dwl->size);
+  if (dwl->oldmtime) {
+    psync_sql_run(res);
+    psync_sql_bind_uint(res, 1, dwl->fileid);
+    psync_sql_bind_uint(res, 2, dwl->oldhash);
+    psync_sql_bind_uint(res, 3, dwl->oldmtime);
+    psync_sql_bind_uint(res, 4, dwl->osize);
+    psync_sql_run_free(res);
+  }
+  else
+    psync_sql_run_free(res);
+  psync_sql_commit_transaction();
+  dwl->fd=psync_file_open(dwl->localpath, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
+  if (dwl->fd==INVALID_HANDLE_VALUE) {
+    log_warn("could not open file %s, errno %d", dwl->localpath, (int)psync_fs_err());
+    dwl->error=PSYNC_ASYNC_ERROR_FILE;
+  }
+  psync_sha1_init(&dwl->sha1ctx);
 }
 
-static int file_download_send_error(stream_t *s, async_thread_params_t *prms, file_download_add_t *fda, uint32_t error, uint32_t errorflags) {
-  psync_async_result_t r;
-  if (error)
-    log_info("got error %u(%u) for file %s", (unsigned)error, (unsigned)errorflags, fda->localpath);
-  else
-    log_info("download of %s finished", fda->localpath);
-  r.error=error;
-  r.errorflags=errorflags;
-  r.file.size=fda->size;
-  r.file.hash=fda->hash;
-  memcpy(r.file.sha1hex, fda->sha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
-  s->cb(s->cbext, &r);
-  close_stream(s, prms, error);
-  return 0;
+static void run_file_download_data(async_job_t *j) {
+  file_download_job_t *dj;
+  file_download_t *dwl;
+  const char *buff;
+  ssize_t wr;
+  uint32_t datalen;
+  int err;
+  dj=(file_download_job_t *)j;
+  dwl=dj->dwl;
+  buff=dj->data;
+  datalen=dj->len;
+  if (!dwl->error) {
+    psync_sha1_update(&dwl->sha1ctx, buff, datalen);
+    while (datalen) {
+      wr=psync_file_write(dwl->fd, buff, datalen);
+      if (wr==-1) {
+        err=(int)psync_fs_err();
+        log_warn("writing to file %s failed, errno %d", dwl->localpath, err);
+        dwl->error=err==P_NOSPC?PSYNC_ASYNC_ERROR_DISK_FULL:PSYNC_ASYNC_ERROR_IO;
+        break;
+      }
+      datalen-=wr;
+      buff+=wr;
+    }
+  }
+  psync_free(dj);
 }
 
-static int file_download_checksum(file_download_add_t *fda) {
+static int file_download_checksum(file_download_t *dwl) {
   unsigned char sha1b[PSYNC_SHA1_DIGEST_LEN], sha1h[PSYNC_SHA1_DIGEST_HEXLEN];
-  psync_sha1_final(sha1b, &fda->sha1ctx);
+  psync_sha1_final(sha1b, &dwl->sha1ctx);
   psync_binhex(sha1h, sha1b, PSYNC_SHA1_DIGEST_LEN);
-  if (memcmp(sha1h, fda->sha1hex, PSYNC_SHA1_DIGEST_HEXLEN)) {
-    log_warn("checksum verification for file %s failed, expected %40s got %40s", fda->localpath, (char *)fda->sha1hex, (char *)sha1h);
+  if (memcmp(sha1h, dwl->sha1hex, PSYNC_SHA1_DIGEST_HEXLEN)) {
+    log_warn("checksum verification for file %s failed, expected %40s got %40s", dwl->localpath, (char *)dwl->sha1hex, (char *)sha1h);
     return -1;
   }
   else
     return 0;
 }
 
+/* Completes the file: a download without errors of its own is checked against the checksum from the headers, a
+ * failed one is deleted. The callback is called only when cb is set. */
+static void run_file_download_done(async_job_t *j) {
+  file_download_done_job_t *dj;
+  file_download_t *dwl;
+  psync_async_result_t r;
+  uint32_t error, errorflags;
+  dj=(file_download_done_job_t *)j;
+  dwl=dj->dwl;
+  error=dj->error;
+  errorflags=dj->errorflags;
+  if (!error && dwl->error)
+    error=dwl->error;
+  else if (!error && dwl->fd!=INVALID_HANDLE_VALUE && file_download_checksum(dwl))
+    error=PSYNC_ASYNC_ERROR_CHECKSUM;
+  if (dwl->fd!=INVALID_HANDLE_VALUE) {
+    psync_file_close(dwl->fd);
+    if (error)
+      psync_file_delete(dwl->localpath);
+  }
+  if (dj->cb) {
+    if (error)
+      log_info("got error %u(%u) for file %s", (unsigned)error, (unsigned)errorflags, dwl->localpath);
+    else
+      log_info("download of %s finished", dwl->localpath);
+    r.error=error;
+    r.errorflags=errorflags;
+    r.file.size=dwl->size;
+    r.file.hash=dwl->hash;
+    memcpy(r.file.sha1hex, dwl->sha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
+    dj->cb(dj->cbext, &r);
+  }
+  psync_free(dwl);
+  psync_free(dj);
+}
+
+static void queue_file_download_done(file_download_t *dwl, psync_async_callback_t cb, void *cbext, uint32_t error, uint32_t errorflags) {
+  file_download_done_job_t *dj;
+  dj=psync_new(file_download_done_job_t);
+  dj->dwl=dwl;
+  dj->cb=cb;
+  dj->cbext=cbext;
+  dj->error=error;
+  dj->errorflags=errorflags;
+  queue_job(&dj->job, run_file_download_done);
+}
+
+/* called for streams that end without a result of their own, the file is only cleaned up */
+static void file_download_free(stream_t *s, uint32_t error) {
+  file_download_add_t *fda;
+  fda=(file_download_add_t *)(s+1);
+  queue_file_download_done(fda->dwl, NULL, NULL, error, 0);
+}
+
+static int file_download_finish(stream_t *s, async_thread_params_t *prms, uint32_t error, uint32_t errorflags) {
+  file_download_add_t *fda;
+  fda=(file_download_add_t *)(s+1);
+  queue_file_download_done(fda->dwl, s->cb, s->cbext, error, errorflags);
+  s->free=NULL;
+  close_stream(s, prms, error);
+  return 0;
+}
+
 static int process_file_download_data(stream_t *s, async_thread_params_t *prms, const char *buff, uint32_t datalen) {
   file_download_add_t *fda;
-  ssize_t wr;
-  int err;
+  file_download_job_t *dj;
   fda=(file_download_add_t *)(s+1);
   if (datalen>fda->remsize) {
     log_error("got packed of size %u for stream %u file %s when the remaining data is %lu",
-          (unsigned)datalen, (unsigned)s->streamid, fda->localpath, (unsigned long)fda->remsize);
-    file_download_send_error(s, prms, fda, PSYNC_ASYNC_ERROR_NET, PSYNC_ASYNC_ERR_FLAG_RETRY_AS_IS);
+          (unsigned)datalen, (unsigned)s->streamid, fda->dwl->localpath, (unsigned long)fda->remsize);
+    file_download_finish(s, prms, PSYNC_ASYNC_ERROR_NET, PSYNC_ASYNC_ERR_FLAG_RETRY_AS_IS);
     return -1;
   }
   fda->remsize-=datalen;
   psync_account_downloaded_bytes(datalen);
-  psync_sha1_update(&fda->sha1ctx, buff, datalen);
-  while (datalen) {
-    wr=psync_file_write(fda->fd, buff, datalen);
-    if (wr==-1) {
-      err=(int)psync_fs_err();
-      log_warn("writing to file %s failed, errno %d", fda->localpath, err);
-      return file_download_send_error(s, prms, fda, err==P_NOSPC?PSYNC_ASYNC_ERROR_DISK_FULL:PSYNC_ASYNC_ERROR_IO, 0);
-    }
-    datalen-=wr;
-    buff+=wr;
-  }
-  if (fda->remsize==0) {
-    if (file_download_checksum(fda))
-      return file_download_send_error(s, prms, fda, PSYNC_ASYNC_ERROR_CHECKSUM, 0);
-    else
-      return file_download_send_error(s, prms, fda, 0, 0);
-  }
+  dj=(file_download_job_t *)psync_malloc(offsetof(file_download_job_t, data)+datalen);
+  dj->dwl=fda->dwl;
+  dj->len=datalen;
+  memcpy(dj->data, buff, datalen);
+  queue_job(&dj->job, run_file_download_data);
+  if (fda->remsize==0)
+    return file_download_finish(s, prms, 0, 0);
   else
     return 0;
 }
@@ -309,79 +597,64 @@ static int process_file_download_data(stream_t *s, async_thread_params_t *prms,
 static int process_file_download_headers(stream_t *s, async_thread_params_t *prms, const char *buff, uint32_t datalen) {
   task_file_download_resp_t r;
   file_download_add_t *fda;
-  psync_sql_res *res;
+  file_download_t *dwl;
+  file_download_job_t *dj;
   if (unlikely(datalen<sizeof(task_file_download_resp_t))) {
     log_error("got packet of size %u while expecting at least %u, disconnecting", (unsigned)datalen, (unsigned)sizeof(task_file_download_resp_t));
     return -1;
   }
   memcpy(&r, buff, sizeof(task_file_download_resp_t));
   fda=(file_download_add_t *)(s+1);
-  fda->size=r.size;
-  fda->hash=r.hash;
-  memcpy(fda->sha1hex, r.sha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
+  dwl=fda->dwl;
+  dwl->size=r.size;
+  dwl->hash=r.hash;
+  dwl->mtime=r.mtime;
+  dwl->oldhash=r.oldhash;
+  dwl->oldmtime=r.oldmtime;
+  memcpy(dwl->sha1hex, r.sha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
   if (r.error)
-    return file_download_send_error(s, prms, fda, r.error+100, r.errorflags);
-  log_info("got headers for file %s size %"P_PRI_U64" hash %"P_PRI_U64" sha1 %.40s", fda->localpath, fda->size, fda->hash, fda->sha1hex);
-  psync_sql_start_transaction();
-  res=psync_sql_prep_statement("REPLACE INTO hashchecksum (hash, size, checksum) VALUES (?, ?, ?)");
-  psync_sql_bind_uint(res, 1, r.hash);
-  psync_sql_bind_uint(res, 2, r.size);
-  psync_sql_bind_lstring(res, 3, (const char *)r.sha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
-  if (r.oldmtime) {
-    psync_sql_run(res);
-    psync_sql_bind_uint(res, 1, r.oldhash);
-    psync_sql_bind_uint(res, 2, fda->osize);
-    psync_sql_bind_lstring(res, 3, (const char *)fda->osha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
-    psync_sql_run_free(res);
-  }
-  else
-    psync_sql_run_free(res);
-  res=psync_sql_prep_statement("REPLACE INTO filerevision (fileid, hash, ctime, size) VALUES (?, ?, ?, ?)");
-  psync_sql_bind_uint(res, 1, fda->fileid);
-  psync_sql_bind_uint(res, 2, r.hash);
-  psync_sql_bind_uint(res, 3, r.mtime);
-  psync_sql_bind_uint(res, 4, r.size);
-  if (r.oldmtime) {
-    psync_sql_run(res);
-    psync_sql_bind_uint(res, 1, fda->fileid);
-    psync_sql_bind_uint(res, 2, r.oldhash);
-    psync_sql_bind_uint(res, 3, r.oldmtime);
-    psync_sql_bind_uint(res, 4, fda->osize);
-    psync_sql_run_free(res);
-  }
-  else
-    psync_sql_run_free(res);
-  psync_sql_commit_transaction();
-  fda->fd=psync_file_open(fda->localpath, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
-  if (fda->fd==INVALID_HANDLE_VALUE) {
-    log_warn("could not open file %s, errno %d", fda->localpath, (int)psync_fs_err());
-    return file_download_send_error(s, prms, fda, PSYNC_ASYNC_ERROR_FILE, 0);
-  }
-  fda->remsize=fda->size;
+    return file_download_finish(s, prms, r.error+100, r.errorflags);
+  log_info("got headers for file %s size %"P_PRI_U64" hash %"P_PRI_U64" sha1 %.40s", dwl->localpath, dwl->size, dwl->hash, dwl->sha1hex);
+  dj=psync_new(file_download_job_t);
+  dj->dwl=dwl;
+  dj->len=0;
+  queue_job(&dj->job, run_file_download_headers);
+  fda->remsize=dwl->size;
   if (!fda->remsize)
-    return file_download_send_error(s, prms, fda, 0, 0);
+    return file_download_finish(s, prms, 0, 0);
   s->process_data=process_file_download_data;
-  psync_sha1_init(&fda->sha1ctx);
   if (datalen>sizeof(task_file_download_resp_t))
     return process_file_download_data(s, prms, buff+sizeof(task_file_download_resp_t), datalen-sizeof(task_file_download_resp_t));
   else
     return 0;
 }
 
-static int handle_file_download(async_thread_params_t *prms, task_file_download_t *dwl) {
-  char buff[256];
+static stream_t *create_file_download_stream(async_thread_params_t *prms, psync_fileid_t fileid, const char *localpath,
+                                             psync_async_callback_t cb, void *cbext) {
   stream_t *s;
   file_download_add_t *fda;
-  int len;
+  file_download_t *dwl;
   s=create_stream(prms, sizeof(file_download_add_t));
   fda=(file_download_add_t *)(s+1);
-  fda->fileid=dwl->fileid;
+  dwl=psync_new(file_download_t);
+  memset(dwl, 0, sizeof(file_download_t));
+  dwl->fileid=fileid;
+  dwl->localpath=localpath;
+  dwl->fd=INVALID_HANDLE_VALUE;
+  fda->dwl=dwl;
+  fda->remsize=0;
   s->free=file_download_free;
-  s->cb=dwl->cb;
-  s->cbext=dwl->cbext;
+  s->cb=cb;
+  s->cbext=cbext;
   s->process_data=process_file_download_headers;
-  fda->localpath=dwl->localpath;
-  fda->fd=INVALID_HANDLE_VALUE;
+  return s;
+}
+
+static int handle_file_download(async_thread_params_t *prms, task_file_download_t *dwl) {
+  char buff[256];
+  stream_t *s;
+  int len;
+  s=create_file_download_stream(prms, dwl->fileid, dwl->localpath, dwl->cb, dwl->cbext);
   len=psync_slprintf(buff, sizeof(buff), "act=dwl,strm=%"P_PRI_U64",fileid=%"P_PRI_U64"\n", (uint64_t)s->streamid, (uint64_t)dwl->fileid);
   if (send_data(prms, buff, len)) {
     log_warn("failed to send request for fileid %lu", (unsigned long)dwl->fileid);
@@ -397,17 +670,10 @@ static int handle_file_download_nm(async_thread_params_t *prms, task_file_downlo
   stream_t *s;
   file_download_add_t *fda;
   int len;
-  s=create_stream(prms, sizeof(file_download_add_t));
+  s=create_file_download_stream(prms, dwl->fileid, dwl->localpath, dwl->cb, dwl->cbext);
   fda=(file_download_add_t *)(s+1);
-  fda->fileid=dwl->fileid;
-  s->free=file_download_free;
-  s->cb=dwl->cb;
-  s->cbext=dwl->cbext;
-  s->process_data=process_file_download_headers;
-  fda->osize=dwl->size;
-  memcpy(fda->osha1hex, dwl->sha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
-  fda->localpath=dwl->localpath;
-  fda->fd=INVALID_HANDLE_VALUE;
+  fda->dwl->osize=dwl->size;
+  memcpy(fda->dwl->osha1hex, dwl->sha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
   len=psync_slprintf(buff, sizeof(buff), "act=dwlnm,strm=%"P_PRI_U64",fileid=%"P_PRI_U64",sha1=%.40s\n", (uint64_t)s->streamid, (uint64_t)dwl->fileid, dwl->sha1hex);
   if (send_data(prms, buff, len)) {
     log_warn("failed to send request for fileid %lu", (unsigned long)dwl->fileid);
@@ -418,6 +684,193 @@ static int handle_file_download_nm(async_thread_params_t *prms, task_file_downlo
   return 0;
 }
 
+static int file_upload_send_result(stream_t *s, async_thread_params_t *prms, uint32_t error, uint32_t errorflags, const task_file_upload_resp_t *r) {
+  psync_async_result_t ar;
+  memset(&ar, 0, sizeof(ar));
+  ar.error=error;
+  ar.errorflags=errorflags;
+  if (r) {
+    ar.upload.fileid=r->fileid;
+    ar.upload.hash=r->hash;
+    ar.upload.size=r->size;
+  }
+  send_result(s->cb, s->cbext, &ar);
+  close_stream(s, prms, ar.error);
+  return 0;
+}
+
+static int process_file_upload_resp(stream_t *s, async_thread_params_t *prms, const char *buff, uint32_t datalen) {
+  task_file_upload_resp_t r;
+  if (unlikely(datalen<sizeof(r))) {
+    log_error("got packet of size %u while expecting at least %u, disconnecting", (unsigned)datalen, (unsigned)sizeof(r));
+    return -1;
+  }
+  memcpy(&r, buff, sizeof(r));
+  log_info("upload on stream %u finished with error %u, fileid %"P_PRI_U64, (unsigned)s->streamid, (unsigned)r.error, r.fileid);
+  return file_upload_send_result(s, prms, r.error?r.error+100:0, r.errorflags, &r);
+}
+
+/* The request line is followed by the name and the whole content of the file. The caller has read the file and
+ * computed its checksum, so nothing here touches the disk. */
+static int handle_file_upload(async_thread_params_t *prms, task_file_upload_t *upl) {
+  char buff[256];
+  stream_t *s;
+  size_t namelen;
+  int len;
+  s=create_stream(prms, 0);
+  s->cb=upl->cb;
+  s->cbext=upl->cbext;
+  s->process_data=process_file_upload_resp;
+  namelen=strlen(upl->name);
+  len=psync_slprintf(buff, sizeof(buff), "act=upl,strm=%"P_PRI_U64",folderid=%"P_PRI_U64",size=%"P_PRI_U64",sha1=%.40s,namelen=%u\n",
+                     (uint64_t)s->streamid, (uint64_t)upl->folderid, upl->size, (const char *)upl->sha1hex, (unsigned)namelen);
+  if (compress_data(prms, buff, len) || compress_data(prms, upl->name, namelen) || send_data(prms, upl->data, upl->size)) {
+    log_warn("failed to send upload of %s", upl->name);
+    return -1;
+  }
+  s->flags|=STREAM_FLAG_ACTIVE;
+  log_info("sent %"P_PRI_U64" bytes to folderid %"P_PRI_U64" as %s", upl->size, (uint64_t)upl->folderid, upl->name);
+  return 0;
+}
+
+static int process_file_checksum_resp(stream_t *s, async_thread_params_t *prms, const char *buff, uint32_t datalen) {
+  task_file_checksum_resp_t r;
+  psync_async_result_t ar;
+  if (unlikely(datalen<sizeof(r))) {
+    log_error("got packet of size %u while expecting at least %u, disconnecting", (unsigned)datalen, (unsigned)sizeof(r));
+    return -1;
+  }
+  memcpy(&r, buff, sizeof(r));
+  memset(&ar, 0, sizeof(ar));
+  ar.error=r.error?r.error+100:0;
+  ar.errorflags=r.errorflags;
+  ar.file.size=r.size;
+  ar.file.hash=r.hash;
+  memcpy(ar.file.sha1hex, r.sha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
+  send_result(s->cb, s->cbext, &ar);
+  close_stream(s, prms, ar.error);
+  return 0;
+}
+
+static int process_file_meta_resp(stream_t *s, async_thread_params_t *prms, const char *buff, uint32_t datalen) {
+  task_file_meta_resp_t r;
+  psync_async_result_t ar;
+  if (unlikely(datalen<sizeof(r))) {
+    log_error("got packet of size %u while expecting at least %u, disconnecting", (unsigned)datalen, (unsigned)sizeof(r));
+    return -1;
+  }
+  memcpy(&r, buff, sizeof(r));
+  memset(&ar, 0, sizeof(ar));
+  ar.error=r.error?r.error+100:0;
+  ar.errorflags=r.errorflags;
+  ar.meta.fileid=r.fileid;
+  ar.meta.parentfolderid=r.parentfolderid;
+  ar.meta.size=r.size;
+  ar.meta.hash=r.hash;
+  ar.meta.ctime=r.ctime;
+  ar.meta.mtime=r.mtime;
+  send_result(s->cb, s->cbext, &ar);
+  close_stream(s, prms, ar.error);
+  return 0;
+}
+
+static int handle_file_info(async_thread_params_t *prms, task_file_info_t *inf, const char *act,
+                            int (*process_data)(stream_t *, async_thread_params_t *, const char *, uint32_t)) {
+  char buff[128];
+  stream_t *s;
+  int len;
+  s=create_stream(prms, 0);
+  s->cb=inf->cb;
+  s->cbext=inf->cbext;
+  s->process_data=process_data;
+  len=psync_slprintf(buff, sizeof(buff), "act=%s,strm=%"P_PRI_U64",fileid=%"P_PRI_U64"\n", act, (uint64_t)s->streamid, (uint64_t)inf->fileid);
+  if (send_data(prms, buff, len)) {
+    log_warn("failed to send %s request for fileid %lu", act, (unsigned long)inf->fileid);
+    return -1;
+  }
+  s->flags|=STREAM_FLAG_ACTIVE;
+  return 0;
+}
+
+static int file_read_send_result(stream_t *s, async_thread_params_t *prms, file_read_add_t *fra, uint32_t error, uint32_t errorflags) {
+  psync_async_result_t ar;
+  memset(&ar, 0, sizeof(ar));
+  ar.error=error;
+  ar.errorflags=errorflags;
+  ar.read.offset=fra->offset;
+  ar.read.size=fra->size;
+  send_result(s->cb, s->cbext, &ar);
+  close_stream(s, prms, error);
+  return 0;
+}
+
+static int process_file_read_data(stream_t *s, async_thread_params_t *prms, const char *buff, uint32_t datalen) {
+  file_read_add_t *fra;
+  fra=(file_read_add_t *)(s+1);
+  if (datalen>fra->remsize) {
+    log_error("got packet of size %u for stream %u when the remaining data is %lu",
+          (unsigned)datalen, (unsigned)s->streamid, (unsigned long)fra->remsize);
+    return file_read_send_result(s, prms, fra, PSYNC_ASYNC_ERROR_NET, PSYNC_ASYNC_ERR_FLAG_RETRY_AS_IS);
+  }
+  memcpy(fra->buff+(fra->size-fra->remsize), buff, datalen);
+  fra->remsize-=datalen;
+  psync_account_downloaded_bytes(datalen);
+  if (fra->remsize==0)
+    return file_read_send_result(s, prms, fra, 0, 0);
+  else
+    return 0;
+}
+
+static int process_file_read_headers(stream_t *s, async_thread_params_t *prms, const char *buff, uint32_t datalen) {
+  task_file_read_resp_t r;
+  file_read_add_t *fra;
+  if (unlikely(datalen<sizeof(r))) {
+    log_error("got packet of size %u while expecting at least %u, disconnecting", (unsigned)datalen, (unsigned)sizeof(r));
+    return -1;
+  }
+  memcpy(&r, buff, sizeof(r));
+  fra=(file_read_add_t *)(s+1);
+  if (r.error)
+    return file_read_send_result(s, prms, fra, r.error+100, r.errorflags);
+  if (r.size>fra->length) {
+    log_error("server returned %"P_PRI_U64" bytes for a read of %u bytes", r.size, (unsigned)fra->length);
+    return file_read_send_result(s, prms, fra, PSYNC_ASYNC_ERROR_NET, PSYNC_ASYNC_ERR_FLAG_RETRY_AS_IS);
+  }
+  fra->size=fra->remsize=r.size;
+  if (!fra->remsize)
+    return file_read_send_result(s, prms, fra, 0, 0);
+  s->process_data=process_file_read_data;
+  if (datalen>sizeof(r))
+    return process_file_read_data(s, prms, buff+sizeof(r), datalen-sizeof(r));
+  else
+    return 0;
+}
+
+static int handle_file_read(async_thread_params_t *prms, task_file_read_t *rd) {
+  char buff[256];
+  stream_t *s;
+  file_read_add_t *fra;
+  int len;
+  s=create_stream(prms, sizeof(file_read_add_t));
+  fra=(file_read_add_t *)(s+1);
+  fra->buff=(char *)rd->buff;
+  fra->offset=rd->offset;
+  fra->size=0;
+  fra->remsize=0;
+  fra->length=rd->length;
+  s->cb=rd->cb;
+  s->cbext=rd->cbext;
+  s->process_data=process_file_read_headers;
+  len=psync_slprintf(buff, sizeof(buff), "act=read,strm=%"P_PRI_U64",fileid=%"P_PRI_U64",hash=%"P_PRI_U64",offset=%"P_PRI_U64",length=%u\n",
+                     (uint64_t)s->streamid, (uint64_t)rd->fileid, rd->hash, rd->offset, (unsigned)rd->length);
+  if (send_data(prms, buff, len)) {
+    log_warn("failed to send read request for fileid %lu", (unsigned long)rd->fileid);
+    return -1;
+  }
+  s->flags|=STREAM_FLAG_ACTIVE;
+  return 0;
+}
+
 #define CHECK_LEN(l)\
   do {\
     if (unlikely(len!=l)) {\
@@ -438,6 +891,18 @@ static int handle_command_data(async_thread_params_t *prms, char *data, uint32_t
     case TASK_TYPE_FILE_DWL_NM:
       CHECK_LEN(sizeof(task_file_download_if_not_mod_t));
       return handle_file_download_nm(prms, (task_file_download_if_not_mod_t *)data);
+    case TASK_TYPE_FILE_UPL:
+      CHECK_LEN(sizeof(task_file_upload_t));
+      return handle_file_upload(prms, (task_file_upload_t *)data);
+    case TASK_TYPE_FILE_SUM:
+      CHECK_LEN(sizeof(task_file_info_t));
+      return handle_file_info(prms, (task_file_info_t *)data, "sum", process_file_checksum_resp);
+    case TASK_TYPE_FILE_META:
+      CHECK_LEN(sizeof(task_file_info_t));
+      return handle_file_info(prms, (task_file_info_t *)data, "meta", process_file_meta_resp);
+    case TASK_TYPE_FILE_READ:
+      CHECK_LEN(sizeof(task_file_read_t));
+      return handle_file_read(prms, (task_file_read_t *)data);
     default:
       log_error("got packet of unknown type %u", (unsigned)type);
       return 1;
@@ -480,7 +945,7 @@ static int handle_command(async_thread_params_t *prms) {
 static int handle_decompressed_data(async_thread_params_t *prms) {
   int rd;
   while (1) {
-    rd=psync_deflate_read(prms->dec, prms->curreadbuff, prms->curreadbuffrem);
+    rd=psync_compressor_read(prms->dec, prms->curreadbuff, prms->curreadbuffrem);
     if (rd>0) {
       prms->curreadbuff+=rd;
       prms->curreadbuffrem-=rd;
@@ -490,7 +955,7 @@ static int handle_decompressed_data(async_thread_params_t *prms) {
     else if (rd==PSYNC_DEFLATE_NODATA)
       return 0;
     else {
-      log_error("psync_deflate_read returned %d", rd);
+      log_error("psync_compressor_read returned %d", rd);
       return -1;
     }
   }
@@ -510,9 +975,9 @@ static int handle_incoming_data(async_thread_params_t *prms) {
     }
     ptr=buff;
     while (rdsock) {
-      wrdecomp=psync_deflate_write(prms->dec, ptr, rdsock, PSYNC_DEFLATE_FLUSH);
+      wrdecomp=psync_compressor_write(prms->dec, ptr, rdsock, PSYNC_DEFLATE_FLUSH);
       if (wrdecomp==PSYNC_DEFLATE_ERROR) {
-        log_error("psync_deflate_write returned PSYNC_DEFLATE_ERROR");
+        log_error("psync_compressor_write returned PSYNC_DEFLATE_ERROR");
         return -1;
       }
       else if (wrdecomp!=PSYNC_DEFLATE_FULL) {
@@ -528,15 +993,16 @@ static int handle_incoming_data(async_thread_params_t *prms) {
 
 static void free_stream(stream_t *s) {
   log_info("freeing unfinished stream %u", (unsigned)s->streamid);
+  // the cleanup is queued first, so a retry started by the callback does not race with it
+  if (s->free)
+    s->free(s, PSYNC_ASYNC_ERROR_NET);
   if (s->flags&STREAM_FLAG_ACTIVE) {
     psync_async_result_t ar;
     memset(&ar, 0, sizeof(ar));
     ar.error=PSYNC_ASYNC_ERROR_NET;
     ar.errorflags=PSYNC_ASYNC_ERR_FLAG_RETRY_AS_IS;
-    s->cb(s->cbext, &ar);
+    send_result(s->cb, s->cbext, &ar);
   }
-  if (s->free)
-    s->free(s, PSYNC_ASYNC_ERROR_NET);
   psync_free(s);
 }
 
@@ -583,66 +1049,99 @@ static int process_stream_header(async_thread_params_t *prms) {
   return 0;
 }
 
-static void psync_async_thread(void *ptr) {
-  async_thread_params_t *prms=(async_thread_params_t *)ptr;
-  psync_socket_t sel[2];
-  int ret;
-  sel[0]=prms->api->sock;
-  sel[1]=prms->privsock;
-  read_stream_header_setup(prms);
-  while (1) {
-    if (prms->pendingrequests) {
-      if ((prms->pendingrequests>=PSYNC_ASYNC_MAX_GROUPED_REQUESTS || prms->datapendingsince+PSYNC_ASYNC_GROUP_REQUESTS_FOR<psync_millitime()) &&
-          flush_pending_data(prms))
-        break;
-      ret=psync_select_in(sel, 2, PSYNC_ASYNC_GROUP_REQUESTS_FOR/4);
-      if (ret==-1)
-        continue;
-    }
-    else {
-      if (psync_socket_pendingdata(prms->api))
-        ret=0;
-      else
-        ret=psync_select_in(sel, 2, PSYNC_ASYNC_THREAD_TIMEOUT);
-    }
-    if (ret==0) {
-      if (handle_incoming_data(prms))
-        break;
-    }
-    else if (ret==1) {
-      if (handle_command(prms))
-        break;
-    }
-    else {
-      log_info("psync_select_in returned %d, exiting, errno %d", ret, (int)psync_sock_err());
-      break;
-    }
-  }
+/* The connection has no thread of its own, both the API socket and our end of the socket pair are watched by the
+ * reactor and the functions below run as its callbacks. The idle/grouping timeout is kept on the socket pair watch. */
+
+static void async_finish(async_thread_params_t *prms) {
+  psync_reactor_del(prms->apiwatch);
+  psync_reactor_del(prms->cmdwatch);
   // close prms->privsock before locking as there might be somebody who keeps the mutex locked while waiting for us to reply
   psync_close_socket(prms->privsock);
-  pthread_mutex_lock(&amutex);
-  psync_close_socket(at_sock);
-  at_sock=INVALID_SOCKET;
-  running--;
-  pthread_mutex_unlock(&amutex);
+  pthread_mutex_lock(&prms->shard->mutex);
+  psync_close_socket(prms->shard->sock);
+  prms->shard->sock=INVALID_SOCKET;
+  prms->shard->running--;
+  pthread_mutex_unlock(&prms->shard->mutex);
   psync_apipool_release_bad(prms->api);
-  psync_deflate_destroy(prms->enc);
-  psync_deflate_destroy(prms->dec);
+  psync_compressor_destroy(prms->enc);
+  psync_compressor_destroy(prms->dec);
   psync_tree_for_each_element_call_safe(prms->streams, stream_t, tree, free_stream);
   psync_free(prms);
 }
 
-static int psync_async_start_thread_locked() {
+static void async_rearm(async_thread_params_t *prms) {
+  uint64_t now, flushat;
+  int64_t timeout;
+  if (prms->pendingrequests) {
+    now=psync_millitime();
+    flushat=prms->datapendingsince+PSYNC_ASYNC_GROUP_REQUESTS_FOR;
+    if (prms->pendingrequests>=PSYNC_ASYNC_MAX_GROUPED_REQUESTS || flushat<now) {
+      if (flush_pending_data(prms)) {
+        async_finish(prms);
+        return;
+      }
+      timeout=PSYNC_ASYNC_THREAD_TIMEOUT;
+    }
+    else
+      timeout=flushat-now+1;
+  }
+  else
+    timeout=PSYNC_ASYNC_THREAD_TIMEOUT;
+  psync_reactor_rearm(prms->apiwatch, prms->api->buffer?PSYNC_REACTOR_READ|PSYNC_REACTOR_WRITE:PSYNC_REACTOR_READ, -1);
+  psync_reactor_rearm(prms->cmdwatch, PSYNC_REACTOR_READ, timeout);
+}
+
+static void async_api_event(psync_reactor_watch *w, void *ptr, uint32_t events) {
+  async_thread_params_t *prms=(async_thread_params_t *)ptr;
+  if ((events&PSYNC_REACTOR_WRITE) && psync_socket_try_write_buffer(prms->api)<0) {
+    log_warn("write to the async connection failed");
+    async_finish(prms);
+    return;
+  }
+  if (!(events&PSYNC_REACTOR_READ)) {
+    async_rearm(prms);
+    return;
+  }
+  do {
+    if (handle_incoming_data(prms)) {
+      async_finish(prms);
+      return;
+    }
+  } while (psync_socket_pendingdata(prms->api));
+  async_rearm(prms);
+}
+
+static void async_cmd_event(psync_reactor_watch *w, void *ptr, uint32_t events) {
+  async_thread_params_t *prms=(async_thread_params_t *)ptr;
+  if (events&PSYNC_REACTOR_READ) {
+    if (handle_command(prms)) {
+      async_finish(prms);
+      return;
+    }
+  }
+  else if (!prms->pendingrequests) {
+    log_info("async connection idle for %u seconds, closing", (unsigned)(PSYNC_ASYNC_THREAD_TIMEOUT/1000));
+    async_finish(prms);
+    return;
+  }
+  async_rearm(prms);
+}
+
+static int psync_async_start_thread_locked(async_shard_t *shard) {
   /* If some form of protocol version negotiation is to be performed, here is the place to pass any needed parameters.
    * The assumption will be that server supports everything and clients inform the server what they support.
+   * The compression methods are listed in order of preference, a server that does not return the one it picked only
+   * knows deflate.
    */
-  binparam params[]={P_STR("auth", psync_my_auth), P_STR("checksum", "sha1")};
+  binparam params[]={P_STR("auth", psync_my_auth), P_STR("checksum", "sha1"),
+                     P_STR("compression", psync_compressor_available(PSYNC_COMPRESSOR_ZSTD)?"zstd,deflate":"deflate")};
   async_thread_params_t *tparams;
-  psync_deflate_t *enc, *dec;
+  psync_compressor_t *enc, *dec;
+  const binresult *cres;
   binresult *res;
   psync_socket *api;
   psync_socket_t pair[2];
-  int tries;
+  int tries, method;
   tries=0;
   while (1) {
     api=psync_apipool_get();
@@ -666,33 +1165,65 @@ static int psync_async_start_thread_locked() {
     psync_apipool_release(api);
     goto err0;
   }
+  cres=psync_check_result(res, "compression", PARAM_STR);
+  if (cres) {
+    method=psync_compressor_find(cres->str);
+    if (method<0) {
+      log_warn("asynctransfer picked unsupported compression %s", cres->str);
+      psync_free(res);
+      psync_apipool_release(api);
+      goto err0;
+    }
+  }
+  else
+    method=PSYNC_COMPRESSOR_DEFLATE;
   psync_free(res);
+  log_info("async connection uses %s compression", psync_compressor_name(method));
   if (psync_socket_pair(pair)) {
     log_info("psync_socket_pair() failed");
     goto err1;
   }
-  enc=psync_deflate_init(PSYNC_DEFLATE_COMP_FAST);
+  enc=psync_compressor_init(method, PSYNC_DEFLATE_COMP_FAST);
   if (!enc) {
-    log_info("psync_deflate_init() failed");
+    log_info("psync_compressor_init() failed");
     goto err2;
   }
-  dec=psync_deflate_init(PSYNC_DEFLATE_DECOMPRESS);
+  dec=psync_compressor_init(method, PSYNC_DEFLATE_DECOMPRESS);
   if (!dec) {
-    log_info("psync_deflate_init() failed");
+    log_info("psync_compressor_init() failed");
     goto err3;
   }
   tparams=psync_new(async_thread_params_t);
   memset(tparams, 0, sizeof(async_thread_params_t));
+  tparams->shard=shard;
   tparams->enc=enc;
   tparams->dec=dec;
   tparams->api=api;
   tparams->privsock=pair[1];
-  at_sock=pair[0];
-  psync_run_thread1("async transfer", psync_async_thread, tparams);
-  running++;
+  read_stream_header_setup(tparams);
+  // added disarmed so that neither callback can run before both watches are known
+  tparams->apiwatch=psync_reactor_add(api->sock, 0, -1, async_api_event, tparams);
+  if (!tparams->apiwatch)
+    goto err4;
+  tparams->cmdwatch=psync_reactor_add(pair[1], 0, -1, async_cmd_event, tparams);
+  if (!tparams->cmdwatch)
+    goto err5;
+  if (psync_socket_pendingdata(api) && handle_incoming_data(tparams))
+    goto err6;
+  shard->sock=pair[0];
+  shard->running++;
+  async_rearm(tparams);
   return 0;
+err6:
+  psync_reactor_del(tparams->cmdwatch);
+err5:
+  psync_reactor_del(tparams->apiwatch);
+err4:
+  psync_tree_for_each_element_call_safe(tparams->streams, stream_t, tree, free_stream);
+  psync_free(tparams);
+  psync_compressor_destroy(dec);
 err3:
-  psync_deflate_destroy(enc);
+  psync_compressor_destroy(enc);
 err2:
   psync_close_socket(pair[0]);
   psync_close_socket(pair[1]);
@@ -702,13 +1233,13 @@ err0:
   return -1;
 }
 
-static int psync_async_send_task_locked(const void *task, size_t len) {
+static int psync_async_send_task_locked(async_shard_t *shard, const void *task, size_t len) {
   unsigned char ch;
-  if (socket_t_writeall(at_sock, task, len)) {
+  if (socket_t_writeall(shard->sock, task, len)) {
     log_warn("failed to write %lu bytes of task to socket", (unsigned long)len);
     return -1;
   }
-  if (socket_t_readall(at_sock, &ch, 1)) {
+  if (socket_t_readall(shard->sock, &ch, 1)) {
     log_warn("failed to read response from socket");
     return -1;
   }
@@ -720,31 +1251,40 @@ static int psync_async_send_task_locked(const void *task, size_t len) {
   }
 }
 
-static int psync_async_send_task(const void *task, size_t len) {
+static int psync_async_send_task(int shardid, const void *task, size_t len) {
+  async_shard_t *shard;
   int ret;
-  pthread_mutex_lock(&amutex);
-  if (running)
-    ret=psync_async_send_task_locked(task, len);
+  shard=&shards[shardid];
+  pthread_mutex_lock(&shard->mutex);
+  if (shard->running)
+    ret=psync_async_send_task_locked(shard, task, len);
   else {
-    ret=psync_async_start_thread_locked();
+    ret=psync_async_start_thread_locked(shard);
     if (!ret)
-      ret=psync_async_send_task_locked(task, len);
+      ret=psync_async_send_task_locked(shard, task, len);
   }
-  pthread_mutex_unlock(&amutex);
+  pthread_mutex_unlock(&shard->mutex);
   return ret;
 }
 
 void psync_async_stop() {
   task_header_t task;
+  int i;
   task.type=TASK_TYPE_EXIT;
   task.len=0;
-  pthread_mutex_lock(&amutex);
-  if (running)
-    psync_async_send_task_locked(&task, sizeof(task));
-  pthread_mutex_unlock(&amutex);
+  for (i=0; i<SHARDS; i++) {
+    pthread_mutex_lock(&shards[i].mutex);
+    if (shards[i].running)
+      psync_async_send_task_locked(&shards[i], &task, sizeof(task));
+    pthread_mutex_unlock(&shards[i].mutex);
+  }
 }
 
-int psync_async_download_file(psync_fileid_t fileid, const char *localpath, psync_async_callback_t cb, void *cbext) {
+static int download_shard(uint64_t size) {
+  return size>=PSYNC_ASYNC_LARGE_DOWNLOAD_SIZE?SHARD_DOWNLOAD_LARGE:SHARD_DOWNLOAD_SMALL;
+}
+
+int psync_async_download_file(psync_fileid_t fileid, uint64_t size, const char *localpath, psync_async_callback_t cb, void *cbext) {
   task_hdr_file_download_t task;
   task.head.type=TASK_TYPE_FILE_DWL;
   task.head.len=get_len(task_hdr_file_download_t);
@@ -752,18 +1292,109 @@ int psync_async_download_file(psync_fileid_t fileid, const char *localpath, psyn
   task.task.localpath=localpath;
   task.task.cb=cb;
   task.task.cbext=cbext;
-  return psync_async_send_task(&task, sizeof(task));
+  return psync_async_send_task(download_shard(size), &task, sizeof(task));
 }
 
-int psync_async_download_file_if_changed(psync_fileid_t fileid, const char *localpath, uint64_t size, const void *sha1hex, psync_async_callback_t cb, void *cbext) {
+int psync_async_download_file_if_changed(psync_fileid_t fileid, uint64_t size, const char *localpath, uint64_t localsize, const void *sha1hex,
+                                         psync_async_callback_t cb, void *cbext) {
   task_hdr_file_download_if_not_mod_t task;
   task.head.type=TASK_TYPE_FILE_DWL_NM;
   task.head.len=get_len(task_hdr_file_download_if_not_mod_t);
   task.task.fileid=fileid;
   task.task.localpath=localpath;
-  task.task.size=size;
+  task.task.size=localsize;
   memcpy(task.task.sha1hex, sha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
   task.task.cb=cb;
   task.task.cbext=cbext;
-  return psync_async_send_task(&task, sizeof(task));
+  return psync_async_send_task(download_shard(size), &task, sizeof(task));
+}
+
+static int read_small_file(const char *localpath, char *buff, uint64_t *size) {
+  psync_file_t fd;
+  ssize_t rd;
+  uint64_t off;
+  fd=psync_file_open(localpath, P_O_RDONLY, 0);
+  if (fd==INVALID_HANDLE_VALUE) {
+    log_warn("could not open file %s, errno %d", localpath, (int)psync_fs_err());
+    return -1;
+  }
+  off=0;
+  while (off<=PSYNC_ASYNC_MAX_UPLOAD_SIZE) {
+    rd=psync_file_read(fd, buff+off, PSYNC_ASYNC_MAX_UPLOAD_SIZE+1-off);
+    if (rd==-1) {
+      log_warn("reading from file %s failed, errno %d", localpath, (int)psync_fs_err());
+      psync_file_close(fd);
+      return -1;
+    }
+    if (rd==0)
+      break;
+    off+=rd;
+  }
+  psync_file_close(fd);
+  if (off>PSYNC_ASYNC_MAX_UPLOAD_SIZE) {
+    log_warn("file %s is over %u bytes, too large for the async connection", localpath, (unsigned)PSYNC_ASYNC_MAX_UPLOAD_SIZE);
+    return -1;
+  }
+  *size=off;
+  return 0;
+}
+
+/* The file is read and hashed here, on the thread of the caller, the connection only gets the data to send. The
+ * reactor is done with the data once the task is sent. */
+int psync_async_upload_file(psync_folderid_t folderid, const char *name, const char *localpath, psync_async_callback_t cb, void *cbext) {
+  task_hdr_file_upload_t task;
+  unsigned char sha1b[PSYNC_SHA1_DIGEST_LEN];
+  char *data;
+  uint64_t size;
+  int ret;
+  data=(char *)psync_malloc(PSYNC_ASYNC_MAX_UPLOAD_SIZE+1);
+  if (read_small_file(localpath, data, &size)) {
+    psync_free(data);
+    return -1;
+  }
+  psync_sha1((const unsigned char *)data, size, sha1b);
+  task.head.type=TASK_TYPE_FILE_UPL;
+  task.head.len=get_len(task_hdr_file_upload_t);
+  task.task.folderid=folderid;
+  task.task.name=name;
+  task.task.data=data;
+  task.task.size=size;
+  psync_binhex(task.task.sha1hex, sha1b, PSYNC_SHA1_DIGEST_LEN);
+  task.task.cb=cb;
+  task.task.cbext=cbext;
+  ret=psync_async_send_task(SHARD_UPLOAD, &task, sizeof(task));
+  psync_free(data);
+  return ret;
+}
+
+static int psync_async_file_info(uint32_t type, psync_fileid_t fileid, psync_async_callback_t cb, void *cbext) {
+  task_hdr_file_info_t task;
+  task.head.type=type;
+  task.head.len=get_len(task_hdr_file_info_t);
+  task.task.fileid=fileid;
+  task.task.cb=cb;
+  task.task.cbext=cbext;
+  return psync_async_send_task(SHARD_SMALL, &task, sizeof(task));
+}
+
+int psync_async_file_checksum(psync_fileid_t fileid, psync_async_callback_t cb, void *cbext) {
+  return psync_async_file_info(TASK_TYPE_FILE_SUM, fileid, cb, cbext);
+}
+
+int psync_async_file_meta(psync_fileid_t fileid, psync_async_callback_t cb, void *cbext) {
+  return psync_async_file_info(TASK_TYPE_FILE_META, fileid, cb, cbext);
+}
+
+int psync_async_read_range(psync_fileid_t fileid, uint64_t hash, uint64_t offset, uint32_t length, void *buff, psync_async_callback_t cb, void *cbext) {
+  task_hdr_file_read_t task;
+  task.head.type=TASK_TYPE_FILE_READ;
+  task.head.len=get_len(task_hdr_file_read_t);
+  task.task.fileid=fileid;
+  task.task.hash=hash;
+  task.task.offset=offset;
+  task.task.length=length;
+  task.task.buff=buff;
+  task.task.cb=cb;
+  task.task.cbext=cbext;
+  return psync_async_send_task(SHARD_SMALL, &task, sizeof(task));
 }
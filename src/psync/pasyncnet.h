@@ -33,11 +33,34 @@ typedef struct {
   unsigned char sha1hex[40];
 } psync_async_file_result_t;
 
+typedef struct {
+  uint64_t fileid;
+  uint64_t hash;
+  uint64_t size;
+} psync_async_upload_result_t;
+
+typedef struct {
+  uint64_t fileid;
+  uint64_t parentfolderid;
+  uint64_t size;
+  uint64_t hash;
+  uint64_t ctime;
+  uint64_t mtime;
+} psync_async_meta_result_t;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t size;
+} psync_async_read_result_t;
+
 typedef struct {
   uint32_t error;
   uint32_t errorflags;
   union {
     psync_async_file_result_t file;
+    psync_async_upload_result_t upload;
+    psync_async_meta_result_t meta;
+    psync_async_read_result_t read;
   };
 } psync_async_result_t;
 
@@ -47,7 +70,14 @@ typedef void (*psync_async_callback_t)(void *, psync_async_result_t *);
  */
 
 void psync_async_stop();
-int psync_async_download_file(psync_fileid_t fileid, const char *localpath, psync_async_callback_t cb, void *cbext);
-int psync_async_download_file_if_changed(psync_fileid_t fileid, const char *localpath, uint64_t size, const void *sha1hex, psync_async_callback_t cb, void *cbext);
+/* size is the size the file is expected to have, large files go over a connection of their own */
+int psync_async_download_file(psync_fileid_t fileid, uint64_t size, const char *localpath, psync_async_callback_t cb, void *cbext);
+int psync_async_download_file_if_changed(psync_fileid_t fileid, uint64_t size, const char *localpath, uint64_t localsize, const void *sha1hex,
+                                         psync_async_callback_t cb, void *cbext);
+/* files up to PSYNC_ASYNC_MAX_UPLOAD_SIZE, read before the call returns */
+int psync_async_upload_file(psync_folderid_t folderid, const char *name, const char *localpath, psync_async_callback_t cb, void *cbext);
+int psync_async_file_checksum(psync_fileid_t fileid, psync_async_callback_t cb, void *cbext);
+int psync_async_file_meta(psync_fileid_t fileid, psync_async_callback_t cb, void *cbext);
+int psync_async_read_range(psync_fileid_t fileid, uint64_t hash, uint64_t offset, uint32_t length, void *buff, psync_async_callback_t cb, void *cbext);
 
 #endif  /* PCLOUD_PSYNC_PASYNCNET_H_ */
@@ -0,0 +1,305 @@
+/*
+ * This file is part of the pCloud Console Client.
+ *
+ * (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+ *
+ * For the full copyright and license information, please view
+ * the LICENSE file that was distributed with this source code.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "pblockscan.h"
+#include "psettings.h"
+#include "plibs.h"
+
+/* Looks for copies of known blocks at every offset of a file. The rolling adler32 of the window is kept without
+ * divisions: both halves stay below ADLER32_BASE with conditional subtractions and the weight of the byte leaving the
+ * window is looked up in outweight. Before a window is handed to the check callback its checksum is looked up in a
+ * bitmap filter with PSYNC_BLOCKSCAN_FILTER_BITS bits per block, so the callback sees about one window in that many
+ * that are not copies of anything.
+ *
+ * Large files are split into regions scanned by up to PSYNC_BLOCKSCAN_THREADS threads. Each region reads blocksize-1
+ * bytes past its end, so the windows that start in it are complete. In greedy mode a region restarts its scan one block
+ * after every match. When the regions are joined a match overlapping the previous one is dropped, so a block that
+ * would have matched right after a region boundary may be missed, but no reported match overlaps another.
+ */
+
+#define ADLER32_1(o) adler+=buff[o]; sum+=adler
+#define ADLER32_2(o) ADLER32_1(o); ADLER32_1(o+1)
+#define ADLER32_4(o) ADLER32_2(o); ADLER32_2(o+2)
+#define ADLER32_8(o) ADLER32_4(o); ADLER32_4(o+4)
+#define ADLER32_16() do{ ADLER32_8(0); ADLER32_8(8); } while (0)
+
+#define ADLER32_BASE    65521U
+#define ADLER32_NMAX    5552U
+
+#define BLOCKSCAN_FILTER_MUL 2654435761U
+
+typedef struct {
+  const psync_blockscan_t *bs;
+  psync_file_t fd;
+  uint64_t start;
+  uint64_t end;
+  psync_blockscan_match_t *matches;
+  uint32_t matchcnt;
+  uint32_t matchalloc;
+  int flags;
+  int err;
+} blockscan_region_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  blockscan_region_t *regions;
+  uint32_t regioncnt;
+  uint32_t next;
+  uint32_t running;
+} blockscan_job_t;
+
+uint32_t psync_adler32(uint32_t adler, const unsigned char *buff, size_t len) {
+  uint32_t sum, i;
+  sum=adler>>16;
+  adler&=0xffff;
+  while (len>=ADLER32_NMAX) {
+    len-=ADLER32_NMAX;
+    for (i=0; i<ADLER32_NMAX/16; i++) {
+      ADLER32_16();
+      buff+=16;
+    }
+    adler%=ADLER32_BASE;
+    sum%=ADLER32_BASE;
+  }
+  while (len>=16) {
+    len-=16;
+    ADLER32_16();
+    buff+=16;
+  }
+  while (len--) {
+    adler+=*buff++;
+    sum+=adler;
+  }
+  adler%=ADLER32_BASE;
+  sum%=ADLER32_BASE;
+  return adler|(sum<<16);
+}
+
+psync_blockscan_t *psync_blockscan_create(uint32_t blocksize, uint32_t blockcnt, psync_blockscan_check_t check, void *ptr) {
+  psync_blockscan_t *bs;
+  uint64_t bits;
+  uint32_t i;
+  bs=psync_new(psync_blockscan_t);
+  bs->check=check;
+  bs->ptr=ptr;
+  bs->blocksize=blocksize;
+  bits=65536;
+  bs->filtershift=16;
+  while (bits<(uint64_t)blockcnt*PSYNC_BLOCKSCAN_FILTER_BITS && bits<PSYNC_BLOCKSCAN_FILTER_MAX_BITS) {
+    bits*=2;
+    bs->filtershift--;
+  }
+  bs->filter=psync_new_cnt(uint64_t, bits/64);
+  memset(bs->filter, 0, bits/8);
+  for (i=0; i<256; i++)
+    bs->outweight[i]=(uint64_t)blocksize*i%ADLER32_BASE;
+  return bs;
+}
+
+void psync_blockscan_add(psync_blockscan_t *bs, uint32_t adler) {
+  uint32_t h;
+  h=(adler*BLOCKSCAN_FILTER_MUL)>>bs->filtershift;
+  bs->filter[h/64]|=(uint64_t)1<<(h%64);
+}
+
+void psync_blockscan_destroy(psync_blockscan_t *bs) {
+  psync_free(bs->filter);
+  psync_free(bs);
+}
+
+static void blockscan_add_match(blockscan_region_t *r, uint64_t off, uint32_t idx) {
+  if (r->matchcnt==r->matchalloc) {
+    r->matchalloc=r->matchalloc?r->matchalloc*2:64;
+    r->matches=(psync_blockscan_match_t *)psync_realloc(r->matches, sizeof(psync_blockscan_match_t)*r->matchalloc);
+  }
+  r->matches[r->matchcnt].off=off;
+  r->matches[r->matchcnt].idx=idx;
+  r->matchcnt++;
+}
+
+/* Scans the cnt windows starting in buff, which holds cnt+blocksize-1 bytes from file offset off. Returns the offset
+ * of the next window to scan, greedy matches may skip past the end of the buffer.
+ */
+static uint64_t blockscan_buffer(blockscan_region_t *r, const unsigned char *buff, size_t cnt, uint64_t off) {
+  const psync_blockscan_t *bs;
+  const uint64_t *filter;
+  const uint32_t *outweight;
+  size_t i, blocksize;
+  uint32_t a, s, adler, h, idx, out, filtershift;
+  bs=r->bs;
+  filter=bs->filter;
+  outweight=bs->outweight;
+  filtershift=bs->filtershift;
+  blocksize=bs->blocksize;
+  adler=psync_adler32(PSYNC_ADLER32_INITIAL, buff, blocksize);
+  a=adler&0xffff;
+  s=adler>>16;
+  i=0;
+  while (1) {
+    adler=a|(s<<16);
+    h=(adler*BLOCKSCAN_FILTER_MUL)>>filtershift;
+    if (unlikely(filter[h/64]&((uint64_t)1<<(h%64))) && (idx=bs->check(bs->ptr, adler, buff+i))) {
+      blockscan_add_match(r, off+i, idx);
+      if (r->flags&PSYNC_BLOCKSCAN_GREEDY) {
+        i+=blocksize;
+        if (i>=cnt)
+          return off+i;
+        adler=psync_adler32(PSYNC_ADLER32_INITIAL, buff+i, blocksize);
+        a=adler&0xffff;
+        s=adler>>16;
+        continue;
+      }
+    }
+    if (++i==cnt)
+      break;
+    out=buff[i-1];
+    a+=buff[i-1+blocksize]-out;
+    if ((int32_t)a<0)
+      a+=ADLER32_BASE;
+    else if (a>=ADLER32_BASE)
+      a-=ADLER32_BASE;
+    s+=a+ADLER32_BASE-PSYNC_ADLER32_INITIAL-outweight[out];
+    if (s>=ADLER32_BASE)
+      s-=ADLER32_BASE;
+    if (s>=ADLER32_BASE)
+      s-=ADLER32_BASE;
+  }
+  return off+cnt;
+}
+
+static void blockscan_region(blockscan_region_t *r) {
+  unsigned char *buff;
+  uint64_t pos;
+  size_t chunk, cnt, need;
+  ssize_t rd;
+  if (r->bs->blocksize>PSYNC_BLOCKSCAN_BUFFER_SIZE)
+    chunk=r->bs->blocksize;
+  else
+    chunk=PSYNC_BLOCKSCAN_BUFFER_SIZE;
+  buff=(unsigned char *)psync_malloc(chunk+r->bs->blocksize);
+  pos=r->start;
+  while (pos<r->end) {
+    if (r->end-pos>chunk)
+      cnt=chunk;
+    else
+      cnt=r->end-pos;
+    need=cnt+r->bs->blocksize-1;
+    rd=psync_file_pread(r->fd, buff, need, pos);
+    if (unlikely_log(rd<0)) {
+      r->err=1;
+      break;
+    }
+    if ((size_t)rd<need)
+      memset(buff+rd, 0, need-rd);
+    pos=blockscan_buffer(r, buff, cnt, pos);
+  }
+  psync_free(buff);
+}
+
+static void blockscan_thread(void *ptr) {
+  blockscan_job_t *j;
+  uint32_t i;
+  j=(blockscan_job_t *)ptr;
+  while (1) {
+    pthread_mutex_lock(&j->mutex);
+    if (j->next==j->regioncnt) {
+      if (--j->running==0)
+        pthread_cond_signal(&j->cond);
+      pthread_mutex_unlock(&j->mutex);
+      return;
+    }
+    i=j->next++;
+    pthread_mutex_unlock(&j->mutex);
+    blockscan_region(&j->regions[i]);
+  }
+}
+
+/* Scans the windows starting in [off, off+len) of fd and returns the matches in file order in a psync_malloc-ed array,
+ * windows reaching past the end of the file are padded with zeroes. Returns -1 on read errors.
+ */
+int psync_blockscan_file(const psync_blockscan_t *bs, psync_file_t fd, uint64_t off, uint64_t len, int flags,
+                         psync_blockscan_match_t **matches, uint32_t *matchcnt) {
+  blockscan_job_t j;
+  psync_blockscan_match_t *m;
+  uint64_t rlen, nextoff;
+  int64_t fsize;
+  uint32_t i, k, cnt;
+  int err;
+  *matches=NULL;
+  *matchcnt=0;
+  fsize=psync_file_size(fd);
+  if (unlikely_log(fsize<0))
+    return -1;
+  if (off>=(uint64_t)fsize)
+    return 0;
+  if (off+len>(uint64_t)fsize)
+    len=fsize-off;
+  j.regioncnt=len/PSYNC_BLOCKSCAN_MIN_REGION;
+  if (j.regioncnt>PSYNC_BLOCKSCAN_THREADS)
+    j.regioncnt=PSYNC_BLOCKSCAN_THREADS;
+  else if (!j.regioncnt)
+    j.regioncnt=1;
+  j.regions=psync_new_cnt(blockscan_region_t, j.regioncnt);
+  memset(j.regions, 0, sizeof(blockscan_region_t)*j.regioncnt);
+  rlen=len/j.regioncnt;
+  for (i=0; i<j.regioncnt; i++) {
+    j.regions[i].bs=bs;
+    j.regions[i].fd=fd;
+    j.regions[i].start=off+rlen*i;
+    j.regions[i].end=i==j.regioncnt-1?off+len:off+rlen*(i+1);
+    j.regions[i].flags=flags;
+  }
+  if (j.regioncnt==1)
+    blockscan_region(&j.regions[0]);
+  else {
+    j.next=0;
+    j.running=1;
+    pthread_mutex_init(&j.mutex, NULL);
+    pthread_cond_init(&j.cond, NULL);
+    for (i=1; i<j.regioncnt; i++) {
+      j.running++;
+      psync_run_thread1("block scan", blockscan_thread, &j);
+    }
+    blockscan_thread(&j);
+    pthread_mutex_lock(&j.mutex);
+    while (j.running)
+      pthread_cond_wait(&j.cond, &j.mutex);
+    pthread_mutex_unlock(&j.mutex);
+    pthread_cond_destroy(&j.cond);
+    pthread_mutex_destroy(&j.mutex);
+  }
+  cnt=0;
+  err=0;
+  for (i=0; i<j.regioncnt; i++) {
+    cnt+=j.regions[i].matchcnt;
+    err|=j.regions[i].err;
+  }
+  if (cnt && !err) {
+    m=psync_new_cnt(psync_blockscan_match_t, cnt);
+    cnt=0;
+    nextoff=0;
+    for (i=0; i<j.regioncnt; i++)
+      for (k=0; k<j.regions[i].matchcnt; k++) {
+        if ((flags&PSYNC_BLOCKSCAN_GREEDY) && j.regions[i].matches[k].off<nextoff)
+          continue;
+        m[cnt++]=j.regions[i].matches[k];
+        nextoff=j.regions[i].matches[k].off+bs->blocksize;
+      }
+    *matches=m;
+    *matchcnt=cnt;
+  }
+  for (i=0; i<j.regioncnt; i++)
+    psync_free(j.regions[i].matches);
+  psync_free(j.regions);
+  return err?-1:0;
+}
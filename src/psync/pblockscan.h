@@ -0,0 +1,59 @@
+/*
+ * This file is part of the pCloud Console Client.
+ *
+ * (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+ *
+ * For the full copyright and license information, please view
+ * the LICENSE file that was distributed with this source code.
+ */
+
+#ifndef PCLOUD_PSYNC_PBLOCKSCAN_H_
+#define PCLOUD_PSYNC_PBLOCKSCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pcloudcc/psync/compat.h"
+
+#define PSYNC_ADLER32_INITIAL 1U
+
+/* after a match continue one block later, so the reported matches do not overlap */
+#define PSYNC_BLOCKSCAN_GREEDY 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returns the nonzero index of the block data (blocksize bytes) is a copy of, or 0. Called only for windows whose
+ * rolling checksum passed the filter, from several threads at once.
+ */
+typedef uint32_t (*psync_blockscan_check_t)(void *ptr, uint32_t adler, const unsigned char *data);
+
+typedef struct {
+  uint64_t off;
+  uint32_t idx;
+} psync_blockscan_match_t;
+
+typedef struct {
+  psync_blockscan_check_t check;
+  void *ptr;
+  uint64_t *filter;
+  uint32_t filtershift;
+  uint32_t blocksize;
+  uint32_t outweight[256];
+} psync_blockscan_t;
+
+uint32_t psync_adler32(uint32_t adler, const unsigned char *buff, size_t len);
+
+psync_blockscan_t *psync_blockscan_create(uint32_t blocksize, uint32_t blockcnt, psync_blockscan_check_t check, void *ptr);
+void psync_blockscan_add(psync_blockscan_t *bs, uint32_t adler);
+void psync_blockscan_destroy(psync_blockscan_t *bs);
+
+int psync_blockscan_file(const psync_blockscan_t *bs, psync_file_t fd, uint64_t off, uint64_t len, int flags,
+                         psync_blockscan_match_t **matches, uint32_t *matchcnt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* PCLOUD_PSYNC_PBLOCKSCAN_H_ */
@@ -20,6 +20,7 @@
 #include "psettings.h"
 #include "pfolder.h"
 #include "pcache.h"
+#include "plist.h"
 #include "pfileops.h"
 #include "pmemlock.h"
 #include "pstatus.h"
@@ -67,9 +68,12 @@ typedef struct {
   unsigned char hmackey[PSYNC_CRYPTO_HMAC_SHA512_KEY_LEN];
 } sym_key_ver1;
 
+static void name_cache_clean(psync_folderid_t folderid, int all);
+
 void psync_cloud_crypto_clean_cache() {
-  const char *prefixes[]={"DKEY", "FKEY", "FLDE", "FLDD", "SEEN"};
+  const char *prefixes[]={"DKEY", "FKEY", "FLDE", "FLDD", "SEEN", "PKEY"};
   psync_cache_clean_starting_with_one_of(prefixes, ARRAY_SIZE(prefixes));
+  name_cache_clean(0, 1);
 }
 
 const char *psync_cloud_crypto_strstart(int status) {
@@ -769,6 +773,8 @@ static psync_encrypted_symmetric_key_t psync_crypto_download_folder_enc_key(psyn
   return ret;
 }
 
+static void prefetch_file_siblings(psync_fileid_t fileid);
+
 static psync_encrypted_symmetric_key_t psync_crypto_download_file_enc_key(psync_fileid_t fileid) {
   binparam params[]={P_STR("auth", psync_my_auth), P_NUM("fileid", fileid)};
   psync_socket *api;
@@ -814,6 +820,7 @@ static psync_encrypted_symmetric_key_t psync_crypto_download_file_enc_key(psync_
   memcpy(ret->data, key, keylen);
   psync_free(key);
   save_file_key_to_db(fileid, result, ret);
+  prefetch_file_siblings(fileid);
   return ret;
 }
 
@@ -926,6 +933,280 @@ static psync_symmetric_key_t psync_crypto_sym_key_ver1_to_sym_key(sym_key_ver1 *
   return key;
 }
 
+/* Key prefetch: when an encrypted folder is listed or the first key of a file in it has to be downloaded, the encrypted keys
+ * of (up to PSYNC_CRYPTO_PREFETCH_MAX_KEYS) children that are not yet in the database are requested over a single api
+ * connection with all commands pipelined, saved in one transaction and (up to PSYNC_CRYPTO_PREFETCH_UNWRAP_KEYS) of them
+ * are RSA decrypted by PSYNC_CRYPTO_PREFETCH_THREADS threads into the symmetric key cache.
+ */
+
+typedef struct {
+  psync_encrypted_symmetric_key_t enckey;
+  uint64_t id;
+  uint64_t hash;
+  int isfolder;
+} prefetch_key_t;
+
+typedef struct {
+  prefetch_key_t *keys;
+  uint32_t cnt;
+  uint32_t next;
+  uint32_t running;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} prefetch_unwrap_t;
+
+static pthread_mutex_t prefetch_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+static void prefetch_seen_free(void *ptr) {
+}
+
+static int prefetch_folder_seen(psync_folderid_t folderid, int add) {
+  char buff[16];
+  int ret;
+  psync_get_string_id(buff, "PKEY", folderid);
+  pthread_mutex_lock(&prefetch_mutex);
+  ret=psync_cache_has(buff);
+  if (!ret && add)
+    psync_cache_add(buff, NULL, PSYNC_CRYPTO_PREFETCH_INTERVAL_SEC, prefetch_seen_free, 1);
+  pthread_mutex_unlock(&prefetch_mutex);
+  return ret;
+}
+
+static int prefetch_folder_has_missing_keys(psync_folderid_t folderid) {
+  psync_sql_res *res;
+  int ret;
+  res=psync_sql_query_rdlock("SELECT 1 FROM file WHERE parentfolderid=? AND "
+                             "NOT EXISTS (SELECT 1 FROM cryptofilekey k WHERE k.fileid=file.id AND k.hash=file.hash) LIMIT 1");
+  psync_sql_bind_uint(res, 1, folderid);
+  ret=psync_sql_fetch_rowint(res)!=NULL;
+  psync_sql_free_result(res);
+  if (ret)
+    return ret;
+  res=psync_sql_query_rdlock("SELECT 1 FROM folder WHERE parentfolderid=? AND flags&? AND "
+                             "NOT EXISTS (SELECT 1 FROM cryptofolderkey k WHERE k.folderid=folder.id) LIMIT 1");
+  psync_sql_bind_uint(res, 1, folderid);
+  psync_sql_bind_uint(res, 2, PSYNC_FOLDER_FLAG_ENCRYPTED);
+  ret=psync_sql_fetch_rowint(res)!=NULL;
+  psync_sql_free_result(res);
+  return ret;
+}
+
+static uint32_t prefetch_collect_keys(psync_folderid_t folderid, prefetch_key_t *keys) {
+  psync_sql_res *res;
+  psync_uint_row row;
+  uint32_t cnt;
+  cnt=0;
+  res=psync_sql_query_rdlock("SELECT id FROM folder WHERE parentfolderid=? AND flags&? AND "
+                             "NOT EXISTS (SELECT 1 FROM cryptofolderkey k WHERE k.folderid=folder.id) LIMIT ?");
+  psync_sql_bind_uint(res, 1, folderid);
+  psync_sql_bind_uint(res, 2, PSYNC_FOLDER_FLAG_ENCRYPTED);
+  psync_sql_bind_uint(res, 3, PSYNC_CRYPTO_PREFETCH_MAX_KEYS);
+  while ((row=psync_sql_fetch_rowint(res))) {
+    keys[cnt].id=row[0];
+    keys[cnt].hash=0;
+    keys[cnt].isfolder=1;
+    keys[cnt].enckey=NULL;
+    cnt++;
+  }
+  psync_sql_free_result(res);
+  res=psync_sql_query_rdlock("SELECT id, hash FROM file WHERE parentfolderid=? AND "
+                             "NOT EXISTS (SELECT 1 FROM cryptofilekey k WHERE k.fileid=file.id AND k.hash=file.hash) LIMIT ?");
+  psync_sql_bind_uint(res, 1, folderid);
+  psync_sql_bind_uint(res, 2, PSYNC_CRYPTO_PREFETCH_MAX_KEYS-cnt);
+  while ((row=psync_sql_fetch_rowint(res))) {
+    keys[cnt].id=row[0];
+    keys[cnt].hash=row[1];
+    keys[cnt].isfolder=0;
+    keys[cnt].enckey=NULL;
+    cnt++;
+  }
+  psync_sql_free_result(res);
+  return cnt;
+}
+
+static psync_encrypted_symmetric_key_t prefetch_key_from_result(const binresult *res) {
+  const binresult *b64key;
+  psync_encrypted_symmetric_key_t ret;
+  unsigned char *key;
+  size_t keylen;
+  if (psync_find_result(res, "result", PARAM_NUM)->num)
+    return NULL;
+  b64key=psync_find_result(res, "key", PARAM_STR);
+  key=psync_base64_decode((const unsigned char *)b64key->str, b64key->length, &keylen);
+  if (!key)
+    return NULL;
+  ret=psync_ssl_alloc_encrypted_symmetric_key(keylen);
+  memcpy(ret->data, key, keylen);
+  psync_free(key);
+  return ret;
+}
+
+static uint32_t prefetch_download_keys(prefetch_key_t *keys, uint32_t cnt) {
+  psync_socket *api;
+  binresult *res;
+  uint32_t i, sent, got;
+  api=psync_apipool_get();
+  if (!api)
+    return 0;
+  for (sent=0; sent<cnt; sent++) {
+    if (keys[sent].isfolder) {
+      binparam params[]={P_STR("auth", psync_my_auth), P_NUM("folderid", keys[sent].id)};
+      if (!send_command_no_res(api, "crypto_getfolderkey", params))
+        break;
+    }
+    else {
+      binparam params[]={P_STR("auth", psync_my_auth), P_NUM("fileid", keys[sent].id)};
+      if (!send_command_no_res(api, "crypto_getfilekey", params))
+        break;
+    }
+  }
+  got=0;
+  for (i=0; i<sent; i++) {
+    res=get_result(api);
+    if (unlikely_log(!res))
+      break;
+    keys[i].enckey=prefetch_key_from_result(res);
+    if (keys[i].enckey) {
+      if (!keys[i].isfolder)
+        keys[i].hash=psync_find_result(res, "hash", PARAM_NUM)->num;
+      got++;
+    }
+    psync_free(res);
+  }
+  if (i==cnt)
+    psync_apipool_release(api);
+  else
+    psync_apipool_release_bad(api);
+  return got;
+}
+
+static void prefetch_save_keys(prefetch_key_t *keys, uint32_t cnt) {
+  psync_sql_res *fres, *dres;
+  uint32_t i;
+  psync_sql_start_transaction();
+  fres=psync_sql_prep_statement("REPLACE INTO cryptofilekey (fileid, hash, enckey) VALUES (?, ?, ?)");
+  dres=psync_sql_prep_statement("REPLACE INTO cryptofolderkey (folderid, enckey) VALUES (?, ?)");
+  for (i=0; i<cnt; i++) {
+    if (!keys[i].enckey)
+      continue;
+    if (keys[i].isfolder) {
+      psync_sql_bind_uint(dres, 1, keys[i].id);
+      psync_sql_bind_blob(dres, 2, (const char *)keys[i].enckey->data, keys[i].enckey->datalen);
+      psync_sql_run(dres);
+    }
+    else {
+      psync_sql_bind_uint(fres, 1, keys[i].id);
+      psync_sql_bind_uint(fres, 2, keys[i].hash);
+      psync_sql_bind_blob(fres, 3, (const char *)keys[i].enckey->data, keys[i].enckey->datalen);
+      psync_sql_run(fres);
+    }
+  }
+  psync_sql_free_result(dres);
+  psync_sql_free_result(fres);
+  psync_sql_commit_transaction();
+}
+
+static void prefetch_unwrap_keys(void *ptr) {
+  prefetch_unwrap_t *u;
+  prefetch_key_t *k;
+  psync_symmetric_key_t symkey;
+  u=(prefetch_unwrap_t *)ptr;
+  while (1) {
+    pthread_mutex_lock(&u->mutex);
+    if (u->next==u->cnt) {
+      if (--u->running==0)
+        pthread_cond_signal(&u->cond);
+      pthread_mutex_unlock(&u->mutex);
+      return;
+    }
+    k=&u->keys[u->next++];
+    pthread_mutex_unlock(&u->mutex);
+    if (!k->enckey)
+      continue;
+    pthread_rwlock_rdlock(&crypto_lock);
+    if (crypto_started_l) {
+      symkey=psync_ssl_rsa_decrypt_symmetric_key(crypto_privkey, k->enckey);
+      if (symkey!=PSYNC_INVALID_SYM_KEY) {
+        if (k->isfolder)
+          psync_crypto_release_folder_symkey_locked(k->id, symkey);
+        else
+          psync_crypto_release_file_symkey_locked(k->id, k->hash, symkey);
+      }
+    }
+    pthread_rwlock_unlock(&crypto_lock);
+  }
+}
+
+static void prefetch_keys_thread(void *ptr) {
+  prefetch_key_t *keys;
+  prefetch_unwrap_t u;
+  psync_folderid_t folderid;
+  uint32_t cnt, got, i;
+  folderid=*(psync_folderid_t *)ptr;
+  psync_free(ptr);
+  keys=psync_new_cnt(prefetch_key_t, PSYNC_CRYPTO_PREFETCH_MAX_KEYS);
+  cnt=prefetch_collect_keys(folderid, keys);
+  if (!cnt) {
+    psync_free(keys);
+    return;
+  }
+  got=prefetch_download_keys(keys, cnt);
+  log_debug("prefetched %u of %u keys in folder %lu", (unsigned)got, (unsigned)cnt, (unsigned long)folderid);
+  if (got) {
+    prefetch_save_keys(keys, cnt);
+    u.keys=keys;
+    u.cnt=cnt>PSYNC_CRYPTO_PREFETCH_UNWRAP_KEYS?PSYNC_CRYPTO_PREFETCH_UNWRAP_KEYS:cnt;
+    u.next=0;
+    u.running=1;
+    pthread_mutex_init(&u.mutex, NULL);
+    pthread_cond_init(&u.cond, NULL);
+    for (i=1; i<PSYNC_CRYPTO_PREFETCH_THREADS && i<u.cnt; i++) {
+      u.running++;
+      psync_run_thread1("crypto key unwrap", prefetch_unwrap_keys, &u);
+    }
+    prefetch_unwrap_keys(&u);
+    pthread_mutex_lock(&u.mutex);
+    while (u.running)
+      pthread_cond_wait(&u.cond, &u.mutex);
+    pthread_mutex_unlock(&u.mutex);
+    pthread_cond_destroy(&u.cond);
+    pthread_mutex_destroy(&u.mutex);
+  }
+  for (i=0; i<cnt; i++)
+    psync_free(keys[i].enckey);
+  psync_free(keys);
+}
+
+void psync_cloud_crypto_prefetch_folder_keys(psync_folderid_t folderid) {
+  psync_folderid_t *fid;
+  if (!crypto_started_un || !folderid || prefetch_folder_seen(folderid, 1))
+    return;
+  fid=psync_new(psync_folderid_t);
+  *fid=folderid;
+  psync_run_thread1("crypto key prefetch", prefetch_keys_thread, fid);
+}
+
+/* Called after every file key download, so the common cases, a folder prefetched recently or one without keys left
+ * to fetch, return without starting a thread.
+ */
+static void prefetch_file_siblings(psync_fileid_t fileid) {
+  psync_sql_res *res;
+  psync_uint_row row;
+  psync_folderid_t folderid, *fid;
+  folderid=0;
+  res=psync_sql_query_rdlock("SELECT parentfolderid FROM file WHERE id=?");
+  psync_sql_bind_uint(res, 1, fileid);
+  if ((row=psync_sql_fetch_rowint(res)))
+    folderid=row[0];
+  psync_sql_free_result(res);
+  if (!folderid || prefetch_folder_seen(folderid, 0) || !prefetch_folder_has_missing_keys(folderid) ||
+      prefetch_folder_seen(folderid, 1))
+    return;
+  fid=psync_new(psync_folderid_t);
+  *fid=folderid;
+  psync_run_thread1("crypto key prefetch", prefetch_keys_thread, fid);
+}
+
 static psync_crypto_aes256_text_encoder_t psync_crypto_get_folder_encoder_locked(psync_folderid_t folderid) {
   psync_crypto_aes256_text_encoder_t enc;
   psync_symmetric_key_t symkey, realkey;
@@ -1206,6 +1487,165 @@ char *psync_cloud_crypto_encode_filename(psync_crypto_aes256_text_encoder_t enco
   return (char *)filenameb32;
 }
 
+/* Cache of encrypted <-> plaintext names, keyed by folderid. Each entry is linked in two hash chains (one per direction)
+ * and in a global LRU list that bounds the cache to PSYNC_CRYPTO_CACHE_NAMES entries. Name encryption is deterministic
+ * for a given folder key, so entries only have to be dropped when the remote entry goes away or crypto is stopped.
+ */
+
+#define NAME_CACHE_HASH_SIZE 16384
+
+typedef struct {
+  psync_list encl;
+  psync_list plainl;
+  psync_list lru;
+  psync_folderid_t folderid;
+  uint32_t enchash;
+  uint32_t plainhash;
+  char *plainname;
+  char encname[];
+} name_cache_entry;
+
+static psync_list name_cache_enc[NAME_CACHE_HASH_SIZE];
+static psync_list name_cache_plain[NAME_CACHE_HASH_SIZE];
+static psync_list name_cache_lru=PSYNC_LIST_STATIC_INIT(name_cache_lru);
+static pthread_mutex_t name_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+static uint32_t name_cache_cnt=0;
+static int name_cache_inited=0;
+
+static uint32_t name_cache_hash(psync_folderid_t folderid, const char *name) {
+  uint32_t c, hash;
+  hash=(uint32_t)folderid*0xc2b2ae35U;
+  while ((c=(unsigned char)*name++))
+    hash=c+(hash<<5)+hash;
+  hash+=hash<<3;
+  hash^=hash>>11;
+  return hash;
+}
+
+static void name_cache_init_locked() {
+  psync_uint_t i;
+  for (i=0; i<NAME_CACHE_HASH_SIZE; i++) {
+    psync_list_init(&name_cache_enc[i]);
+    psync_list_init(&name_cache_plain[i]);
+  }
+  name_cache_inited=1;
+}
+
+static void name_cache_free_entry_locked(name_cache_entry *ne) {
+  psync_list_del(&ne->encl);
+  psync_list_del(&ne->plainl);
+  psync_list_del(&ne->lru);
+  name_cache_cnt--;
+  psync_free(ne);
+}
+
+static char *name_cache_get(psync_folderid_t folderid, const char *name, int encrypted) {
+  name_cache_entry *ne;
+  char *ret;
+  uint32_t h;
+  if (folderid<=0)
+    return NULL;
+  h=name_cache_hash(folderid, name);
+  ret=NULL;
+  pthread_mutex_lock(&name_cache_mutex);
+  if (unlikely(!name_cache_inited)) {
+    pthread_mutex_unlock(&name_cache_mutex);
+    return NULL;
+  }
+  if (encrypted) {
+    psync_list_for_each_element(ne, &name_cache_enc[h%NAME_CACHE_HASH_SIZE], name_cache_entry, encl)
+      if (ne->enchash==h && ne->folderid==folderid && !strcmp(ne->encname, name)) {
+        ret=psync_strdup(ne->plainname);
+        break;
+      }
+  }
+  else {
+    psync_list_for_each_element(ne, &name_cache_plain[h%NAME_CACHE_HASH_SIZE], name_cache_entry, plainl)
+      if (ne->plainhash==h && ne->folderid==folderid && !strcmp(ne->plainname, name)) {
+        ret=psync_strdup(ne->encname);
+        break;
+      }
+  }
+  if (ret) {
+    psync_list_del(&ne->lru);
+    psync_list_add_tail(&name_cache_lru, &ne->lru);
+  }
+  pthread_mutex_unlock(&name_cache_mutex);
+  return ret;
+}
+
+char *psync_cloud_crypto_names_get_plain(psync_fsfolderid_t folderid, const char *encname) {
+  return name_cache_get(folderid, encname, 1);
+}
+
+char *psync_cloud_crypto_names_get_encrypted(psync_fsfolderid_t folderid, const char *plainname) {
+  return name_cache_get(folderid, plainname, 0);
+}
+
+void psync_cloud_crypto_names_add(psync_fsfolderid_t folderid, const char *encname, const char *plainname) {
+  name_cache_entry *ne, *ne2;
+  size_t enclen, plainlen;
+  uint32_t h;
+  if (folderid<=0 || !crypto_started_un)
+    return;
+  enclen=strlen(encname)+1;
+  plainlen=strlen(plainname)+1;
+  ne=(name_cache_entry *)psync_malloc(offsetof(name_cache_entry, encname)+enclen+plainlen);
+  ne->folderid=folderid;
+  ne->enchash=name_cache_hash(folderid, encname);
+  ne->plainhash=name_cache_hash(folderid, plainname);
+  memcpy(ne->encname, encname, enclen);
+  ne->plainname=ne->encname+enclen;
+  memcpy(ne->plainname, plainname, plainlen);
+  h=ne->enchash;
+  pthread_mutex_lock(&name_cache_mutex);
+  if (unlikely(!name_cache_inited))
+    name_cache_init_locked();
+  psync_list_for_each_element(ne2, &name_cache_enc[h%NAME_CACHE_HASH_SIZE], name_cache_entry, encl)
+    if (ne2->enchash==h && ne2->folderid==folderid && !strcmp(ne2->encname, encname)) {
+      pthread_mutex_unlock(&name_cache_mutex);
+      psync_free(ne);
+      return;
+    }
+  if (name_cache_cnt>=PSYNC_CRYPTO_CACHE_NAMES)
+    name_cache_free_entry_locked(psync_list_element(name_cache_lru.next, name_cache_entry, lru));
+  psync_list_add_head(&name_cache_enc[h%NAME_CACHE_HASH_SIZE], &ne->encl);
+  psync_list_add_head(&name_cache_plain[ne->plainhash%NAME_CACHE_HASH_SIZE], &ne->plainl);
+  psync_list_add_tail(&name_cache_lru, &ne->lru);
+  name_cache_cnt++;
+  pthread_mutex_unlock(&name_cache_mutex);
+}
+
+void psync_cloud_crypto_names_forget(psync_folderid_t folderid, const char *encname) {
+  name_cache_entry *ne;
+  uint32_t h;
+  h=name_cache_hash(folderid, encname);
+  pthread_mutex_lock(&name_cache_mutex);
+  if (name_cache_inited)
+    psync_list_for_each_element(ne, &name_cache_enc[h%NAME_CACHE_HASH_SIZE], name_cache_entry, encl)
+      if (ne->enchash==h && ne->folderid==folderid && !strcmp(ne->encname, encname)) {
+        name_cache_free_entry_locked(ne);
+        break;
+      }
+  pthread_mutex_unlock(&name_cache_mutex);
+}
+
+static void name_cache_clean(psync_folderid_t folderid, int all) {
+  psync_list *l1, *l2;
+  name_cache_entry *ne;
+  pthread_mutex_lock(&name_cache_mutex);
+  psync_list_for_each_safe(l1, l2, &name_cache_lru) {
+    ne=psync_list_element(l1, name_cache_entry, lru);
+    if (all || ne->folderid==folderid)
+      name_cache_free_entry_locked(ne);
+  }
+  pthread_mutex_unlock(&name_cache_mutex);
+}
+
+void psync_cloud_crypto_names_forget_folder(psync_folderid_t folderid) {
+  name_cache_clean(folderid, 0);
+}
+
 static psync_crypto_aes256_sector_encoder_decoder_t psync_crypto_get_file_encoder_locked(psync_fileid_t fileid, uint64_t hash, int nonetwork) {
   psync_crypto_aes256_sector_encoder_decoder_t enc;
   psync_symmetric_key_t symkey, realkey;
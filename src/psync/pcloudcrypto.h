@@ -97,6 +97,14 @@ psync_crypto_aes256_text_encoder_t psync_cloud_crypto_get_folder_encoder(psync_f
 void psync_cloud_crypto_release_folder_encoder(psync_fsfolderid_t folderid, psync_crypto_aes256_text_encoder_t encoder);
 char *psync_cloud_crypto_encode_filename(psync_crypto_aes256_text_encoder_t encoder, const char *name);
 
+char *psync_cloud_crypto_names_get_plain(psync_fsfolderid_t folderid, const char *encname);
+char *psync_cloud_crypto_names_get_encrypted(psync_fsfolderid_t folderid, const char *plainname);
+void psync_cloud_crypto_names_add(psync_fsfolderid_t folderid, const char *encname, const char *plainname);
+void psync_cloud_crypto_names_forget(psync_folderid_t folderid, const char *encname);
+void psync_cloud_crypto_names_forget_folder(psync_folderid_t folderid);
+
+void psync_cloud_crypto_prefetch_folder_keys(psync_folderid_t folderid);
+
 psync_crypto_aes256_sector_encoder_decoder_t psync_cloud_crypto_get_file_encoder(psync_fsfileid_t fileid, uint64_t hash, int nonetwork);
 psync_crypto_aes256_sector_encoder_decoder_t psync_cloud_crypto_get_file_encoder_from_binresult(psync_fileid_t fileid, binresult *res);
 void psync_cloud_crypto_release_file_encoder(psync_fsfileid_t fileid, uint64_t hash, psync_crypto_aes256_sector_encoder_decoder_t encoder);
@@ -23,6 +23,8 @@
 
 #ifdef P_OS_LINUX
 #include <sys/sysinfo.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #endif
 
 #ifdef P_OS_MACOSX
@@ -48,6 +50,7 @@
 #include <ctype.h>
 #include <pwd.h>
 #include <grp.h>
+#include <poll.h>
 
 extern char **environ;
 
@@ -63,6 +66,7 @@ extern char **environ;
 #include "psettings.h"
 #include "pssl.h"
 #include "ptimer.h"
+#include "ptree.h"
 #include "logger.h"
 
 #define PROXY_NONE    0
@@ -684,15 +688,23 @@ void psync_get_random_seed(unsigned char *seed, const void *addent, size_t aelen
   psync_store_seed_in_db(seed);
 }
 
+/* poll() rather than select() here and below, select() can not handle descriptors above FD_SETSIZE and with many
+ * parallel transfers we do get there */
+static int psync_poll_socket(psync_socket_t sock, short events, long sec, long usec) {
+  struct pollfd pfd;
+  int res;
+  pfd.fd=sock;
+  pfd.events=events;
+  pfd.revents=0;
+  do {
+    res=poll(&pfd, 1, sec*1000+usec/1000);
+  } while (res==-1 && errno==EINTR);
+  return res;
+}
+
 static int psync_wait_socket_writable_microsec(psync_socket_t sock, long sec, long usec) {
-  fd_set wfds;
-  struct timeval tv;
   int res;
-  tv.tv_sec=sec;
-  tv.tv_usec=usec;
-  FD_ZERO(&wfds);
-  FD_SET(sock, &wfds);
-  res=select(sock+1, NULL, &wfds, NULL, &tv);
+  res=psync_poll_socket(sock, POLLOUT, sec, usec);
   if (res==1)
     return 0;
   if (res==0)
@@ -707,21 +719,15 @@ int psync_wait_socket_write_timeout(psync_socket_t sock) {
 }
 
 static int psync_wait_socket_readable_microsec(psync_socket_t sock, long sec, long usec) {
-  fd_set rfds;
-  struct timeval tv;
 #if IS_DEBUG
   struct timespec start, end;
   unsigned long msec;
 #endif
   int res;
-  tv.tv_sec=sec;
-  tv.tv_usec=usec;
-  FD_ZERO(&rfds);
-  FD_SET(sock, &rfds);
 #if IS_DEBUG
   psync_nanotime(&start);
 #endif
-  res=select(sock+1, &rfds, NULL, NULL, &tv);
+  res=psync_poll_socket(sock, POLLIN, sec, usec);
   if (res==1) {
 #if IS_DEBUG
     psync_nanotime(&end);
@@ -739,7 +745,7 @@ static int psync_wait_socket_readable_microsec(psync_socket_t sock, long sec, lo
     psync_sock_set_err(P_TIMEDOUT);
   }
   else
-    log_warn("select returned %d", res);
+    log_warn("poll returned %d", res);
   return SOCKET_ERROR;
 }
 
@@ -749,6 +755,20 @@ int psync_wait_socket_read_timeout(psync_socket_t sock) {
   return psync_wait_socket_readable(sock, PSYNC_SOCK_READ_TIMEOUT);
 }
 
+// a refused connection makes the socket writable as well, only SO_ERROR tells it from an established one
+static int connect_res_failed(psync_socket_t sock) {
+  socklen_t len;
+  int err;
+  len=sizeof(err);
+  if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len))
+    return 1;
+  if (err) {
+    psync_sock_set_err(err);
+    return 1;
+  }
+  return 0;
+}
+
 static psync_socket_t connect_res(struct addrinfo *res) {
   psync_socket_t sock;
 #if defined(SOCK_NONBLOCK)
@@ -773,7 +793,8 @@ static psync_socket_t connect_res(struct addrinfo *res) {
 #endif
 #endif
       if ((connect(sock, res->ai_addr, res->ai_addrlen)!=SOCKET_ERROR) ||
-          (psync_sock_err()==P_INPROGRESS && !psync_wait_socket_writable(sock, PSYNC_SOCK_CONNECT_TIMEOUT)))
+          (psync_sock_err()==P_INPROGRESS && !psync_wait_socket_writable(sock, PSYNC_SOCK_CONNECT_TIMEOUT) &&
+           !connect_res_failed(sock)))
         return sock;
       psync_close_socket(sock);
     }
@@ -1154,28 +1175,16 @@ static psync_socket_t connect_socket(const char *host, const char *port) {
 }
 
 static int wait_sock_ready_for_ssl(psync_socket_t sock) {
-  fd_set fds, *rfds, *wfds;
-  struct timeval tv;
   int res;
-  FD_ZERO(&fds);
-  FD_SET(sock, &fds);
-  if (psync_ssl_errno==PSYNC_SSL_ERR_WANT_READ) {
-    rfds=&fds;
-    wfds=NULL;
-    tv.tv_sec=PSYNC_SOCK_READ_TIMEOUT;
-  }
-  else if (psync_ssl_errno==PSYNC_SSL_ERR_WANT_WRITE) {
-    rfds=NULL;
-    wfds=&fds;
-    tv.tv_sec=PSYNC_SOCK_WRITE_TIMEOUT;
-  }
+  if (psync_ssl_errno==PSYNC_SSL_ERR_WANT_READ)
+    res=psync_poll_socket(sock, POLLIN, PSYNC_SOCK_READ_TIMEOUT, 0);
+  else if (psync_ssl_errno==PSYNC_SSL_ERR_WANT_WRITE)
+    res=psync_poll_socket(sock, POLLOUT, PSYNC_SOCK_WRITE_TIMEOUT, 0);
   else {
     log_error("this functions should only be called when SSL returns WANT_READ/WANT_WRITE");
     psync_sock_set_err(P_INVAL);
     return SOCKET_ERROR;
   }
-  tv.tv_usec=0;
-  res=select(sock+1, rfds, wfds, NULL, &tv);
   if (res==1)
     return 0;
   if (res==0) {
@@ -1221,6 +1230,7 @@ psync_socket *psync_socket_connect(const char *host, int unsigned port, int ssl)
   ret->buffer = NULL;
   ret->sock=sock;
   ret->pending=0;
+  ret->minrtt=0;
 
   return ret;
 }
@@ -1746,6 +1756,81 @@ int psync_socket_writeall(psync_socket *sock, const void *buff, int num) {
     return psync_socket_writeall_plain(sock->sock, buff, num);
 }
 
+/* File data can go from the page cache to the socket without passing through our buffers when the socket is plain or
+ * the kernel does the TLS record encryption. */
+int psync_socket_can_sendfile(psync_socket *sock) {
+  if (sock->buffer)
+    return 0;
+  if (sock->ssl)
+    return psync_ssl_can_sendfile(sock->ssl);
+#if defined(P_OS_LINUX)
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+int psync_socket_sendfile(psync_socket *sock, psync_file_t fd, uint64_t offset, int num) {
+  int br, r;
+  br=0;
+  while (br<num) {
+    if (sock->ssl) {
+      r=psync_ssl_sendfile(sock->ssl, fd, offset+br, num-br);
+      if (r==PSYNC_SSL_FAIL) {
+        if (psync_ssl_errno==PSYNC_SSL_ERR_WANT_READ || psync_ssl_errno==PSYNC_SSL_ERR_WANT_WRITE) {
+          if (wait_sock_ready_for_ssl(sock->sock))
+            return -1;
+          else
+            continue;
+        }
+        else {
+          psync_sock_set_err(P_CONNRESET);
+          return -1;
+        }
+      }
+    }
+    else {
+#if defined(P_OS_LINUX)
+      off_t off;
+      off=offset+br;
+      r=sendfile(sock->sock, fd, &off, num-br);
+      if (r==SOCKET_ERROR) {
+        if (psync_sock_err()==P_WOULDBLOCK || psync_sock_err()==P_AGAIN || psync_sock_err()==P_INTR) {
+          if (psync_wait_socket_write_timeout(sock->sock))
+            return -1;
+          else
+            continue;
+        }
+        else
+          return -1;
+      }
+#else
+      return -1;
+#endif
+    }
+    // the file ended before offset+num
+    if (r==0)
+      return br;
+    br+=r;
+  }
+  return br;
+}
+
+/* The kernel's smoothed round trip time of the connection, for sending or as estimated by the receiving side. */
+int psync_socket_get_rtt(psync_socket *sock, int recv, uint32_t *rttus) {
+#if defined(P_OS_LINUX) && defined(TCP_INFO)
+  struct tcp_info info;
+  socklen_t len;
+  len=sizeof(info);
+  if (getsockopt(sock->sock, IPPROTO_TCP, TCP_INFO, &info, &len))
+    return -1;
+  *rttus=recv?info.tcpi_rcv_rtt:info.tcpi_rtt;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
 static int psync_socket_readall_ssl_thread(psync_socket *sock, void *buff, int num) {
   int br, r;
   br=0;
@@ -2019,42 +2104,412 @@ int psync_socket_pair(psync_socket_t sfd[2]) {
 }
 
 int psync_socket_is_broken(psync_socket_t sock) {
-  fd_set rfds;
-  struct timeval tv;
-  memset(&tv, 0, sizeof(tv));
-  FD_ZERO(&rfds);
-  FD_SET(sock, &rfds);
-  return select(sock+1, NULL, NULL, &rfds, &tv)==1;
+  return psync_poll_socket(sock, POLLPRI, 0, 0)==1;
 }
 
 int psync_select_in(psync_socket_t *sockets, int cnt, int64_t timeoutmillisec) {
-  fd_set rfds;
-  struct timeval tv, *ptv;
-  psync_socket_t max;
+  struct pollfd *pfds;
   int i;
-  if (timeoutmillisec<0)
-    ptv=NULL;
-  else {
-    tv.tv_sec=timeoutmillisec/1000;
-    tv.tv_usec=(timeoutmillisec%1000)*1000;
-    ptv=&tv;
-  }
-  FD_ZERO(&rfds);
-  max=0;
+  pfds=psync_new_cnt(struct pollfd, cnt);
   for (i=0; i<cnt; i++) {
-    FD_SET(sockets[i], &rfds);
-    if (sockets[i]>=max)
-      max=sockets[i]+1;
+    pfds[i].fd=sockets[i];
+    pfds[i].events=POLLIN;
+    pfds[i].revents=0;
   }
-  i=select(max, &rfds, NULL, NULL, ptv);
+  i=poll(pfds, cnt, timeoutmillisec<0?-1:(int)timeoutmillisec);
   if (i>0) {
     for (i=0; i<cnt; i++)
-      if (FD_ISSET(sockets[i], &rfds))
-        return i;
+      if (pfds[i].revents)
+        break;
+    if (i==cnt)
+      i=SOCKET_ERROR;
   }
-  else if (i==0)
-    psync_sock_set_err(P_TIMEDOUT);
-  return SOCKET_ERROR;
+  else {
+    if (i==0)
+      psync_sock_set_err(P_TIMEDOUT);
+    i=SOCKET_ERROR;
+  }
+  psync_free(pfds);
+  return i;
+}
+
+/* Reactor: a single thread multiplexing many sockets (epoll on Linux, poll() elsewhere). Watches are one-shot, once the
+ * callback is called the watch is disarmed until psync_reactor_rearm() is called, usually from the callback itself.
+ * Callbacks run on the reactor thread and should not block for long. Rearming or deleting a watch cancels any event not
+ * yet delivered to it. Watches are freed by the reactor thread once no event can refer to them any more, so deleting a
+ * watch from any thread (including from its own callback) is safe, the socket should be closed only after that. */
+
+struct _psync_reactor_watch {
+  psync_tree tree;
+  struct _psync_reactor_watch *next;
+  struct _psync_reactor_watch *freenext;
+  psync_reactor_callback cb;
+  void *ptr;
+  uint64_t deadline;
+  psync_socket_t sock;
+  uint32_t events;
+  uint32_t fired;
+  int deleted;
+#if !defined(P_OS_LINUX)
+  uint32_t idx;
+#endif
+};
+
+static pthread_mutex_t reactor_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_tree *reactor_timers=PSYNC_TREE_EMPTY;
+static psync_reactor_watch *reactor_freed=NULL;
+static psync_socket_t reactor_wakefd[2]={INVALID_SOCKET, INVALID_SOCKET};
+static int reactor_started=0;
+static __thread int reactor_is_reactor_thread=0;
+
+#if defined(P_OS_LINUX)
+static int reactor_epfd=-1;
+#else
+static psync_reactor_watch **reactor_watches=NULL;
+static uint32_t reactor_watchcnt=0;
+static uint32_t reactor_watchalloc=0;
+#endif
+
+static int reactor_cmp_deadline(const psync_tree *t1, const psync_tree *t2) {
+  const psync_reactor_watch *w1, *w2;
+  w1=psync_tree_element(t1, psync_reactor_watch, tree);
+  w2=psync_tree_element(t2, psync_reactor_watch, tree);
+  if (w1->deadline<w2->deadline)
+    return -1;
+  else if (w1->deadline>w2->deadline)
+    return 1;
+  else
+    return 0;
+}
+
+static void reactor_set_timer_locked(psync_reactor_watch *w, int64_t timeoutms) {
+  if (w->deadline) {
+    psync_tree_del(&reactor_timers, &w->tree);
+    w->deadline=0;
+  }
+  if (timeoutms>=0) {
+    w->deadline=psync_millitime()+timeoutms;
+    psync_tree_add(&reactor_timers, &w->tree, reactor_cmp_deadline);
+  }
+}
+
+static int reactor_next_timeout_locked() {
+  psync_reactor_watch *w;
+  uint64_t now;
+  if (!reactor_timers)
+    return -1;
+  w=psync_tree_element(psync_tree_get_first(reactor_timers), psync_reactor_watch, tree);
+  now=psync_millitime();
+  if (w->deadline<=now)
+    return 0;
+  else if (w->deadline-now>INT32_MAX)
+    return INT32_MAX;
+  else
+    return w->deadline-now;
+}
+
+static void reactor_wake() {
+  char ch;
+  /* the reactor thread recomputes its timeout before waiting again anyway */
+  if (reactor_is_reactor_thread)
+    return;
+  ch=0;
+  if (write(reactor_wakefd[1], &ch, 1)!=1 && errno!=EAGAIN)
+    log_warn("failed to wake up reactor, errno %d", (int)errno);
+}
+
+static void reactor_drain_wake() {
+  char buff[64];
+  while (read(reactor_wakefd[0], buff, sizeof(buff))>0);
+}
+
+#if defined(P_OS_LINUX)
+
+static int reactor_os_init() {
+  struct epoll_event e;
+  reactor_epfd=epoll_create1(EPOLL_CLOEXEC);
+  if (unlikely_log(reactor_epfd==-1))
+    return -1;
+  memset(&e, 0, sizeof(e));
+  e.events=EPOLLIN;
+  e.data.ptr=NULL;
+  if (unlikely_log(epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, reactor_wakefd[0], &e))) {
+    close(reactor_epfd);
+    reactor_epfd=-1;
+    return -1;
+  }
+  return 0;
+}
+
+static uint32_t reactor_os_events(uint32_t events) {
+  uint32_t ret;
+  ret=EPOLLONESHOT;
+  if (events&PSYNC_REACTOR_READ)
+    ret|=EPOLLIN;
+  if (events&PSYNC_REACTOR_WRITE)
+    ret|=EPOLLOUT;
+  return ret;
+}
+
+static int reactor_os_add_locked(psync_reactor_watch *w) {
+  struct epoll_event e;
+  memset(&e, 0, sizeof(e));
+  e.events=reactor_os_events(w->events);
+  e.data.ptr=w;
+  return epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, w->sock, &e);
+}
+
+static void reactor_os_arm_locked(psync_reactor_watch *w) {
+  struct epoll_event e;
+  memset(&e, 0, sizeof(e));
+  e.events=reactor_os_events(w->events);
+  e.data.ptr=w;
+  if (unlikely(epoll_ctl(reactor_epfd, EPOLL_CTL_MOD, w->sock, &e)))
+    log_warn("epoll_ctl failed for socket %d, errno %d", (int)w->sock, (int)errno);
+}
+
+static void reactor_os_del_locked(psync_reactor_watch *w) {
+  epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, w->sock, NULL);
+}
+
+#else
+
+static int reactor_os_init() {
+  return 0;
+}
+
+static int reactor_os_add_locked(psync_reactor_watch *w) {
+  if (reactor_watchcnt==reactor_watchalloc) {
+    reactor_watchalloc=reactor_watchalloc?reactor_watchalloc*2:64;
+    reactor_watches=(psync_reactor_watch **)psync_realloc(reactor_watches, sizeof(psync_reactor_watch *)*reactor_watchalloc);
+  }
+  w->idx=reactor_watchcnt;
+  reactor_watches[reactor_watchcnt++]=w;
+  return 0;
+}
+
+static void reactor_os_arm_locked(psync_reactor_watch *w) {
+  /* poll() set is rebuilt on every iteration, just make sure the thread picks up the change */
+}
+
+static void reactor_os_del_locked(psync_reactor_watch *w) {
+  reactor_watches[w->idx]=reactor_watches[--reactor_watchcnt];
+  reactor_watches[w->idx]->idx=w->idx;
+}
+
+#endif
+
+static void reactor_fire_locked(psync_reactor_watch *w, uint32_t events, psync_reactor_watch **fired) {
+  if (w->fired) {
+    w->fired|=events;
+    return;
+  }
+  w->fired=events;
+  if (w->deadline) {
+    psync_tree_del(&reactor_timers, &w->tree);
+    w->deadline=0;
+  }
+  /* one-shot, a watch that fired on timeout may still be armed for I/O */
+  if (w->events && (events&PSYNC_REACTOR_TIMEOUT)) {
+    w->events=0;
+    reactor_os_arm_locked(w);
+  }
+  w->events=0;
+  w->next=*fired;
+  *fired=w;
+}
+
+static void reactor_fire_timers_locked(psync_reactor_watch **fired) {
+  psync_reactor_watch *w;
+  uint64_t now;
+  now=psync_millitime();
+  while (reactor_timers) {
+    w=psync_tree_element(psync_tree_get_first(reactor_timers), psync_reactor_watch, tree);
+    if (w->deadline>now)
+      break;
+    reactor_fire_locked(w, PSYNC_REACTOR_TIMEOUT, fired);
+  }
+}
+
+#if defined(P_OS_LINUX)
+
+static psync_reactor_watch *reactor_wait(int timeout) {
+  struct epoll_event evs[PSYNC_REACTOR_MAX_EVENTS];
+  psync_reactor_watch *w, *fired;
+  uint32_t ev;
+  int cnt, i;
+  cnt=epoll_wait(reactor_epfd, evs, PSYNC_REACTOR_MAX_EVENTS, timeout);
+  if (unlikely(cnt==-1)) {
+    if (errno!=EINTR) {
+      log_error("epoll_wait failed, errno %d", (int)errno);
+      psync_milisleep(100);
+    }
+    cnt=0;
+  }
+  fired=NULL;
+  pthread_mutex_lock(&reactor_mutex);
+  for (i=0; i<cnt; i++) {
+    w=(psync_reactor_watch *)evs[i].data.ptr;
+    if (!w) {
+      reactor_drain_wake();
+      continue;
+    }
+    if (w->deleted || !w->events)
+      continue;
+    ev=0;
+    if (evs[i].events&EPOLLIN)
+      ev|=PSYNC_REACTOR_READ;
+    if (evs[i].events&EPOLLOUT)
+      ev|=PSYNC_REACTOR_WRITE;
+    if (evs[i].events&(EPOLLERR|EPOLLHUP))
+      ev|=PSYNC_REACTOR_ERROR|(w->events&(PSYNC_REACTOR_READ|PSYNC_REACTOR_WRITE));
+    reactor_fire_locked(w, ev, &fired);
+  }
+  reactor_fire_timers_locked(&fired);
+  pthread_mutex_unlock(&reactor_mutex);
+  return fired;
+}
+
+#else
+
+static psync_reactor_watch *reactor_wait(int timeout) {
+  struct pollfd *pfds;
+  psync_reactor_watch **ws, *w, *fired;
+  uint32_t ev, cnt, i;
+  int res;
+  pthread_mutex_lock(&reactor_mutex);
+  pfds=psync_new_cnt(struct pollfd, reactor_watchcnt+1);
+  ws=psync_new_cnt(psync_reactor_watch *, reactor_watchcnt+1);
+  pfds[0].fd=reactor_wakefd[0];
+  pfds[0].events=POLLIN;
+  pfds[0].revents=0;
+  ws[0]=NULL;
+  cnt=1;
+  for (i=0; i<reactor_watchcnt; i++) {
+    w=reactor_watches[i];
+    if (!w->events)
+      continue;
+    pfds[cnt].fd=w->sock;
+    pfds[cnt].events=((w->events&PSYNC_REACTOR_READ)?POLLIN:0)|((w->events&PSYNC_REACTOR_WRITE)?POLLOUT:0);
+    pfds[cnt].revents=0;
+    ws[cnt++]=w;
+  }
+  pthread_mutex_unlock(&reactor_mutex);
+  res=poll(pfds, cnt, timeout);
+  if (unlikely(res==-1) && errno!=EINTR) {
+    log_error("poll failed, errno %d", (int)errno);
+    psync_milisleep(100);
+  }
+  fired=NULL;
+  pthread_mutex_lock(&reactor_mutex);
+  if (res>0) {
+    if (pfds[0].revents)
+      reactor_drain_wake();
+    for (i=1; i<cnt; i++) {
+      w=ws[i];
+      if (!pfds[i].revents || w->deleted || !w->events)
+        continue;
+      ev=0;
+      if (pfds[i].revents&POLLIN)
+        ev|=PSYNC_REACTOR_READ;
+      if (pfds[i].revents&POLLOUT)
+        ev|=PSYNC_REACTOR_WRITE;
+      if (pfds[i].revents&(POLLERR|POLLHUP|POLLNVAL))
+        ev|=PSYNC_REACTOR_ERROR|(w->events&(PSYNC_REACTOR_READ|PSYNC_REACTOR_WRITE));
+      reactor_fire_locked(w, ev, &fired);
+    }
+  }
+  reactor_fire_timers_locked(&fired);
+  pthread_mutex_unlock(&reactor_mutex);
+  psync_free(ws);
+  psync_free(pfds);
+  return fired;
+}
+
+#endif
+
+static void reactor_thread() {
+  psync_reactor_watch *w, *fired;
+  uint32_t ev;
+  int timeout;
+  reactor_is_reactor_thread=1;
+  while (1) {
+    pthread_mutex_lock(&reactor_mutex);
+    while ((w=reactor_freed)) {
+      reactor_freed=w->freenext;
+      psync_free(w);
+    }
+    timeout=reactor_next_timeout_locked();
+    pthread_mutex_unlock(&reactor_mutex);
+    fired=reactor_wait(timeout);
+    while (fired) {
+      w=fired;
+      fired=w->next;
+      pthread_mutex_lock(&reactor_mutex);
+      ev=w->deleted?0:w->fired;
+      w->fired=0;
+      pthread_mutex_unlock(&reactor_mutex);
+      if (ev)
+        w->cb(w, w->ptr, ev);
+    }
+  }
+}
+
+static int reactor_start_locked() {
+  if (psync_pipe(reactor_wakefd))
+    return -1;
+  fcntl(reactor_wakefd[0], F_SETFL, fcntl(reactor_wakefd[0], F_GETFL)|O_NONBLOCK);
+  fcntl(reactor_wakefd[1], F_SETFL, fcntl(reactor_wakefd[1], F_GETFL)|O_NONBLOCK);
+  if (reactor_os_init()) {
+    psync_pipe_close(reactor_wakefd[0]);
+    psync_pipe_close(reactor_wakefd[1]);
+    return -1;
+  }
+  psync_run_thread("reactor", reactor_thread);
+  reactor_started=1;
+  return 0;
+}
+
+psync_reactor_watch *psync_reactor_add(psync_socket_t sock, uint32_t events, int64_t timeoutms, psync_reactor_callback cb, void *ptr) {
+  psync_reactor_watch *w;
+  w=psync_new(psync_reactor_watch);
+  memset(w, 0, sizeof(psync_reactor_watch));
+  w->cb=cb;
+  w->ptr=ptr;
+  w->sock=sock;
+  w->events=events;
+  pthread_mutex_lock(&reactor_mutex);
+  if ((!reactor_started && reactor_start_locked()) || reactor_os_add_locked(w)) {
+    pthread_mutex_unlock(&reactor_mutex);
+    log_warn("failed to add socket %d to the reactor, errno %d", (int)sock, (int)errno);
+    psync_free(w);
+    return NULL;
+  }
+  reactor_set_timer_locked(w, timeoutms);
+  pthread_mutex_unlock(&reactor_mutex);
+  reactor_wake();
+  return w;
+}
+
+void psync_reactor_rearm(psync_reactor_watch *w, uint32_t events, int64_t timeoutms) {
+  pthread_mutex_lock(&reactor_mutex);
+  w->events=events;
+  w->fired=0;
+  reactor_os_arm_locked(w);
+  reactor_set_timer_locked(w, timeoutms);
+  pthread_mutex_unlock(&reactor_mutex);
+  reactor_wake();
+}
+
+void psync_reactor_del(psync_reactor_watch *w) {
+  pthread_mutex_lock(&reactor_mutex);
+  reactor_os_del_locked(w);
+  reactor_set_timer_locked(w, -1);
+  w->deleted=1;
+  w->events=0;
+  w->freenext=reactor_freed;
+  reactor_freed=w;
+  pthread_mutex_unlock(&reactor_mutex);
 }
 
 /*! \brief Traverses a \a path and calls a \a cb with \a ptr for every file
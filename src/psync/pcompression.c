@@ -12,6 +12,9 @@
 #include "pcloudcc/psync/compat.h"
 
 #include "zlib.h"
+#if defined(P_HAS_ZSTD)
+#include <zstd.h>
+#endif
 #include "plibs.h"
 #include "pcompression.h"
 #include "logger.h"
@@ -242,3 +245,270 @@ int psync_deflate_read(psync_deflate_t *def, void *data, int len) {
 int psync_deflate_pending(psync_deflate_t *def) {
   return def->bufferendoff-def->bufferstartoff+(def->flushbuff?def->flushbufflen:0);
 }
+
+#if defined(P_HAS_ZSTD)
+
+/* zstd streams keep their output in a linear buffer that is compacted on every write. Writes stop taking input once
+ * ZSTD_BUFFER_LIMIT bytes are waiting to be read, except that a flush of the compressor always completes and may grow
+ * the buffer past the limit. Output the decompressor holds back is fetched by the next read. */
+#define ZSTD_BUFFER_LIMIT (64*1024)
+
+typedef struct {
+  ZSTD_CStream *cstream;
+  ZSTD_DStream *dstream;
+  unsigned char *buffer;
+  size_t start;
+  size_t end;
+  size_t alloced;
+  uint32_t flags;
+} zstd_stream_t;
+
+static void *zstd_init(int level) {
+  zstd_stream_t *zs;
+  zs=psync_new(zstd_stream_t);
+  memset(zs, 0, sizeof(zstd_stream_t));
+  if (level==PSYNC_DEFLATE_DECOMPRESS) {
+    zs->dstream=ZSTD_createDStream();
+    if (unlikely_log(!zs->dstream) || unlikely_log(ZSTD_isError(ZSTD_initDStream(zs->dstream))))
+      goto err;
+  }
+  else {
+    zs->flags=FLAG_DEFLATE;
+    zs->cstream=ZSTD_createCStream();
+    if (unlikely_log(!zs->cstream) || unlikely_log(ZSTD_isError(ZSTD_CCtx_setParameter(zs->cstream, ZSTD_c_compressionLevel, level))))
+      goto err;
+  }
+  zs->alloced=ZSTD_BUFFER_LIMIT;
+  zs->buffer=psync_new_cnt(unsigned char, zs->alloced);
+  return zs;
+err:
+  ZSTD_freeCStream(zs->cstream);
+  ZSTD_freeDStream(zs->dstream);
+  psync_free(zs);
+  return NULL;
+}
+
+static void zstd_destroy(void *ptr) {
+  zstd_stream_t *zs=(zstd_stream_t *)ptr;
+  ZSTD_freeCStream(zs->cstream);
+  ZSTD_freeDStream(zs->dstream);
+  psync_free(zs->buffer);
+  psync_free(zs);
+}
+
+static void zstd_make_room(zstd_stream_t *zs, size_t need) {
+  if (zs->start) {
+    memmove(zs->buffer, zs->buffer+zs->start, zs->end-zs->start);
+    zs->end-=zs->start;
+    zs->start=0;
+  }
+  if (zs->alloced-zs->end<need) {
+    while (zs->alloced-zs->end<need)
+      zs->alloced*=2;
+    zs->buffer=(unsigned char *)psync_realloc(zs->buffer, zs->alloced);
+  }
+}
+
+static int zstd_run(zstd_stream_t *zs, ZSTD_inBuffer *in, int flush) {
+  ZSTD_EndDirective mode;
+  ZSTD_outBuffer out;
+  size_t ret;
+  if (flush==PSYNC_DEFLATE_FLUSH)
+    mode=ZSTD_e_flush;
+  else if (flush==PSYNC_DEFLATE_FLUSH_END)
+    mode=ZSTD_e_end;
+  else
+    mode=ZSTD_e_continue;
+  while (1) {
+    if (zs->flags&FLAG_DEFLATE)
+      zstd_make_room(zs, ZSTD_CStreamOutSize());
+    else
+      zstd_make_room(zs, ZSTD_DStreamOutSize());
+    out.dst=zs->buffer;
+    out.size=zs->alloced;
+    out.pos=zs->end;
+    if (zs->flags&FLAG_DEFLATE)
+      ret=ZSTD_compressStream2(zs->cstream, &out, in, mode);
+    else
+      ret=ZSTD_decompressStream(zs->dstream, &out, in);
+    if (ZSTD_isError(ret)) {
+      log_warn("zstd stream failed: %s", ZSTD_getErrorName(ret));
+      return -1;
+    }
+    zs->end=out.pos;
+    if (zs->flags&FLAG_DEFLATE) {
+      if (mode==ZSTD_e_continue) {
+        if (in->pos==in->size || zs->end-zs->start>=ZSTD_BUFFER_LIMIT)
+          break;
+      }
+      else if (in->pos==in->size && !ret) {
+        if (mode==ZSTD_e_end)
+          zs->flags|=FLAG_STREAM_END;
+        break;
+      }
+    }
+    else {
+      // a full output buffer means the decompressor may hold more for us
+      if (out.pos==out.size)
+        zs->flags|=FLAG_MORE_DATA;
+      else
+        zs->flags&=~FLAG_MORE_DATA;
+      if (!ret)
+        zs->flags|=FLAG_STREAM_END;
+      if ((in->pos==in->size && !(zs->flags&FLAG_MORE_DATA)) || zs->end-zs->start>=ZSTD_BUFFER_LIMIT)
+        break;
+    }
+  }
+  return 0;
+}
+
+static int zstd_write(void *ptr, const void *data, int len, int flush) {
+  zstd_stream_t *zs=(zstd_stream_t *)ptr;
+  ZSTD_inBuffer in;
+  if (!len && flush==PSYNC_DEFLATE_NOFLUSH) {
+    log_warn("called with no len and no flush");
+    return PSYNC_DEFLATE_ERROR;
+  }
+  if (zs->end-zs->start>=ZSTD_BUFFER_LIMIT)
+    return PSYNC_DEFLATE_FULL;
+  in.src=data;
+  in.size=len;
+  in.pos=0;
+  if (!(zs->flags&FLAG_DEFLATE))
+    flush=PSYNC_DEFLATE_NOFLUSH;
+  if (zstd_run(zs, &in, flush))
+    return PSYNC_DEFLATE_ERROR;
+  if (!in.pos && len)
+    return PSYNC_DEFLATE_FULL;
+  return in.pos;
+}
+
+static int zstd_read(void *ptr, void *data, int len) {
+  zstd_stream_t *zs=(zstd_stream_t *)ptr;
+  ZSTD_inBuffer in;
+  if (zs->start==zs->end) {
+    zs->start=zs->end=0;
+    if (!(zs->flags&FLAG_MORE_DATA))
+      return (zs->flags&FLAG_STREAM_END)?PSYNC_DEFLATE_EOF:PSYNC_DEFLATE_NODATA;
+    in.src="";
+    in.size=0;
+    in.pos=0;
+    if (zstd_run(zs, &in, PSYNC_DEFLATE_NOFLUSH))
+      return PSYNC_DEFLATE_ERROR;
+    if (zs->start==zs->end)
+      return PSYNC_DEFLATE_NODATA;
+  }
+  if (len>zs->end-zs->start)
+    len=zs->end-zs->start;
+  memcpy(data, zs->buffer+zs->start, len);
+  zs->start+=len;
+  return len;
+}
+
+static int zstd_pending(void *ptr) {
+  zstd_stream_t *zs=(zstd_stream_t *)ptr;
+  return zs->end-zs->start;
+}
+
+#endif
+
+typedef struct {
+  const char *name;
+  void *(*init)(int);
+  void (*destroy)(void *);
+  int (*write)(void *, const void *, int, int);
+  int (*read)(void *, void *, int);
+  int (*pending)(void *);
+} compressor_ops_t;
+
+struct _psync_compressor_t {
+  const compressor_ops_t *ops;
+  void *stream;
+  int method;
+};
+
+static void *deflate_init(int level) {
+  return psync_deflate_init(level);
+}
+
+static void deflate_destroy(void *ptr) {
+  psync_deflate_destroy((psync_deflate_t *)ptr);
+}
+
+static int deflate_write(void *ptr, const void *data, int len, int flush) {
+  return psync_deflate_write((psync_deflate_t *)ptr, data, len, flush);
+}
+
+static int deflate_read(void *ptr, void *data, int len) {
+  return psync_deflate_read((psync_deflate_t *)ptr, data, len);
+}
+
+static int deflate_pending(void *ptr) {
+  return psync_deflate_pending((psync_deflate_t *)ptr);
+}
+
+static const compressor_ops_t compressors[PSYNC_COMPRESSOR_CNT]={
+  {"deflate", deflate_init, deflate_destroy, deflate_write, deflate_read, deflate_pending},
+#if defined(P_HAS_ZSTD)
+  {"zstd", zstd_init, zstd_destroy, zstd_write, zstd_read, zstd_pending}
+#else
+  {"zstd", NULL, NULL, NULL, NULL, NULL}
+#endif
+};
+
+int psync_compressor_available(int method) {
+  return method>=0 && method<PSYNC_COMPRESSOR_CNT && compressors[method].init!=NULL;
+}
+
+const char *psync_compressor_name(int method) {
+  if (method>=0 && method<PSYNC_COMPRESSOR_CNT)
+    return compressors[method].name;
+  else
+    return NULL;
+}
+
+int psync_compressor_find(const char *name) {
+  int i;
+  for (i=0; i<PSYNC_COMPRESSOR_CNT; i++)
+    if (!strcmp(compressors[i].name, name))
+      return psync_compressor_available(i)?i:-1;
+  return -1;
+}
+
+psync_compressor_t *psync_compressor_init(int method, int level) {
+  psync_compressor_t *comp;
+  void *stream;
+  if (!psync_compressor_available(method)) {
+    log_warn("compression method %d is not available", method);
+    return NULL;
+  }
+  stream=compressors[method].init(level);
+  if (!stream)
+    return NULL;
+  comp=psync_new(psync_compressor_t);
+  comp->ops=&compressors[method];
+  comp->stream=stream;
+  comp->method=method;
+  return comp;
+}
+
+void psync_compressor_destroy(psync_compressor_t *comp) {
+  comp->ops->destroy(comp->stream);
+  psync_free(comp);
+}
+
+int psync_compressor_method(psync_compressor_t *comp) {
+  return comp->method;
+}
+
+int psync_compressor_write(psync_compressor_t *comp, const void *data, int len, int flush) {
+  return comp->ops->write(comp->stream, data, len, flush);
+}
+
+int psync_compressor_read(psync_compressor_t *comp, void *data, int len) {
+  return comp->ops->read(comp->stream, data, len);
+}
+
+int psync_compressor_pending(psync_compressor_t *comp) {
+  return comp->ops->pending(comp->stream);
+}
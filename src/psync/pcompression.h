@@ -12,9 +12,15 @@
 #ifndef PCLOUD_PSYNC_PCOMPRESSION_H_
 #define PCLOUD_PSYNC_PCOMPRESSION_H_
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct _psync_deflate_t;
+struct _psync_compressor_t;
 
 typedef struct _psync_deflate_t psync_deflate_t;
+typedef struct _psync_compressor_t psync_compressor_t;
 
 #define PSYNC_DEFLATE_DECOMPRESS   0
 #define PSYNC_DEFLATE_COMP_FASTEST 1
@@ -31,6 +37,12 @@ typedef struct _psync_deflate_t psync_deflate_t;
 #define PSYNC_DEFLATE_ERROR  (-3)
 #define PSYNC_DEFLATE_EOF      0
 
+/* A compressor is a deflate or zstd stream behind the same calls, levels, flush modes and return values as
+ * psync_deflate_*(). Methods that were not compiled in are not available and fail to initialize. */
+#define PSYNC_COMPRESSOR_DEFLATE 0
+#define PSYNC_COMPRESSOR_ZSTD    1
+
+#define PSYNC_COMPRESSOR_CNT 2
 
 psync_deflate_t *psync_deflate_init(int level);
 void psync_deflate_destroy(psync_deflate_t *def);
@@ -38,4 +50,18 @@ int psync_deflate_write(psync_deflate_t *def, const void *data, int len, int flu
 int psync_deflate_read(psync_deflate_t *def, void *data, int len);
 int psync_deflate_pending(psync_deflate_t *def);
 
+int psync_compressor_available(int method);
+const char *psync_compressor_name(int method);
+int psync_compressor_find(const char *name);
+psync_compressor_t *psync_compressor_init(int method, int level);
+void psync_compressor_destroy(psync_compressor_t *comp);
+int psync_compressor_method(psync_compressor_t *comp);
+int psync_compressor_write(psync_compressor_t *comp, const void *data, int len, int flush);
+int psync_compressor_read(psync_compressor_t *comp, void *data, int len);
+int psync_compressor_pending(psync_compressor_t *comp);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* PCLOUD_PSYNC_PCOMPRESSION_H_ */
@@ -43,18 +43,26 @@
 #define PSYNC_TEXT_COL "COLLATE NOCASE"
 #endif
 
-#define PSYNC_DATABASE_VERSION 18
+#define PSYNC_DATABASE_VERSION 20
 
 #define PSYNC_DATABASE_CONFIG \
 "\
 PRAGMA page_size=4096;\
 PRAGMA journal_mode=WAL;\
 PRAGMA synchronous=1;\
-PRAGMA locking_mode=EXCLUSIVE;\
 PRAGMA cache_size=8000;\
 PRAGMA foreign_keys=ON;\
 "
 
+/* only without read connections, a database that entered WAL mode locked exclusively can not be shared with them */
+#define PSYNC_DATABASE_EXCLUSIVE "PRAGMA locking_mode=EXCLUSIVE;"
+
+#define PSYNC_DATABASE_READER_CONFIG \
+"\
+PRAGMA cache_size=2000;\
+PRAGMA query_only=1;\
+"
+
 #define PSYNC_DATABASE_STRUCTURE \
 "\
 PRAGMA page_size=4096;\
@@ -90,6 +98,8 @@ CREATE INDEX IF NOT EXISTS klocalfilefileid ON localfile(fileid);\
 CREATE INDEX IF NOT EXISTS klocalfilechecksum ON localfile(checksum);\
 CREATE UNIQUE INDEX IF NOT EXISTS klocalfilerpsn ON localfile(syncid, localparentfolderid, name);\
 CREATE TABLE IF NOT EXISTS localfileupload (localfileid INTEGER REFERENCES localfile(id) ON DELETE CASCADE, uploadid INTEGER, PRIMARY KEY (localfileid, uploadid)) " P_SQL_WOWROWID ";\
+CREATE TABLE IF NOT EXISTS uploadchunk (uploadid INTEGER, uploadoffset INTEGER, length INTEGER, filesize INTEGER, filemtime INTEGER,\
+  PRIMARY KEY (uploadid, uploadoffset)) " P_SQL_WOWROWID ";\
 CREATE TABLE IF NOT EXISTS syncedfolder (syncid INTEGER REFERENCES syncfolder(id) ON DELETE CASCADE, folderid INTEGER, localfolderid INTEGER, synctype INTEGER,\
   PRIMARY KEY (syncid, folderid));\
 CREATE INDEX IF NOT EXISTS ksyncedfolderdownfolderid ON syncedfolder(folderid);\
@@ -271,6 +281,15 @@ COMMIT;",
 "BEGIN;\
 CREATE TABLE IF NOT EXISTS devices (id INTEGER PRIMARY KEY, last_path VARCHAR(1024), type INTEGER, vendor VARCHAR(2048), product VARCHAR(2048), device_id VARCHAR(4096),\
   connected INTEGER, enabled INTEGER); \
+COMMIT;",
+"BEGIN;\
+CREATE TABLE IF NOT EXISTS uploadchunk (uploadid INTEGER, uploadoffset INTEGER, length INTEGER, PRIMARY KEY (uploadid, uploadoffset)) " P_SQL_WOWROWID ";\
+UPDATE setting SET value=19 WHERE id='dbversion'; \
+COMMIT;",
+"BEGIN;\
+ALTER TABLE uploadchunk ADD filesize INTEGER;\
+ALTER TABLE uploadchunk ADD filemtime INTEGER;\
+UPDATE setting SET value=20 WHERE id='dbversion'; \
 COMMIT;"
 };
 
@@ -67,6 +67,7 @@ static psync_uint_t needdownload=0;
 static psync_socket_t exceptionsockwrite=INVALID_SOCKET;
 static pthread_mutex_t diff_mutex=PTHREAD_MUTEX_INITIALIZER;
 static int initialdownload=0;
+static int bulkload=0;
 static paccount_cache_callback_t psync_cache_callback=NULL;
 static uint32_t psync_is_business=0;
 static unsigned char adapter_hash[PSYNC_FAST_HASH256_LEN];
@@ -170,6 +171,7 @@ static binresult *get_userinfo_user_pass(
 }
 
 static psync_socket *get_connected_socket() {
+  char server[PSYNC_APISERVER_LEN];
   char *auth = NULL;
   char *user = NULL;
   char *pass = NULL;
@@ -209,9 +211,10 @@ static psync_socket *get_connected_socket() {
     }
     psync_set_status(PSTATUS_TYPE_AUTH, PSTATUS_AUTH_PROVIDED);
     saveauth=psync_setting_get_bool(_PS(saveauth));
-    sock=psync_api_connect(apiserver, psync_setting_get_bool(_PS(usessl)));
+    psync_apipool_get_server(server);
+    sock=psync_api_connect(server, psync_setting_get_bool(_PS(usessl)));
     if (unlikely(!sock)) {
-      log_error("failed to connect to API server on %s", apiserver);
+      log_error("failed to connect to API server on %s", server);
       psync_set_status(PSTATUS_TYPE_ONLINE, PSTATUS_ONLINE_OFFLINE);
       psync_milisleep(PSYNC_SLEEP_BEFORE_RECONNECT);
       continue;
@@ -434,8 +437,7 @@ static psync_socket *get_connected_socket() {
     else
       psync_sql_statement("DELETE FROM setting WHERE id IN ('pass', 'auth')");
     cres=psync_find_result(psync_find_result(res, "apiserver", PARAM_HASH), "binapi", PARAM_ARRAY);
-    if (cres->length)
-      psync_apipool_set_server(cres->array[0]->str);
+    psync_apipool_set_servers(cres);
     psync_free(res);
     if (isbusiness) {
       binparam params[] = {P_STR("timeformat", "timestamp"),
@@ -469,6 +471,13 @@ static psync_socket *get_connected_socket() {
   }
 }
 
+static void forget_crypto_name(const binresult *meta, psync_folderid_t parentfolderid, const char *name) {
+  const binresult *enc;
+  enc=psync_check_result(meta, "encrypted", PARAM_BOOL);
+  if (enc && enc->num)
+    psync_cloud_crypto_names_forget(parentfolderid, name);
+}
+
 static void process_createfolder(const binresult *entry) {
   static psync_sql_res *st=NULL, *st2=NULL;
   psync_sql_res *res, *stmt, *stmt2;
@@ -680,6 +689,8 @@ static void process_modifyfolder(const binresult *entry) {
   psync_sql_bind_uint(st, 7, flags);
   psync_sql_bind_uint(st, 8, folderid);
   psync_sql_run(st);
+  if (oldparentfolderid!=parentfolderid || strcmp(name->str, oldname))
+    forget_crypto_name(meta, oldparentfolderid, oldname);
   if (oldparentfolderid!=parentfolderid) {
     res=psync_sql_prep_statement("UPDATE folder SET subdircnt=subdircnt-1, mtime=? WHERE id=?");
     psync_sql_bind_uint(res, 1, mtime);
@@ -816,6 +827,7 @@ static void process_deletefolder(const binresult *entry) {
   meta=psync_find_result(entry, "metadata", PARAM_HASH);
   folderid=psync_find_result(meta, "folderid", PARAM_NUM)->num;
   psync_path_status_folder_deleted(folderid);
+  psync_cloud_crypto_names_forget_folder(folderid);
   if (psync_is_folder_in_downloadlist(folderid)) {
     psync_del_folder_from_downloadlist(folderid);
     res=psync_sql_query("SELECT syncid, localfolderid FROM syncedfolder WHERE folderid=?");
@@ -840,6 +852,7 @@ static void process_deletefolder(const binresult *entry) {
     psync_sql_bind_uint(st2, 1, psync_find_result(meta, "modified", PARAM_NUM)->num);
     psync_sql_bind_uint(st2, 2, psync_find_result(meta, "parentfolderid", PARAM_NUM)->num);
     psync_sql_run(st2);
+    forget_crypto_name(meta, psync_find_result(meta, "parentfolderid", PARAM_NUM)->num, psync_find_result(meta, "name", PARAM_STR)->str);
     psync_fs_folder_deleted(folderid);
   }
 }
@@ -929,65 +942,185 @@ static void insert_revision(psync_fileid_t fileid, uint64_t hash, uint64_t ctime
   psync_sql_run(st);
 }
 
-static void process_createfile(const binresult *entry) {
+#define FILE_COLUMNS "id, parentfolderid, userid, size, hash, name, ctime, mtime, category, thumb, icon, artist, album, title, genre, "\
+                     "trackno, width, height, duration, fps, videocodec, audiocodec, videobitrate, audiobitrate, audiosamplerate, rotate"
+#define FILE_COLUMN_CNT 26
+#define FILE_PLACEHOLDERS "(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)"
+
+typedef struct {
+  const binresult *meta;
+  const binresult *name;
+  psync_fileid_t fileid;
+  psync_folderid_t parentfolderid;
+  uint64_t userid;
+  uint64_t size;
+  uint64_t hash;
+} bulk_file_t;
+
+static bulk_file_t bulk_files[PSYNC_DIFF_BULK_ROWS];
+static uint32_t bulk_files_cnt=0;
+
+static void update_file(const bulk_file_t *f) {
+  psync_sql_res *res;
+  int off;
+  res=psync_sql_prep_statement("UPDATE file SET id=?, parentfolderid=?, userid=?, size=?, hash=?, name=?, ctime=?, mtime=?, category=?, thumb=?, icon=?, "
+                              "artist=?, album=?, title=?, genre=?, trackno=?, width=?, height=?, duration=?, fps=?, videocodec=?, audiocodec=?, videobitrate=?, "
+                              "audiobitrate=?, audiosamplerate=?, rotate=? WHERE id=?");
+  psync_sql_bind_uint(res, 1, f->fileid);
+  psync_sql_bind_uint(res, 2, f->parentfolderid);
+  psync_sql_bind_uint(res, 3, f->userid);
+  psync_sql_bind_uint(res, 4, f->size);
+  psync_sql_bind_uint(res, 5, f->hash);
+  psync_sql_bind_lstring(res, 6, f->name->str, f->name->length);
+  off=bind_meta(res, f->meta, 7);
+  psync_sql_bind_uint(res, off, f->fileid);
+  psync_sql_run_free(res);
+}
+
+static void insert_file(const bulk_file_t *f) {
   static psync_sql_res *st=NULL;
+  if (!f) {
+    if (st) {
+      psync_sql_free_result(st);
+      st=NULL;
+    }
+    return;
+  }
+  if (!st)
+    st=psync_sql_prep_statement("INSERT OR IGNORE INTO file ("FILE_COLUMNS") VALUES "FILE_PLACEHOLDERS);
+  psync_sql_bind_uint(st, 1, f->fileid);
+  psync_sql_bind_uint(st, 2, f->parentfolderid);
+  psync_sql_bind_uint(st, 3, f->userid);
+  psync_sql_bind_uint(st, 4, f->size);
+  psync_sql_bind_uint(st, 5, f->hash);
+  psync_sql_bind_lstring(st, 6, f->name->str, f->name->length);
+  bind_meta(st, f->meta, 7);
+  psync_sql_run(st);
+  if (!psync_sql_affected_rows())
+    update_file(f);
+  insert_revision(f->fileid, f->hash, psync_find_result(f->meta, "modified", PARAM_NUM)->num, f->size);
+}
+
+static char *repeat_sql(const char *head, const char *row, uint32_t cnt) {
+  size_t hlen, rlen;
+  char *ret, *p;
+  hlen=strlen(head);
+  rlen=strlen(row);
+  ret=psync_new_cnt(char, hlen+(rlen+1)*cnt);
+  memcpy(ret, head, hlen);
+  p=ret+hlen;
+  while (cnt--) {
+    memcpy(p, row, rlen);
+    p+=rlen;
+    *p++=cnt?',':0;
+  }
+  return ret;
+}
+
+/* Consecutive createfile events are inserted PSYNC_DIFF_BULK_ROWS at a time, outside of the initial import only if
+ * PSYNC_DIFF_BULK_CREATE is set. Only complete batches use the multi-row
+ * statements, whatever is left when the run of createfile events ends goes through insert_file(). Rows that already
+ * existed are updated one by one afterwards, which gives the same result as inserting them in order.
+ */
+static void insert_bulk_files(int flush) {
+  static psync_sql_res *fst=NULL, *rst=NULL;
+  static char *fsql=NULL, *rsql=NULL;
+  bulk_file_t *f;
+  uint32_t i;
+  int off;
+  if (flush<0) {
+    if (fst) {
+      psync_sql_free_result(fst);
+      fst=NULL;
+    }
+    if (rst) {
+      psync_sql_free_result(rst);
+      rst=NULL;
+    }
+    return;
+  }
+  if (bulk_files_cnt<PSYNC_DIFF_BULK_ROWS) {
+    if (flush) {
+      for (i=0; i<bulk_files_cnt; i++)
+        insert_file(&bulk_files[i]);
+      bulk_files_cnt=0;
+    }
+    return;
+  }
+  if (!fst) {
+    if (!fsql) {
+      fsql=repeat_sql("INSERT OR IGNORE INTO file ("FILE_COLUMNS") VALUES ", FILE_PLACEHOLDERS, PSYNC_DIFF_BULK_ROWS);
+      rsql=repeat_sql("REPLACE INTO filerevision (fileid, hash, ctime, size) VALUES ", "(?, ?, ?, ?)", PSYNC_DIFF_BULK_ROWS);
+    }
+    fst=psync_sql_prep_statement(fsql);
+    rst=psync_sql_prep_statement(rsql);
+  }
+  for (i=0; i<PSYNC_DIFF_BULK_ROWS; i++) {
+    f=&bulk_files[i];
+    off=i*FILE_COLUMN_CNT;
+    psync_sql_bind_uint(fst, off+1, f->fileid);
+    psync_sql_bind_uint(fst, off+2, f->parentfolderid);
+    psync_sql_bind_uint(fst, off+3, f->userid);
+    psync_sql_bind_uint(fst, off+4, f->size);
+    psync_sql_bind_uint(fst, off+5, f->hash);
+    psync_sql_bind_lstring(fst, off+6, f->name->str, f->name->length);
+    bind_meta(fst, f->meta, off+7);
+  }
+  psync_sql_run(fst);
+  if (psync_sql_affected_rows()<PSYNC_DIFF_BULK_ROWS)
+    for (i=0; i<PSYNC_DIFF_BULK_ROWS; i++)
+      update_file(&bulk_files[i]);
+  for (i=0; i<PSYNC_DIFF_BULK_ROWS; i++) {
+    f=&bulk_files[i];
+    psync_sql_bind_uint(rst, i*4+1, f->fileid);
+    psync_sql_bind_uint(rst, i*4+2, f->hash);
+    psync_sql_bind_uint(rst, i*4+3, psync_find_result(f->meta, "modified", PARAM_NUM)->num);
+    psync_sql_bind_uint(rst, i*4+4, f->size);
+  }
+  psync_sql_run(rst);
+  bulk_files_cnt=0;
+}
+
+static void process_createfile(const binresult *entry) {
   const binresult *meta, *name;
   psync_sql_res *res, *res2;
+  bulk_file_t *f, nf;
   psync_folderid_t parentfolderid;
   psync_fileid_t fileid;
-  uint64_t size, userid, hash;
+  uint64_t hash;
   psync_uint_row row;
   psync_str_row row2;
   int hasit;
   if (!entry) {
-    if (st) {
-      psync_sql_free_result(st);
-      st=NULL;
-    }
+    insert_bulk_files(1);
+    insert_bulk_files(-1);
+    insert_file(NULL);
     insert_revision(0, 0, 0, 0);
     return;
   }
-  if (!st)
-    st=psync_sql_prep_statement("INSERT OR IGNORE INTO file (id, parentfolderid, userid, size, hash, name, ctime, mtime, category, thumb, icon, "
-                                "artist, album, title, genre, trackno, width, height, duration, fps, videocodec, audiocodec, videobitrate, "
-                                "audiobitrate, audiosamplerate, rotate) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
   meta=psync_find_result(entry, "metadata", PARAM_HASH);
-  size=psync_find_result(meta, "size", PARAM_NUM)->num;
-  fileid=psync_find_result(meta, "fileid", PARAM_NUM)->num;
-  parentfolderid=psync_find_result(meta, "parentfolderid", PARAM_NUM)->num;
+  if (psync_check_result(meta, "deletedfileid", PARAM_NUM))
+    insert_bulk_files(1);
+  f=(bulkload || PSYNC_DIFF_BULK_CREATE)?&bulk_files[bulk_files_cnt]:&nf;
+  f->meta=meta;
+  f->size=psync_find_result(meta, "size", PARAM_NUM)->num;
+  f->fileid=fileid=psync_find_result(meta, "fileid", PARAM_NUM)->num;
+  f->parentfolderid=parentfolderid=psync_find_result(meta, "parentfolderid", PARAM_NUM)->num;
   if (psync_find_result(meta, "ismine", PARAM_BOOL)->num) {
-    userid=psync_my_userid;
-    used_quota+=size;
+    f->userid=psync_my_userid;
+    used_quota+=f->size;
   }
   else
-    userid=psync_find_result(meta, "userid", PARAM_NUM)->num;
-  hash=psync_find_result(meta, "hash", PARAM_NUM)->num;
-  name=psync_find_result(meta, "name", PARAM_STR);
+    f->userid=psync_find_result(meta, "userid", PARAM_NUM)->num;
+  f->hash=hash=psync_find_result(meta, "hash", PARAM_NUM)->num;
+  f->name=name=psync_find_result(meta, "name", PARAM_STR);
   check_for_deletedfileid(meta);
-  psync_sql_bind_uint(st, 1, fileid);
-  psync_sql_bind_uint(st, 2, parentfolderid);
-  psync_sql_bind_uint(st, 3, userid);
-  psync_sql_bind_uint(st, 4, size);
-  psync_sql_bind_uint(st, 5, hash);
-  psync_sql_bind_lstring(st, 6, name->str, name->length);
-  bind_meta(st, meta, 7);
-  psync_sql_run(st);
-  if (!psync_sql_affected_rows()) {
-    int off;
-    res=psync_sql_prep_statement("UPDATE file SET id=?, parentfolderid=?, userid=?, size=?, hash=?, name=?, ctime=?, mtime=?, category=?, thumb=?, icon=?, "
-                                "artist=?, album=?, title=?, genre=?, trackno=?, width=?, height=?, duration=?, fps=?, videocodec=?, audiocodec=?, videobitrate=?, "
-                                "audiobitrate=?, audiosamplerate=?, rotate=? WHERE id=?");
-    psync_sql_bind_uint(res, 1, fileid);
-    psync_sql_bind_uint(res, 2, parentfolderid);
-    psync_sql_bind_uint(res, 3, userid);
-    psync_sql_bind_uint(res, 4, size);
-    psync_sql_bind_uint(res, 5, hash);
-    psync_sql_bind_lstring(res, 6, name->str, name->length);
-    off=bind_meta(res, meta, 7);
-    psync_sql_bind_uint(res, off, fileid);
-    psync_sql_run_free(res);
+  if (bulkload || PSYNC_DIFF_BULK_CREATE) {
+    bulk_files_cnt++;
+    insert_bulk_files(0);
   }
-  insert_revision(fileid, hash, psync_find_result(meta, "modified", PARAM_NUM)->num, size);
+  else
+    insert_file(f);
   if (psync_is_folder_in_downloadlist(parentfolderid) && !psync_is_name_to_ignore(name->str)) {
     res=psync_sql_query("SELECT syncid, localfolderid FROM syncedfolder WHERE folderid=? AND "PSYNC_SQL_DOWNLOAD);
     psync_sql_bind_uint(res, 1, parentfolderid);
@@ -1063,6 +1196,7 @@ static void process_modifyfile(const binresult *entry) {
         (unsigned long)fileid, name->str
     );
     process_createfile(entry);
+    insert_bulk_files(1);
     return;
   }
   oldsize=psync_get_number(row[2]);
@@ -1100,6 +1234,11 @@ static void process_modifyfile(const binresult *entry) {
   psync_sql_run(st);
   insert_revision(fileid, hash, psync_find_result(meta, "modified", PARAM_NUM)->num, size);
   oldparentfolderid=psync_get_number(row[0]);
+  if (enc && enc->num) {
+    oldname=psync_get_lstring(row[4], &oldnamelen);
+    if (oldparentfolderid!=parentfolderid || name->length!=oldnamelen || memcmp(name->str, oldname, oldnamelen))
+      psync_cloud_crypto_names_forget(oldparentfolderid, oldname);
+  }
   oldsync=psync_is_folder_in_downloadlist(oldparentfolderid);
   if (oldparentfolderid==parentfolderid)
     newsync=oldsync;
@@ -1173,12 +1312,23 @@ static void process_modifyfile(const binresult *entry) {
   }
 }
 
+static psync_fileid_t deleted_files[PSYNC_DIFF_BULK_ROWS];
+static uint32_t deleted_files_cnt=0;
+
+static void flush_deletefile() {
+  if (deleted_files_cnt) {
+    psync_fs_files_deleted(deleted_files, deleted_files_cnt);
+    deleted_files_cnt=0;
+  }
+}
+
 static void process_deletefile(const binresult *entry) {
   static psync_sql_res *st=NULL;
   const binresult *meta;
   char *path;
   psync_fileid_t fileid;
   if (!entry) {
+    flush_deletefile();
     if (st) {
       psync_sql_free_result(st);
       st=NULL;
@@ -1206,7 +1356,10 @@ static void process_deletefile(const binresult *entry) {
   if (psync_sql_affected_rows()) {
     if (psync_find_result(meta, "ismine", PARAM_BOOL)->num)
       used_quota-=psync_find_result(meta, "size", PARAM_NUM)->num;
-    psync_fs_file_deleted(fileid);
+    forget_crypto_name(meta, psync_find_result(meta, "parentfolderid", PARAM_NUM)->num, psync_find_result(meta, "name", PARAM_STR)->str);
+    deleted_files[deleted_files_cnt++]=fileid;
+    if (deleted_files_cnt==PSYNC_DIFF_BULK_ROWS)
+      flush_deletefile();
   }
 }
 
@@ -1289,14 +1442,21 @@ static void stop_crypto_thread() {
   delete_cached_crypto_keys();
 }
 
+static int userinfo_changed=0;
+
 static void process_modifyuserinfo(const binresult *entry) {
   const binresult *res, *cres;
   psync_sql_res *q;
   uint64_t u, crexp, crsub = 0;
   int crst = 0,crstat;
 
-  if (!entry)
+  if (!entry) {
+    if (userinfo_changed) {
+      userinfo_changed=0;
+      psync_send_eventid(PEVENT_USERINFO_CHANGED);
+    }
     return;
+  }
   res=psync_find_result(entry, "userinfo", PARAM_HASH);
   q=psync_sql_prep_statement("REPLACE INTO setting (id, value) VALUES (?, ?)");
   psync_sql_bind_string(q, 1, "userid");
@@ -1363,7 +1523,7 @@ static void process_modifyuserinfo(const binresult *entry) {
   psync_sql_bind_uint(q, 2, crstat);
   psync_sql_run(q);
   psync_sql_free_result(q);
-  psync_send_eventid(PEVENT_USERINFO_CHANGED);
+  userinfo_changed=1;
 
 
 }
@@ -1980,10 +2140,19 @@ static void process_modifybshareout(const binresult *entry) {
                         psync_find_result(share, "shareid", PARAM_NUM)->num);
 }
 
-#define FN(n) {process_##n, #n, sizeof(#n)-1, 0}
+static void flush_createfile() {
+  insert_bulk_files(1);
+}
+
+/* Events are processed in the order they come, but handlers with a flush function may defer part of their work while
+ * consecutive events are of the same type. The flush function is called when a run of events of that type ends.
+ */
+#define FN(n) {process_##n, NULL, #n, sizeof(#n)-1, 0}
+#define FNF(n) {process_##n, flush_##n, #n, sizeof(#n)-1, 0}
 
 static struct {
   void (*process)(const binresult *);
+  void (*flush)();
   const char *name;
   uint32_t len;
   uint8_t used;
@@ -1991,9 +2160,9 @@ static struct {
   FN(createfolder),
   FN(modifyfolder),
   FN(deletefolder),
-  FN(createfile),
+  FNF(createfile),
   FN(modifyfile),
-  FN(deletefile),
+  FNF(deletefile),
   FN(modifyuserinfo),
   FN(requestsharein),
   FN(requestshareout),
@@ -2016,6 +2185,41 @@ static struct {
 };
 
 #define event_list_size ARRAY_SIZE(event_list)
+#define EVENT_HASH_SIZE 64
+
+// event_hash holds indexes in event_list plus one, zero marks an empty slot
+static uint8_t event_hash[EVENT_HASH_SIZE];
+static int event_hash_ready=0;
+
+static uint32_t event_name_hash(const char *name, size_t len) {
+  uint32_t h;
+  h=2166136261U;
+  while (len--)
+    h=(h^(unsigned char)*name++)*16777619U;
+  return h;
+}
+
+static void init_event_hash() {
+  uint32_t i, h;
+  for (i=0; i<event_list_size; i++) {
+    h=event_name_hash(event_list[i].name, event_list[i].len);
+    while (event_hash[h%EVENT_HASH_SIZE])
+      h++;
+    event_hash[h%EVENT_HASH_SIZE]=i+1;
+  }
+}
+
+static int find_event(const binresult *etype) {
+  uint32_t h, i;
+  h=event_name_hash(etype->str, etype->length);
+  while ((i=event_hash[h%EVENT_HASH_SIZE])) {
+    i--;
+    if (etype->length==event_list[i].len && !memcmp(etype->str, event_list[i].name, etype->length))
+      return i;
+    h++;
+  }
+  return -1;
+}
 
 void psync_diff_lock() {
   pthread_mutex_lock(&diff_mutex);
@@ -2026,9 +2230,10 @@ void psync_diff_unlock() {
 }
 
 static uint64_t process_entries(const binresult *entries, uint64_t newdiffid) {
-  const binresult *entry, *etype;
+  const binresult *entry;
   uint64_t oused_quota;
   uint32_t i, j;
+  int e, last;
   oused_quota=used_quota;
   needdownload=0;
   psync_diff_lock();
@@ -2039,15 +2244,26 @@ static uint64_t process_entries(const binresult *entries, uint64_t newdiffid) {
   psync_sql_start_transaction();
   if (entries->length>=10000)
     psync_sql_statement("DELETE FROM setting WHERE id='lastanalyze'");
+  if (unlikely(!event_hash_ready)) {
+    init_event_hash();
+    event_hash_ready=1;
+  }
+  last=-1;
   for (i=0; i<entries->length; i++) {
     entry=entries->array[i];
-    etype=psync_find_result(entry, "event", PARAM_STR);
-    for (j=0; j<event_list_size; j++)
-      if (etype->length==event_list[j].len && !memcmp(etype->str, event_list[j].name, etype->length)) {
-        event_list[j].process(entry);
-        event_list[j].used=1;
-      }
+    e=find_event(psync_find_result(entry, "event", PARAM_STR));
+    if (e<0)
+      continue;
+    if (e!=last) {
+      if (last>=0 && event_list[last].flush)
+        event_list[last].flush();
+      last=e;
+    }
+    event_list[e].process(entry);
+    event_list[e].used=1;
   }
+  if (last>=0 && event_list[last].flush)
+    event_list[last].flush();
   for (j=0; j<event_list_size; j++)
     if (event_list[j].used)
       event_list[j].process(NULL);
@@ -2068,6 +2284,45 @@ static uint64_t process_entries(const binresult *entries, uint64_t newdiffid) {
   return psync_sql_cellint("SELECT value FROM setting WHERE id='diffid'", 0);
 }
 
+uint64_t psync_diff_apply_entries(const binresult *entries, uint64_t newdiffid) {
+  return process_entries(entries, newdiffid);
+}
+
+// must match the indexes on file in PSYNC_DATABASE_STRUCTURE
+#define FILE_INDEXES \
+  "CREATE INDEX IF NOT EXISTS kfilefolderid ON file(parentfolderid);"\
+  "CREATE INDEX IF NOT EXISTS kfilecategory ON file(category);"\
+  "CREATE INDEX IF NOT EXISTS kfileartist ON file(artist, album);"
+#define DROP_FILE_INDEXES "DROP INDEX IF EXISTS kfilefolderid;DROP INDEX IF EXISTS kfilecategory;DROP INDEX IF EXISTS kfileartist;"
+
+/* The initial import of the account runs with the secondary indexes of the file table dropped and without syncing the
+ * database. The diffbulkload setting is removed in the same transaction that rebuilds the indexes, so if we crash or are
+ * stopped before that, the import resumes in bulk mode from the last committed diffid.
+ */
+static void bulkload_start() {
+  log_info("starting bulk load of the initial diff");
+  psync_sql_statement("BEGIN;REPLACE INTO setting (id, value) VALUES ('diffbulkload', 1);" DROP_FILE_INDEXES "COMMIT;");
+  psync_sql_statement("PRAGMA synchronous=0");
+  bulkload=1;
+}
+
+/* On failure diffbulkload is left set, so the next start goes through bulk mode again and retries. */
+static void bulkload_finish() {
+  log_info("bulk load finished, rebuilding indexes");
+  bulkload=0;
+  if (psync_sql_statement("PRAGMA synchronous=1")) {
+    log_error("could not restore synchronous mode after bulk load, will retry on next start");
+    psync_sql_statement("BEGIN;" FILE_INDEXES "COMMIT;");
+    return;
+  }
+  if (psync_sql_statement("BEGIN;" FILE_INDEXES "DELETE FROM setting WHERE id='diffbulkload';COMMIT;")) {
+    psync_sql_statement("ROLLBACK");
+    log_error("could not rebuild indexes after bulk load, will retry on next start");
+    return;
+  }
+  log_info("indexes rebuilt");
+}
+
 static void check_overquota() {
   static int lisover=0;
   int isover=(used_quota>=current_quota);
@@ -2276,6 +2531,38 @@ static void psync_diff_refresh_fs(const binresult *entries) {
   }
 }
 
+/* The settings the diff thread keeps outside of process_entries() are single rows, they share the transaction of the group
+ * committer instead of committing one each. */
+typedef struct {
+  const char *id;
+  uint64_t value;
+  int remove;
+} diff_setting_t;
+
+static int psync_diff_do_set_setting(void *ptr) {
+  diff_setting_t *st;
+  psync_sql_res *res;
+  st=(diff_setting_t *)ptr;
+  if (st->remove) {
+    res=psync_sql_prep_statement("DELETE FROM setting WHERE id=?");
+    psync_sql_bind_string(res, 1, st->id);
+  }
+  else {
+    res=psync_sql_prep_statement("REPLACE INTO setting (id, value) VALUES (?, ?)");
+    psync_sql_bind_string(res, 1, st->id);
+    psync_sql_bind_uint(res, 2, st->value);
+  }
+  return psync_sql_run_free(res);
+}
+
+static void psync_diff_set_setting(const char *id, uint64_t value, int remove) {
+  diff_setting_t st;
+  st.id=id;
+  st.value=value;
+  st.remove=remove;
+  psync_sql_group_commit_wait(psync_diff_do_set_setting, &st);
+}
+
 static void psync_run_analyze_if_needed() {
   if (psync_timer_time()>psync_sql_cellint("SELECT value FROM setting WHERE id='lastanalyze'", 0)+24*3600) {
     static const char *skiptables[] = {"pagecache", "sqlite_stat1"};
@@ -2316,10 +2603,7 @@ static void psync_run_analyze_if_needed() {
       psync_milisleep(5);
     }
     psync_free(tablenames);
-    res=psync_sql_prep_statement("REPLACE INTO setting (id, value) VALUES (?, ?)");
-    psync_sql_bind_string(res, 1, "lastanalyze");
-    psync_sql_bind_uint(res, 2, psync_timer_time());
-    psync_sql_run_free(res);
+    psync_diff_set_setting("lastanalyze", psync_timer_time(), 0);
     log_debug("done running ANALYZE on tables");
   }
 }
@@ -2359,7 +2643,7 @@ static int psync_diff_check_quota(psync_socket *sock) {
         "corrected locally calculated quota from %lu to %lu",
         (unsigned long)oused_quota, (unsigned long)used_quota
     );
-    psync_set_uint_value("usedquota", used_quota);
+    psync_diff_set_setting("usedquota", used_quota, 0);
     psync_send_eventid(PEVENT_USEDQUOTA_CHANGED);
   }
 
@@ -2369,8 +2653,7 @@ static int psync_diff_check_quota(psync_socket *sock) {
       PARAM_ARRAY
   );
 
-  if (uq->length)
-    psync_apipool_set_server(uq->array[0]->str);
+  psync_apipool_set_servers(uq);
 
   psync_free(res);
   return 0;
@@ -2415,6 +2698,224 @@ void psync_diff_wake() {
   psync_pipe_write(exceptionsockwrite, "c", 1);
 }
 
+/* The initial diff is fetched by a separate thread so that the next batch is requested and parsed while the current one is
+ * applied. Responses are parsed as they arrive and their entries are handed over in parts of PSYNC_DIFF_STREAM_BATCH, the
+ * fetcher stores one part and waits for it to be taken before passing the next one, so only a few parts are in memory. The
+ * new diffid is known at the end of the response, so it comes with the last part and is only stored once that one is
+ * applied. The request size is adjusted after every response so that applying one takes about PSYNC_DIFF_APPLY_TARGET_MS.
+ * The new size is used by the next request sent, which is one response later.
+ */
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  psync_socket *sock;
+  binresult *res;
+  binresult *pending;
+  uint64_t diffid;
+  uint64_t newdiffid;
+  uint64_t limit;
+  int last;
+  int state;
+  int stop;
+  int running;
+} diff_fetcher_t;
+
+#define DIFF_FETCH_RUNNING 0
+#define DIFF_FETCH_DONE    1
+#define DIFF_FETCH_ERROR   2
+
+static int diff_fetch_post(diff_fetcher_t *f, binresult *entries, uint64_t newdiffid, int last) {
+  pthread_mutex_lock(&f->mutex);
+  while (f->res && !f->stop)
+    pthread_cond_wait(&f->cond, &f->mutex);
+  if (f->stop) {
+    pthread_mutex_unlock(&f->mutex);
+    psync_free(entries);
+    return -1;
+  }
+  f->res=entries;
+  f->newdiffid=newdiffid;
+  f->last=last;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->mutex);
+  return 0;
+}
+
+// the last part is held back until the response ends, so that it can be posted with the diffid
+static int diff_fetch_entries(void *ptr, binresult *entries) {
+  diff_fetcher_t *f;
+  binresult *prev;
+  f=(diff_fetcher_t *)ptr;
+  prev=f->pending;
+  f->pending=entries;
+  if (prev && diff_fetch_post(f, prev, 0, 0))
+    return -1;
+  return 0;
+}
+
+static void diff_fetch_thread(void *ptr) {
+  diff_fetcher_t *f;
+  binresult *res;
+  uint64_t result, limit, newdiffid;
+  int state;
+  f=(diff_fetcher_t *)ptr;
+  do {
+    pthread_mutex_lock(&f->mutex);
+    while (f->res && !f->stop)
+      pthread_cond_wait(&f->cond, &f->mutex);
+    limit=f->limit;
+    state=f->stop?DIFF_FETCH_ERROR:DIFF_FETCH_RUNNING;
+    pthread_mutex_unlock(&f->mutex);
+    if (state!=DIFF_FETCH_RUNNING)
+      break;
+    if (!psync_do_run) {
+      state=DIFF_FETCH_ERROR;
+      break;
+    }
+    binparam diffparams[] = {P_STR("timeformat", "timestamp"), P_NUM("limit", limit), P_NUM("diffid", f->diffid)};
+    if (!send_command_no_res(f->sock, "diff", diffparams)) {
+      state=DIFF_FETCH_ERROR;
+      break;
+    }
+    res=get_result_stream(f->sock, "entries", PSYNC_DIFF_STREAM_BATCH, diff_fetch_entries, f);
+    if (!res) {
+      state=DIFF_FETCH_ERROR;
+      break;
+    }
+    result=psync_find_result(res, "result", PARAM_NUM)->num;
+    if (unlikely(result)) {
+      log_warn("diff returned error %u: %s", (unsigned int)result, psync_find_result(res, "error", PARAM_STR)->str);
+      psync_free(res);
+      state=DIFF_FETCH_ERROR;
+      break;
+    }
+    if (!f->pending) {
+      psync_free(res);
+      state=DIFF_FETCH_DONE;
+      break;
+    }
+    newdiffid=psync_find_result(res, "diffid", PARAM_NUM)->num;
+    psync_free(res);
+    res=f->pending;
+    f->pending=NULL;
+    if (diff_fetch_post(f, res, newdiffid, 1)) {
+      state=DIFF_FETCH_ERROR;
+      break;
+    }
+    f->diffid=newdiffid;
+  } while (1);
+  if (f->pending) {
+    psync_free(f->pending);
+    f->pending=NULL;
+  }
+  if (state==DIFF_FETCH_RUNNING)
+    state=DIFF_FETCH_ERROR;
+  pthread_mutex_lock(&f->mutex);
+  f->state=state;
+  f->running=0;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->mutex);
+}
+
+static uint64_t adapt_diff_limit(uint64_t limit, uint32_t entries, uint64_t elapsed) {
+  uint64_t nlimit;
+  // only grow if the batch was full, a short batch says nothing about how long a full one takes
+  if (entries<limit && elapsed<PSYNC_DIFF_APPLY_TARGET_MS)
+    return limit;
+  if (!elapsed)
+    elapsed=1;
+  nlimit=(uint64_t)entries*PSYNC_DIFF_APPLY_TARGET_MS/elapsed;
+  // do not change by more than a factor of 4 at once
+  if (nlimit>limit*4)
+    nlimit=limit*4;
+  else if (nlimit<limit/4)
+    nlimit=limit/4;
+  if (nlimit<PSYNC_DIFF_MIN_LIMIT)
+    nlimit=PSYNC_DIFF_MIN_LIMIT;
+  else if (nlimit>PSYNC_DIFF_LIMIT)
+    nlimit=PSYNC_DIFF_LIMIT;
+  return nlimit;
+}
+
+// returns 0 once all of the diff is applied and -1 if the connection should be restarted
+static int fetch_initial_diff(psync_socket *sock, subscribed_ids *ids) {
+  static uint64_t limit=PSYNC_DIFF_START_LIMIT;
+  diff_fetcher_t f;
+  binresult *entries;
+  uint64_t newdiffid, start, elapsed, respelapsed;
+  uint32_t respentries;
+  int ret, last;
+  pthread_mutex_init(&f.mutex, NULL);
+  pthread_cond_init(&f.cond, NULL);
+  f.sock=sock;
+  f.res=NULL;
+  f.pending=NULL;
+  f.diffid=ids->diffid;
+  f.limit=limit;
+  f.state=DIFF_FETCH_RUNNING;
+  f.stop=0;
+  f.running=1;
+  psync_run_thread1("diff fetch", diff_fetch_thread, &f);
+  ret=0;
+  respentries=0;
+  respelapsed=0;
+  while (1) {
+    pthread_mutex_lock(&f.mutex);
+    while (!f.res && f.running)
+      pthread_cond_wait(&f.cond, &f.mutex);
+    entries=f.res;
+    newdiffid=f.newdiffid;
+    last=f.last;
+    f.res=NULL;
+    pthread_cond_broadcast(&f.cond);
+    pthread_mutex_unlock(&f.mutex);
+    if (!entries)
+      break;
+    log_info("processing diff with %u entries", (unsigned)entries->length);
+    // a large diff changes the statistics enough to analyze again, process_entries only sees a part of it
+    if (respentries<10000 && respentries+entries->length>=10000)
+      psync_diff_set_setting("lastanalyze", 0, 1);
+    start=psync_millitime();
+    // parts before the last one keep the diffid, so that an interrupted response is fetched again
+    ids->diffid=process_entries(entries, last?newdiffid:ids->diffid);
+    elapsed=psync_millitime()-start;
+    respentries+=entries->length;
+    respelapsed+=elapsed;
+    log_info("got diff with %u entries, new diffid %lu, applied in %lums",
+             (unsigned)entries->length, (unsigned long)ids->diffid, (unsigned long)elapsed);
+    psync_free(entries);
+    if (!last)
+      continue;
+    limit=adapt_diff_limit(limit, respentries, respelapsed);
+    respentries=0;
+    respelapsed=0;
+    pthread_mutex_lock(&f.mutex);
+    f.limit=limit;
+    // the batch was not applied (e.g. we got logged out), the fetcher is already ahead of us
+    if (ids->diffid!=newdiffid) {
+      f.stop=1;
+      ret=-1;
+      pthread_cond_broadcast(&f.cond);
+    }
+    pthread_mutex_unlock(&f.mutex);
+    if (ret)
+      break;
+  }
+  pthread_mutex_lock(&f.mutex);
+  while (f.running)
+    pthread_cond_wait(&f.cond, &f.mutex);
+  if (f.res) {
+    psync_free(f.res);
+    f.res=NULL;
+  }
+  if (f.state!=DIFF_FETCH_DONE)
+    ret=-1;
+  pthread_mutex_unlock(&f.mutex);
+  pthread_cond_destroy(&f.cond);
+  pthread_mutex_destroy(&f.mutex);
+  return ret;
+}
+
 static void psync_diff_thread() {
   psync_socket *sock;
   binresult *res;
@@ -2435,40 +2936,19 @@ restart:
   ids.diffid=psync_sql_cellint("SELECT value FROM setting WHERE id='diffid'", 0);
   if (ids.diffid==0)
     initialdownload=1;
+  if (!bulkload && (ids.diffid==0 || psync_sql_cellint("SELECT value FROM setting WHERE id='diffbulkload'", 0)))
+    bulkload_start();
   used_quota=psync_sql_cellint("SELECT value FROM setting WHERE id='usedquota'", 0);
-  do{
-    binparam diffparams[] = {P_STR("timeformat", "timestamp"), P_NUM("limit", PSYNC_DIFF_LIMIT), P_NUM("diffid", ids.diffid)};
+  if (fetch_initial_diff(sock, &ids)) {
+    psync_socket_close(sock);
+    // stopped in the middle of the initial diff, a bulk load is resumed on the next start
     if (!psync_do_run)
-      break;
-    res=send_command(sock, "diff", diffparams);
-    if (!res) {
-      psync_socket_close(sock);
-      goto restart;
-    }
-    result=psync_find_result(res, "result", PARAM_NUM)->num;
-    if (unlikely(result)) {
-      log_warn(
-          "diff returned error %u: %s",
-          (unsigned int)result, psync_find_result(res, "error", PARAM_STR)->str
-      );
-      psync_free(res);
-      psync_socket_close(sock);
-      psync_milisleep(PSYNC_SLEEP_BEFORE_RECONNECT);
-      goto restart;
-    }
-    entries=psync_find_result(res, "entries", PARAM_ARRAY);
-    if (entries->length) {
-      newdiffid=psync_find_result(res, "diffid", PARAM_NUM)->num;
-      log_info("processing diff with %u entries", (unsigned)entries->length);
-      ids.diffid=process_entries(entries, newdiffid);
-      log_info(
-          "got diff with %u entries, new diffid %lu",
-          (unsigned)entries->length, (unsigned long)ids.diffid
-      );
-    }
-    result=entries->length;
-    psync_free(res);
-  } while (result);
+      return;
+    psync_milisleep(PSYNC_SLEEP_BEFORE_RECONNECT);
+    goto restart;
+  }
+  if (bulkload)
+    bulkload_finish();
   psync_fs_refresh_folder(0);
   log_info("initial sync finished");
   if (psync_diff_check_quota(sock)) {
@@ -25,6 +25,11 @@ void psync_diff_delete_file(const binresult *meta);
 void psync_diff_update_folder(const binresult *meta);
 void psync_diff_delete_folder(const binresult *meta);
 
+/* Applies entries, an array of diff events, in one transaction as if they were received from the server and stores
+ * newdiffid. Returns the stored diffid, which stays the old one if the events were not applied (e.g. after a logout).
+ */
+uint64_t psync_diff_apply_entries(const binresult *entries, uint64_t newdiffid);
+
 void do_register_account_events_callback(paccount_cache_callback_t callback);
 
 #endif  /* PCLOUD_PSYNC_PDIFF_H_ */
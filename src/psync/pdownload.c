@@ -69,7 +69,42 @@ static const uint32_t requiredstatuses[]={
   PSTATUS_COMBINE(PSTATUS_TYPE_ONLINE, PSTATUS_ONLINE_ONLINE)
 };
 
+typedef struct {
+  psync_list list;
+  uint64_t taskid;
+  psync_syncid_t syncid;
+  psync_fileid_t fileid;
+  psync_folderid_t localfolderid;
+  char filename[];
+} download_queued_t;
+
+/* inprogress value of file tasks claimed by the dispatcher and waiting for (or being prepared by) a download worker,
+ * a task that actually starts downloading is marked with 1 */
+#define TASK_INPROGRESS_QUEUED 2
+
+/* Files are queued to one of two lanes by size, each with workers of its own. A worker waits until its file can be
+ * admitted, so large files that can not start only hold the few large workers and small files keep going. busy counts
+ * tasks queued or in a worker. */
+typedef struct {
+  psync_list queue;
+  psync_uint_t len;
+  psync_uint_t busy;
+  pthread_cond_t cond;
+} download_lane_t;
+
+#define DOWNLOAD_LANE_SMALL 0
+#define DOWNLOAD_LANE_LARGE 1
+
+static download_lane_t download_lanes[2]={
+  {PSYNC_LIST_STATIC_INIT(download_lanes[DOWNLOAD_LANE_SMALL].queue), 0, 0, PTHREAD_COND_INITIALIZER},
+  {PSYNC_LIST_STATIC_INIT(download_lanes[DOWNLOAD_LANE_LARGE].queue), 0, 0, PTHREAD_COND_INITIALIZER}
+};
+static psync_uint_t download_queue_busy=0;
+static pthread_mutex_t download_queue_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t download_queue_idle_cond=PTHREAD_COND_INITIALIZER;
+
 static psync_uint_t started_downloads=0;
+static uint64_t small_downloads_bytes=0;
 static psync_uint_t current_downloads_waiters=0;
 static pthread_mutex_t current_downloads_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t current_downloads_cond=PTHREAD_COND_INITIALIZER;
@@ -507,6 +542,7 @@ static int task_download_file(download_task_t *dt) {
   char *oldfiles[2];
   uint32_t oldcnt;
   const char *requestpath;
+  const char *ordered[PSYNC_HOSTS_MAX_ORDER];
   void *buff;
   psync_http_socket *http;
   uint64_t result, serversize, hash;
@@ -516,7 +552,7 @@ static int task_download_file(download_task_t *dt) {
                 localhashhex[PSYNC_HASH_DIGEST_HEXLEN],
                 localhashbin[PSYNC_HASH_DIGEST_LEN];
   char cookie[128];
-  uint32_t i;
+  uint32_t i, hostcnt;
   psync_file_t fd, ifd;
   int rd, rt;
 
@@ -669,8 +705,9 @@ static int task_download_file(download_task_t *dt) {
       continue;
     if (range->type==PSYNC_RANGE_TRANSFER) {
       log_info("downloading %lu bytes from offset %lu of fileid %lu", (unsigned long)range->len, (unsigned long)range->off, (unsigned long)dt->dwllist.fileid);
-      for (i=0; i<hosts->length; i++)
-        if ((http=psync_http_connect(hosts->array[i]->str, requestpath, range->off, (range->len==serversize&&range->off==0)?0:(range->len+range->off-1), cookie)))
+      hostcnt=psync_hosts_order(hosts, ordered);
+      for (i=0; i<hostcnt; i++)
+        if ((http=psync_http_connect(ordered[i], requestpath, range->off, (range->len==serversize&&range->off==0)?0:(range->len+range->off-1), cookie)))
           break;
       if (unlikely_log(!http))
         goto err2;
@@ -687,7 +724,7 @@ static int task_download_file(download_task_t *dt) {
         psync_status.bytesdownloaded+=rd;
         if (current_downloads_waiters && psync_status.bytestodownloadcurrent-psync_status.bytesdownloaded<=
                 PSYNC_START_NEW_DOWNLOADS_THRESHOLD)
-          pthread_cond_signal(&current_downloads_cond);
+          pthread_cond_broadcast(&current_downloads_cond);
         pthread_mutex_unlock(&current_downloads_mutex);
         psync_send_status_update();
         dt->downloadedsize+=rd;
@@ -724,7 +761,7 @@ static int task_download_file(download_task_t *dt) {
         psync_status.bytesdownloaded+=rd;
         if (current_downloads_waiters && psync_status.bytestodownloadcurrent-psync_status.bytesdownloaded<=
                 PSYNC_START_NEW_DOWNLOADS_THRESHOLD)
-          pthread_cond_signal(&current_downloads_cond);
+          pthread_cond_broadcast(&current_downloads_cond);
         pthread_mutex_unlock(&current_downloads_mutex);
         psync_send_status_update();
         dt->downloadedsize+=rd;
@@ -921,6 +958,8 @@ static void free_download_task(download_task_t *dt) {
     pthread_mutex_lock(&current_downloads_mutex);
     psync_list_del(&dt->dwllist.list);
     started_downloads--;
+    if (dt->size<=PSYNC_MAX_SIZE_FOR_ASYNC_DOWNLOAD)
+      small_downloads_bytes-=dt->size;
     psync_status.filesdownloading--;
     psync_status.bytestodownloadcurrent-=dt->size;
     psync_status.bytesdownloaded-=dt->downloadedsize;
@@ -1032,6 +1071,39 @@ static void task_run_download_file_thread(void *ptr) {
   psync_status_recalc_to_download_async();
 }
 
+static int task_claim_for_download(uint64_t taskid) {
+  psync_sql_res *res;
+  uint32_t aff;
+  res=psync_sql_prep_statement("UPDATE task SET inprogress=1 WHERE id=? AND inprogress IN (0, "NTO_STR(TASK_INPROGRESS_QUEUED)")");
+  psync_sql_bind_uint(res, 1, taskid);
+  psync_sql_run(res);
+  aff=psync_sql_affected_rows();
+  psync_sql_free_result(res);
+  return aff?0:-1;
+}
+
+/* gives a claimed task that did not start back to the dispatcher */
+static void task_release_claim(uint64_t taskid) {
+  set_task_inprogress(taskid, 0);
+  psync_wake_download();
+}
+
+/* Small files go through the async connection and are admitted against a budget of their own, so that a large
+ * download that keeps the shared threshold exceeded for a long time can not hold them back. */
+static int download_can_start_locked(uint64_t size) {
+  uint64_t pending;
+  if (started_downloads>=PSYNC_MAX_PARALLEL_DOWNLOADS)
+    return 0;
+  if (size<=PSYNC_MAX_SIZE_FOR_ASYNC_DOWNLOAD)
+    return small_downloads_bytes<=PSYNC_START_NEW_SMALL_DOWNLOADS_THRESHOLD;
+  pending=psync_status.bytestodownloadcurrent-psync_status.bytesdownloaded;
+  if (pending>small_downloads_bytes)
+    pending-=small_downloads_bytes;
+  else
+    pending=0;
+  return pending<=PSYNC_START_NEW_DOWNLOADS_THRESHOLD;
+}
+
 static int task_run_download_file(uint64_t taskid, psync_syncid_t syncid, psync_fileid_t fileid, psync_folderid_t localfolderid, const char *filename) {
   psync_sql_res *res;
   psync_uint_row row;
@@ -1099,9 +1171,7 @@ static int task_run_download_file(uint64_t taskid, psync_syncid_t syncid, psync_
   memcpy(dt->filename, filename, len+1);
   pthread_mutex_lock(&current_downloads_mutex);
   psync_list_add_tail(&downloads, &dt->dwllist.list);
-  while (!dt->dwllist.stop && (started_downloads>=PSYNC_MAX_PARALLEL_DOWNLOADS ||
-          psync_status.bytestodownloadcurrent-psync_status.bytesdownloaded>
-              PSYNC_START_NEW_DOWNLOADS_THRESHOLD)) {
+  while (!dt->dwllist.stop && !download_can_start_locked(size)) {
     current_downloads_waiters++;
     pthread_cond_wait(&current_downloads_cond, &current_downloads_mutex);
     current_downloads_waiters--;
@@ -1115,28 +1185,41 @@ static int task_run_download_file(uint64_t taskid, psync_syncid_t syncid, psync_
     psync_status.bytestodownloadcurrent+=size;
     psync_status.filesdownloading++;
     started_downloads++;
+    if (size<=PSYNC_MAX_SIZE_FOR_ASYNC_DOWNLOAD)
+      small_downloads_bytes+=size;
   }
   pthread_mutex_unlock(&current_downloads_mutex);
   if (unlikely(!dt->indwllist)) {
     free_download_task(dt);
     return -1;
   }
+  // the task might have been deleted (file deleted or moved remotely) while it was waiting in the queue, nothing is
+  // done for it before it is ours
+  if (task_claim_for_download(taskid)) {
+    log_info("download of %s cancelled before it started", localname);
+    free_download_task(dt);
+    return -1;
+  }
   psync_send_status_update();
   if (hastargetchecksum && psync_get_local_file_checksum(tmpname, dt->checksum, &csize)==PSYNC_NET_OK && csize==size &&
       !memcmp(dt->checksum, targetchecksum, PSYNC_HASH_DIGEST_HEXLEN)) {
     log_info("found file %s, candidate for %s with the right size and checksum", tmpname, localname);
     ret=rename_and_create_local(dt, targetchecksum, size, hash);
     free_download_task(dt);
+    if (ret)
+      task_release_claim(taskid);
     return ret;
   }
   if (psync_get_local_file_checksum(localname, dt->checksum, &dt->localsize)==PSYNC_NET_OK)
     dt->localexists=1;
   else
     dt->localexists=0;
-  if (hastargetchecksum && dt->localexists && size==csize && !memcmp(dt->checksum, targetchecksum, PSYNC_HASH_DIGEST_HEXLEN)) {
+  if (hastargetchecksum && dt->localexists && size==dt->localsize && !memcmp(dt->checksum, targetchecksum, PSYNC_HASH_DIGEST_HEXLEN)) {
     log_info("file %s already exists and has correct checksum, not downloading", localname);
     ret=stat_and_create_local(dt->dwllist.syncid, dt->dwllist.fileid, dt->localfolderid, dt->filename, dt->localname, targetchecksum, size, hash);
     free_download_task(dt);
+    if (ret)
+      task_release_claim(taskid);
     return ret;
   }
   minfree=psync_setting_get_uint(_PS(minlocalfreespace));
@@ -1150,6 +1233,7 @@ static int task_run_download_file(uint64_t taskid, psync_syncid_t syncid, psync_
       psync_set_local_full(1);
       log_info("disk is full, sleeping 10 seconds");
       psync_milisleep(PSYNC_SLEEP_ON_DISK_FULL);
+      task_release_claim(taskid);
       return -1;
     }
   }
@@ -1157,6 +1241,7 @@ static int task_run_download_file(uint64_t taskid, psync_syncid_t syncid, psync_
     log_warn("could not get free space for %s, maybe it is locally deleted, sleeping a bit and failing task", localpath);
     free_download_task(dt);
     psync_milisleep(PSYNC_SLEEP_ON_FAILED_DOWNLOAD);
+    task_release_claim(taskid);
     return -1;
   }
   lock=psync_lock_file(localname);
@@ -1164,20 +1249,20 @@ static int task_run_download_file(uint64_t taskid, psync_syncid_t syncid, psync_
     log_info("file %s is currently locked, skipping for now", localname);
     free_download_task(dt);
     psync_milisleep(PSYNC_SLEEP_ON_LOCKED_FILE);
+    task_release_claim(taskid);
     return -1;
   }
   dt->lock=lock;
-  set_task_inprogress(taskid, 1);
   if (size<=PSYNC_MAX_SIZE_FOR_ASYNC_DOWNLOAD) {
     if (dt->localexists)
-      ret=psync_async_download_file_if_changed(fileid, dt->tmpname, csize, dt->checksum, finish_async_download_existing, dt);
+      ret=psync_async_download_file_if_changed(fileid, size, dt->tmpname, dt->localsize, dt->checksum, finish_async_download_existing, dt);
     else
-      ret=psync_async_download_file(fileid, dt->tmpname, finish_async_download, dt);
+      ret=psync_async_download_file(fileid, size, dt->tmpname, finish_async_download, dt);
     if (ret) {
       log_warn("async download start failed for %s", dt->localname);
       free_download_task(dt);
-      set_task_inprogress(taskid, 0);
       psync_milisleep(PSYNC_SLEEP_ON_FAILED_DOWNLOAD);
+      task_release_claim(taskid);
     }
   }
   else {
@@ -1309,18 +1394,157 @@ static int download_task(uint64_t taskid, uint32_t type, psync_syncid_t syncid,
   return res;
 }
 
+static int download_lane_for_size(uint64_t size) {
+  return size<=PSYNC_MAX_SIZE_FOR_ASYNC_DOWNLOAD?DOWNLOAD_LANE_SMALL:DOWNLOAD_LANE_LARGE;
+}
+
+static void download_queue_add(uint64_t taskid, psync_syncid_t syncid, psync_fileid_t fileid, psync_folderid_t localfolderid, const char *filename,
+                               uint64_t size) {
+  download_queued_t *dq;
+  download_lane_t *lane;
+  size_t len;
+  set_task_inprogress(taskid, TASK_INPROGRESS_QUEUED);
+  len=strlen(filename);
+  dq=(download_queued_t *)psync_malloc(offsetof(download_queued_t, filename)+len+1);
+  dq->taskid=taskid;
+  dq->syncid=syncid;
+  dq->fileid=fileid;
+  dq->localfolderid=localfolderid;
+  memcpy(dq->filename, filename, len+1);
+  lane=&download_lanes[download_lane_for_size(size)];
+  pthread_mutex_lock(&download_queue_mutex);
+  while (lane->len>=PSYNC_DOWNLOAD_QUEUE_MAX)
+    pthread_cond_wait(&download_queue_idle_cond, &download_queue_mutex);
+  psync_list_add_tail(&lane->queue, &dq->list);
+  lane->len++;
+  lane->busy++;
+  download_queue_busy++;
+  pthread_cond_signal(&lane->cond);
+  pthread_mutex_unlock(&download_queue_mutex);
+}
+
+/* every large worker is waiting for its file to be admitted, another large file would only wait in the queue */
+static int download_large_lane_full() {
+  psync_uint_t busy;
+  pthread_mutex_lock(&download_queue_mutex);
+  busy=download_lanes[DOWNLOAD_LANE_LARGE].busy;
+  pthread_mutex_unlock(&download_queue_mutex);
+  return busy>=PSYNC_DOWNLOAD_LARGE_WORKERS;
+}
+
+/* Queues the first small file that comes before any task of another type, those are ordered against the files before
+ * them. Returns -1 if there is none. */
+static int download_queue_next_small_file() {
+  psync_sql_res *res;
+  psync_variant_row row;
+  uint64_t taskid;
+  psync_syncid_t syncid;
+  psync_fileid_t fileid;
+  psync_folderid_t localfolderid;
+  char *filename;
+  res=psync_sql_query_rdlock("SELECT id, syncid, itemid, localitemid, name FROM task t WHERE inprogress=0 AND type="NTO_STR(PSYNC_DOWNLOAD_FILE)
+                             " AND name IS NOT NULL AND id<IFNULL((SELECT MIN(id) FROM task WHERE inprogress=0 AND type&"NTO_STR(PSYNC_TASK_DWLUPL_MASK)
+                             "="NTO_STR(PSYNC_TASK_DOWNLOAD)" AND type!="NTO_STR(PSYNC_DOWNLOAD_FILE)"), t.id+1) AND "
+                             "IFNULL((SELECT size FROM file WHERE id=t.itemid), 0)<=? ORDER BY id LIMIT 1");
+  psync_sql_bind_uint(res, 1, PSYNC_MAX_SIZE_FOR_ASYNC_DOWNLOAD);
+  row=psync_sql_fetch_row(res);
+  if (!row) {
+    psync_sql_free_result(res);
+    return -1;
+  }
+  taskid=psync_get_number(row[0]);
+  syncid=psync_get_number_or_null(row[1]);
+  fileid=psync_get_number(row[2]);
+  localfolderid=psync_get_number(row[3]);
+  filename=psync_strdup(psync_get_string(row[4]));
+  psync_sql_free_result(res);
+  download_queue_add(taskid, syncid, fileid, localfolderid, filename, 0);
+  psync_free(filename);
+  return 0;
+}
+
+/* Other tasks (folder creation, renames, deletes) are ordered against the file tasks before them, wait until all
+ * queued files are at least started. */
+static void download_queue_wait_idle() {
+  pthread_mutex_lock(&download_queue_mutex);
+  while (download_queue_busy)
+    pthread_cond_wait(&download_queue_idle_cond, &download_queue_mutex);
+  pthread_mutex_unlock(&download_queue_mutex);
+}
+
+int psync_download_queued_file(uint64_t taskid, psync_syncid_t syncid, psync_fileid_t fileid, psync_folderid_t localfolderid, const char *filename) {
+  psync_sql_res *res;
+  uint32_t aff;
+  if (!download_task(taskid, PSYNC_DOWNLOAD_FILE, syncid, fileid, localfolderid, 0, filename, 0)) {
+    delete_task(taskid);
+    psync_status_recalc_to_download_async();
+    psync_path_status_sync_folder_task_completed(syncid, localfolderid);
+    return 0;
+  }
+  // not started, give the task back to the dispatcher unless it was deleted or claimed meanwhile
+  res=psync_sql_prep_statement("UPDATE task SET inprogress=0 WHERE id=? AND inprogress="NTO_STR(TASK_INPROGRESS_QUEUED));
+  psync_sql_bind_uint(res, 1, taskid);
+  psync_sql_run(res);
+  aff=psync_sql_affected_rows();
+  psync_sql_free_result(res);
+  if (aff)
+    psync_wake_download();
+  return -1;
+}
+
+static void download_worker_thread(void *ptr) {
+  download_lane_t *lane;
+  download_queued_t *dq;
+  lane=(download_lane_t *)ptr;
+  while (psync_do_run) {
+    pthread_mutex_lock(&download_queue_mutex);
+    while (psync_list_isempty(&lane->queue))
+      pthread_cond_wait(&lane->cond, &download_queue_mutex);
+    dq=psync_list_remove_head_element(&lane->queue, download_queued_t, list);
+    lane->len--;
+    pthread_cond_broadcast(&download_queue_idle_cond);
+    pthread_mutex_unlock(&download_queue_mutex);
+    psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
+    psync_download_queued_file(dq->taskid, dq->syncid, dq->fileid, dq->localfolderid, dq->filename);
+    psync_free(dq);
+    pthread_mutex_lock(&download_queue_mutex);
+    lane->busy--;
+    if (!--download_queue_busy)
+      pthread_cond_broadcast(&download_queue_idle_cond);
+    pthread_mutex_unlock(&download_queue_mutex);
+    // the dispatcher may be holding back large files until a large worker is free
+    if (lane==&download_lanes[DOWNLOAD_LANE_LARGE])
+      psync_wake_download();
+  }
+}
+
 static void download_thread() {
   psync_variant *row;
-  uint64_t taskid;
+  uint64_t taskid, size;
   uint32_t type;
   while (psync_do_run) {
     psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
 
-    row=psync_sql_row("SELECT id, type, syncid, itemid, localitemid, newitemid, name, newsyncid FROM task WHERE "
+    row=psync_sql_row("SELECT id, type, syncid, itemid, localitemid, newitemid, name, newsyncid, "
+                      "(SELECT size FROM file WHERE id=task.itemid) FROM task WHERE "
                       "inprogress=0 AND type&"NTO_STR(PSYNC_TASK_DWLUPL_MASK)"="NTO_STR(PSYNC_TASK_DOWNLOAD)" ORDER BY id LIMIT 1");
     if (row) {
       taskid=psync_get_number(row[0]);
       type=psync_get_number(row[1]);
+      if (type==PSYNC_DOWNLOAD_FILE && psync_get_string_or_null(row[6])) {
+        size=psync_get_number_or_null(row[8]);
+        if (download_lane_for_size(size)==DOWNLOAD_LANE_LARGE && download_large_lane_full()) {
+          psync_free(row);
+          if (!download_queue_next_small_file())
+            continue;
+          goto wait;
+        }
+        download_queue_add(taskid, psync_get_number_or_null(row[2]), psync_get_number(row[3]), psync_get_number(row[4]),
+                           psync_get_string(row[6]), size);
+        psync_free(row);
+        continue;
+      }
+      download_queue_wait_idle();
       if (!download_task(taskid, type,
                          psync_get_number_or_null(row[2]),
                          psync_get_number(row[3]),
@@ -1340,6 +1564,7 @@ static void download_thread() {
       continue;
     }
 
+wait:
     pthread_mutex_lock(&download_mutex);
     if (!download_wakes)
       pthread_cond_wait(&download_cond, &download_mutex);
@@ -1356,7 +1581,12 @@ void psync_wake_download() {
 }
 
 void psync_download_init() {
+  psync_uint_t i;
   psync_timer_exception_handler(psync_wake_download);
+  for (i=0; i<PSYNC_DOWNLOAD_WORKERS; i++)
+    psync_run_thread1("download worker", download_worker_thread, &download_lanes[DOWNLOAD_LANE_SMALL]);
+  for (i=0; i<PSYNC_DOWNLOAD_LARGE_WORKERS; i++)
+    psync_run_thread1("large download worker", download_worker_thread, &download_lanes[DOWNLOAD_LANE_LARGE]);
   psync_run_thread("download main", download_thread);
 }
 
@@ -1394,6 +1624,8 @@ void psync_stop_file_download(psync_fileid_t fileid, psync_syncid_t syncid) {
   psync_list_for_each_element(dwl, &downloads, download_list_t, list)
     if (dwl->fileid==fileid && dwl->syncid==syncid)
       dwl->stop=1;
+  if (current_downloads_waiters)
+    pthread_cond_broadcast(&current_downloads_cond);
   pthread_mutex_unlock(&current_downloads_mutex);
 }
 
@@ -1408,6 +1640,8 @@ void psync_stop_sync_download(psync_syncid_t syncid) {
   psync_list_for_each_element(dwl, &downloads, download_list_t, list)
     if (dwl->syncid==syncid)
       dwl->stop=1;
+  if (current_downloads_waiters)
+    pthread_cond_broadcast(&current_downloads_cond);
   pthread_mutex_unlock(&current_downloads_mutex);
 }
 
@@ -1416,6 +1650,9 @@ void psync_stop_all_download() {
   pthread_mutex_lock(&current_downloads_mutex);
   psync_list_for_each_element(dwl, &downloads, download_list_t, list)
     dwl->stop=1;
+  // tasks waiting to be admitted are in the list too
+  if (current_downloads_waiters)
+    pthread_cond_broadcast(&current_downloads_cond);
   pthread_mutex_unlock(&current_downloads_mutex);
 }
 
@@ -25,6 +25,10 @@ typedef struct {
 
 void psync_download_init();
 void psync_wake_download();
+/* Prepares and starts the download of a file task the dispatcher queued (inprogress=2). Nothing is done unless the task
+ * can still be claimed. Returns 0 when the task is completed and deleted, -1 when it was started in the background or
+ * given back to the dispatcher. */
+int psync_download_queued_file(uint64_t taskid, psync_syncid_t syncid, psync_fileid_t fileid, psync_folderid_t localfolderid, const char *filename);
 void psync_delete_download_tasks_for_file(psync_fileid_t fileid, psync_syncid_t syncid, int deltemp);
 void psync_stop_file_download(psync_fileid_t fileid, psync_syncid_t syncid);
 void psync_stop_sync_download(psync_syncid_t syncid);
@@ -242,15 +242,20 @@ static int psync_add_path_to_list(psync_list *lst, psync_folderid_t folderid) {
 static string_list *str_list_decode(psync_folderid_t folderid, string_list *e) {
   psync_crypto_aes256_text_decoder_t dec;
   char *fn;
-  dec=psync_cloud_crypto_get_folder_decoder(folderid);
-  if (psync_crypto_is_error(dec)) {
-    psync_free(e);
-    log_warn("got error %d getting decoder for folderid %lu",
-             psync_crypto_to_error(dec), (unsigned long)folderid);
-    return NULL;
+  fn=psync_cloud_crypto_names_get_plain(folderid, e->str);
+  if (!fn) {
+    dec=psync_cloud_crypto_get_folder_decoder(folderid);
+    if (psync_crypto_is_error(dec)) {
+      psync_free(e);
+      log_warn("got error %d getting decoder for folderid %lu",
+               psync_crypto_to_error(dec), (unsigned long)folderid);
+      return NULL;
+    }
+    fn=psync_cloud_crypto_decode_filename(dec, e->str);
+    psync_cloud_crypto_release_folder_decoder(folderid, dec);
+    if (fn)
+      psync_cloud_crypto_names_add(folderid, e->str, fn);
   }
-  fn=psync_cloud_crypto_decode_filename(dec, e->str);
-  psync_cloud_crypto_release_folder_decoder(folderid, dec);
   psync_free(e);
   if (unlikely_log(!fn))
     return NULL;
@@ -787,13 +787,18 @@ static int psync_fs_getattr(const char *path, struct FUSE_STAT *stbuf) {
   return -ENOENT;
 }
 
-static int filler_decoded(psync_crypto_aes256_text_decoder_t dec, fuse_fill_dir_t filler, void *buf, const char *name, struct FUSE_STAT *st, fuse_off_t off) {
+static int filler_decoded(psync_fsfolderid_t folderid, psync_crypto_aes256_text_decoder_t dec, fuse_fill_dir_t filler, void *buf,
+                          const char *name, struct FUSE_STAT *st, fuse_off_t off) {
   if (dec) {
     char *namedec;
     int ret;
-    namedec=psync_cloud_crypto_decode_filename(dec, name);
-    if (!namedec)
-      return 0;
+    namedec=psync_cloud_crypto_names_get_plain(folderid, name);
+    if (!namedec) {
+      namedec=psync_cloud_crypto_decode_filename(dec, name);
+      if (!namedec)
+        return 0;
+      psync_cloud_crypto_names_add(folderid, name, namedec);
+    }
     ret=filler(buf, namedec, st, off);
     psync_free(namedec);
     return ret;
@@ -852,7 +857,7 @@ static int psync_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
       if (folder && (psync_fstask_find_rmdir(folder, name, 0) || psync_fstask_find_mkdir(folder, name, 0)))
         continue;
       psync_row_to_folder_stat(row, &st);
-      filler_decoded(dec, filler, buf, name, &st, 0);
+      filler_decoded(folderid, dec, filler, buf, name, &st, 0);
     }
     psync_sql_free_result(res);
     res=psync_sql_query_nolock("SELECT name, size, ctime, mtime, id FROM file WHERE parentfolderid=?");
@@ -868,7 +873,7 @@ static int psync_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
       if (folder && psync_fstask_find_unlink(folder, name, 0))
         continue;
       psync_row_to_file_stat(row, &st, flags);
-      filler_decoded(dec, filler, buf, name, &st, 0);
+      filler_decoded(folderid, dec, filler, buf, name, &st, 0);
     }
     psync_sql_free_result(res);
   }
@@ -881,7 +886,7 @@ static int psync_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
       if (psync_tree_element(trel, psync_fstask_mkdir_t, tree)->flags&PSYNC_FOLDER_FLAG_INVISIBLE)
         continue;
       psync_mkdir_to_folder_stat(psync_tree_element(trel, psync_fstask_mkdir_t, tree), &st);
-      filler_decoded(dec, filler, buf, psync_tree_element(trel, psync_fstask_mkdir_t, tree)->name, &st, 0);
+      filler_decoded(folderid, dec, filler, buf, psync_tree_element(trel, psync_fstask_mkdir_t, tree)->name, &st, 0);
     }
     psync_tree_for_each(trel, folder->creats) {
 #if defined(FS_MAX_ACCEPTABLE_FILENAME_LEN)
@@ -889,12 +894,15 @@ static int psync_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         continue;
 #endif
       if (!psync_creat_to_file_stat(psync_tree_element(trel, psync_fstask_creat_t, tree), &st, flags))
-        filler_decoded(dec, filler, buf, psync_tree_element(trel, psync_fstask_creat_t, tree)->name, &st, 0);
+        filler_decoded(folderid, dec, filler, buf, psync_tree_element(trel, psync_fstask_creat_t, tree)->name, &st, 0);
     }
   }
   psync_sql_rdunlock();
-  if (dec)
+  if (dec) {
     psync_cloud_crypto_release_folder_decoder(folderid, dec);
+    if (folderid>0)
+      psync_cloud_crypto_prefetch_folder_keys(folderid);
+  }
   return 0;
 }
 
@@ -1127,6 +1135,7 @@ static void psync_fs_del_creat(psync_fspath_t *fpath, psync_openfile_t *of) {
   psync_sql_bind_uint(res, 1, -of->fileid);
   psync_sql_run_free(res);
   psync_sql_commit_transaction();
+  psync_status_fstask_removed(-of->fileid);
   folder=psync_fstask_get_or_create_folder_tasks_locked(fpath->folderid);
   if (likely(folder)) {
     if (likely((cr=psync_fstask_find_creat(folder, fpath->name, 0)))) {
@@ -1680,6 +1689,7 @@ static void psync_fs_upload_release_timer(void *ptr) {
     psync_sql_bind_uint(res, 3, ofw->writeid);
     psync_sql_run_free(res);
   }
+  psync_status_fstask_changed(-ofw->of->fileid);
   psync_fs_dec_of_refcnt(ofw->of);
   psync_free(ofw);
   psync_status_recalc_to_upload_async();
@@ -1768,6 +1778,7 @@ static int psync_fs_flush(const char *path, struct fuse_file_info *fi) {
       psync_sql_bind_uint(res, 3, writeid);
       psync_sql_run_free(res);
     }
+    psync_status_fstask_changed(-of->fileid);
     psync_status_recalc_to_upload_async();
     return 0;
   }
@@ -2741,9 +2752,16 @@ int psync_fs_chown(const char *path, uid_t uid, gid_t gid) {
   return 0;
 }
 
-static int psync_fs_set_filetime_locked(psync_fsfileid_t fileid, const struct timespec *tv, int crtime, uint64_t current) {
-  if (fileid>0)
-    return psync_fstask_set_mtime(fileid, current, tv->tv_sec, crtime);
+/* Times of files already on the server are changed through a group commit, which has to run without the lock the caller
+ * holds, so their fileid and current time are returned in setfileid and setcurrent for psync_fs_set_time() to apply later.
+ */
+static int psync_fs_set_filetime_locked(psync_fsfileid_t fileid, const struct timespec *tv, int crtime, uint64_t current,
+                                        psync_fileid_t *setfileid, uint64_t *setcurrent) {
+  if (fileid>0) {
+    *setfileid=fileid;
+    *setcurrent=current;
+    return 0;
+  }
   else{
     char fileidhex[sizeof(psync_fsfileid_t)*2+2], *filename;
     const char *cachepath;
@@ -2794,7 +2812,8 @@ static int psync_fs_set_foldertime_locked(psync_fsfolderid_t folderid, const str
   return 0;
 }
 
-static int psync_fs_set_time_locked(psync_fsfolderid_t folderid, const char *name, const struct timespec *tv, int crtime) {
+static int psync_fs_set_time_locked(psync_fsfolderid_t folderid, const char *name, const struct timespec *tv, int crtime,
+                                    psync_fileid_t *setfileid, uint64_t *setcurrent) {
   psync_fstask_folder_t *folder;
   psync_fstask_creat_t *creat;
   psync_fstask_mkdir_t *mkdir;
@@ -2811,7 +2830,7 @@ static int psync_fs_set_time_locked(psync_fsfolderid_t folderid, const char *nam
         if ((row=psync_sql_fetch_rowint(res))) {
           uint64_t ctm=row[crtime];
           psync_sql_free_result(res);
-          return psync_fs_set_filetime_locked(creat->fileid, tv, crtime, ctm);
+          return psync_fs_set_filetime_locked(creat->fileid, tv, crtime, ctm, setfileid, setcurrent);
         }
         else{
           psync_sql_free_result(res);
@@ -2821,7 +2840,7 @@ static int psync_fs_set_time_locked(psync_fsfolderid_t folderid, const char *nam
         }
       }
       else
-        return psync_fs_set_filetime_locked(creat->fileid, tv, crtime, 0);
+        return psync_fs_set_filetime_locked(creat->fileid, tv, crtime, 0, setfileid, setcurrent);
     }
     if ((mkdir=psync_fstask_find_mkdir(folder, name, 0)))
       return psync_fs_set_foldertime_locked(mkdir->folderid, tv, crtime, 0);
@@ -2840,7 +2859,7 @@ static int psync_fs_set_time_locked(psync_fsfolderid_t folderid, const char *nam
       uint64_t fileid=row[0];
       uint64_t ctm=row[1+crtime];
       psync_sql_free_result(res);
-      return psync_fs_set_filetime_locked(fileid, tv, crtime, ctm);
+      return psync_fs_set_filetime_locked(fileid, tv, crtime, ctm, setfileid, setcurrent);
     }
     psync_sql_free_result(res);
   }
@@ -2864,7 +2883,11 @@ static int psync_fs_set_time_locked(psync_fsfolderid_t folderid, const char *nam
 
 static int psync_fs_set_time(const char *path, const struct timespec *tv, int crtime) {
   psync_fspath_t *fpath;
+  psync_fileid_t setfileid;
+  uint64_t setcurrent;
   int ret;
+  setfileid=0;
+  setcurrent=0;
   psync_sql_lock();
   CHECK_LOGIN_LOCKED();
   fpath=psync_fsfolder_resolve_path(path);
@@ -2873,9 +2896,11 @@ static int psync_fs_set_time(const char *path, const struct timespec *tv, int cr
   else if (!(fpath->permissions&PSYNC_PERM_MODIFY))
     ret=-EACCES;
   else
-    ret=psync_fs_set_time_locked(fpath->folderid, fpath->name, tv, crtime);
+    ret=psync_fs_set_time_locked(fpath->folderid, fpath->name, tv, crtime, &setfileid, &setcurrent);
   psync_sql_unlock();
   psync_free(fpath);
+  if (!ret && setfileid)
+    ret=psync_fstask_set_mtime(setfileid, setcurrent, tv->tv_sec, crtime);
   return ret;
 }
 
@@ -503,8 +503,129 @@ static void psync_fs_crypto_set_sector_log_offset(psync_openfile_t *of, psync_cr
   psync_tree_added_at(&of->sectorsinlog, &tr->tree, &ntr->tree);
 }
 
+/* Sector encoding and auth sector signing are spread over a pool of PSYNC_CRYPTO_WORKERS-1 threads that are started on
+ * first use and kept for the life of the process. Jobs of one caller are counted in a psync_fs_crypto_jobs_t, the caller
+ * runs its own jobs that no worker has picked up yet while it waits, so it always makes progress even if the workers are
+ * busy with another file.
+ */
+typedef struct {
+  pthread_cond_t cond;
+  uint32_t pending;
+} psync_fs_crypto_jobs_t;
+
+typedef struct {
+  psync_list list;
+  psync_fs_crypto_jobs_t *jobs;
+  void (*run)(void *);
+  void *ptr;
+} psync_fs_crypto_job_t;
+
+static pthread_mutex_t crypto_pool_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t crypto_pool_cond=PTHREAD_COND_INITIALIZER;
+static psync_list crypto_pool_queue=PSYNC_LIST_STATIC_INIT(crypto_pool_queue);
+static uint32_t crypto_pool_threads=0;
+
+/* called with crypto_pool_mutex held and the job removed from the queue, returns with the mutex held */
+static void psync_fs_crypto_run_job(psync_fs_crypto_job_t *job) {
+  psync_fs_crypto_jobs_t *jobs;
+  jobs=job->jobs;
+  pthread_mutex_unlock(&crypto_pool_mutex);
+  job->run(job->ptr);
+  psync_free(job);
+  pthread_mutex_lock(&crypto_pool_mutex);
+  if (--jobs->pending==0)
+    pthread_cond_signal(&jobs->cond);
+}
+
+static void psync_fs_crypto_pool_thread() {
+  pthread_mutex_lock(&crypto_pool_mutex);
+  while (1) {
+    while (psync_list_isempty(&crypto_pool_queue))
+      pthread_cond_wait(&crypto_pool_cond, &crypto_pool_mutex);
+    psync_fs_crypto_run_job(psync_list_remove_head_element(&crypto_pool_queue, psync_fs_crypto_job_t, list));
+  }
+}
+
+static void psync_fs_crypto_jobs_init(psync_fs_crypto_jobs_t *jobs) {
+  pthread_cond_init(&jobs->cond, NULL);
+  jobs->pending=0;
+}
+
+static void psync_fs_crypto_jobs_add(psync_fs_crypto_jobs_t *jobs, void (*run)(void *), void *ptr) {
+  psync_fs_crypto_job_t *job;
+  job=psync_new(psync_fs_crypto_job_t);
+  job->jobs=jobs;
+  job->run=run;
+  job->ptr=ptr;
+  pthread_mutex_lock(&crypto_pool_mutex);
+  if (crypto_pool_threads<PSYNC_CRYPTO_WORKERS-1) {
+    crypto_pool_threads++;
+    psync_run_thread("crypto worker", psync_fs_crypto_pool_thread);
+  }
+  jobs->pending++;
+  psync_list_add_tail(&crypto_pool_queue, &job->list);
+  pthread_cond_signal(&crypto_pool_cond);
+  pthread_mutex_unlock(&crypto_pool_mutex);
+}
+
+/* waits for all jobs added so far, jobs can be added again afterwards */
+static void psync_fs_crypto_jobs_wait(psync_fs_crypto_jobs_t *jobs) {
+  psync_fs_crypto_job_t *job, *own;
+  pthread_mutex_lock(&crypto_pool_mutex);
+  while (jobs->pending) {
+    own=NULL;
+    psync_list_for_each_element(job, &crypto_pool_queue, psync_fs_crypto_job_t, list)
+      if (job->jobs==jobs) {
+        own=job;
+        break;
+      }
+    if (own) {
+      psync_list_del(&own->list);
+      psync_fs_crypto_run_job(own);
+    }
+    else
+      pthread_cond_wait(&jobs->cond, &crypto_pool_mutex);
+  }
+  pthread_mutex_unlock(&crypto_pool_mutex);
+}
+
+static void psync_fs_crypto_jobs_destroy(psync_fs_crypto_jobs_t *jobs) {
+  psync_fs_crypto_jobs_wait(jobs);
+  pthread_cond_destroy(&jobs->cond);
+}
+
+typedef struct {
+  psync_crypto_aes256_sector_encoder_decoder_t encoder;
+  unsigned char *authout;
+  uint32_t len;
+  psync_crypto_auth_sector_t data;
+} psync_fs_auth_signer_t;
+
+static void psync_fs_crypto_sign_auth_sector_job(void *ptr) {
+  psync_fs_auth_signer_t *as;
+  as=(psync_fs_auth_signer_t *)ptr;
+  psync_crypto_sign_auth_sector(as->encoder, (unsigned char *)as->data, as->len, as->authout);
+  psync_free(as);
+}
+
+/* Signs a copy of len bytes of the auth sector in a worker, authout is only valid after psync_fs_crypto_jobs_wait. */
+static void psync_fs_crypto_sign_auth_sector_async(psync_openfile_t *of, psync_fs_crypto_jobs_t *jobs, psync_crypto_auth_sector_t *sector,
+                                                   uint32_t len, psync_crypto_sector_auth_t authout) {
+  psync_fs_auth_signer_t *as;
+  as=psync_new(psync_fs_auth_signer_t);
+  as->encoder=of->encoder;
+  as->authout=authout;
+  as->len=len;
+  memcpy(as->data, sector, len);
+  psync_fs_crypto_jobs_add(jobs, psync_fs_crypto_sign_auth_sector_job, as);
+}
+
+/* Level 0 auth sectors, which are all but one in 128 of the signatures, are signed in the pool. Their signatures are
+ * only read when a level 1 sector is signed or replaced by the one of the next sector, so the jobs are waited for then.
+ */
 static int psync_fs_crypto_switch_sectors(psync_openfile_t *of, psync_crypto_sectorid_t oldsectorid, psync_crypto_sectorid_t newsectorid,
-                                          psync_crypto_auth_sector_t *autharr, psync_crypto_offsets_t *offsets) {
+                                          psync_crypto_auth_sector_t *autharr, psync_crypto_offsets_t *offsets, psync_fs_crypto_jobs_t *jobs) {
+  psync_crypto_log_data_record rec;
   psync_crypto_log_header hdr;
   psync_crypto_offsets_t ooffsets;
   int64_t filesize, off;
@@ -532,19 +653,20 @@ static int psync_fs_crypto_switch_sectors(psync_openfile_t *of, psync_crypto_sec
       assert(hdr.offset+sz<=offsets->masterauthoff+PSYNC_CRYPTO_AUTH_SIZE);
 //      log_info("writing level %u signatures to offset %lu size %u", level, hdr.offset, sz);
       hdr.length=sz;
-      psync_crypto_sign_auth_sector(of->encoder, (unsigned char *)&autharr[level], sz, autharr[level+1][oldsecn]);
-      wrt=psync_file_pwrite(of->logfile, &hdr, sizeof(hdr), of->logoffset);
-      if (unlikely(wrt!=sizeof(hdr))) {
-        log_error("write to log of %u bytes returned %d", (unsigned)sizeof(hdr), (int)wrt);
-        return -EIO;
+      if (level==0)
+        psync_fs_crypto_sign_auth_sector_async(of, jobs, &autharr[level], sz, autharr[level+1][oldsecn]);
+      else{
+        psync_fs_crypto_jobs_wait(jobs);
+        psync_crypto_sign_auth_sector(of->encoder, (unsigned char *)&autharr[level], sz, autharr[level+1][oldsecn]);
       }
-      psync_fast_hash256_update(&of->loghashctx, &hdr, sizeof(hdr));
-      wrt=psync_file_pwrite(of->logfile, &autharr[level], sz, of->logoffset+sizeof(hdr));
-      if (unlikely(wrt!=sz)) {
-        log_error("write to log of %u bytes returned %d", (unsigned)sz, (int)wrt);
+      rec.header=hdr;
+      memcpy(rec.data, &autharr[level], sz);
+      wrt=psync_file_pwrite(of->logfile, &rec, sizeof(hdr)+sz, of->logoffset);
+      if (unlikely(wrt!=sizeof(hdr)+sz)) {
+        log_error("write to log of %u bytes returned %d", (unsigned)(sizeof(hdr)+sz), (int)wrt);
         return -EIO;
       }
-      psync_fast_hash256_update(&of->loghashctx, &autharr[level], sz);
+      psync_fast_hash256_update(&of->loghashctx, &rec, sizeof(hdr)+sz);
       if (!of->newfile)
         psync_interval_tree_add(&of->writeintervals, hdr.offset, hdr.offset+sz);
       of->logoffset+=sz+sizeof(hdr);
@@ -575,6 +697,8 @@ static int psync_fs_crypto_switch_sectors(psync_openfile_t *of, psync_crypto_sec
             off=psync_fs_crypto_auth_offset(level, newsecd);
             sz=PSYNC_CRYPTO_SECTOR_SIZE;
           }
+          if (level)
+            psync_fs_crypto_jobs_wait(jobs);
           wrt=psync_file_pread(of->datafile, &autharr[level], sz, off);
           if (unlikely(wrt!=sz)) {
             log_error("read from datafile of %u bytes returned %d at offset %u", (unsigned)sz, (int)wrt, (unsigned)off);
@@ -619,16 +743,16 @@ static int psync_fs_crypto_write_master_auth(psync_openfile_t *of, psync_crypto_
   return 0;
 }
 
-static int psync_fs_write_auth_tree_to_log(psync_openfile_t *of, psync_crypto_offsets_t *offsets) {
+static int psync_fs_write_auth_sectors_to_log(psync_openfile_t *of, psync_crypto_offsets_t *offsets, psync_crypto_auth_sector_t *authsect,
+                                              psync_fs_crypto_jobs_t *jobs, psync_crypto_sectorid_t *lastsectorid) {
   psync_sector_inlog_t *sect;
   psync_crypto_sectorid_t lastsect;
   int ret;
-  psync_def_var_arr(authsect, psync_crypto_auth_sector_t, offsets->treelevels+1);
   lastsect=PSYNC_CRYPTO_INVALID_SECTORID;
   sect=psync_tree_element(psync_tree_get_first(of->sectorsinlog), psync_sector_inlog_t, tree);
   while (sect) {
     if (lastsect/PSYNC_CRYPTO_HASH_TREE_SECTORS!=sect->sectorid/PSYNC_CRYPTO_HASH_TREE_SECTORS) {
-      ret=psync_fs_crypto_switch_sectors(of, lastsect, sect->sectorid, authsect, offsets);
+      ret=psync_fs_crypto_switch_sectors(of, lastsect, sect->sectorid, authsect, offsets, jobs);
       if (ret)
         return ret;
     }
@@ -636,7 +760,18 @@ static int psync_fs_write_auth_tree_to_log(psync_openfile_t *of, psync_crypto_of
     lastsect=sect->sectorid;
     sect=psync_tree_element(psync_tree_get_next(&sect->tree), psync_sector_inlog_t, tree);
   }
-  ret=psync_fs_crypto_switch_sectors(of, lastsect, PSYNC_CRYPTO_INVALID_SECTORID, authsect, offsets);
+  *lastsectorid=lastsect;
+  return psync_fs_crypto_switch_sectors(of, lastsect, PSYNC_CRYPTO_INVALID_SECTORID, authsect, offsets, jobs);
+}
+
+static int psync_fs_write_auth_tree_to_log(psync_openfile_t *of, psync_crypto_offsets_t *offsets) {
+  psync_fs_crypto_jobs_t jobs;
+  psync_crypto_sectorid_t lastsect;
+  int ret;
+  psync_def_var_arr(authsect, psync_crypto_auth_sector_t, offsets->treelevels+1);
+  psync_fs_crypto_jobs_init(&jobs);
+  ret=psync_fs_write_auth_sectors_to_log(of, offsets, authsect, &jobs, &lastsect);
+  psync_fs_crypto_jobs_destroy(&jobs);
   if (ret)
     return ret;
   if (offsets->needmasterauth && (ret=psync_fs_crypto_write_master_auth(of, authsect, offsets)))
@@ -646,7 +781,10 @@ static int psync_fs_write_auth_tree_to_log(psync_openfile_t *of, psync_crypto_of
 }
 
 PSYNC_NOINLINE static int psync_fs_crypto_check_log_hash(psync_file_t lfd, psync_crypto_master_record *mr) {
-  char buff[PSYNC_CRYPTO_SECTOR_SIZE];
+#if IS_DEBUG
+  char buff[PSYNC_FAST_HASH256_LEN*2+1];
+#endif
+  char *rbuff;
   psync_fast_hash256_ctx ctx;
   uint64_t off;
   ssize_t rd;
@@ -656,15 +794,18 @@ PSYNC_NOINLINE static int psync_fs_crypto_check_log_hash(psync_file_t lfd, psync
     return -1;
   }
   psync_fast_hash256_init(&ctx);
+  rbuff=psync_new_cnt(char, PSYNC_CRYPTO_REPLAY_BUFFER);
   off=PSYNC_CRYPTO_SECTOR_SIZE;
-  while ((rd=psync_file_pread(lfd, buff, PSYNC_CRYPTO_SECTOR_SIZE, off))!=0) {
+  while ((rd=psync_file_pread(lfd, rbuff, PSYNC_CRYPTO_REPLAY_BUFFER, off))!=0) {
     if (unlikely(rd==-1)) {
       log_warn("got error %d while reading from log", (int)psync_fs_err());
+      psync_free(rbuff);
       return -1;
     }
-    psync_fast_hash256_update(&ctx, buff, rd);
+    psync_fast_hash256_update(&ctx, rbuff, rd);
     off+=rd;
   }
+  psync_free(rbuff);
   psync_fast_hash256_final(chash, &ctx);
   if (memcmp(chash, mr->hash, PSYNC_FAST_HASH256_LEN)) {
     log_warn("calculated hash does not match");
@@ -684,75 +825,106 @@ PSYNC_NOINLINE static int psync_fs_crypto_check_log_hash(psync_file_t lfd, psync
   }
 }
 
-static int psync_fs_crypto_process_log(psync_file_t lfd, psync_file_t dfd, psync_file_t ifd, int checkhash) {
-  char buff[PSYNC_CRYPTO_SECTOR_SIZE];
-  psync_fs_index_record *records;
-  psync_crypto_master_record *mr;
-  psync_crypto_log_header hdr;
-  uint64_t off, size, ioff;
+typedef struct {
+  psync_file_t fd;
+  char *buff;
+  uint64_t off;
+  uint32_t start;
+  uint32_t end;
+} psync_crypto_log_reader;
+
+/* Makes sure at least len bytes starting at the current position of the reader are in the buffer, reading the log in
+ * PSYNC_CRYPTO_REPLAY_BUFFER chunks. Returns 1 on success, 0 on end of file and -1 on error or a truncated record.
+ */
+static int psync_fs_crypto_log_reader_fill(psync_crypto_log_reader *lr, uint32_t len) {
   ssize_t rd;
-  uint32_t recid;
-  mr=(psync_crypto_master_record *)buff;
-  rd=psync_file_pread(lfd, mr, sizeof(psync_crypto_master_record), 0);
-  if (unlikely(rd!=sizeof(psync_crypto_master_record))) {
-    log_warn("error reading from log file, expected to read %u got %d", (unsigned)sizeof(psync_crypto_master_record), (int)rd);
-    return -1;
-  }
-  if (unlikely(mr->status!=PSYNC_LOG_STATUS_FINALIZED)) {
-    log_warn("got log file that is not finalized, skipping");
-    return -1;
-  }
-  if (unlikely(mr->logsize!=psync_file_size(lfd))) {
-    log_warn("got log file that does not match in size, expected %u, got %d", (unsigned)mr->logsize, (int)psync_file_size(lfd));
-    return -1;
-  }
-  if (unlikely(mr->crc!=psync_crc32c(PSYNC_CRC_INITIAL, mr, offsetof(psync_crypto_master_record, crc)))) {
-    log_warn("got log file with bad master record CRC, expected %u got %u", (unsigned)mr->crc,
-          (unsigned)psync_crc32c(PSYNC_CRC_INITIAL, mr, offsetof(psync_crypto_master_record, crc)));
-    return -1;
+  if (lr->end-lr->start>=len)
+    return 1;
+  if (lr->start) {
+    memmove(lr->buff, lr->buff+lr->start, lr->end-lr->start);
+    lr->end-=lr->start;
+    lr->start=0;
+  }
+  while (lr->end<len) {
+    rd=psync_file_pread(lr->fd, lr->buff+lr->end, PSYNC_CRYPTO_REPLAY_BUFFER-lr->end, lr->off);
+    if (unlikely(rd==-1)) {
+      log_error("error reading from log file, got error %d", (int)psync_fs_err());
+      return -1;
+    }
+    if (rd==0)
+      return lr->end?-1:0;
+    lr->end+=rd;
+    lr->off+=rd;
   }
-  if (unlikely(checkhash && psync_fs_crypto_check_log_hash(lfd, mr))) {
-    log_warn("log checksum failed, skipping replay");
+  return 1;
+}
+
+typedef struct {
+  psync_file_t fd;
+  char *buff;
+  uint64_t off;
+  uint32_t len;
+} psync_crypto_data_writer;
+
+static int psync_fs_crypto_data_writer_flush(psync_crypto_data_writer *dw) {
+  ssize_t wr;
+  if (!dw->len)
+    return 0;
+  wr=psync_file_pwrite(dw->fd, dw->buff, dw->len, dw->off);
+  if (unlikely(wr!=dw->len)) {
+    log_error("error writing to data file, expected to write %u got %d", (unsigned)dw->len, (int)wr);
     return -1;
   }
-  size=mr->filesize;
-  off=PSYNC_CRYPTO_SECTOR_SIZE;
-  if (unlikely_log(psync_file_seek(dfd, size, P_SEEK_SET)!=size || psync_file_truncate(dfd)))
-    return -1;
-  if (ifd!=INVALID_HANDLE_VALUE && unlikely_log(psync_file_seek(ifd, sizeof(psync_fs_index_header), P_SEEK_SET)!=sizeof(psync_fs_index_header) || psync_file_truncate(ifd)))
+  dw->len=0;
+  return 0;
+}
+
+/* Records that continue right where the previous one ended are merged into one write. Overlapping or out of order records
+ * flush what is pending first, so they are applied in log order.
+ */
+static int psync_fs_crypto_data_writer_add(psync_crypto_data_writer *dw, const char *data, uint32_t len, uint64_t off) {
+  if (dw->len && (dw->off+dw->len!=off || dw->len+len>PSYNC_CRYPTO_REPLAY_BUFFER) && psync_fs_crypto_data_writer_flush(dw))
     return -1;
-  records=(psync_fs_index_record *)buff;
+  if (!dw->len)
+    dw->off=off;
+  memcpy(dw->buff+dw->len, data, len);
+  dw->len+=len;
+  return 0;
+}
+
+static int psync_fs_crypto_do_process_log(psync_file_t ifd, uint64_t size,
+                                          psync_crypto_log_reader *lr, psync_crypto_data_writer *dw) {
+  psync_fs_index_record records[PSYNC_CRYPTO_SECTOR_SIZE/sizeof(psync_fs_index_record)];
+  psync_crypto_log_header hdr;
+  uint64_t ioff;
+  ssize_t rd;
+  uint32_t recid;
+  int ret;
   recid=0;
   ioff=0;
-  while ((rd=psync_file_pread(lfd, &hdr, sizeof(hdr), off))!=0) {
-    if (unlikely_log(rd!=sizeof(hdr)))
+  while ((ret=psync_fs_crypto_log_reader_fill(lr, sizeof(hdr)))!=0) {
+    if (unlikely_log(ret==-1))
       return -1;
-    off+=sizeof(hdr);
+    memcpy(&hdr, lr->buff+lr->start, sizeof(hdr));
+    lr->start+=sizeof(hdr);
     if (hdr.type==PSYNC_CRYPTO_LOG_DATA) {
-      assert(hdr.length<=sizeof(buff));
+      assert(hdr.length<=PSYNC_CRYPTO_SECTOR_SIZE);
       assert(recid==0);
-      if (unlikely(hdr.offset+hdr.length>size)) {
-        log_info("got record past the current end of file, this should only happen if file was truncated down, skipping record");
-        off+=hdr.length;
-        continue;
-      }
-      rd=psync_file_pread(lfd, buff, hdr.length, off);
-      if (unlikely(rd!=hdr.length)) {
-        log_error("error reading from log file, expected to read %u got %d", (unsigned)hdr.length, (int)rd);
+      if (unlikely(psync_fs_crypto_log_reader_fill(lr, hdr.length)!=1)) {
+        log_error("error reading from log file, expected to read %u bytes of data", (unsigned)hdr.length);
         return -1;
       }
-      off+=hdr.length;
-      rd=psync_file_pwrite(dfd, buff, hdr.length, hdr.offset);
-      if (unlikely(rd!=hdr.length)) {
-        log_error("error writing to data file, expected to write %u got %d", (unsigned)hdr.length, (int)rd);
+      if (unlikely(hdr.offset+hdr.length>size))
+        log_info("got record past the current end of file, this should only happen if file was truncated down, skipping record");
+      else if (unlikely(psync_fs_crypto_data_writer_add(dw, lr->buff+lr->start, hdr.length, hdr.offset)))
         return -1;
-      }
+      lr->start+=hdr.length;
     }
     else if (hdr.type==PSYNC_CRYPTO_LOG_INT) {
       assert(ifd!=INVALID_HANDLE_VALUE);
       records[recid].offset=hdr.offset;
       records[recid].length=hdr.longlengthlo+((uint64_t)hdr.longlengthhi<<32);
-      if (++recid>=PSYNC_CRYPTO_SECTOR_SIZE/sizeof(psync_fs_index_record)) {
+      if (++recid>=ARRAY_SIZE(records)) {
         rd=psync_file_pwrite(ifd, records, sizeof(psync_fs_index_record)*recid, sizeof(psync_fs_index_record)*ioff+sizeof(psync_fs_index_header));
         if (rd!=sizeof(psync_fs_index_record)*recid) {
           log_error("error writing to index file, expected to write %u got %d", (unsigned)(sizeof(psync_fs_index_record)*recid), (int)rd);
@@ -774,6 +946,57 @@ static int psync_fs_crypto_process_log(psync_file_t lfd, psync_file_t dfd, psync
       return -1;
     }
   }
+  return psync_fs_crypto_data_writer_flush(dw);
+}
+
+static int psync_fs_crypto_process_log(psync_file_t lfd, psync_file_t dfd, psync_file_t ifd, int checkhash) {
+  psync_crypto_master_record mr;
+  psync_crypto_log_reader lr;
+  psync_crypto_data_writer dw;
+  uint64_t size;
+  ssize_t rd;
+  int ret;
+  rd=psync_file_pread(lfd, &mr, sizeof(psync_crypto_master_record), 0);
+  if (unlikely(rd!=sizeof(psync_crypto_master_record))) {
+    log_warn("error reading from log file, expected to read %u got %d", (unsigned)sizeof(psync_crypto_master_record), (int)rd);
+    return -1;
+  }
+  if (unlikely(mr.status!=PSYNC_LOG_STATUS_FINALIZED)) {
+    log_warn("got log file that is not finalized, skipping");
+    return -1;
+  }
+  if (unlikely(mr.logsize!=psync_file_size(lfd))) {
+    log_warn("got log file that does not match in size, expected %u, got %d", (unsigned)mr.logsize, (int)psync_file_size(lfd));
+    return -1;
+  }
+  if (unlikely(mr.crc!=psync_crc32c(PSYNC_CRC_INITIAL, &mr, offsetof(psync_crypto_master_record, crc)))) {
+    log_warn("got log file with bad master record CRC, expected %u got %u", (unsigned)mr.crc,
+          (unsigned)psync_crc32c(PSYNC_CRC_INITIAL, &mr, offsetof(psync_crypto_master_record, crc)));
+    return -1;
+  }
+  if (unlikely(checkhash && psync_fs_crypto_check_log_hash(lfd, &mr))) {
+    log_warn("log checksum failed, skipping replay");
+    return -1;
+  }
+  size=mr.filesize;
+  if (unlikely_log(psync_file_seek(dfd, size, P_SEEK_SET)!=size || psync_file_truncate(dfd)))
+    return -1;
+  if (ifd!=INVALID_HANDLE_VALUE && unlikely_log(psync_file_seek(ifd, sizeof(psync_fs_index_header), P_SEEK_SET)!=sizeof(psync_fs_index_header) || psync_file_truncate(ifd)))
+    return -1;
+  lr.fd=lfd;
+  lr.buff=psync_new_cnt(char, PSYNC_CRYPTO_REPLAY_BUFFER);
+  lr.off=PSYNC_CRYPTO_SECTOR_SIZE;
+  lr.start=0;
+  lr.end=0;
+  dw.fd=dfd;
+  dw.buff=psync_new_cnt(char, PSYNC_CRYPTO_REPLAY_BUFFER);
+  dw.off=0;
+  dw.len=0;
+  ret=psync_fs_crypto_do_process_log(ifd, size, &lr, &dw);
+  psync_free(dw.buff);
+  psync_free(lr.buff);
+  if (ret)
+    return ret;
   if (unlikely_log(psync_file_seek(dfd, size, P_SEEK_SET)!=size || psync_file_truncate(dfd)))
     return -1;
   return 0;
@@ -1056,10 +1279,100 @@ static int psync_fs_crypto_write_newfile_partial_sector(psync_openfile_t *of, co
   return psync_fs_crypto_write_newfile_full_sector(of, buff, sectorid, rd);
 }
 
+typedef struct {
+  psync_crypto_aes256_sector_encoder_decoder_t encoder;
+  psync_crypto_log_data_record *recs;
+  psync_crypto_sector_auth_t *auths;
+  psync_crypto_sectorid_t firstsectorid;
+  uint32_t cnt;
+  uint32_t lastsize;
+} psync_fs_zero_encoder_t;
+
+typedef struct {
+  psync_fs_zero_encoder_t *ze;
+  uint32_t from;
+  uint32_t to;
+} psync_fs_zero_encoder_range_t;
+
+static const unsigned char psync_fs_zero_sector[PSYNC_CRYPTO_SECTOR_SIZE]={0};
+
+static void psync_fs_encode_zero_sectors(void *ptr) {
+  psync_fs_zero_encoder_range_t *zr;
+  psync_fs_zero_encoder_t *ze;
+  psync_crypto_log_data_record *rec;
+  uint32_t i, size;
+  zr=(psync_fs_zero_encoder_range_t *)ptr;
+  ze=zr->ze;
+  for (i=zr->from; i<zr->to; i++) {
+    size=i==ze->cnt-1?ze->lastsize:PSYNC_CRYPTO_SECTOR_SIZE;
+    rec=&ze->recs[i];
+    psync_crypto_aes256_encode_sector(ze->encoder, psync_fs_zero_sector, size, rec->data, ze->auths[i], ze->firstsectorid+i);
+    memset(&rec->header, 0, sizeof(psync_crypto_log_header));
+    rec->header.type=PSYNC_CRYPTO_LOG_DATA;
+    rec->header.length=size;
+    rec->header.offset=psync_fs_crypto_data_offset_by_sectorid(ze->firstsectorid+i);
+  }
+}
+
+/* Appends cnt consecutive zero sectors starting at sectorid to the log, the last one being lastsize bytes long. Sectors
+ * are encoded in parallel by up to PSYNC_CRYPTO_WORKERS threads of the crypto pool and all records are written to the log
+ * with a single write. Records are laid out in the log exactly as psync_fs_crypto_write_newfile_full_sector would write
+ * them one by one, only the last one may be shorter than a full record.
+ */
+static int psync_fs_crypto_write_newfile_zero_sectors(psync_openfile_t *of, psync_crypto_sectorid_t sectorid, uint32_t cnt, uint32_t lastsize) {
+  psync_fs_zero_encoder_range_t ranges[PSYNC_CRYPTO_WORKERS];
+  psync_fs_zero_encoder_t ze;
+  psync_fs_crypto_jobs_t jobs;
+  ssize_t wrt;
+  uint32_t i, len, parts;
+  assert(cnt && lastsize && lastsize<=PSYNC_CRYPTO_SECTOR_SIZE);
+  ze.encoder=of->encoder;
+  ze.recs=psync_new_cnt(psync_crypto_log_data_record, cnt);
+  ze.auths=psync_new_cnt(psync_crypto_sector_auth_t, cnt);
+  ze.firstsectorid=sectorid;
+  ze.cnt=cnt;
+  ze.lastsize=lastsize;
+  parts=cnt/PSYNC_CRYPTO_MIN_SECTORS_PER_WORKER;
+  if (parts>PSYNC_CRYPTO_WORKERS)
+    parts=PSYNC_CRYPTO_WORKERS;
+  else if (!parts)
+    parts=1;
+  for (i=0; i<parts; i++) {
+    ranges[i].ze=&ze;
+    ranges[i].from=(uint64_t)cnt*i/parts;
+    ranges[i].to=(uint64_t)cnt*(i+1)/parts;
+  }
+  psync_fs_crypto_jobs_init(&jobs);
+  for (i=1; i<parts; i++)
+    psync_fs_crypto_jobs_add(&jobs, psync_fs_encode_zero_sectors, &ranges[i]);
+  psync_fs_encode_zero_sectors(&ranges[0]);
+  psync_fs_crypto_jobs_destroy(&jobs);
+  len=sizeof(psync_crypto_log_data_record)*(cnt-1)+offsetof(psync_crypto_log_data_record, data)+lastsize;
+  wrt=psync_file_pwrite(of->logfile, ze.recs, len, of->logoffset);
+  if (unlikely(wrt!=len)) {
+    log_error("write to log of %u bytes returned %d", (unsigned)len, (int)wrt);
+    psync_free(ze.auths);
+    psync_free(ze.recs);
+    psync_fs_crypto_reset_log_to_off(of, of->logoffset);
+    return -EIO;
+  }
+  psync_fast_hash256_update(&of->loghashctx, ze.recs, len);
+  for (i=0; i<cnt; i++) {
+    psync_fs_crypto_set_sector_log_offset(of, sectorid+i, of->logoffset, ze.auths[i]);
+    of->logoffset+=i==cnt-1?offsetof(psync_crypto_log_data_record, data)+lastsize:sizeof(psync_crypto_log_data_record);
+    if (!of->newfile)
+      psync_fs_crypt_add_sector_to_interval_tree(of, sectorid+i, i==cnt-1?lastsize:PSYNC_CRYPTO_SECTOR_SIZE);
+  }
+  psync_free(ze.auths);
+  psync_free(ze.recs);
+  return 0;
+}
+
 static int psync_fs_newfile_fillzero(psync_openfile_t *of, uint64_t size, uint64_t offset) {
   char buff[PSYNC_CRYPTO_SECTOR_SIZE];
   uint64_t wr;
   psync_crypto_sectorid_t sectorid;
+  uint32_t cnt;
   int ret;
   memset(buff, 0, sizeof(buff));
   sectorid=offset/PSYNC_CRYPTO_SECTOR_SIZE;
@@ -1077,18 +1390,22 @@ static int psync_fs_newfile_fillzero(psync_openfile_t *of, uint64_t size, uint64
     sectorid++;
   }
   while (size) {
-    if (size>PSYNC_CRYPTO_SECTOR_SIZE)
-      wr=PSYNC_CRYPTO_SECTOR_SIZE;
-    else
+    if (size>(uint64_t)PSYNC_CRYPTO_EXTENDER_BATCH*PSYNC_CRYPTO_SECTOR_SIZE) {
+      cnt=PSYNC_CRYPTO_EXTENDER_BATCH;
+      wr=(uint64_t)cnt*PSYNC_CRYPTO_SECTOR_SIZE;
+    }
+    else{
+      cnt=(size+PSYNC_CRYPTO_SECTOR_SIZE-1)/PSYNC_CRYPTO_SECTOR_SIZE;
       wr=size;
-    ret=psync_fs_crypto_write_newfile_full_sector(of, buff, sectorid, wr);
+    }
+    ret=psync_fs_crypto_write_newfile_zero_sectors(of, sectorid, cnt, wr-(uint64_t)(cnt-1)*PSYNC_CRYPTO_SECTOR_SIZE);
     if (ret<0)
       goto fail;
     size-=wr;
     offset+=wr;
     if (likely(of->currentsize<offset))
       of->currentsize=offset;
-    sectorid++;
+    sectorid+=cnt;
   }
   return 0;
 fail:
@@ -22,17 +22,27 @@
 
 static __thread int cryptoerr=0;
 
-static char *get_encname_for_folder(psync_fsfolderid_t folderid, const char *path, size_t len) {
-  char *name, *encname;
+static char *get_encname_for_name(psync_fsfolderid_t folderid, const char *name) {
+  char *encname;
   psync_crypto_aes256_text_encoder_t enc;
+  encname=psync_cloud_crypto_names_get_encrypted(folderid, name);
+  if (encname)
+    return encname;
   enc=psync_cloud_crypto_get_folder_encoder(folderid);
   if (psync_crypto_is_error(enc)) {
     cryptoerr=psync_crypto_to_error(enc);
     return NULL;
   }
-  name=psync_strndup(path, len);
   encname=psync_cloud_crypto_encode_filename(enc, name);
   psync_cloud_crypto_release_folder_encoder(folderid, enc);
+  psync_cloud_crypto_names_add(folderid, encname, name);
+  return encname;
+}
+
+static char *get_encname_for_folder(psync_fsfolderid_t folderid, const char *path, size_t len) {
+  char *name, *encname;
+  name=psync_strndup(path, len);
+  encname=get_encname_for_name(folderid, name);
   psync_free(name);
   return encname;
 }
@@ -40,16 +50,11 @@ static char *get_encname_for_folder(psync_fsfolderid_t folderid, const char *pat
 static psync_fspath_t *ret_folder_data(psync_fsfolderid_t folderid, const char *name, uint32_t permissions, uint32_t flags, uint32_t shareid) {
   psync_fspath_t *ret;
   if (flags&PSYNC_FOLDER_FLAG_ENCRYPTED && strncmp(psync_fake_prefix, name, psync_fake_prefix_len)) {
-    psync_crypto_aes256_text_encoder_t enc;
     char *encname;
     size_t len;
-    enc=psync_cloud_crypto_get_folder_encoder(folderid);
-    if (psync_crypto_is_error(enc)) {
-      cryptoerr=psync_crypto_to_error(enc);
+    encname=get_encname_for_name(folderid, name);
+    if (!encname)
       return NULL;
-    }
-    encname=psync_cloud_crypto_encode_filename(enc, name);
-    psync_cloud_crypto_release_folder_encoder(folderid, enc);
     len=strlen(encname);
     ret=(psync_fspath_t *)psync_malloc(sizeof(psync_fspath_t)+len+1);
     memcpy(ret+1, encname, len+1);
@@ -664,24 +664,43 @@ psync_fstask_creat_t *psync_fstask_add_modified_file(psync_fstask_folder_t *fold
   return task;
 }
 
-int psync_fstask_set_mtime(psync_fileid_t fileid, uint64_t oldtm, uint64_t newtm, int is_ctime) {
+typedef struct {
+  psync_fileid_t fileid;
+  uint64_t oldtm;
+  uint64_t newtm;
+  int is_ctime;
+} psync_fstask_mtime_t;
+
+static int psync_fstask_do_set_mtime(void *ptr) {
+  psync_fstask_mtime_t *mt;
   psync_sql_res *res;
-  psync_sql_start_transaction();
-  if (is_ctime)
+  mt=(psync_fstask_mtime_t *)ptr;
+  if (mt->is_ctime)
     res=psync_sql_prep_statement("UPDATE file SET ctime=? WHERE id=?");
   else
     res=psync_sql_prep_statement("UPDATE file SET mtime=? WHERE id=?");
-  psync_sql_bind_uint(res, 1, newtm);
-  psync_sql_bind_uint(res, 2, fileid);
+  psync_sql_bind_uint(res, 1, mt->newtm);
+  psync_sql_bind_uint(res, 2, mt->fileid);
   psync_sql_run_free(res);
+  // the file was deleted after the caller looked it up
+  if (!psync_sql_affected_rows())
+    return 0;
   // folderid is ignored for these tasks
   res=psync_sql_prep_statement("INSERT INTO fstask (type, status, folderid, fileid, int1, int2) VALUES (?, 0, 0, ?, ?, ?)");
-  psync_sql_bind_int(res, 1, is_ctime?PSYNC_FS_TASK_SET_FILE_CR:PSYNC_FS_TASK_SET_FILE_MOD);
-  psync_sql_bind_int(res, 2, fileid);
-  psync_sql_bind_int(res, 3, oldtm);
-  psync_sql_bind_int(res, 4, newtm);
-  psync_sql_run_free(res);
-  if (unlikely_log(psync_sql_commit_transaction()))
+  psync_sql_bind_int(res, 1, mt->is_ctime?PSYNC_FS_TASK_SET_FILE_CR:PSYNC_FS_TASK_SET_FILE_MOD);
+  psync_sql_bind_int(res, 2, mt->fileid);
+  psync_sql_bind_int(res, 3, mt->oldtm);
+  psync_sql_bind_int(res, 4, mt->newtm);
+  return psync_sql_run_free(res);
+}
+
+int psync_fstask_set_mtime(psync_fileid_t fileid, uint64_t oldtm, uint64_t newtm, int is_ctime) {
+  psync_fstask_mtime_t mt;
+  mt.fileid=fileid;
+  mt.oldtm=oldtm;
+  mt.newtm=newtm;
+  mt.is_ctime=is_ctime;
+  if (unlikely_log(psync_sql_group_commit_wait(psync_fstask_do_set_mtime, &mt)))
     return -EIO;
   psync_fsupload_wake();
   return 0;
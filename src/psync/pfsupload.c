@@ -30,6 +30,7 @@
 #include "pcache.h"
 #include "ppathstatus.h"
 #include "pdiff.h"
+#include "pshaper.h"
 #include "logger.h"
 
 typedef struct {
@@ -246,6 +247,7 @@ static int clean_uploads_for_task(psync_socket *api, psync_uploadid_t taskid) {
   fr=psync_sql_fetchall_int(sql);
   for (i=0; i<fr->rows; i++) {
     binparam params[] = {P_STR("auth", psync_my_auth), P_NUM("uploadid", psync_get_result_cell(fr, i, 0))};
+    psync_upload_forget_chunks(psync_get_result_cell(fr, i, 0));
     res=send_command(api, "upload_delete", params);
     if (!res) {
       ret=-1;
@@ -278,6 +280,8 @@ static int large_upload_check_checksum(psync_socket *api, uint64_t uploadid, con
     psync_process_api_error(result);
     return -1;
   }
+  // the upload is either complete or has to start over, either way its chunks are of no use anymore
+  psync_upload_forget_chunks(uploadid);
   if (memcmp(filehash, psync_find_result(res, PSYNC_CHECKSUM, PARAM_STR)->str, PSYNC_HASH_DIGEST_HEXLEN)) {
     log_warn("upload_info returned different checksum");
     psync_free(res);
@@ -421,6 +425,7 @@ static int save_meta(const binresult *meta, psync_folderid_t folderid, const cha
     return -1;
   }
   psync_sql_commit_transaction();
+  psync_status_fstask_removed(taskid);
   log_info("file %lu/%s uploaded (mtime=%lu, size=%lu)", (unsigned long)folderid, name,
     (unsigned long)psync_find_result(meta, "modified", PARAM_NUM)->num,
     (unsigned long)psync_find_result(meta, "size", PARAM_NUM)->num);
@@ -495,6 +500,7 @@ static void perm_fail_upload_task(uint64_t taskid) {
   psync_sql_bind_uint(sql, 1, taskid);
   psync_sql_run_free(sql);
   psync_fs_task_deleted(taskid);
+  psync_status_fstask_removed(taskid);
   psync_sql_commit_transaction();
   psync_status_recalc_to_upload_async();
 }
@@ -571,6 +577,11 @@ static int copy_file_if_exists(psync_socket *api, const char *filename, const un
   return ret;
 }
 
+static void large_upload_chunks_progress(void *ptr, uint64_t bytes) {
+  *(uint64_t *)ptr+=bytes;
+  psync_upload_add_bytes_uploaded(bytes);
+}
+
 static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const char *name, const char *filename,
                               psync_uploadid_t uploadid, uint64_t writeid, const char *key) {
   psync_sql_res *sql;
@@ -581,11 +592,15 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
   size_t rd;
   ssize_t rrd;
   psync_file_t fd;
-  int ret;
+  int ret, chunked, zerocopy;
   unsigned char uploadhash[PSYNC_HASH_DIGEST_HEXLEN], filehash[PSYNC_HASH_DIGEST_HEXLEN], fileparthash[PSYNC_HASH_DIGEST_HEXLEN];
   log_info("uploading %s as %lu/%s (uploadid=%lu)", filename, (unsigned long)folderid, name, (unsigned long)uploadid);
   asize=0;
-  if (uploadid) {
+  usize=0;
+  chunked=uploadid && psync_upload_has_chunks(uploadid, filename);
+  if (chunked)
+    log_info("resuming chunked upload %lu", (unsigned long)uploadid);
+  else if (uploadid) {
     ret=psync_get_upload_checksum(uploadid, uploadhash, &usize);
     if (ret!=PSYNC_NET_OK) {
       if (ret==PSYNC_NET_TEMPFAIL)
@@ -594,7 +609,7 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
         uploadid=0;
     }
   }
-  if (uploadid)
+  if (uploadid && !chunked)
     ret=psync_get_local_file_checksum_part(filename, filehash, &fsize, fileparthash, usize);
   else
     ret=psync_get_local_file_checksum(filename, filehash, &fsize);
@@ -603,7 +618,7 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
     log_warn("could not open local file %s, skipping task", filename);
     return 0;
   }
-  if (uploadid && memcmp(fileparthash, uploadhash, PSYNC_HASH_DIGEST_HEXLEN))
+  if (uploadid && !chunked && memcmp(fileparthash, uploadhash, PSYNC_HASH_DIGEST_HEXLEN))
     uploadid=0;
   api=psync_apipool_get();
   if (unlikely(!api))
@@ -645,6 +660,32 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
     psync_sql_bind_uint(sql, 2, uploadid);
     psync_sql_run_free(sql);
   }
+  if (fsize-usize>=PSYNC_UPLOAD_CHUNK_MIN_SIZE) {
+    psync_apipool_release(api);
+    if (usize) {
+      log_info("resuming from offset %lu", (unsigned long)usize);
+      asize=usize;
+      psync_upload_add_bytes_uploaded(asize);
+    }
+    ret=psync_upload_chunks(uploadid, filename, usize, fsize-usize, requiredstatuses, ARRAY_SIZE(requiredstatuses), &stop_current_upload,
+                            large_upload_chunks_progress, &asize);
+    if (ret==PSYNC_NET_PERMFAIL) {
+      psync_upload_forget_chunks(uploadid);
+      api=psync_apipool_get();
+      if (api) {
+        if (clean_uploads_for_task(api, taskid))
+          psync_apipool_release_bad(api);
+        else
+          psync_apipool_release(api);
+      }
+    }
+    if (ret!=PSYNC_NET_OK)
+      goto errs;
+    api=psync_apipool_get();
+    if (unlikely(!api))
+      goto errs;
+    goto written;
+  }
   fd=psync_file_open(filename, P_O_RDONLY, 0);
   if (unlikely_log(fd==INVALID_HANDLE_VALUE))
     goto ret0;
@@ -655,6 +696,7 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
   }
   if (large_upload_creat_send_write(api, uploadid, usize, fsize-usize))
     goto err1;
+  zerocopy=psync_socket_can_sendfile_upload(api);
   buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
   if (usize) {
     asize=usize;
@@ -670,12 +712,20 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
       rd=PSYNC_COPY_BUFFER_SIZE;
     else
       rd=fsize-usize;
-    rrd=psync_file_read(fd, buff, rd);
-    if (unlikely_log(rrd<=0))
-      goto err2;
-    usize+=rrd;
-    if (unlikely_log(psync_socket_writeall_upload(api, buff, rrd)!=rrd))
-      goto err2;
+    if (zerocopy) {
+      rrd=psync_socket_sendfile_upload(api, fd, usize, rd);
+      if (unlikely_log(rrd!=rd))
+        goto err2;
+      usize+=rrd;
+    }
+    else {
+      rrd=psync_file_read(fd, buff, rd);
+      if (unlikely_log(rrd<=0))
+        goto err2;
+      usize+=rrd;
+      if (unlikely_log(psync_socket_writeall_upload(api, buff, rrd)!=rrd))
+        goto err2;
+    }
     asize+=rrd;
     psync_upload_add_bytes_uploaded(rrd);
   }
@@ -696,6 +746,7 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
     psync_process_api_error(result);
     goto errs;
   }
+written:
   if (unlikely(stop_current_upload)) {
     log_info("got stop for file %s", name);
     psync_apipool_release(api);
@@ -985,6 +1036,7 @@ static void large_upload() {
   int ret;
   char fileidhex[sizeof(psync_fsfileid_t)*2+2];
   log_info("started");
+  psync_shaper_set_class(PSYNC_SHAPER_CLASS_FS);
   while (1) {
     psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
     res=psync_sql_query("SELECT id, type, folderid, text1, text2, int1, fileid, int2 FROM fstask WHERE status=2 AND "
@@ -1604,6 +1656,7 @@ static void pr_del_task(uint64_t taskid) {
   res=psync_sql_prep_statement("DELETE FROM fstask WHERE id=?");
   psync_sql_bind_uint(res, 1, taskid);
   psync_sql_run_free(res);
+  psync_status_fstask_removed(taskid);
 }
 
 /*static void pr_set_task_status3(uint64_t taskid) {
@@ -1862,6 +1915,7 @@ static void psync_fsupload_check_tasks() {
 
 static void psync_fsupload_thread() {
   int waited;
+  psync_shaper_set_class(PSYNC_SHAPER_CLASS_FS);
   clean_stuck_tasks();
   waited=0;
   while (psync_do_run) {
@@ -56,6 +56,30 @@ void psync_fs_file_deleted(psync_fileid_t fileid) {
   delete_object_id(fileid_to_objid(fileid));
 }
 
+void psync_fs_files_deleted(const psync_fileid_t *fileids, uint32_t cnt) {
+  static const char head[]="DELETE FROM fsxattr WHERE objectid IN (";
+  psync_sql_res *res;
+  char *sql, *p;
+  uint32_t i;
+  if (cnt==1) {
+    psync_fs_file_deleted(fileids[0]);
+    return;
+  }
+  sql=psync_new_cnt(char, sizeof(head)+cnt*2);
+  memcpy(sql, head, sizeof(head)-1);
+  p=sql+sizeof(head)-1;
+  for (i=0; i<cnt; i++) {
+    *p++='?';
+    *p++=i+1<cnt?',':')';
+  }
+  *p=0;
+  res=psync_sql_prep_statement_nocache(sql);
+  for (i=0; i<cnt; i++)
+    psync_sql_bind_uint(res, i+1, fileid_to_objid(fileids[i]));
+  psync_sql_run_free_nocache(res);
+  psync_free(sql);
+}
+
 void psync_fs_folder_deleted(psync_folderid_t folderid) {
   delete_object_id(folderid_to_objid(folderid));
 }
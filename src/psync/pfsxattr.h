@@ -26,6 +26,7 @@ int psync_fs_listxattr(const char *path, char *list, size_t size);
 int psync_fs_removexattr(const char *path, const char *name);
 
 void psync_fs_file_deleted(psync_fileid_t fileid);
+void psync_fs_files_deleted(const psync_fileid_t *fileids, uint32_t cnt);
 void psync_fs_folder_deleted(psync_folderid_t folderid);
 void psync_fs_task_deleted(uint64_t taskid);
 
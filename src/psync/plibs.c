@@ -13,6 +13,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <sys/file.h>
 
 #include "psettings.h"
 #include "plibs.h"
@@ -111,6 +112,23 @@ static int in_transaction=0;
 static int transaction_failed=0;
 static psync_list tran_callbacks;
 
+static void psync_sql_group_flush();
+
+typedef struct psync_sql_reader_ {
+  sqlite3 *db;
+  psync_sql_res *stmts[PSYNC_SQL_MAX_STMT_IDS];
+} psync_sql_reader;
+
+static psync_sql_res *psync_sql_stmts[PSYNC_SQL_MAX_STMT_IDS];
+static uint32_t psync_sql_next_stmt_id=0;
+
+static uint32_t psync_sql_read_connections=PSYNC_DB_READ_CONNECTIONS;
+static psync_sql_reader *psync_sql_readers=NULL;
+static uint32_t psync_sql_reader_cnt=0;
+static uint32_t psync_sql_reader_next=0;
+static __thread uint32_t psync_sql_reader_slot=0;
+static psync_file_t psync_db_instance_lock=INVALID_HANDLE_VALUE;
+
 
 char *psync_strdup(const char *str) {
   size_t len;
@@ -378,6 +396,98 @@ static int psync_sql_wal_hook(void *ptr, sqlite3 *db, const char *name, int nump
   return SQLITE_OK;
 }
 
+static int psync_sql_db_is_file(const char *db) {
+  return db[0] && strcmp(db, ":memory:") && strncmp(db, "file:", 5);
+}
+
+/* With read connections the primary can no longer keep the database locked exclusively, so a flock() on the database file
+ * takes over detecting another instance using the same database. The file is created here if needed, so the lock is held before
+ * sqlite ever touches it, also on a fresh install. Returns -1 if another instance holds the lock or the file can not be opened.
+ */
+static int psync_sql_lock_instance(const char *db) {
+  psync_file_t fd;
+  fd=psync_file_open(db, P_O_RDWR, P_O_CREAT);
+  if (fd==INVALID_HANDLE_VALUE) {
+    log_error("could not open database file %s", db);
+    return -1;
+  }
+  if (flock(fd, LOCK_EX|LOCK_NB)) {
+    psync_file_close(fd);
+    log_error("database %s is used by another instance", db);
+    return -1;
+  }
+  psync_db_instance_lock=fd;
+  return 0;
+}
+
+static void psync_sql_unlock_instance() {
+  if (psync_db_instance_lock!=INVALID_HANDLE_VALUE) {
+    psync_file_close(psync_db_instance_lock);
+    psync_db_instance_lock=INVALID_HANDLE_VALUE;
+  }
+}
+
+static void psync_sql_free_cache(void *ptr);
+
+static void psync_sql_free_stmt_slots(psync_sql_res **slots) {
+  uint32_t i;
+  for (i=1; i<PSYNC_SQL_MAX_STMT_IDS; i++)
+    if (slots[i]) {
+      psync_sql_free_cache(slots[i]);
+      slots[i]=NULL;
+    }
+}
+
+static void psync_sql_close_readers() {
+  psync_sql_reader *reader;
+  uint32_t i;
+  for (i=0; i<psync_sql_reader_cnt; i++) {
+    reader=&psync_sql_readers[i];
+    psync_sql_free_stmt_slots(reader->stmts);
+    if (sqlite3_close(reader->db)!=SQLITE_OK)
+      log_error("error when closing read connection %u", (unsigned)i);
+  }
+  psync_free(psync_sql_readers);
+  psync_sql_readers=NULL;
+  psync_sql_reader_cnt=0;
+}
+
+/* Opens psync_sql_read_connections read-only connections to the database. Queries that take the read lock run on one of them
+ * instead of the primary connection, so that readers do not serialize on the mutex of the single primary handle. Readers still
+ * hold psync_db_lock for reading, so they never overlap with a write transaction and see exactly what the primary would.
+ */
+static void psync_sql_open_readers(const char *db) {
+  psync_sql_reader *reader;
+  uint32_t i;
+  if (!psync_sql_read_connections || psync_db_instance_lock==INVALID_HANDLE_VALUE)
+    return;
+  psync_sql_readers=psync_new_cnt(psync_sql_reader, psync_sql_read_connections);
+  memset(psync_sql_readers, 0, sizeof(psync_sql_reader)*psync_sql_read_connections);
+  for (i=0; i<psync_sql_read_connections; i++) {
+    reader=&psync_sql_readers[i];
+    if (sqlite3_open_v2(db, &reader->db, SQLITE_OPEN_READONLY|SQLITE_OPEN_FULLMUTEX, NULL)!=SQLITE_OK ||
+        sqlite3_exec(reader->db, PSYNC_DATABASE_READER_CONFIG, NULL, NULL, NULL)!=SQLITE_OK) {
+      log_warn("could not open read connection to %s: %s", db, sqlite3_errmsg(reader->db));
+      sqlite3_close(reader->db);
+      break;
+    }
+    psync_sql_reader_cnt++;
+  }
+  if (!psync_sql_reader_cnt) {
+    psync_free(psync_sql_readers);
+    psync_sql_readers=NULL;
+  }
+  else
+    log_info("opened %u read connections to the database", (unsigned)psync_sql_reader_cnt);
+}
+
+/* Without read connections, the default, the primary keeps the database locked exclusively, which is the fastest for a
+ * single connection and also keeps other instances out. Takes effect on the next psync_sql_connect.
+ */
+void psync_sql_set_read_connections(uint32_t cnt) {
+  psync_sql_read_connections=cnt;
+}
+
 int psync_sql_connect(const char *db) {
   static int initmutex=1;
   pthread_mutexattr_t mattr;
@@ -399,8 +509,12 @@ int psync_sql_connect(const char *db) {
     log_fatal("sqlite is compiled without thread support");
     return -1;
   }
-  if (psync_stat(db, &st)!=0)
+  if (psync_stat(db, &st)!=0 || !psync_stat_size(&st))
     initdbneeded=1;
+  if (psync_sql_read_connections && psync_sql_db_is_file(db) && psync_sql_lock_instance(db)) {
+    log_error("database is locked");
+    return -1;
+  }
 
   code=sqlite3_open(db, &psync_db);
   if (likely(code==SQLITE_OK)) {
@@ -416,11 +530,18 @@ int psync_sql_connect(const char *db) {
       sqlite3_config(SQLITE_CONFIG_LOG, psync_sql_err_callback, NULL);
     sqlite3_wal_hook(psync_db, psync_sql_wal_hook, NULL);
     psync_sql_statement(PSYNC_DATABASE_CONFIG);
-    if (initdbneeded==1)
-      return psync_sql_statement(PSYNC_DATABASE_STRUCTURE);
+    if (psync_db_instance_lock==INVALID_HANDLE_VALUE)
+      psync_sql_statement(PSYNC_DATABASE_EXCLUSIVE);
+    if (initdbneeded==1) {
+      code=psync_sql_statement(PSYNC_DATABASE_STRUCTURE);
+      if (!code)
+        psync_sql_open_readers(db);
+      return code;
+    }
     else if (psync_sql_statement("DELETE FROM setting WHERE id='justcheckingiflocked'")) {
       log_error("database is locked");
       sqlite3_close(psync_db);
+      psync_sql_unlock_instance();
       psync_rwlock_destroy(&psync_db_lock);
       return -1;
     }
@@ -445,16 +566,21 @@ int psync_sql_connect(const char *db) {
         }
     }
 
+    psync_sql_open_readers(db);
     return 0;
   }
   else{
     log_fatal("could not open sqlite database %s: %d", db, code);
+    psync_sql_unlock_instance();
     return -1;
   }
 }
 
 int psync_sql_close() {
   int code, tries;
+  psync_sql_group_flush();
+  psync_sql_close_readers();
+  psync_sql_free_stmt_slots(psync_sql_stmts);
   tries=0;
   while (1) {
     code=sqlite3_close(psync_db);
@@ -478,9 +604,11 @@ int psync_sql_close() {
     code=sqlite3_close_v2(psync_db);
     if (unlikely(code!=SQLITE_OK)) {
       log_fatal("error when closing database even with sqlite3_close_v2: %d", code);
+      psync_sql_unlock_instance();
       return -1;
     }
   }
+  psync_sql_unlock_instance();
   return 0;
 }
 
@@ -620,24 +748,221 @@ void psync_sql_dump_locks() {
 
 #endif
 
-#if IS_DEBUG
+/* Lock profiler: when enabled, one in PSYNC_SQL_LOCKPROF_SAMPLE outermost read and as many write acquisitions of
+ * psync_db_lock per thread are timed and their wait and hold times are added to the counters of the call site that took
+ * the lock. Call sites are found by the address of their __FILE__ string and line in a fixed open addressing table,
+ * lookups do not lock and only inserting a new site takes a mutex. Acquisitions that are not sampled only update thread
+ * local counters.
+ *
+ * While disabled every hook returns on a read of lockprof_enabled, without touching the clock or thread local storage.
+ * The per thread state is therefore not kept up to date while disabled and carries the generation it was last used in,
+ * enabling the profiler starts a new generation and the state of every thread is reset on its first use after that.
+ * The state uses the initial-exec TLS model where there is one, so that reaching it from the shared library is a load
+ * off the thread pointer and not a call to __tls_get_addr() in every hook.
+ */
+typedef struct {
+  const char *file;
+  unsigned line;
+  uint64_t cnt[2];
+  uint64_t wait[2];
+  uint64_t hold[2];
+  uint64_t maxhold[2];
+} psync_sql_lock_site;
+
+typedef struct {
+  psync_sql_lock_site *site;
+  uint64_t start;
+  uint32_t depth;
+  uint32_t tick;
+} psync_sql_lock_state;
+
+typedef struct {
+  psync_sql_lock_state state[2];
+  uint32_t gen;
+} psync_sql_lock_thread;
+
+#define LOCKPROF_RD 0
+#define LOCKPROF_WR 1
+
+#if defined(__ELF__)
+#define LOCKPROF_THREAD __thread __attribute__((tls_model("initial-exec")))
+#else
+#define LOCKPROF_THREAD __thread
+#endif
+
+static psync_sql_lock_site lockprof_sites[PSYNC_SQL_LOCKPROF_SITES];
+static pthread_mutex_t lockprof_mutex=PTHREAD_MUTEX_INITIALIZER;
+static int lockprof_enabled=0;
+static uint32_t lockprof_gen=0;
+static LOCKPROF_THREAD psync_sql_lock_thread lockprof_thread;
+
+static uint64_t lockprof_now() {
+  struct timespec ts;
+  psync_nanotime(&ts);
+  return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+static psync_sql_lock_site *lockprof_get_site(const char *file, unsigned line) {
+  psync_sql_lock_site *site;
+  uint32_t h, i;
+  h=((uint32_t)((uintptr_t)file>>3)*31+line)%PSYNC_SQL_LOCKPROF_SITES;
+  for (i=0; i<PSYNC_SQL_LOCKPROF_SITES; i++) {
+    site=&lockprof_sites[(h+i)%PSYNC_SQL_LOCKPROF_SITES];
+    if (!site->file) {
+      pthread_mutex_lock(&lockprof_mutex);
+      if (!site->file) {
+        site->line=line;
+        __sync_synchronize();
+        site->file=file;
+        pthread_mutex_unlock(&lockprof_mutex);
+        return site;
+      }
+      pthread_mutex_unlock(&lockprof_mutex);
+    }
+    __sync_synchronize();
+    if (site->file==file && site->line==line)
+      return site;
+  }
+  return NULL;
+}
+
+// the read and write lock state of this thread
+static psync_sql_lock_state *lockprof_get_state() {
+  psync_sql_lock_thread *th;
+  th=&lockprof_thread;
+  if (unlikely(th->gen!=lockprof_gen)) {
+    memset(th->state, 0, sizeof(th->state));
+    th->gen=lockprof_gen;
+  }
+  return th->state;
+}
+
+static uint64_t lockprof_start(int type) {
+  psync_sql_lock_state *st;
+  if (likely(!lockprof_enabled))
+    return 0;
+  st=&lockprof_get_state()[type];
+  if (st->depth || ++st->tick%PSYNC_SQL_LOCKPROF_SAMPLE)
+    return 0;
+  return lockprof_now();
+}
+
+static void lockprof_acquired(int type, uint64_t start, const char *file, unsigned line) {
+  psync_sql_lock_state *st;
+  uint64_t now;
+  if (likely(!lockprof_enabled))
+    return;
+  st=&lockprof_get_state()[type];
+  if (st->depth++ || !start)
+    return;
+  st->site=lockprof_get_site(file, line);
+  if (unlikely(!st->site))
+    return;
+  now=lockprof_now();
+  __sync_add_and_fetch(&st->site->cnt[type], 1);
+  __sync_add_and_fetch(&st->site->wait[type], now-start);
+  st->start=now;
+}
+
+static void lockprof_released(int type) {
+  psync_sql_lock_state *st;
+  uint64_t hold, max;
+  if (likely(!lockprof_enabled))
+    return;
+  st=&lockprof_get_state()[type];
+  if (unlikely(!st->depth) || --st->depth || !st->site)
+    return;
+  hold=lockprof_now()-st->start;
+  __sync_add_and_fetch(&st->site->hold[type], hold);
+  max=st->site->maxhold[type];
+  while (hold>max && !__sync_bool_compare_and_swap(&st->site->maxhold[type], max, hold))
+    max=st->site->maxhold[type];
+  st->site=NULL;
+}
+
+void psync_sql_lockprof_enable(int enable) {
+  uint32_t i;
+  if (enable && !lockprof_enabled) {
+    pthread_mutex_lock(&lockprof_mutex);
+    for (i=0; i<PSYNC_SQL_LOCKPROF_SITES; i++) {
+      memset(lockprof_sites[i].cnt, 0, sizeof(lockprof_sites[i].cnt));
+      memset(lockprof_sites[i].wait, 0, sizeof(lockprof_sites[i].wait));
+      memset(lockprof_sites[i].hold, 0, sizeof(lockprof_sites[i].hold));
+      memset(lockprof_sites[i].maxhold, 0, sizeof(lockprof_sites[i].maxhold));
+    }
+    lockprof_gen++;
+    pthread_mutex_unlock(&lockprof_mutex);
+  }
+  lockprof_enabled=enable;
+  log_info("lock profiling %s", enable?"enabled":"disabled");
+}
+
+static uint64_t lockprof_site_total(const psync_sql_lock_site *site) {
+  return site->wait[LOCKPROF_RD]+site->wait[LOCKPROF_WR]+site->hold[LOCKPROF_WR];
+}
+
+static int lockprof_site_cmp(const void *a, const void *b) {
+  uint64_t ta, tb;
+  ta=lockprof_site_total(*(const psync_sql_lock_site **)a);
+  tb=lockprof_site_total(*(const psync_sql_lock_site **)b);
+  return ta<tb?1:ta>tb?-1:0;
+}
+
+/* Returns a report of the topn call sites ordered by the time they made others wait, that is the time they waited for the lock
+ * plus the time they held the write lock. Counts and totals are estimated from the sampled acquisitions, maximum hold times
+ * are the largest sampled ones. The result is to be freed with psync_free.
+ */
+char *psync_sql_lockprof_dump(uint32_t topn) {
+  psync_sql_lock_site **sites, *site;
+  char *ret;
+  size_t len, off;
+  uint32_t cnt, i;
+  sites=psync_new_cnt(psync_sql_lock_site *, PSYNC_SQL_LOCKPROF_SITES);
+  cnt=0;
+  for (i=0; i<PSYNC_SQL_LOCKPROF_SITES; i++)
+    if (lockprof_sites[i].file && (lockprof_sites[i].cnt[LOCKPROF_RD] || lockprof_sites[i].cnt[LOCKPROF_WR]))
+      sites[cnt++]=&lockprof_sites[i];
+  qsort(sites, cnt, sizeof(psync_sql_lock_site *), lockprof_site_cmp);
+  if (cnt>topn)
+    cnt=topn;
+  len=128+cnt*256;
+  ret=psync_new_cnt(char, len);
+  off=snprintf(ret, len, "lock profiling is %s, 1 in %u acquisitions sampled, times in ms\n",
+               lockprof_enabled?"on":"off", (unsigned)PSYNC_SQL_LOCKPROF_SAMPLE);
+  for (i=0; i<cnt && off<len; i++) {
+    site=sites[i];
+    off+=snprintf(ret+off, len-off, "%s:%u rd n=%lu wait=%lu hold=%lu max=%lu wr n=%lu wait=%lu hold=%lu max=%lu\n",
+                  site->file, site->line,
+                  (unsigned long)(site->cnt[LOCKPROF_RD]*PSYNC_SQL_LOCKPROF_SAMPLE),
+                  (unsigned long)(site->wait[LOCKPROF_RD]*PSYNC_SQL_LOCKPROF_SAMPLE/1000000),
+                  (unsigned long)(site->hold[LOCKPROF_RD]*PSYNC_SQL_LOCKPROF_SAMPLE/1000000),
+                  (unsigned long)(site->maxhold[LOCKPROF_RD]/1000000),
+                  (unsigned long)(site->cnt[LOCKPROF_WR]*PSYNC_SQL_LOCKPROF_SAMPLE),
+                  (unsigned long)(site->wait[LOCKPROF_WR]*PSYNC_SQL_LOCKPROF_SAMPLE/1000000),
+                  (unsigned long)(site->hold[LOCKPROF_WR]*PSYNC_SQL_LOCKPROF_SAMPLE/1000000),
+                  (unsigned long)(site->maxhold[LOCKPROF_WR]/1000000));
+  }
+  psync_free(sites);
+  return ret;
+}
+
 int psync_sql_do_trylock(const char *file, unsigned line) {
   if (psync_rwlock_trywrlock(&psync_db_lock))
     return -1;
+#if IS_DEBUG
   if (++sqllockcnt==1) {
     psync_nanotime(&sqllockstart);
     record_wrlock(file, line);
   }
+#endif
+  lockprof_acquired(LOCKPROF_WR, lockprof_start(LOCKPROF_WR), file, line);
   return 0;
 }
-#else
-int psync_sql_trylock() {
-  return psync_rwlock_trywrlock(&psync_db_lock);
-}
-#endif
 
-#if IS_DEBUG
 void psync_sql_do_lock(const char *file, unsigned line) {
+  uint64_t start;
+  start=lockprof_start(LOCKPROF_WR);
+#if IS_DEBUG
   if (psync_rwlock_trywrlock(&psync_db_lock)) {
     struct timespec start, end;
     unsigned long msec;
@@ -662,14 +987,14 @@ void psync_sql_do_lock(const char *file, unsigned line) {
     psync_nanotime(&sqllockstart);
     record_wrlock(file, line);
   }
-}
 #else
-void psync_sql_lock() {
   psync_rwlock_wrlock(&psync_db_lock);
-}
 #endif
+  lockprof_acquired(LOCKPROF_WR, start, file, line);
+}
 
 void psync_sql_unlock() {
+  lockprof_released(LOCKPROF_WR);
 #if IS_DEBUG
   assert(sqllockcnt>0);
   if (--sqllockcnt==0) {
@@ -694,8 +1019,10 @@ void psync_sql_unlock() {
 #endif
 }
 
-#if IS_DEBUG
 void psync_sql_do_rdlock(const char *file, unsigned line) {
+  uint64_t start;
+  start=lockprof_start(LOCKPROF_RD);
+#if IS_DEBUG
   if (psync_rwlock_tryrdlock(&psync_db_lock)) {
     struct timespec start, end;
     unsigned long msec;
@@ -719,14 +1046,23 @@ void psync_sql_do_rdlock(const char *file, unsigned line) {
     psync_nanotime(&sqlrdlockstart);
     record_rdlock(file, line, &sqlrdlockstart);
   }
-}
 #else
-void psync_sql_rdlock() {
   psync_rwlock_rdlock(&psync_db_lock);
-}
 #endif
+  lockprof_acquired(LOCKPROF_RD, start, file, line);
+}
 
 void psync_sql_rdunlock() {
+  psync_sql_lock_state *st;
+  // a read unlock of the write lock, only the profiler needs to tell them apart
+  if (unlikely(lockprof_enabled)) {
+    st=lockprof_get_state();
+    if (!st[LOCKPROF_RD].depth && st[LOCKPROF_WR].depth) {
+      psync_sql_unlock();
+      return;
+    }
+  }
+  lockprof_released(LOCKPROF_RD);
 #if IS_DEBUG
   if (unlikely(sqlrdlockcnt==0)) {
     psync_sql_unlock();
@@ -768,6 +1104,24 @@ int psync_sql_islocked() {
   return psync_rwlock_holding_lock(&psync_db_lock);
 }
 
+static void lockprof_upgraded() {
+  psync_sql_lock_state *rd, *wr;
+  if (likely(!lockprof_enabled))
+    return;
+  rd=&lockprof_get_state()[LOCKPROF_RD];
+  wr=&lockprof_get_state()[LOCKPROF_WR];
+  if (wr->depth)
+    return;
+  if (rd->site)
+    __sync_add_and_fetch(&rd->site->hold[LOCKPROF_RD], lockprof_now()-rd->start);
+  *wr=*rd;
+  if (wr->site)
+    __sync_add_and_fetch(&wr->site->cnt[LOCKPROF_WR], 1);
+  wr->start=lockprof_now();
+  rd->site=NULL;
+  rd->depth=0;
+}
+
 int psync_sql_tryupgradelock() {
 #if IS_DEBUG
   if (psync_rwlock_holding_wrlock(&psync_db_lock))
@@ -783,10 +1137,14 @@ int psync_sql_tryupgradelock() {
     sqllockstart=sqlrdlockstart;
     record_wrlock(lock->file, lock->line);
     psync_free(lock);
+    lockprof_upgraded();
     return 0;
   }
 #else
-  return psync_rwlock_towrlock(&psync_db_lock);
+  if (psync_rwlock_towrlock(&psync_db_lock))
+    return -1;
+  lockprof_upgraded();
+  return 0;
 #endif
 }
 
@@ -823,17 +1181,11 @@ int psync_sql_do_statement(const char *sql, const char *file, unsigned line) {
   return -1;
 }
 
-#if IS_DEBUG
 int psync_sql_do_start_transaction(const char *file, unsigned line) {
+  static uint32_t beginid=0;
   psync_sql_res *res;
   psync_sql_do_lock(file, line);
-  res=psync_sql_do_prep_statement("BEGIN", file, line);
-#else
-int psync_sql_start_transaction() {
-  psync_sql_res *res;
-  psync_sql_lock();
-  res=psync_sql_prep_statement("BEGIN");
-#endif
+  res=psync_sql_do_prep_statement("BEGIN", &beginid, file, line);
   assert(!in_transaction);
   if (unlikely(!res || psync_sql_run_free(res)))
     return -1;
@@ -893,6 +1245,200 @@ void psync_sql_transation_add_callbacks(psync_transaction_callback_t commit_call
   psync_list_add_tail(&tran_callbacks, &cb->list);
 }
 
+/* Group commit: small write transactions are queued as closures and a committer thread applies everything that was queued
+ * while the previous batch was committing in a single transaction. Each closure runs in its own savepoint, a closure that
+ * returns non-zero or in which a statement fails is rolled back alone together with the transaction callbacks it added.
+ */
+typedef struct {
+  psync_list list;
+  psync_sql_group_fn_t run;
+  psync_sql_group_done_fn_t done;
+  void *ptr;
+  int result;
+} psync_sql_group_t;
+
+static pthread_mutex_t group_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t group_cond=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t group_done_cond=PTHREAD_COND_INITIALIZER;
+static psync_list group_queue=PSYNC_LIST_STATIC_INIT(group_queue);
+static int group_thread_started=0;
+static int group_busy=0;
+
+static int psync_sql_group_run_one(psync_sql_group_fn_t run, void *ptr) {
+  tran_callback_t *cb;
+  psync_list *mark;
+  int ret, failed;
+  mark=tran_callbacks.prev;
+  if (unlikely_log(psync_sql_statement("SAVEPOINT psyncgroup")))
+    return -1;
+  failed=transaction_failed;
+  transaction_failed=0;
+  ret=run(ptr);
+  if (ret || transaction_failed) {
+    psync_sql_statement("ROLLBACK TO psyncgroup");
+    while (mark->next!=&tran_callbacks) {
+      cb=psync_list_element(mark->next, tran_callback_t, list);
+      psync_list_del(&cb->list);
+      cb->rollback_callback(cb->ptr);
+      psync_free(cb);
+    }
+    if (!ret)
+      ret=-1;
+  }
+  psync_sql_statement("RELEASE psyncgroup");
+  transaction_failed=failed;
+  return ret;
+}
+
+/* Runs the closures taken off the queue in one transaction, called with the write lock held. */
+static int psync_sql_group_run_batch(psync_list *batch, uint32_t cnt) {
+  psync_sql_group_t *g;
+  int ret;
+  psync_sql_start_transaction();
+  psync_list_for_each_element(g, batch, psync_sql_group_t, list)
+    g->result=psync_sql_group_run_one(g->run, g->ptr);
+  ret=psync_sql_commit_transaction();
+  if (cnt>1)
+    log_debug("committed %u grouped transactions", (unsigned)cnt);
+  return ret;
+}
+
+static void psync_sql_group_finish_batch(psync_list *batch, int ret) {
+  psync_sql_group_t *g;
+  while (!psync_list_isempty(batch)) {
+    g=psync_list_remove_head_element(batch, psync_sql_group_t, list);
+    if (g->done)
+      g->done(g->ptr, ret?-1:g->result);
+    psync_free(g);
+  }
+}
+
+/* The batch is only taken off the queue once the committer holds the write lock, so group_busy implies holding it. Whoever
+ * else holds the write lock can be sure that the committer is not half way through a batch and may run the queue itself. */
+static void psync_sql_group_thread() {
+  psync_list batch;
+  psync_sql_group_t *g;
+  uint32_t cnt;
+  int ret;
+  while (1) {
+    psync_list_init(&batch);
+    cnt=0;
+    pthread_mutex_lock(&group_mutex);
+    while (psync_list_isempty(&group_queue))
+      pthread_cond_wait(&group_cond, &group_mutex);
+    pthread_mutex_unlock(&group_mutex);
+    psync_sql_lock();
+    pthread_mutex_lock(&group_mutex);
+    while (!psync_list_isempty(&group_queue) && cnt<PSYNC_SQL_GROUP_COMMIT_MAX) {
+      g=psync_list_remove_head_element(&group_queue, psync_sql_group_t, list);
+      psync_list_add_tail(&batch, &g->list);
+      cnt++;
+    }
+    group_busy=cnt>0;
+    pthread_mutex_unlock(&group_mutex);
+    // the queue may have been run by psync_sql_group_flush() while we waited for the lock
+    ret=cnt?psync_sql_group_run_batch(&batch, cnt):0;
+    psync_sql_unlock();
+    psync_sql_group_finish_batch(&batch, ret);
+    pthread_mutex_lock(&group_mutex);
+    group_busy=0;
+    pthread_cond_broadcast(&group_done_cond);
+    pthread_mutex_unlock(&group_mutex);
+  }
+}
+
+void psync_sql_group_commit(psync_sql_group_fn_t run, psync_sql_group_done_fn_t done, void *ptr) {
+  psync_sql_group_t *g;
+  g=psync_new(psync_sql_group_t);
+  g->run=run;
+  g->done=done;
+  g->ptr=ptr;
+  g->result=0;
+  pthread_mutex_lock(&group_mutex);
+  if (unlikely(!group_thread_started)) {
+    group_thread_started=1;
+    psync_run_thread("sql group commit", psync_sql_group_thread);
+  }
+  psync_list_add_tail(&group_queue, &g->list);
+  pthread_cond_signal(&group_cond);
+  pthread_mutex_unlock(&group_mutex);
+}
+
+typedef struct {
+  psync_sql_group_fn_t run;
+  void *ptr;
+  int result;
+  int finished;
+} psync_sql_group_sync_t;
+
+static int psync_sql_group_run_sync(void *ptr) {
+  psync_sql_group_sync_t *s=(psync_sql_group_sync_t *)ptr;
+  return s->run(s->ptr);
+}
+
+static void psync_sql_group_done_sync(void *ptr, int result) {
+  psync_sql_group_sync_t *s=(psync_sql_group_sync_t *)ptr;
+  pthread_mutex_lock(&group_mutex);
+  s->result=result;
+  s->finished=1;
+  pthread_cond_broadcast(&group_done_cond);
+  pthread_mutex_unlock(&group_mutex);
+}
+
+int psync_sql_group_commit_wait(psync_sql_group_fn_t run, void *ptr) {
+  psync_sql_group_sync_t s;
+  int ret;
+  // the committer could never get the lock we are holding, so run in our own (or the current) transaction
+  if (psync_rwlock_holding_wrlock(&psync_db_lock)) {
+    if (in_transaction)
+      return psync_sql_group_run_one(run, ptr);
+    psync_sql_start_transaction();
+    ret=psync_sql_group_run_one(run, ptr);
+    if (psync_sql_commit_transaction())
+      ret=-1;
+    return ret;
+  }
+  if (unlikely(psync_rwlock_holding_rdlock(&psync_db_lock))) {
+    log_error("group commit requested while holding the database read lock");
+    return -1;
+  }
+  s.run=run;
+  s.ptr=ptr;
+  s.result=-1;
+  s.finished=0;
+  psync_sql_group_commit(psync_sql_group_run_sync, psync_sql_group_done_sync, &s);
+  pthread_mutex_lock(&group_mutex);
+  while (!s.finished)
+    pthread_cond_wait(&group_done_cond, &group_mutex);
+  pthread_mutex_unlock(&group_mutex);
+  return s.result;
+}
+
+/* Waits until everything queued is committed. A caller holding the write lock would wait for the committer forever, so it
+ * runs the queue itself instead, the committer can not be in the middle of a batch while somebody else holds the lock. */
+static void psync_sql_group_flush() {
+  psync_list batch;
+  uint32_t cnt;
+  if (psync_rwlock_holding_wrlock(&psync_db_lock)) {
+    psync_list_init(&batch);
+    cnt=0;
+    pthread_mutex_lock(&group_mutex);
+    assert(!group_busy);
+    while (!psync_list_isempty(&group_queue)) {
+      psync_list_add_tail(&batch, psync_list_remove_head(&group_queue));
+      cnt++;
+    }
+    pthread_mutex_unlock(&group_mutex);
+    if (cnt)
+      psync_sql_group_finish_batch(&batch, psync_sql_group_run_batch(&batch, cnt));
+    return;
+  }
+  pthread_mutex_lock(&group_mutex);
+  while (!psync_list_isempty(&group_queue) || group_busy)
+    pthread_cond_wait(&group_done_cond, &group_mutex);
+  pthread_mutex_unlock(&group_mutex);
+}
+
 #if IS_DEBUG && 0
 
 typedef struct {
@@ -973,18 +1519,77 @@ static void psync_sql_check_query_plan(const char *sql) {
 
 #endif
 
+/* Returns the read connection of the calling thread, threads are assigned to connections round-robin on first use. Threads
+ * holding the write lock keep using the primary connection, as they have to see their own uncommitted changes.
+ */
+static psync_sql_reader *psync_sql_get_reader() {
+  if (!psync_sql_reader_cnt || psync_rwlock_holding_wrlock(&psync_db_lock))
+    return NULL;
+  if (unlikely(!psync_sql_reader_slot))
+    psync_sql_reader_slot=__sync_add_and_fetch(&psync_sql_reader_next, 1);
+  return &psync_sql_readers[(psync_sql_reader_slot-1)%psync_sql_reader_cnt];
+}
+
+static sqlite3 *psync_sql_get_rd_db() {
+  psync_sql_reader *reader;
+  reader=psync_sql_get_reader();
+  return reader?reader->db:psync_db;
+}
+
+/* Call sites of the cached query functions pass a pointer to their own static id, which is assigned from a global counter the
+ * first time the call site runs. Each connection keeps an array of idle prepared statements indexed by that id, so getting a
+ * cached statement is a single atomic exchange instead of hashing the SQL text under the cache mutex. Sites whose id does not
+ * fit in PSYNC_SQL_MAX_STMT_IDS fall back to the SQL keyed cache.
+ */
+static uint32_t psync_sql_stmt_id(uint32_t *pid) {
+  uint32_t id;
+  id=*pid;
+  if (unlikely(!id)) {
+    id=__sync_add_and_fetch(&psync_sql_next_stmt_id, 1);
+    if (!__sync_bool_compare_and_swap(pid, 0, id))
+      id=*pid;
+  }
+  return id<PSYNC_SQL_MAX_STMT_IDS?id:0;
+}
+
+static psync_sql_res *psync_sql_get_cached(psync_sql_reader *reader, const char *sql, uint32_t id) {
+  psync_sql_res *res;
+  if (!id)
+    return reader?NULL:(psync_sql_res *)psync_cache_get(sql);
+  res=__sync_lock_test_and_set(&(reader?reader->stmts:psync_sql_stmts)[id], NULL);
+  if (res && unlikely(res->sql!=sql)) {
+    psync_sql_free_cache(res);
+    return NULL;
+  }
+  assert(!res || !strcmp(sqlite3_sql(res->stmt), sql));
+  return res;
+}
+
+static void psync_sql_put_cached(psync_sql_res *res) {
+  if (res->id) {
+    if (!__sync_bool_compare_and_swap(&(res->reader?res->reader->stmts:psync_sql_stmts)[res->id], NULL, res))
+      psync_sql_free_cache(res);
+  }
+  else if (res->reader)
+    psync_sql_free_cache(res);
+  else
+    psync_cache_add(res->sql, res, PSYNC_QUERY_CACHE_SEC, psync_sql_free_cache, PSYNC_QUERY_MAX_CNT);
+}
+
 char *psync_sql_cellstr(const char *sql) {
   sqlite3_stmt *stmt;
+  sqlite3 *db;
   int code;
   psync_sql_check_query_plan(sql);
   psync_sql_rdlock();
-  code=sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
+  db=psync_sql_get_rd_db();
+  code=sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
   if (unlikely(code!=SQLITE_OK)) {
     psync_sql_rdunlock();
     log_error(
         "error running sql statement: %s: %s",
         sql,
-        sqlite3_errmsg(psync_db)
+        sqlite3_errmsg(db)
     );
     return NULL;
   }
@@ -1002,7 +1607,7 @@ char *psync_sql_cellstr(const char *sql) {
     sqlite3_finalize(stmt);
     psync_sql_rdunlock();
     if (unlikely(code!=SQLITE_DONE)) {
-      log_error("sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(psync_db));
+      log_error("sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(db));
     }
     return NULL;
   }
@@ -1010,20 +1615,21 @@ char *psync_sql_cellstr(const char *sql) {
 
 int64_t psync_sql_cellint(const char *sql, int64_t def_val) {
   sqlite3_stmt *stmt;
+  sqlite3 *db;
   int code;
   psync_sql_check_query_plan(sql);
   psync_sql_rdlock();
-
-  code = sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
+  db=psync_sql_get_rd_db();
+  code=sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
   if (unlikely(code != SQLITE_OK)) {
-    log_error("error running sql statement: %s: %s", sql, sqlite3_errmsg(psync_db));
+    log_error("error running sql statement: %s: %s", sql, sqlite3_errmsg(db));
   }
   else {
     code = sqlite3_step(stmt);
     if (code == SQLITE_ROW)
       def_val = sqlite3_column_int64(stmt, 0);
     else if (unlikely(code != SQLITE_DONE)) {
-      log_error("sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(psync_db));
+      log_error("sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(db));
     }
     sqlite3_finalize(stmt);
   }
@@ -1033,13 +1639,15 @@ int64_t psync_sql_cellint(const char *sql, int64_t def_val) {
 
 char **psync_sql_rowstr(const char *sql) {
   sqlite3_stmt *stmt;
+  sqlite3 *db;
   int code, cnt;
   psync_sql_check_query_plan(sql);
   psync_sql_rdlock();
-  code=sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
+  db=psync_sql_get_rd_db();
+  code=sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
   if (unlikely(code!=SQLITE_OK)) {
     psync_sql_rdunlock();
-    log_error("error running sql statement: %s: %s", sql, sqlite3_errmsg(psync_db));
+    log_error("error running sql statement: %s: %s", sql, sqlite3_errmsg(db));
     return NULL;
   }
   cnt=sqlite3_column_count(stmt);
@@ -1078,7 +1686,7 @@ char **psync_sql_rowstr(const char *sql) {
     sqlite3_finalize(stmt);
     psync_sql_rdunlock();
     if (unlikely(code!=SQLITE_DONE)) {
-      log_error("sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(psync_db));
+      log_error("sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(db));
     }
     return NULL;
   }
@@ -1086,13 +1694,15 @@ char **psync_sql_rowstr(const char *sql) {
 
 psync_variant *psync_sql_row(const char *sql) {
   sqlite3_stmt *stmt;
+  sqlite3 *db;
   int code, cnt;
   psync_sql_check_query_plan(sql);
   psync_sql_rdlock();
-  code=sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
+  db=psync_sql_get_rd_db();
+  code=sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
   if (unlikely(code!=SQLITE_OK)) {
     psync_sql_rdunlock();
-    log_error("error running sql statement: %s: %s", sql, sqlite3_errmsg(psync_db));
+    log_error("error running sql statement: %s: %s", sql, sqlite3_errmsg(db));
     return NULL;
   }
   cnt=sqlite3_column_count(stmt);
@@ -1147,131 +1757,95 @@ psync_variant *psync_sql_row(const char *sql) {
     sqlite3_finalize(stmt);
     psync_sql_rdunlock();
     if (unlikely(code!=SQLITE_DONE)) {
-      log_error("sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(psync_db));
+      log_error("sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(db));
     }
     return NULL;
   }
 }
 
-#if IS_DEBUG
 psync_sql_res *psync_sql_do_query_nocache(const char *sql, const char *file, unsigned line) {
-#else
-psync_sql_res *psync_sql_query_nocache(const char *sql) {
-#endif
   sqlite3_stmt *stmt;
   psync_sql_res *res;
   int code, cnt;
   psync_sql_check_query_plan(sql);
-#if IS_DEBUG
   psync_sql_do_lock(file, line);
-#else
-  psync_sql_lock();
-#endif
   code=sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
   if (unlikely(code!=SQLITE_OK)) {
     psync_sql_unlock();
-#if IS_DEBUG
     log_error("error running sql statement: %s: %s called from %s:%u", sql, sqlite3_errmsg(psync_db), file, line);
-#else
-    log_error("error running sql statement: %s: %s", sql, sqlite3_errmsg(psync_db));
-#endif
     return NULL;
   }
   cnt=sqlite3_column_count(stmt);
   res=(psync_sql_res *)psync_malloc(sizeof(psync_sql_res)+cnt*sizeof(psync_variant));
   res->stmt=stmt;
   res->sql=sql;
+  res->reader=NULL;
+  res->id=0;
   res->column_count=cnt;
   res->locked=SQL_WRITE_LOCK;
   return res;
 }
 
-#if IS_DEBUG
-psync_sql_res *psync_sql_do_query(const char *sql, const char *file, unsigned line) {
-#else
-psync_sql_res *psync_sql_query(const char *sql) {
-#endif
+psync_sql_res *psync_sql_do_query(const char *sql, uint32_t *pid, const char *file, unsigned line) {
   psync_sql_res *ret;
-  ret=(psync_sql_res *)psync_cache_get(sql);
+  uint32_t id;
+  id=psync_sql_stmt_id(pid);
+  ret=psync_sql_get_cached(NULL, sql, id);
   if (ret) {
     ret->locked=SQL_WRITE_LOCK;
-#if IS_DEBUG
     psync_sql_do_lock(file, line);
-#else
-    psync_sql_lock();
-#endif
     return ret;
   }
-  else
-#if IS_DEBUG
-    return psync_sql_do_query_nocache(sql, file, line);
-#else
-    return psync_sql_query_nocache(sql);
-#endif
+  ret=psync_sql_do_query_nocache(sql, file, line);
+  if (ret)
+    ret->id=id;
+  return ret;
 }
 
-#if IS_DEBUG
 psync_sql_res *psync_sql_do_query_rdlock_nocache(const char *sql, const char *file, unsigned line) {
-#else
-psync_sql_res *psync_sql_query_rdlock_nocache(const char *sql) {
-#endif
+  psync_sql_reader *reader;
   sqlite3_stmt *stmt;
+  sqlite3 *db;
   psync_sql_res *res;
   int code, cnt;
   psync_sql_check_query_plan(sql);
-#if IS_DEBUG
   psync_sql_do_rdlock(file, line);
-#else
-  psync_sql_rdlock();
-#endif
-  code=sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
+  reader=psync_sql_get_reader();
+  db=reader?reader->db:psync_db;
+  code=sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
   if (unlikely(code!=SQLITE_OK)) {
     psync_sql_rdunlock();
-#if IS_DEBUG
-    log_error("error running sql statement: %s: %s called from %s:%u", sql, sqlite3_errmsg(psync_db), file, line);
-#else
-    log_error("error running sql statement: %s: %s", sql, sqlite3_errmsg(psync_db));
-#endif
+    log_error("error running sql statement: %s: %s called from %s:%u", sql, sqlite3_errmsg(db), file, line);
     return NULL;
   }
   cnt=sqlite3_column_count(stmt);
   res=(psync_sql_res *)psync_malloc(sizeof(psync_sql_res)+cnt*sizeof(psync_variant));
   res->stmt=stmt;
   res->sql=sql;
+  res->reader=reader;
+  res->id=0;
   res->column_count=cnt;
   res->locked=SQL_READ_LOCK;
   return res;
 }
 
-#if IS_DEBUG
-psync_sql_res *psync_sql_do_query_rdlock(const char *sql, const char *file, unsigned line) {
-#else
-psync_sql_res *psync_sql_query_rdlock(const char *sql) {
-#endif
+psync_sql_res *psync_sql_do_query_rdlock(const char *sql, uint32_t *pid, const char *file, unsigned line) {
   psync_sql_res *ret;
-  ret=(psync_sql_res *)psync_cache_get(sql);
+  uint32_t id;
+  id=psync_sql_stmt_id(pid);
+  ret=psync_sql_get_cached(psync_sql_get_reader(), sql, id);
   if (ret) {
     ret->locked=SQL_READ_LOCK;
-#if IS_DEBUG
     psync_sql_do_rdlock(file, line);
-#else
-    psync_sql_rdlock();
-#endif
     return ret;
   }
-  else
-#if IS_DEBUG
-    return psync_sql_do_query_rdlock_nocache(sql, file, line);
-#else
-    return psync_sql_query_rdlock_nocache(sql);
-#endif
+  ret=psync_sql_do_query_rdlock_nocache(sql, file, line);
+  if (ret)
+    ret->id=id;
+  return ret;
 }
 
-#if IS_DEBUG
 psync_sql_res *psync_sql_do_query_nolock_nocache(const char *sql, const char *file, unsigned line) {
-#else
-psync_sql_res *psync_sql_query_nolock_nocache(const char *sql) {
-#endif
   sqlite3_stmt *stmt;
   psync_sql_res *res;
   int code, cnt;
@@ -1291,34 +1865,32 @@ psync_sql_res *psync_sql_query_nolock_nocache(const char *sql) {
   res=(psync_sql_res *)psync_malloc(sizeof(psync_sql_res)+cnt*sizeof(psync_variant));
   res->stmt=stmt;
   res->sql=sql;
+  res->reader=NULL;
+  res->id=0;
   res->column_count=cnt;
   res->locked=SQL_NO_LOCK;
   return res;
 }
 
-#if IS_DEBUG
-psync_sql_res *psync_sql_do_query_nolock(const char *sql, const char *file, unsigned line) {
-#else
-psync_sql_res *psync_sql_query_nolock(const char *sql) {
-#endif
+psync_sql_res *psync_sql_do_query_nolock(const char *sql, uint32_t *pid, const char *file, unsigned line) {
   psync_sql_res *ret;
+  uint32_t id;
 #if IS_DEBUG
   if (!psync_sql_islocked()) {
     log_fatal("illegal use of psync_sql_query_nolock, can only be used while holding lock, invoked from %s:%u, sql: %s", file, line, sql);
     abort();
   }
 #endif
-  ret=(psync_sql_res *)psync_cache_get(sql);
+  id=psync_sql_stmt_id(pid);
+  ret=psync_sql_get_cached(NULL, sql, id);
   if (ret) {
     ret->locked=SQL_NO_LOCK;
     return ret;
   }
-  else
-#if IS_DEBUG
-    return psync_sql_do_query_nolock_nocache(sql, file, line);
-#else
-    return psync_sql_query_nolock_nocache(sql);
-#endif
+  ret=psync_sql_do_query_nolock_nocache(sql, file, line);
+  if (ret)
+    ret->id=id;
+  return ret;
 }
 
 static void psync_sql_free_cache(void *ptr) {
@@ -1355,7 +1927,7 @@ void psync_sql_free_result(psync_sql_res *res) {
   memset(res->row, 0xff, res->column_count*sizeof(psync_variant));
 #endif
   if (code==SQLITE_OK)
-    psync_cache_add(res->sql, res, PSYNC_QUERY_CACHE_SEC, psync_sql_free_cache, PSYNC_QUERY_MAX_CNT);
+    psync_sql_put_cached(res);
   else
     psync_sql_free_cache(res);
 }
@@ -1369,33 +1941,23 @@ void psync_sql_free_result_nocache(psync_sql_res *res) {
   psync_free(res);
 }
 
-#if IS_DEBUG
 psync_sql_res *psync_sql_do_prep_statement_nocache(const char *sql, const char *file, unsigned line) {
-#else
-psync_sql_res *psync_sql_prep_statement_nocache(const char *sql) {
-#endif
   sqlite3_stmt *stmt;
   psync_sql_res *res;
   int code;
   psync_sql_check_query_plan(sql);
-#if IS_DEBUG
   psync_sql_do_lock(file, line);
-#else
-  psync_sql_lock();
-#endif
   code=sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
   if (unlikely(code!=SQLITE_OK)) {
     psync_sql_unlock();
-#if IS_DEBUG
     log_error("error running sql statement: %s: %s called from %s:%u", sql, sqlite3_errmsg(psync_db), file, line);
-#else
-    log_error("error running sql statement: %s: %s", sql, sqlite3_errmsg(psync_db));
-#endif
     return NULL;
   }
   res=psync_new(psync_sql_res);
   res->stmt=stmt;
   res->sql=sql;
+  res->reader=NULL;
+  res->id=0;
 #if IS_DEBUG
   res->column_count=0;
 #endif
@@ -1403,28 +1965,20 @@ psync_sql_res *psync_sql_prep_statement_nocache(const char *sql) {
   return res;
 }
 
-#if IS_DEBUG
-psync_sql_res *psync_sql_do_prep_statement(const char *sql, const char *file, unsigned line) {
-#else
-psync_sql_res *psync_sql_prep_statement(const char *sql) {
-#endif
+psync_sql_res *psync_sql_do_prep_statement(const char *sql, uint32_t *pid, const char *file, unsigned line) {
   psync_sql_res *ret;
-  ret=psync_cache_get(sql);
+  uint32_t id;
+  id=psync_sql_stmt_id(pid);
+  ret=psync_sql_get_cached(NULL, sql, id);
   if (ret) {
     ret->locked=SQL_WRITE_LOCK;
-#if IS_DEBUG
     psync_sql_do_lock(file, line);
-#else
-    psync_sql_lock();
-#endif
     return ret;
   }
-  else
-#if IS_DEBUG
-    return psync_sql_do_prep_statement_nocache(sql, file, line);
-#else
-    return psync_sql_prep_statement_nocache(sql);
-#endif
+  ret=psync_sql_do_prep_statement_nocache(sql, file, line);
+  if (ret)
+    ret->id=id;
+  return ret;
 }
 
 int psync_sql_reset(psync_sql_res *res) {
@@ -1483,7 +2037,7 @@ int psync_sql_run_free(psync_sql_res *res) {
   }
   else{
     psync_sql_res_unlock(res);
-    psync_cache_add(res->sql, res, PSYNC_QUERY_CACHE_SEC, psync_sql_free_cache, PSYNC_QUERY_MAX_CNT);
+    psync_sql_put_cached(res);
     return 0;
   }
 }
@@ -138,9 +138,13 @@ typedef struct {
   };
 } psync_variant;
 
+struct psync_sql_reader_;
+
 typedef struct {
   sqlite3_stmt *stmt;
   const char *sql;
+  struct psync_sql_reader_ *reader;
+  uint32_t id;
   int column_count;
   int locked;
   psync_variant row[];
@@ -171,6 +175,8 @@ typedef void (*psync_task_callback_t)(void *, void *);
 
 
 typedef void (*psync_transaction_callback_t)(void *);
+typedef int (*psync_sql_group_fn_t)(void *);
+typedef void (*psync_sql_group_done_fn_t)(void *, int);
 
 extern int psync_do_run;
 extern int psync_recache_contacts;
@@ -196,14 +202,16 @@ unsigned char *psync_base64_decode(const unsigned char *str, size_t length, size
 
 int psync_is_valid_utf8(const char *str);
 
+void psync_sql_set_read_connections(uint32_t cnt);
 int psync_sql_connect(const char *db) PSYNC_NONNULL(1);
 int psync_sql_close();
 int psync_sql_reopen(const char *path);
 void psync_sql_checkpoint_lock();
 void psync_sql_checkpoint_unlock();
 
-#if IS_DEBUG
-
+/* The lock and query macros pass their call site, debug builds use it to report long held locks and all builds use it
+ * for the lock profiler, see psync_sql_lockprof_dump().
+ */
 #define psync_sql_trylock() psync_sql_do_trylock(__FILE__, __LINE__)
 #define psync_sql_lock() psync_sql_do_lock(__FILE__, __LINE__)
 #define psync_sql_rdlock() psync_sql_do_rdlock(__FILE__, __LINE__)
@@ -211,13 +219,13 @@ void psync_sql_checkpoint_unlock();
 #define psync_sql_start_transaction() psync_sql_do_start_transaction(__FILE__, __LINE__)
 
 #define psync_sql_query_nocache(sql) psync_sql_do_query_nocache(sql, __FILE__, __LINE__)
-#define psync_sql_query(sql) psync_sql_do_query(sql, __FILE__, __LINE__)
+#define psync_sql_query(sql) ({static uint32_t psync_sql_id__=0; psync_sql_do_query(sql, &psync_sql_id__, __FILE__, __LINE__);})
 #define psync_sql_query_rdlock_nocache(sql) psync_sql_do_query_rdlock_nocache(sql, __FILE__, __LINE__)
-#define psync_sql_query_rdlock(sql) psync_sql_do_query_rdlock(sql, __FILE__, __LINE__)
+#define psync_sql_query_rdlock(sql) ({static uint32_t psync_sql_id__=0; psync_sql_do_query_rdlock(sql, &psync_sql_id__, __FILE__, __LINE__);})
 #define psync_sql_query_nolock_nocache(sql) psync_sql_do_query_nolock_nocache(sql, __FILE__, __LINE__)
-#define psync_sql_query_nolock(sql) psync_sql_do_query_nolock(sql, __FILE__, __LINE__)
+#define psync_sql_query_nolock(sql) ({static uint32_t psync_sql_id__=0; psync_sql_do_query_nolock(sql, &psync_sql_id__, __FILE__, __LINE__);})
 #define psync_sql_prep_statement_nocache(sql) psync_sql_do_prep_statement_nocache(sql, __FILE__, __LINE__)
-#define psync_sql_prep_statement(sql) psync_sql_do_prep_statement(sql, __FILE__, __LINE__)
+#define psync_sql_prep_statement(sql) ({static uint32_t psync_sql_id__=0; psync_sql_do_prep_statement(sql, &psync_sql_id__, __FILE__, __LINE__);})
 
 int psync_sql_do_trylock(const char *file, unsigned line);
 void psync_sql_do_lock(const char *file, unsigned line);
@@ -226,35 +234,19 @@ int psync_sql_do_statement(const char *sql, const char *file, unsigned line) PSY
 int psync_sql_do_start_transaction(const char *file, unsigned line);
 
 psync_sql_res *psync_sql_do_query_nocache(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
-psync_sql_res *psync_sql_do_query(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
+psync_sql_res *psync_sql_do_query(const char *sql, uint32_t *pid, const char *file, unsigned line) PSYNC_NONNULL(1, 2);
 psync_sql_res *psync_sql_do_query_rdlock_nocache(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
-psync_sql_res *psync_sql_do_query_rdlock(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
+psync_sql_res *psync_sql_do_query_rdlock(const char *sql, uint32_t *pid, const char *file, unsigned line) PSYNC_NONNULL(1, 2);
 psync_sql_res *psync_sql_do_query_nolock_nocache(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
-psync_sql_res *psync_sql_do_query_nolock(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
+psync_sql_res *psync_sql_do_query_nolock(const char *sql, uint32_t *pid, const char *file, unsigned line) PSYNC_NONNULL(1, 2);
 psync_sql_res *psync_sql_do_prep_statement_nocache(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
-psync_sql_res *psync_sql_do_prep_statement(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
-
-void psync_sql_dump_locks();
-
-#else
-
-int psync_sql_trylock();
-void psync_sql_lock();
-void psync_sql_rdlock();
-int psync_sql_statement(const char *sql) PSYNC_NONNULL(1);
-int psync_sql_start_transaction();
-
-psync_sql_res *psync_sql_query_nocache(const char *sql) PSYNC_NONNULL(1);
-psync_sql_res *psync_sql_query(const char *sql) PSYNC_NONNULL(1);
-psync_sql_res *psync_sql_query_rdlock_nocache(const char *sql) PSYNC_NONNULL(1);
-psync_sql_res *psync_sql_query_rdlock(const char *sql) PSYNC_NONNULL(1);
-psync_sql_res *psync_sql_query_nolock(const char *sql) PSYNC_NONNULL(1);
-psync_sql_res *psync_sql_query_nolock_nocache(const char *sql) PSYNC_NONNULL(1);
-psync_sql_res *psync_sql_prep_statement(const char *sql) PSYNC_NONNULL(1);
-psync_sql_res *psync_sql_prep_statement_nocache(const char *sql) PSYNC_NONNULL(1);
-
+psync_sql_res *psync_sql_do_prep_statement(const char *sql, uint32_t *pid, const char *file, unsigned line) PSYNC_NONNULL(1, 2);
 
+void psync_sql_lockprof_enable(int enable);
+char *psync_sql_lockprof_dump(uint32_t topn);
 
+#if IS_DEBUG
+void psync_sql_dump_locks();
 #endif
 
 void psync_sql_unlock();
@@ -269,6 +261,16 @@ int psync_sql_rollback_transaction();
 
 void psync_sql_transation_add_callbacks(psync_transaction_callback_t commit_callback, psync_transaction_callback_t rollback_callback, void *ptr);
 
+/* psync_sql_group_commit() queues run to be executed by the group committer in a transaction shared with other queued closures
+ * and calls done (if not NULL) from the committer thread with 0 once the transaction is committed, or with non-zero if run
+ * returned non-zero, one of its statements failed or the transaction could not be committed. Either all or none of the changes
+ * of run are committed. psync_sql_group_commit_wait() does the same and waits for the result. It is to be called without the
+ * database lock, so that its transaction can be shared, a caller holding the write lock runs run in its own transaction and one
+ * holding only the read lock gets an error.
+ */
+void psync_sql_group_commit(psync_sql_group_fn_t run, psync_sql_group_done_fn_t done, void *ptr) PSYNC_NONNULL(1);
+int psync_sql_group_commit_wait(psync_sql_group_fn_t run, void *ptr) PSYNC_NONNULL(1);
+
 char *psync_sql_cellstr(const char *sql) PSYNC_NONNULL(1);
 int64_t psync_sql_cellint(const char *sql, int64_t def_val) PSYNC_NONNULL(1);
 char **psync_sql_rowstr(const char *sql) PSYNC_NONNULL(1);
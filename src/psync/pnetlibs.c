@@ -31,6 +31,8 @@
 #include "papi.h"
 #include "pcache.h"
 #include "ptree.h"
+#include "pshaper.h"
+#include "pblockscan.h"
 #include "logger.h"
 
 struct time_bytes {
@@ -82,7 +84,9 @@ static time_t current_upload_sec=0;
 static psync_uint_t upload_bytes_this_sec=0;
 static psync_uint_t upload_bytes_off=0;
 static psync_uint_t upload_speed=0;
-static psync_uint_t dyn_upload_speed=PSYNC_UPL_AUTO_SHAPER_INITIAL;
+
+static pthread_mutex_t auto_shaper_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_shaper_auto_t auto_shapers[2];
 
 static psync_tree *file_lock_tree=PSYNC_TREE_EMPTY;
 static pthread_mutex_t file_lock_mutex=PTHREAD_MUTEX_INITIALIZER;
@@ -95,8 +99,13 @@ dispatch_semaphore_t api_pool_sem;
 sem_t                api_pool_sem;
 #endif
 
-char apiserver[64] = "";
-static char apikey[68] = "";
+// the server picked for the pool and the cache key of its connections, both change under apiservers_mutex
+static char apiserver[PSYNC_APISERVER_LEN] = "";
+static char apikey[PSYNC_APISERVER_LEN+4] = "";
+
+static char apiservers[PSYNC_HOSTS_MAX_ORDER][PSYNC_HOSTS_NAME_LEN];
+static uint32_t apiservers_cnt=0;
+static pthread_mutex_t apiservers_mutex=PTHREAD_MUTEX_INITIALIZER;
 
 static uint32_t hash_func(const char *key) {
   uint32_t c, hash;
@@ -106,8 +115,272 @@ static uint32_t hash_func(const char *key) {
   return hash;
 }
 
+/*
+ * Scoreboard of the API and content hosts we connect to. For every host an
+ * exponentially weighted average of the time to connect (TCP and TLS) and of
+ * the download throughput is kept, hosts that fail are backed off for an
+ * exponentially growing time. psync_hosts_order() sorts the hosts the servers
+ * give us by the time a PSYNC_HOSTS_SCORE_BYTES download is expected to take,
+ * hosts never measured go first so that they get measured. The scoreboard is
+ * saved in the settings every PSYNC_HOSTS_SAVE_INTERVAL seconds.
+ *
+ * The TCP connect and the TLS handshake share one average on purpose. Both are
+ * round trips to the same host and grow and shrink together, and what a caller
+ * waits for before it can send a request is their sum. Keeping them apart would
+ * need psync_socket_connect() to time the two steps for us and would not change
+ * the order of the hosts.
+ */
+static psync_host_score_t host_scores[PSYNC_HOSTS_MAX];
+static uint32_t host_scores_cnt=0;
+static int host_scores_loaded=0;
+static int host_scores_dirty=0;
+static pthread_mutex_t host_scores_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+static void psync_hosts_load() {
+  char *str, *line, *next;
+  char host[PSYNC_HOSTS_NAME_LEN];
+  unsigned connectms, kbps, failures;
+  psync_host_score_t *hs;
+  // read outside of the mutex, the sql lock must not be taken while holding it
+  str=psync_get_string_value("hostscores");
+  pthread_mutex_lock(&host_scores_mutex);
+  if (!host_scores_loaded && str) {
+    for (line=str; *line && host_scores_cnt<PSYNC_HOSTS_MAX; line=next) {
+      next=strchr(line, '\n');
+      if (next)
+        *next++=0;
+      else
+        next=line+strlen(line);
+      if (sscanf(line, "%63s %u %u %u", host, &connectms, &kbps, &failures)!=4)
+        continue;
+      hs=&host_scores[host_scores_cnt++];
+      memset(hs, 0, sizeof(psync_host_score_t));
+      strcpy(hs->host, host);
+      hs->connectms=connectms;
+      hs->kbps=kbps;
+      hs->failures=failures;
+    }
+    log_info("loaded scores of %u hosts", (unsigned)host_scores_cnt);
+  }
+  host_scores_loaded=1;
+  pthread_mutex_unlock(&host_scores_mutex);
+  psync_free(str);
+}
+
+static void psync_hosts_save() {
+  char *str;
+  size_t off;
+  uint32_t i;
+  pthread_mutex_lock(&host_scores_mutex);
+  if (!host_scores_dirty) {
+    pthread_mutex_unlock(&host_scores_mutex);
+    return;
+  }
+  host_scores_dirty=0;
+  str=psync_new_cnt(char, (PSYNC_HOSTS_NAME_LEN+36)*host_scores_cnt+1);
+  off=0;
+  for (i=0; i<host_scores_cnt; i++)
+    off+=sprintf(str+off, "%s %u %u %u\n", host_scores[i].host, (unsigned)host_scores[i].connectms,
+                 (unsigned)host_scores[i].kbps, (unsigned)host_scores[i].failures);
+  str[off]=0;
+  pthread_mutex_unlock(&host_scores_mutex);
+  psync_set_string_value("hostscores", str);
+  psync_free(str);
+}
+
+// must be called with host_scores_mutex held, returns NULL for names that do not fit
+static psync_host_score_t *psync_hosts_get(const char *host, int create) {
+  psync_host_score_t *hs;
+  uint32_t i, oldest;
+  if (strlen(host)>=PSYNC_HOSTS_NAME_LEN)
+    return NULL;
+  for (i=0; i<host_scores_cnt; i++)
+    if (!strcmp(host_scores[i].host, host))
+      return &host_scores[i];
+  if (!create)
+    return NULL;
+  if (host_scores_cnt<PSYNC_HOSTS_MAX)
+    hs=&host_scores[host_scores_cnt++];
+  else {
+    oldest=0;
+    for (i=1; i<host_scores_cnt; i++)
+      if (host_scores[i].lastused<host_scores[oldest].lastused)
+        oldest=i;
+    hs=&host_scores[oldest];
+  }
+  memset(hs, 0, sizeof(psync_host_score_t));
+  strcpy(hs->host, host);
+  return hs;
+}
+
+static uint32_t psync_hosts_ewma(uint32_t avg, uint64_t sample) {
+  if (!sample)
+    sample=1;
+  else if (sample>UINT32_MAX)
+    sample=UINT32_MAX;
+  if (!avg)
+    return sample;
+  return (avg*(uint64_t)(PSYNC_HOSTS_EWMA_WEIGHT-1)+sample)/PSYNC_HOSTS_EWMA_WEIGHT;
+}
+
+static void psync_hosts_connected(const char *host, uint64_t ms) {
+  psync_host_score_t *hs;
+  if (unlikely(!host_scores_loaded))
+    psync_hosts_load();
+  pthread_mutex_lock(&host_scores_mutex);
+  if ((hs=psync_hosts_get(host, 1))) {
+    hs->connectms=psync_hosts_ewma(hs->connectms, ms);
+    hs->failures=0;
+    hs->backoffuntil=0;
+    hs->lastused=psync_timer_time();
+    host_scores_dirty=1;
+  }
+  pthread_mutex_unlock(&host_scores_mutex);
+}
+
+static void psync_hosts_failed(const char *host) {
+  psync_host_score_t *hs;
+  time_t backoff;
+  if (unlikely(!host_scores_loaded))
+    psync_hosts_load();
+  pthread_mutex_lock(&host_scores_mutex);
+  if ((hs=psync_hosts_get(host, 1))) {
+    if (hs->failures<16)
+      hs->failures++;
+    backoff=(time_t)1<<hs->failures;
+    if (backoff>PSYNC_HOSTS_MAX_BACKOFF)
+      backoff=PSYNC_HOSTS_MAX_BACKOFF;
+    hs->lastused=psync_timer_time();
+    hs->backoffuntil=hs->lastused+backoff;
+    host_scores_dirty=1;
+    log_info("connection to %s failed %u times in a row, backing off for %u seconds", host, (unsigned)hs->failures, (unsigned)backoff);
+  }
+  pthread_mutex_unlock(&host_scores_mutex);
+}
+
+static void psync_hosts_transferred(const char *host, uint64_t bytes, uint64_t us) {
+  psync_host_score_t *hs;
+  if (bytes<PSYNC_HOSTS_MIN_TRANSFER)
+    return;
+  if (!us)
+    us=1;
+  pthread_mutex_lock(&host_scores_mutex);
+  if ((hs=psync_hosts_get(host, 0))) {
+    hs->kbps=psync_hosts_ewma(hs->kbps, bytes*1000000/1024/us);
+    host_scores_dirty=1;
+  }
+  pthread_mutex_unlock(&host_scores_mutex);
+}
+
+static psync_socket *psync_hosts_connect(const char *host, int usessl, int download) {
+  char name[PSYNC_HOSTS_NAME_LEN];
+  const char *cname, *colon;
+  psync_socket *sock;
+  uint64_t start;
+  unsigned port;
+  cname=host;
+  port=usessl?443:80;
+  // the servers give plain names, a name with a port is a local server, the score is kept for the whole name
+  colon=strchr(host, ':');
+  if (colon && (size_t)(colon-host)<sizeof(name) && !strchr(colon+1, ':') && atoi(colon+1)>0) {
+    memcpy(name, host, colon-host);
+    name[colon-host]=0;
+    cname=name;
+    port=atoi(colon+1);
+  }
+  start=psync_millitime();
+  if (download)
+    sock=psync_socket_connect_download(cname, port, usessl);
+  else
+    sock=psync_socket_connect(cname, port, usessl);
+  if (sock)
+    psync_hosts_connected(host, psync_millitime()-start);
+  else
+    psync_hosts_failed(host);
+  return sock;
+}
+
+/* Sorts names by the expected time of a PSYNC_HOSTS_SCORE_BYTES download according to scores, which is only read. Hosts
+ * without a score go first, hosts backed off at now go last, equal ones keep their order. At most PSYNC_HOSTS_MAX_ORDER
+ * names are sorted, their number is returned.
+ */
+uint32_t psync_hosts_order_names(const psync_host_score_t *scores, uint32_t scorecnt, time_t now,
+                                 const char *const *names, uint32_t cnt, const char **ordered) {
+  uint64_t keys[PSYNC_HOSTS_MAX_ORDER], key;
+  const psync_host_score_t *hs;
+  uint32_t i, j;
+  if (cnt>PSYNC_HOSTS_MAX_ORDER)
+    cnt=PSYNC_HOSTS_MAX_ORDER;
+  for (i=0; i<cnt; i++) {
+    hs=NULL;
+    for (j=0; j<scorecnt; j++)
+      if (!strcmp(scores[j].host, names[i])) {
+        hs=&scores[j];
+        break;
+      }
+    if (!hs || !hs->connectms)
+      key=0;
+    else {
+      key=hs->connectms;
+      if (hs->kbps)
+        key+=PSYNC_HOSTS_SCORE_BYTES/1024*1000/hs->kbps;
+    }
+    // hosts that are backed off only after all healthy ones
+    if (hs && hs->backoffuntil>now)
+      key+=(uint64_t)1<<40;
+    // insertion sort, keeps the order of the server for equal scores
+    for (j=i; j>0 && keys[j-1]>key; j--) {
+      keys[j]=keys[j-1];
+      ordered[j]=ordered[j-1];
+    }
+    keys[j]=key;
+    ordered[j]=names[i];
+  }
+  return cnt;
+}
+
+static uint32_t psync_hosts_order_scored(const char *const *names, uint32_t cnt, const char **ordered) {
+  time_t now;
+  if (unlikely(!host_scores_loaded))
+    psync_hosts_load();
+  now=psync_timer_time();
+  pthread_mutex_lock(&host_scores_mutex);
+  cnt=psync_hosts_order_names(host_scores, host_scores_cnt, now, names, cnt, ordered);
+  pthread_mutex_unlock(&host_scores_mutex);
+  return cnt;
+}
+
+uint32_t psync_hosts_order(const binresult *hosts, const char **ordered) {
+  const char *names[PSYNC_HOSTS_MAX_ORDER];
+  uint32_t i, cnt;
+  cnt=hosts->length<PSYNC_HOSTS_MAX_ORDER?hosts->length:PSYNC_HOSTS_MAX_ORDER;
+  for (i=0; i<cnt; i++)
+    names[i]=hosts->array[i]->str;
+  return psync_hosts_order_scored(names, cnt, ordered);
+}
+
+static void psync_hosts_timer(psync_timer_t timer, void *ptr) {
+  psync_hosts_save();
+}
+
+static void psync_apipool_pick_server();
+
+static void psync_apipool_get_key(char *key) {
+  pthread_mutex_lock(&apiservers_mutex);
+  memcpy(key, apikey, sizeof(apikey));
+  pthread_mutex_unlock(&apiservers_mutex);
+}
+
+void psync_apipool_get_server(char *server) {
+  pthread_mutex_lock(&apiservers_mutex);
+  memcpy(server, apiserver, sizeof(apiserver));
+  pthread_mutex_unlock(&apiservers_mutex);
+}
+
 static psync_socket *psync_get_api() {
+  char server[PSYNC_APISERVER_LEN];
   psync_socket *sock;
+  uint64_t start;
 
 #ifdef __APPLE__
   dispatch_semaphore_wait(api_pool_sem, DISPATCH_TIME_FOREVER);
@@ -115,10 +388,18 @@ static psync_socket *psync_get_api() {
   sem_wait(&api_pool_sem);
 #endif
 
-  log_info("connecting to %s", apiserver);
-  sock=psync_api_connect(apiserver, psync_setting_get_bool(_PS(usessl)));
-  if (sock)
-    sock->misc=hash_func(apiserver);
+  psync_apipool_get_server(server);
+  log_info("connecting to %s", server);
+  start=psync_millitime();
+  sock=psync_api_connect(server, psync_setting_get_bool(_PS(usessl)));
+  if (sock) {
+    psync_hosts_connected(server, psync_millitime()-start);
+    sock->misc=hash_func(server);
+  }
+  else {
+    psync_hosts_failed(server);
+    psync_apipool_pick_server();
+  }
   return sock;
 }
 
@@ -158,26 +439,66 @@ static int api_sock_is_broken(psync_socket *ret) {
       return 1;
     }
     else{
-      log_info("got api connection from cache, key %s", apikey);
+      log_info("got api connection from cache");
       return 0;
     }
   }
 }
 
-void psync_apipool_set_server(const char *binapi) {
+static void psync_apipool_set_server_locked(const char *binapi) {
   size_t len;
   len=strlen(binapi)+1;
-  if (len<=sizeof(apiserver)) {
+  if (len<=sizeof(apiserver) && strcmp(apiserver, binapi)) {
     memcpy(apiserver, binapi, len);
     memcpy(apikey+4, binapi, len);
     log_info("set %s as best api server", apiserver);
   }
 }
 
+void psync_apipool_set_server(const char *binapi) {
+  pthread_mutex_lock(&apiservers_mutex);
+  psync_apipool_set_server_locked(binapi);
+  pthread_mutex_unlock(&apiservers_mutex);
+}
+
+static void psync_apipool_pick_server() {
+  const char *names[PSYNC_HOSTS_MAX_ORDER], *ordered[PSYNC_HOSTS_MAX_ORDER];
+  uint32_t i;
+  // loading takes the sql lock, which must not be waited for under apiservers_mutex
+  if (unlikely(!host_scores_loaded))
+    psync_hosts_load();
+  pthread_mutex_lock(&apiservers_mutex);
+  if (apiservers_cnt>1) {
+    for (i=0; i<apiservers_cnt; i++)
+      names[i]=apiservers[i];
+    psync_hosts_order_scored(names, apiservers_cnt, ordered);
+    psync_apipool_set_server_locked(ordered[0]);
+  }
+  pthread_mutex_unlock(&apiservers_mutex);
+}
+
+void psync_apipool_set_servers(const binresult *binapi) {
+  uint32_t i, cnt;
+  if (!binapi->length)
+    return;
+  pthread_mutex_lock(&apiservers_mutex);
+  cnt=0;
+  for (i=0; i<binapi->length && cnt<PSYNC_HOSTS_MAX_ORDER; i++)
+    if (binapi->array[i]->length<PSYNC_HOSTS_NAME_LEN)
+      memcpy(apiservers[cnt++], binapi->array[i]->str, binapi->array[i]->length+1);
+  apiservers_cnt=cnt;
+  if (cnt==1)
+    psync_apipool_set_server_locked(apiservers[0]);
+  pthread_mutex_unlock(&apiservers_mutex);
+  psync_apipool_pick_server();
+}
+
 psync_socket *psync_apipool_get() {
+  char key[sizeof(apikey)];
   psync_socket *ret;
+  psync_apipool_get_key(key);
   while (1) {
-    ret=(psync_socket *)psync_cache_get(apikey);
+    ret=(psync_socket *)psync_cache_get(key);
     if (!ret)
       break;
     if (!api_sock_is_broken(ret))
@@ -190,9 +511,11 @@ psync_socket *psync_apipool_get() {
 }
 
 psync_socket *psync_apipool_get_from_cache() {
+  char key[sizeof(apikey)];
   psync_socket *ret;
+  psync_apipool_get_key(key);
   while (1) {
-    ret=(psync_socket *)psync_cache_get(apikey);
+    ret=(psync_socket *)psync_cache_get(key);
     if (!ret)
       break;
     if (!api_sock_is_broken(ret))
@@ -202,7 +525,9 @@ psync_socket *psync_apipool_get_from_cache() {
 }
 
 void psync_apipool_prepare() {
-  if (psync_cache_has(apikey))
+  char key[sizeof(apikey)];
+  psync_apipool_get_key(key);
+  if (psync_cache_has(key))
     return;
   else{
     psync_socket *ret;
@@ -317,8 +642,11 @@ void psync_apipool_release(psync_socket *api) {
     return;
   }
 #endif
-  if (hash_func(apiserver)==api->misc)
-    psync_cache_add(apikey, api, PSYNC_APIPOOL_MAXIDLESEC, psync_ret_api, PSYNC_APIPOOL_MAXIDLE);
+  char key[sizeof(apikey)];
+  psync_apipool_get_key(key);
+  // key is "API:" and the server
+  if (hash_func(key+4)==api->misc)
+    psync_cache_add(key, api, PSYNC_APIPOOL_MAXIDLESEC, psync_ret_api, PSYNC_APIPOOL_MAXIDLE);
   else
     psync_ret_api(api);
 }
@@ -663,9 +991,11 @@ psync_socket *psync_socket_connect_download(const char *host, int unsigned port,
 }
 
 psync_socket *psync_api_connect_download() {
+  char server[PSYNC_APISERVER_LEN];
   psync_socket *sock;
   int64_t dwlspeed;
-  sock=psync_api_connect(apiserver, psync_setting_get_bool(_PS(usessl)));
+  psync_apipool_get_server(server);
+  sock=psync_api_connect(server, psync_setting_get_bool(_PS(usessl)));
   if (sock) {
     dwlspeed=psync_setting_get_int(_PS(maxdownloadspeed));
     if (dwlspeed!=-1 && dwlspeed<PSYNC_MAX_SPEED_RECV_BUFFER) {
@@ -705,55 +1035,52 @@ void psync_account_downloaded_bytes(int unsigned bytes) {
   }
 }
 
-static psync_uint_t get_download_bytes_this_sec() {
-  if (current_download_sec==psync_current_time)
-    return download_bytes_this_sec;
-  else
-    return 0;
+/* With the auto setting every direction is paced by its delay based controller, fed with the RTT the kernel keeps for the
+ * connection the bytes were granted for. */
+static size_t auto_shaper_take(int dir, int cls, psync_socket *sock, size_t num) {
+  psync_shaper_auto_t *a;
+  uint64_t rate;
+  uint32_t rttus;
+  size_t grant;
+  a=&auto_shapers[dir];
+  pthread_mutex_lock(&auto_shaper_mutex);
+  if (unlikely(!a->rate))
+    psync_shaper_auto_init(a);
+  rate=a->rate;
+  pthread_mutex_unlock(&auto_shaper_mutex);
+  grant=psync_shaper_take(dir, cls, rate, num);
+  if (psync_socket_get_rtt(sock, dir==PSYNC_SHAPER_DOWNLOAD, &rttus))
+    rttus=0;
+  else if (rttus && (!sock->minrtt || rttus<sock->minrtt))
+    sock->minrtt=rttus;
+  pthread_mutex_lock(&auto_shaper_mutex);
+  psync_shaper_auto_update(a, psync_millitime(), rttus, sock->minrtt, grant);
+  pthread_mutex_unlock(&auto_shaper_mutex);
+  return grant;
 }
 
 static int psync_socket_readall_download_th(psync_socket *sock, void *buff, int num, int th) {
-  psync_int_t dwlspeed, readbytes, pending, lpending, rd, rrd;
-  psync_uint_t thissec, ds;
+  psync_int_t dwlspeed, readbytes, rd, rrd;
+  int cls;
   dwlspeed=psync_setting_get_int(_PS(maxdownloadspeed));
-  if (dwlspeed==0) {
-    if (th)
-      lpending=psync_socket_pendingdata_buf_thread(sock);
-    else
-      lpending=psync_socket_pendingdata_buf(sock);
-    if (download_speed>100*1024)
-      ds=download_speed/1024;
-    else
-      ds=100;
-    while (1) {
-      psync_milisleep(PSYNC_SLEEP_AUTO_SHAPER*100/ds);
-      if (th)
-        pending=psync_socket_pendingdata_buf_thread(sock);
-      else
-        pending=psync_socket_pendingdata_buf(sock);
-      if (pending==lpending)
-        break;
-      else
-        lpending=pending;
-    }
-    if (pending>0)
-      sock->pending=1;
-  }
-  else if (dwlspeed>0) {
+  if (dwlspeed>=0) {
     readbytes=0;
+    cls=psync_shaper_get_class();
     while (num) {
-      while ((thissec=get_download_bytes_this_sec())>=dwlspeed)
-        psync_timer_wait_next_sec();
-      if (num>dwlspeed-thissec)
-        rrd=dwlspeed-thissec;
+      if (dwlspeed)
+        rrd=psync_shaper_take(PSYNC_SHAPER_DOWNLOAD, cls, dwlspeed, num);
       else
-        rrd=num;
+        rrd=auto_shaper_take(PSYNC_SHAPER_DOWNLOAD, cls, sock, num);
       if (th)
         rd=psync_socket_read_thread(sock, buff, rrd);
       else
         rd=psync_socket_read(sock, buff, rrd);
-      if (rd<=0)
+      if (rd<=0) {
+        psync_shaper_return(PSYNC_SHAPER_DOWNLOAD, cls, rrd);
         return readbytes?readbytes:rd;
+      }
+      if (rd<rrd)
+        psync_shaper_return(PSYNC_SHAPER_DOWNLOAD, cls, rrd-rd);
       num-=rd;
       buff=(char *)buff+rd;
       readbytes+=rd;
@@ -778,7 +1105,9 @@ int psync_socket_readall_download_thread(psync_socket *sock, void *buff, int num
   return psync_socket_readall_download_th(sock, buff, num, 1);
 }
 
-static void account_uploaded_bytes(int unsigned bytes) {
+static pthread_mutex_t upload_bytes_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+static void account_uploaded_bytes_locked(int unsigned bytes) {
   if (current_upload_sec==psync_current_time)
     upload_bytes_this_sec+=bytes;
   else{
@@ -798,17 +1127,12 @@ static void account_uploaded_bytes(int unsigned bytes) {
   }
 }
 
-static psync_uint_t get_upload_bytes_this_sec() {
-  if (current_upload_sec==psync_current_time)
-    return upload_bytes_this_sec;
-  else
-    return 0;
+static void account_uploaded_bytes(int unsigned bytes) {
+  pthread_mutex_lock(&upload_bytes_mutex);
+  account_uploaded_bytes_locked(bytes);
+  pthread_mutex_unlock(&upload_bytes_mutex);
 }
 
-//static void set_send_buf(psync_socket *sock) {
-//  psync_socket_set_sendbuf(sock, dyn_upload_speed*PSYNC_UPL_AUTO_SHAPER_BUF_PER/100);
-//}
-
 int psync_set_default_sendbuf(psync_socket *sock) {
 //  return psync_socket_set_sendbuf(sock, PSYNC_DEFAULT_SEND_BUFF);
   return 0;
@@ -816,58 +1140,69 @@ int psync_set_default_sendbuf(psync_socket *sock) {
 
 int psync_socket_writeall_upload(psync_socket *sock, const void *buff, int num) {
   psync_int_t uplspeed, writebytes, wr, wwr;
-  psync_uint_t thissec;
+  int cls;
   uplspeed=psync_setting_get_int(_PS(maxuploadspeed));
-  if (uplspeed==0) {
+  if (uplspeed>=0) {
     writebytes=0;
+    cls=psync_shaper_get_class();
     while (num) {
-      while ((thissec=get_upload_bytes_this_sec())>=dyn_upload_speed) {
-        dyn_upload_speed=(dyn_upload_speed*PSYNC_UPL_AUTO_SHAPER_INC_PER)/100;
-//        set_send_buf(sock);
-        psync_timer_wait_next_sec();
-      }
-      log_info("dyn_upload_speed=%lu", dyn_upload_speed);
-      if (num>dyn_upload_speed-thissec)
-        wwr=dyn_upload_speed-thissec;
+      if (uplspeed)
+        wwr=psync_shaper_take(PSYNC_SHAPER_UPLOAD, cls, uplspeed, num);
       else
-        wwr=num;
-      if (!psync_socket_writable(sock)) {
-        dyn_upload_speed=(dyn_upload_speed*PSYNC_UPL_AUTO_SHAPER_DEC_PER)/100;
-        if (dyn_upload_speed<PSYNC_UPL_AUTO_SHAPER_MIN)
-          dyn_upload_speed=PSYNC_UPL_AUTO_SHAPER_MIN;
-//        set_send_buf(sock);
-        psync_milisleep(1000);
-      }
+        wwr=auto_shaper_take(PSYNC_SHAPER_UPLOAD, cls, sock, num);
       wr=psync_socket_write(sock, buff, wwr);
-      if (wr==-1)
+      if (wr==-1) {
+        psync_shaper_return(PSYNC_SHAPER_UPLOAD, cls, wwr);
         return writebytes?writebytes:wr;
+      }
+      if (wr<wwr)
+        psync_shaper_return(PSYNC_SHAPER_UPLOAD, cls, wwr-wr);
+      account_uploaded_bytes(wr);
       num-=wr;
       buff=(char *)buff+wr;
       writebytes+=wr;
-      account_uploaded_bytes(wr);
     }
     return writebytes;
   }
-  else if (uplspeed>0) {
+  writebytes=psync_socket_writeall(sock, buff, num);
+  if (writebytes>0)
+    account_uploaded_bytes(writebytes);
+  return writebytes;
+}
+
+int psync_socket_can_sendfile_upload(psync_socket *sock) {
+  return psync_socket_can_sendfile(sock);
+}
+
+int psync_socket_sendfile_upload(psync_socket *sock, psync_file_t fd, uint64_t offset, int num) {
+  psync_int_t uplspeed, writebytes, wr, wwr;
+  int cls;
+  uplspeed=psync_setting_get_int(_PS(maxuploadspeed));
+  if (uplspeed>=0) {
     writebytes=0;
+    cls=psync_shaper_get_class();
     while (num) {
-      while ((thissec=get_upload_bytes_this_sec())>=uplspeed)
-        psync_timer_wait_next_sec();
-      if (num>uplspeed-thissec)
-        wwr=uplspeed-thissec;
+      if (uplspeed)
+        wwr=psync_shaper_take(PSYNC_SHAPER_UPLOAD, cls, uplspeed, num);
       else
-        wwr=num;
-      wr=psync_socket_write(sock, buff, wwr);
-      if (wr==-1)
+        wwr=auto_shaper_take(PSYNC_SHAPER_UPLOAD, cls, sock, num);
+      wr=psync_socket_sendfile(sock, fd, offset, wwr);
+      if (wr<=0) {
+        psync_shaper_return(PSYNC_SHAPER_UPLOAD, cls, wwr);
         return writebytes?writebytes:wr;
+      }
+      account_uploaded_bytes(wr);
+      if (wr<wwr) {
+        psync_shaper_return(PSYNC_SHAPER_UPLOAD, cls, wwr-wr);
+        return writebytes+wr;
+      }
       num-=wr;
-      buff=(char *)buff+wr;
+      offset+=wr;
       writebytes+=wr;
-      account_uploaded_bytes(wr);
     }
     return writebytes;
   }
-  writebytes=psync_socket_writeall(sock, buff, num);
+  writebytes=psync_socket_sendfile(sock, fd, offset, num);
   if (writebytes>0)
     account_uploaded_bytes(writebytes);
   return writebytes;
@@ -887,7 +1222,7 @@ psync_http_socket *psync_http_connect(const char *host, const char *path, uint64
   cachekey[sizeof(cachekey)-1]=0;
   sock=(psync_socket *)psync_cache_get(cachekey);
   if (!sock) {
-    sock=psync_socket_connect_download(host, usessl?443:80, usessl);
+    sock=psync_hosts_connect(host, usessl, 1);
     if (!sock)
       goto err0;
   }
@@ -984,6 +1319,8 @@ ex:
   hsock->keepalive=keepalive;
   hsock->readbuffoff=rl;
   hsock->readbuffsize=rb;
+  hsock->timed=1;
+  hsock->readus=0;
   memcpy(hsock->cachekey, cachekey, cl);
   return hsock;
 err1:
@@ -994,6 +1331,9 @@ err0:
 }
 
 void psync_http_close(psync_http_socket *http) {
+  const char *host;
+  if (http->timed && (host=strchr(http->cachekey, '-')))
+    psync_hosts_transferred(host+1, http->readbytes, http->readus);
   if (http->keepalive>5 && http->readbytes==http->contentlength) {
 //    log_info("caching socket %s keepalive=%u, readbytes=%lu, contentlength=%lu", http->cachekey, (unsigned)http->keepalive,
 //                    (unsigned long)http->readbytes, (unsigned long)http->contentlength);
@@ -1009,6 +1349,22 @@ void psync_http_close(psync_http_socket *http) {
   psync_free(http);
 }
 
+static uint64_t psync_http_microtime() {
+  struct timespec tm;
+  psync_nanotime(&tm);
+  return tm.tv_sec*1000000ULL+tm.tv_nsec/1000;
+}
+
+// only the time spent waiting for the body counts for the throughput, not the time the caller holds the socket
+static int psync_http_read_timed(psync_http_socket *http, void *buff, int num) {
+  uint64_t start;
+  int rd;
+  start=psync_http_microtime();
+  rd=psync_socket_readall_download(http->sock, buff, num);
+  http->readus+=psync_http_microtime()-start;
+  return rd;
+}
+
 int psync_http_readall(psync_http_socket *http, void *buff, int num) {
   if (http->contentlength!=-1) {
     if ((uint64_t)num>(uint64_t)http->contentlength-http->readbytes)
@@ -1031,7 +1387,7 @@ int psync_http_readall(psync_http_socket *http, void *buff, int num) {
     }
     if (cp==num)
       return cp;
-    num=psync_socket_readall_download(http->sock, (unsigned char*)buff+cp, num-cp);
+    num=psync_http_read_timed(http, (unsigned char*)buff+cp, num-cp);
     if (num<=0)
       return cp;
     else{
@@ -1040,7 +1396,7 @@ int psync_http_readall(psync_http_socket *http, void *buff, int num) {
     }
   }
   else{
-    num=psync_socket_readall_download(http->sock, buff, num);
+    num=psync_http_read_timed(http, buff, num);
     if (num>0)
       http->readbytes+=num;
     return num;
@@ -1064,7 +1420,7 @@ static void connect_cache_thread(void *ptr) {
   connect_cache_tree_node_t *node;
   psync_socket *sock;
   node=(connect_cache_tree_node_t *)ptr;
-  sock=psync_socket_connect(node->host, node->usessl?443:80, node->usessl);
+  sock=psync_hosts_connect(node->host, node->usessl, 0);
   pthread_mutex_lock(&connect_cache_mutex);
   psync_tree_del(&connect_cache_tree, &node->tree);
   if (node->haswaiter) {
@@ -1228,7 +1584,8 @@ psync_socket *connect_cache_wait_for_http_connection(const char *host, int usess
 psync_http_socket *psync_http_connect_multihost(const binresult *hosts, const char **host) {
   psync_socket *sock;
   psync_http_socket *hsock;
-  uint32_t i;
+  const char *ordered[PSYNC_HOSTS_MAX_ORDER];
+  uint32_t i, cnt;
   int usessl, cl;
   char cachekey[256];
   usessl=psync_setting_get_bool(_PS(usessl));
@@ -1258,12 +1615,13 @@ psync_http_socket *psync_http_connect_multihost(const binresult *hosts, const ch
         break;
       }
     if (!sock) {
-      for (i=0; i<hosts->length; i++) {
-        sock=psync_socket_connect(hosts->array[i]->str, usessl?443:80, usessl);
+      cnt=psync_hosts_order(hosts, ordered);
+      for (i=0; i<cnt; i++) {
+        sock=psync_hosts_connect(ordered[i], usessl, 0);
         if (sock) {
-          cl=snprintf(cachekey, sizeof(cachekey)-1, "HTTP%d-%s", usessl, hosts->array[i]->str)+1;
+          cl=snprintf(cachekey, sizeof(cachekey)-1, "HTTP%d-%s", usessl, ordered[i])+1;
           cachekey[sizeof(cachekey)-1]=0;
-          *host=hosts->array[i]->str;
+          *host=ordered[i];
           break;
         }
       }
@@ -1281,6 +1639,8 @@ psync_http_socket *psync_http_connect_multihost(const binresult *hosts, const ch
   hsock->keepalive=0;
   hsock->readbuffoff=0;
   hsock->readbuffsize=0;
+  hsock->timed=0;
+  hsock->readus=0;
   memcpy(hsock->cachekey, cachekey, cl);
   return hsock;
 }
@@ -1319,6 +1679,8 @@ psync_http_socket *psync_http_connect_multihost_from_cache(const binresult *host
   hsock->keepalive=0;
   hsock->readbuffoff=0;
   hsock->readbuffsize=0;
+  hsock->timed=0;
+  hsock->readus=0;
   memcpy(hsock->cachekey, cachekey, cl);
   return hsock;
 }
@@ -1515,11 +1877,12 @@ static int psync_net_get_checksums(psync_socket *api, psync_fileid_t fileid, uin
   binresult *res;
   const binresult *hosts;
   const char *requestpath;
+  const char *ordered[PSYNC_HOSTS_MAX_ORDER];
   psync_http_socket *http;
   psync_file_checksums *cs;
   psync_block_checksum_header hdr;
   uint64_t result;
-  uint32_t i;
+  uint32_t i, cnt;
   char cookie[128];
   *checksums=NULL; /* gcc is not smart enough to notice that initialization is not needed */
   if (api)
@@ -1548,8 +1911,9 @@ static int psync_net_get_checksums(psync_socket *api, psync_fileid_t fileid, uin
   requestpath=psync_find_result(res, "path", PARAM_STR)->str;
   psync_slprintf(cookie, sizeof(cookie), "Cookie: dwltag=%s\015\012", psync_find_result(res, "dwltag", PARAM_STR)->str);
   http=NULL;
-  for (i=0; i<hosts->length; i++)
-    if ((http=psync_http_connect(hosts->array[i]->str, requestpath, 0, 0, cookie)))
+  cnt=psync_hosts_order(hosts, ordered);
+  for (i=0; i<cnt; i++)
+    if ((http=psync_http_connect(ordered[i], requestpath, 0, 0, cookie)))
       break;
   psync_free(res);
   if (unlikely_log(!http))
@@ -1758,14 +2122,15 @@ static void psync_net_block_match_found(psync_file_checksum_hash *restrict hash,
   psync_net_hash_remove(hash, checksums, checksums->blocks[idx].adler, checksums->blocks[idx].sha1);
 }
 
-static int psync_net_hash_has_adler(const psync_file_checksum_hash *hash, const psync_file_checksums *checksums, uint32_t adler) {
+static int psync_net_hash_has_adler(const psync_file_checksum_hash *hash, const psync_file_checksums *checksums,
+                                    const unsigned char *matched, uint32_t adler) {
   uint32_t idx, o;
   o=adler%hash->elementcnt;
   while (1) {
     idx=hash->elements[o];
     if (!idx)
       return 0;
-    else if (checksums->blocks[idx-1].adler==adler)
+    else if (checksums->blocks[idx-1].adler==adler && (!matched || !matched[idx-1]))
       return 1;
     else if (++o>=hash->elementcnt)
       o=0;
@@ -1787,141 +2152,62 @@ static uint32_t psync_net_hash_has_adler_and_sha1(const psync_file_checksum_hash
   }
 }
 
-#define ADLER32_1(o) adler+=buff[o]; sum+=adler
-#define ADLER32_2(o) ADLER32_1(o); ADLER32_1(o+1)
-#define ADLER32_4(o) ADLER32_2(o); ADLER32_2(o+2)
-#define ADLER32_8(o) ADLER32_4(o); ADLER32_4(o+4)
-#define ADLER32_16() do{ ADLER32_8(0); ADLER32_8(8); } while (0)
-
-#define ADLER32_BASE    65521U
-#define ADLER32_NMAX    5552U
-#define ADLER32_INITIAL 1U
+typedef struct {
+  psync_file_checksums *checksums;
+  psync_file_checksum_hash *hash;
+  unsigned char *matched;
+} block_check_t;
 
-static uint32_t adler32(uint32_t adler, const unsigned char *buff, size_t len) {
-  uint32_t sum, i;
-  sum=adler>>16;
-  adler&=0xffff;
-  while (len>=ADLER32_NMAX) {
-    len-=ADLER32_NMAX;
-    for (i=0; i<ADLER32_NMAX/16; i++) {
-      ADLER32_16();
-      buff+=16;
-    }
-    adler%=ADLER32_BASE;
-    sum%=ADLER32_BASE;
-  }
-  while (len>=16) {
-    len-=16;
-    ADLER32_16();
-    buff+=16;
-  }
-  while (len--) {
-    adler+=*buff++;
-    sum+=adler;
-  }
-  adler%=ADLER32_BASE;
-  sum%=ADLER32_BASE;
-  return adler|(sum<<16);
+/* Runs on the block scan threads, the hash is not modified until the scan is over. Downloads need every block only
+ * once, so they pass matched flags and the first thread to find a block takes it.
+ */
+static uint32_t psync_net_check_block(void *ptr, uint32_t adler, const unsigned char *data) {
+  block_check_t *bc;
+  unsigned char sha1bin[PSYNC_SHA1_DIGEST_LEN];
+  uint32_t idx;
+  bc=(block_check_t *)ptr;
+  if (!psync_net_hash_has_adler(bc->hash, bc->checksums, bc->matched, adler))
+    return 0;
+  psync_sha1(data, bc->checksums->blocksize, sha1bin);
+  idx=psync_net_hash_has_adler_and_sha1(bc->hash, bc->checksums, adler, sha1bin);
+  if (idx && bc->matched && !__sync_bool_compare_and_swap(&bc->matched[idx-1], 0, 1))
+    return 0;
+  return idx;
 }
 
-static uint32_t adler32_roll(uint32_t adler, unsigned char byteout, unsigned char bytein, uint32_t len) {
-  uint32_t sum;
-  sum=adler>>16;
-  adler&=0xffff;
-  adler+=ADLER32_BASE+bytein-byteout;
-  sum=(ADLER32_BASE*ADLER32_BASE+sum-len*byteout-ADLER32_INITIAL+adler)%ADLER32_BASE;
-  /* dividing after sum calculation gives processor a chance to run the divisions in parallel */
-  adler%=ADLER32_BASE;
-  return adler|(sum<<16);
+static psync_blockscan_t *psync_net_create_blockscan(block_check_t *bc) {
+  psync_blockscan_t *bs;
+  uint32_t i;
+  bs=psync_blockscan_create(bc->checksums->blocksize, bc->checksums->blockcnt, psync_net_check_block, bc);
+  for (i=0; i<bc->checksums->blockcnt; i++)
+    psync_blockscan_add(bs, bc->checksums->blocks[i].adler);
+  return bs;
 }
 
 static void psync_net_check_file_for_blocks(const char *name, psync_file_checksums *restrict checksums,
-                                            psync_file_checksum_hash *restrict hash, psync_block_action *restrict blockactions,
-                                            uint32_t fileidx) {
-  unsigned char *buff;
-  uint64_t buffoff;
-  psync_uint_t buffersize, hbuffersize, bufferlen, inbyteoff, outbyteoff, blockmask;
-  ssize_t rd;
+                                            psync_file_checksum_hash *restrict hash, const psync_blockscan_t *bs,
+                                            psync_block_action *restrict blockactions, uint32_t fileidx) {
+  psync_blockscan_match_t *matches;
+  uint64_t len;
+  int64_t fsize;
+  uint32_t matchcnt, i;
   psync_file_t fd;
-  uint32_t adler, off;
-  psync_sha1_ctx ctx;
-  unsigned char sha1bin[PSYNC_SHA1_DIGEST_LEN];
   log_info("scanning file %s for blocks", name);
   fd=psync_file_open(name, P_O_RDONLY, 0);
   if (fd==INVALID_HANDLE_VALUE)
     return;
-  if (checksums->blocksize*2>PSYNC_COPY_BUFFER_SIZE)
-    buffersize=checksums->blocksize*2;
-  else
-    buffersize=PSYNC_COPY_BUFFER_SIZE;
-  hbuffersize=buffersize/2;
-  buff=psync_malloc(buffersize);
-  rd=psync_file_read(fd, buff, hbuffersize);
-  if (unlikely(rd<(ssize_t)hbuffersize)) {
-    if (rd<(ssize_t)checksums->blocksize) {
-      psync_free(buff);
-      psync_file_close(fd);
-      return;
-    }
-    bufferlen=(rd+checksums->blocksize-1)/checksums->blocksize*checksums->blocksize;
-    memset(buff+rd, 0, bufferlen-rd);
+  fsize=psync_file_size(fd);
+  if (fsize<(int64_t)checksums->blocksize) {
+    psync_file_close(fd);
+    return;
   }
-  else
-    bufferlen=buffersize;
-  adler=adler32(ADLER32_INITIAL, buff, checksums->blocksize);
-  outbyteoff=0;
-  buffoff=0;
-  inbyteoff=checksums->blocksize;
-  blockmask=checksums->blocksize-1;
-  while (1) {
-    if (psync_net_hash_has_adler(hash, checksums, adler)) {
-      if (outbyteoff<inbyteoff)
-        psync_sha1(buff+outbyteoff, checksums->blocksize, sha1bin);
-      else{
-        psync_sha1_init(&ctx);
-        psync_sha1_update(&ctx, buff+outbyteoff, buffersize-outbyteoff);
-        psync_sha1_update(&ctx, buff, inbyteoff);
-        psync_sha1_final(sha1bin, &ctx);
-      }
-      off=psync_net_hash_has_adler_and_sha1(hash, checksums, adler, sha1bin);
-      if (off)
-        psync_net_block_match_found(hash, checksums, blockactions, off, fileidx, buffoff+outbyteoff);
-    }
-    if (unlikely((inbyteoff&blockmask)==0)) {
-      if (outbyteoff>=bufferlen) {
-        outbyteoff=0;
-        buffoff+=buffersize;
-      }
-      if (inbyteoff==bufferlen) { /* not >=, bufferlen might be lower than current inbyteoff */
-        if (bufferlen!=buffersize)
-          break;
-        inbyteoff=0;
-        rd=psync_file_read(fd, buff, hbuffersize);
-        if (unlikely(rd!=hbuffersize)) {
-          if (rd<=0)
-            break;
-          else{
-            bufferlen=(rd+checksums->blocksize-1)/checksums->blocksize*checksums->blocksize;
-            memset(buff+rd, 0, bufferlen-rd);
-          }
-        }
-      }
-      else if (inbyteoff==hbuffersize) {
-        rd=psync_file_read(fd, buff+hbuffersize, hbuffersize);
-        if (unlikely(rd!=hbuffersize)) {
-          if (rd<=0)
-            break;
-          else{
-            bufferlen=(rd+checksums->blocksize-1)/checksums->blocksize*checksums->blocksize;
-            memset(buff+hbuffersize+rd, 0, bufferlen-rd);
-            bufferlen+=hbuffersize;
-          }
-        }
-      }
-    }
-    adler=adler32_roll(adler, buff[outbyteoff++], buff[inbyteoff++], checksums->blocksize);
+  /* the last window ends with the last, zero padded, block of the file */
+  len=(fsize+checksums->blocksize-1)/checksums->blocksize*checksums->blocksize-checksums->blocksize+1;
+  if (!psync_blockscan_file(bs, fd, 0, len, 0, &matches, &matchcnt)) {
+    for (i=0; i<matchcnt; i++)
+      psync_net_block_match_found(hash, checksums, blockactions, matches[i].idx, fileidx, matches[i].off);
+    psync_free(matches);
   }
-  psync_free(buff);
   psync_file_close(fd);
 }
 
@@ -1930,7 +2216,9 @@ int psync_net_download_ranges(psync_list *ranges, psync_fileid_t fileid, uint64_
   psync_file_checksums *checksums;
   psync_file_checksum_hash *hash;
   psync_block_action *blockactions;
-  uint32_t i, bs;
+  psync_blockscan_t *bs;
+  block_check_t bc;
+  uint32_t i, blen;
   int rt;
   if (!filecnt)
     goto fulldownload;
@@ -1946,8 +2234,15 @@ int psync_net_download_ranges(psync_list *ranges, psync_fileid_t fileid, uint64_
   hash=psync_net_create_hash(checksums);
   blockactions=psync_new_cnt(psync_block_action, checksums->blockcnt);
   memset(blockactions, 0, sizeof(psync_block_action)*checksums->blockcnt);
+  bc.checksums=checksums;
+  bc.hash=hash;
+  bc.matched=psync_new_cnt(unsigned char, checksums->blockcnt);
+  memset(bc.matched, 0, checksums->blockcnt);
+  bs=psync_net_create_blockscan(&bc);
   for (i=0; i<filecnt; i++)
-    psync_net_check_file_for_blocks(files[i], checksums, hash, blockactions, i);
+    psync_net_check_file_for_blocks(files[i], checksums, hash, bs, blockactions, i);
+  psync_blockscan_destroy(bs);
+  psync_free(bc.matched);
   psync_free(hash);
   range=psync_new(psync_range_list_t);
   range->len=checksums->blocksize;
@@ -1961,16 +2256,16 @@ int psync_net_download_ranges(psync_list *ranges, psync_fileid_t fileid, uint64_
   psync_list_add_tail(ranges, &range->list);
   for (i=1; i<checksums->blockcnt; i++) {
     if (i==checksums->blockcnt-1) {
-      bs=checksums->filesize%checksums->blocksize;
-      if (!bs)
-        bs=checksums->blocksize;
+      blen=checksums->filesize%checksums->blocksize;
+      if (!blen)
+        blen=checksums->blocksize;
     }
     else
-      bs=checksums->blocksize;
+      blen=checksums->blocksize;
     if (blockactions[i].type!=range->type || (range->type==PSYNC_RANGE_COPY &&
          (range->filename!=files[blockactions[i].idx] || range->off+range->len!=blockactions[i].off))) {
       range=psync_new(psync_range_list_t);
-      range->len=bs;
+      range->len=blen;
       range->type=blockactions[i].type;
       if (range->type==PSYNC_RANGE_COPY) {
         range->off=blockactions[i].off;
@@ -1981,7 +2276,7 @@ int psync_net_download_ranges(psync_list *ranges, psync_fileid_t fileid, uint64_
       psync_list_add_tail(ranges, &range->list);
     }
     else
-      range->len+=bs;
+      range->len+=blen;
   }
   psync_free(checksums);
   psync_free(blockactions);
@@ -1995,123 +2290,34 @@ fulldownload:
   return PSYNC_NET_OK;
 }
 
-static int check_range_for_blocks(psync_file_checksums *checksums, psync_file_checksum_hash *hash,
+static int check_range_for_blocks(psync_file_checksums *checksums, const psync_blockscan_t *bs,
                                   uint64_t off, uint64_t len, psync_file_t fd, psync_list *nr) {
-  unsigned char *buff;
+  psync_blockscan_match_t *matches;
   psync_upload_range_list_t *ur;
-  uint64_t buffoff, blen;
-  psync_uint_t buffersize, hbuffersize, bufferlen, inbyteoff, outbyteoff, blockmask;
-  ssize_t rd;
-  uint32_t adler, blockidx;
-  int32_t skipbytes;
-  psync_sha1_ctx ctx;
-  unsigned char sha1bin[PSYNC_SHA1_DIGEST_LEN];
-  if (unlikely_log(psync_file_seek(fd, off, P_SEEK_SET)==-1))
-    return PSYNC_NET_TEMPFAIL;
+  uint64_t blen;
+  uint32_t matchcnt, i;
   log_info("scanning in range starting %lu, length %lu, blocksize %u", (unsigned long)off, (unsigned long)len, (unsigned)checksums->blocksize);
-  if (checksums->blocksize*2>PSYNC_COPY_BUFFER_SIZE || len<PSYNC_COPY_BUFFER_SIZE)
-    buffersize=checksums->blocksize*2;
-  else
-    buffersize=PSYNC_COPY_BUFFER_SIZE;
-  hbuffersize=buffersize/2;
-  buff=psync_malloc(buffersize);
-  rd=psync_file_read(fd, buff, hbuffersize);
-  if (unlikely(rd<(ssize_t)hbuffersize)) {
-    psync_free(buff);
-    return PSYNC_NET_OK;
-  }
-  else
-    bufferlen=buffersize;
-  adler=adler32(ADLER32_INITIAL, buff, checksums->blocksize);
-  outbyteoff=0;
-  buffoff=0;
-  inbyteoff=checksums->blocksize;
-  blockmask=checksums->blocksize-1;
+  if (unlikely_log(psync_blockscan_file(bs, fd, off, len, PSYNC_BLOCKSCAN_GREEDY, &matches, &matchcnt)))
+    return PSYNC_NET_TEMPFAIL;
   ur=NULL;
-  skipbytes=-1;
-  while (buffoff+outbyteoff<len) {
-    if (psync_net_hash_has_adler(hash, checksums, adler)) {
-      if (outbyteoff<inbyteoff)
-        psync_sha1(buff+outbyteoff, checksums->blocksize, sha1bin);
-      else{
-        psync_sha1_init(&ctx);
-        psync_sha1_update(&ctx, buff+outbyteoff, buffersize-outbyteoff);
-        psync_sha1_update(&ctx, buff, inbyteoff);
-        psync_sha1_final(sha1bin, &ctx);
-      }
-      blockidx=psync_net_hash_has_adler_and_sha1(hash, checksums, adler, sha1bin);
-      if (blockidx) {
-        //log_info("got block, buffoff+outbyteoff=%lu, off=%lu, blockidx=%u", buffoff+outbyteoff, off, (unsigned)(blockidx-1));
-        if (buffoff+outbyteoff+checksums->blocksize<=len)
-          blen=checksums->blocksize;
-        else
-          blen=len-buffoff-outbyteoff;
-        if (ur && ur->off+ur->len==(uint64_t)(blockidx-1)*checksums->blocksize && ur->uploadoffset+ur->len==off+buffoff+outbyteoff)
-          ur->len+=blen;
-        else{
-          ur=psync_new(psync_upload_range_list_t);
-          ur->uploadoffset=off+buffoff+outbyteoff;
-          ur->off=(uint64_t)(blockidx-1)*checksums->blocksize;
-          ur->len=blen;
-          psync_list_add_tail(nr, &ur->list);
-        }
-        if (blen!=checksums->blocksize)
-          break;
-        blockidx=checksums->blocksize-(inbyteoff&blockmask);
-        if (blockidx==checksums->blocksize)
-          blockidx=0;
-        skipbytes=checksums->blocksize-blockidx;
-        inbyteoff+=blockidx;
-        outbyteoff+=blockidx;
-      }
-    }
-    if (unlikely((inbyteoff&blockmask)==0)) {
-      if (outbyteoff>=buffersize) {
-        outbyteoff-=buffersize;
-        buffoff+=buffersize;
-      }
-      if (inbyteoff==bufferlen) { /* not >=, bufferlen might be lower than current inbyteoff */
-        if (bufferlen!=buffersize)
-          break;
-        inbyteoff=0;
-        rd=psync_file_read(fd, buff, hbuffersize);
-        if (unlikely(rd!=hbuffersize)) {
-          if (rd<=0)
-            break;
-          else{
-            bufferlen=(rd+checksums->blocksize-1)/checksums->blocksize*checksums->blocksize;
-            memset(buff+rd, 0, bufferlen-rd);
-          }
-        }
-      }
-      else if (inbyteoff==hbuffersize) {
-        rd=psync_file_read(fd, buff+hbuffersize, hbuffersize);
-        if (unlikely(rd!=hbuffersize)) {
-          if (rd<=0)
-            break;
-          else{
-            bufferlen=(rd+checksums->blocksize-1)/checksums->blocksize*checksums->blocksize;
-            memset(buff+hbuffersize+rd, 0, bufferlen-rd);
-            bufferlen+=hbuffersize;
-          }
-        }
-      }
-      if (skipbytes!=-1) {
-        inbyteoff+=skipbytes;
-        outbyteoff+=skipbytes;
-        skipbytes=-1;
-        if (outbyteoff<inbyteoff)
-          adler=adler32(ADLER32_INITIAL, buff+outbyteoff, checksums->blocksize);
-        else{
-          adler=adler32(ADLER32_INITIAL, buff+outbyteoff, buffersize-outbyteoff);
-          adler=adler32(adler, buff, inbyteoff);
-        }
-        continue;
-      }
+  for (i=0; i<matchcnt; i++) {
+    if (matches[i].off+checksums->blocksize<=off+len)
+      blen=checksums->blocksize;
+    else
+      blen=off+len-matches[i].off;
+    if (ur && ur->off+ur->len==(uint64_t)(matches[i].idx-1)*checksums->blocksize && ur->uploadoffset+ur->len==matches[i].off)
+      ur->len+=blen;
+    else{
+      ur=psync_new(psync_upload_range_list_t);
+      ur->uploadoffset=matches[i].off;
+      ur->off=(uint64_t)(matches[i].idx-1)*checksums->blocksize;
+      ur->len=blen;
+      psync_list_add_tail(nr, &ur->list);
     }
-    adler=adler32_roll(adler, buff[outbyteoff++], buff[inbyteoff++], checksums->blocksize);
+    if (blen!=checksums->blocksize)
+      break;
   }
-  psync_free(buff);
+  psync_free(matches);
   return PSYNC_NET_OK;
 }
 
@@ -2161,6 +2367,8 @@ static void merge_list_to_element(psync_upload_range_list_t *le, psync_list *rli
 int psync_net_scan_file_for_blocks(psync_socket *api, psync_list *rlist, psync_fileid_t fileid, uint64_t filehash, psync_file_t fd) {
   psync_file_checksums *checksums;
   psync_file_checksum_hash *hash;
+  psync_blockscan_t *bs;
+  block_check_t bc;
   psync_list *l, *lb;
   psync_upload_range_list_t *ur, *le;
   psync_list nr;
@@ -2172,12 +2380,17 @@ int psync_net_scan_file_for_blocks(psync_socket *api, psync_list *rlist, psync_f
   else if (unlikely_log(rt==PSYNC_NET_TEMPFAIL))
     return PSYNC_NET_TEMPFAIL;
   hash=psync_net_create_hash(checksums);
+  bc.checksums=checksums;
+  bc.hash=hash;
+  bc.matched=NULL;
+  bs=psync_net_create_blockscan(&bc);
   psync_list_for_each_safe(l, lb, rlist) {
     ur=psync_list_element(l, psync_upload_range_list_t, list);
     if (ur->len<checksums->blocksize || ur->type!=PSYNC_URANGE_UPLOAD)
       continue;
     psync_list_init(&nr);
-    if (check_range_for_blocks(checksums, hash, ur->off, ur->len, fd, &nr)==PSYNC_NET_TEMPFAIL) {
+    if (check_range_for_blocks(checksums, bs, ur->off, ur->len, fd, &nr)==PSYNC_NET_TEMPFAIL) {
+      psync_blockscan_destroy(bs);
       psync_free(hash);
       psync_free(checksums);
       return PSYNC_NET_TEMPFAIL;
@@ -2191,6 +2404,7 @@ int psync_net_scan_file_for_blocks(psync_socket *api, psync_list *rlist, psync_f
       merge_list_to_element(ur, &nr);
     }
   }
+  psync_blockscan_destroy(bs);
   psync_free(hash);
   psync_free(checksums);
   return PSYNC_NET_OK;
@@ -2199,6 +2413,8 @@ int psync_net_scan_file_for_blocks(psync_socket *api, psync_list *rlist, psync_f
 int psync_net_scan_upload_for_blocks(psync_socket *api, psync_list *rlist, psync_uploadid_t uploadid, psync_file_t fd) {
   psync_file_checksums *checksums;
   psync_file_checksum_hash *hash;
+  psync_blockscan_t *bs;
+  block_check_t bc;
   psync_list *l, *lb;
   psync_upload_range_list_t *ur, *le;
   psync_list nr;
@@ -2210,12 +2426,17 @@ int psync_net_scan_upload_for_blocks(psync_socket *api, psync_list *rlist, psync
   else if (unlikely_log(rt==PSYNC_NET_TEMPFAIL))
     return PSYNC_NET_TEMPFAIL;
   hash=psync_net_create_hash(checksums);
+  bc.checksums=checksums;
+  bc.hash=hash;
+  bc.matched=NULL;
+  bs=psync_net_create_blockscan(&bc);
   psync_list_for_each_safe(l, lb, rlist) {
     ur=psync_list_element(l, psync_upload_range_list_t, list);
     if (ur->len<checksums->blocksize || ur->type!=PSYNC_URANGE_UPLOAD)
       continue;
     psync_list_init(&nr);
-    if (check_range_for_blocks(checksums, hash, ur->off, ur->len, fd, &nr)==PSYNC_NET_TEMPFAIL) {
+    if (check_range_for_blocks(checksums, bs, ur->off, ur->len, fd, &nr)==PSYNC_NET_TEMPFAIL) {
+      psync_blockscan_destroy(bs);
       psync_free(hash);
       psync_free(checksums);
       return PSYNC_NET_TEMPFAIL;
@@ -2228,6 +2449,7 @@ int psync_net_scan_upload_for_blocks(psync_socket *api, psync_list *rlist, psync
       merge_list_to_element(ur, &nr);
     }
   }
+  psync_blockscan_destroy(bs);
   psync_free(hash);
   psync_free(checksums);
   return PSYNC_NET_OK;
@@ -2393,6 +2615,262 @@ int psync_get_upload_checksum(psync_uploadid_t uploadid, unsigned char *uhash, u
   return PSYNC_NET_OK;
 }
 
+/* Large uploads are cut into chunks at PSYNC_UPLOAD_CHUNK_SIZE boundaries of the file and written with upload_write at
+ * explicit offsets over up to PSYNC_UPLOAD_CHUNK_WORKERS API connections. Each chunk is retried on its own. Chunks the
+ * server acknowledged are recorded in uploadchunk, so an interrupted upload skips them when it is resumed instead of
+ * starting over after the first hole. The rows carry the size and modification time of the file they were read from and
+ * are discarded once the file no longer matches. The caller still has to verify the whole upload with upload_info. */
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  psync_uploadid_t uploadid;
+  psync_file_t fd;
+  uint64_t filesize;
+  uint64_t filemtime;
+  uint64_t next;
+  uint64_t end;
+  psync_full_result_int *acked;
+  uint32_t ackedidx;
+  uint32_t running;
+  const uint32_t *statuses;
+  uint32_t statusescnt;
+  const int *stop;
+  psync_upload_chunks_progress progress;
+  void *ptr;
+  int shaperclass;
+  int ret;
+} upload_chunks_t;
+
+static int upload_chunk_acked(upload_chunks_t *uc, uint64_t off, uint64_t end) {
+  uint64_t aoff;
+  while (uc->ackedidx<uc->acked->rows &&
+         psync_get_result_cell(uc->acked, uc->ackedidx, 0)+psync_get_result_cell(uc->acked, uc->ackedidx, 1)<=off)
+    uc->ackedidx++;
+  if (uc->ackedidx==uc->acked->rows)
+    return 0;
+  aoff=psync_get_result_cell(uc->acked, uc->ackedidx, 0);
+  return aoff<=off && aoff+psync_get_result_cell(uc->acked, uc->ackedidx, 1)>=end;
+}
+
+static int upload_chunk_next_locked(upload_chunks_t *uc, uint64_t *off, uint64_t *len) {
+  uint64_t end;
+  while (uc->ret==PSYNC_NET_OK && uc->next<uc->end && !*uc->stop) {
+    end=(uc->next/PSYNC_UPLOAD_CHUNK_SIZE+1)*PSYNC_UPLOAD_CHUNK_SIZE;
+    if (end>uc->end)
+      end=uc->end;
+    *off=uc->next;
+    *len=end-uc->next;
+    uc->next=end;
+    if (upload_chunk_acked(uc, *off, end)) {
+      log_debug("chunk of %lu bytes at offset %lu of upload %lu is already acknowledged", (unsigned long)*len, (unsigned long)*off,
+                (unsigned long)uc->uploadid);
+      uc->progress(uc->ptr, *len);
+      continue;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+static int upload_chunk_write(upload_chunks_t *uc, psync_socket *api, void *buff, uint64_t off, uint64_t len, uint64_t *reported) {
+  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("uploadoffset", off), P_NUM("uploadid", uc->uploadid)};
+  psync_sql_res *res;
+  binresult *bres;
+  uint64_t result, wr;
+  size_t rd;
+  ssize_t rrd;
+  int zerocopy;
+  if (unlikely_log(!do_send_command(api, "upload_write", strlen("upload_write"), params, ARRAY_SIZE(params), len, 0)))
+    return PSYNC_NET_TEMPFAIL;
+  zerocopy=psync_socket_can_sendfile_upload(api);
+  wr=0;
+  while (wr<len) {
+    if (unlikely(*uc->stop))
+      return PSYNC_NET_TEMPFAIL;
+    psync_wait_statuses_array(uc->statuses, uc->statusescnt);
+    if (len-wr>PSYNC_COPY_BUFFER_SIZE)
+      rd=PSYNC_COPY_BUFFER_SIZE;
+    else
+      rd=len-wr;
+    if (zerocopy) {
+      rrd=psync_socket_sendfile_upload(api, uc->fd, off+wr, rd);
+      if (unlikely_log(rrd!=rd))
+        return PSYNC_NET_TEMPFAIL;
+    }
+    else {
+      rrd=psync_file_pread(uc->fd, buff, rd, off+wr);
+      if (unlikely_log(rrd<=0))
+        return PSYNC_NET_TEMPFAIL;
+      if (unlikely_log(psync_socket_writeall_upload(api, buff, rrd)!=rrd))
+        return PSYNC_NET_TEMPFAIL;
+    }
+    wr+=rrd;
+    // a retried chunk only reports the bytes that the failed attempts did not
+    if (wr>*reported) {
+      pthread_mutex_lock(&uc->mutex);
+      uc->progress(uc->ptr, wr-*reported);
+      pthread_mutex_unlock(&uc->mutex);
+      *reported=wr;
+    }
+  }
+  bres=get_result(api);
+  if (unlikely_log(!bres))
+    return PSYNC_NET_TEMPFAIL;
+  result=psync_find_result(bres, "result", PARAM_NUM)->num;
+  psync_free(bres);
+  if (unlikely(result)) {
+    log_warn("upload_write of %lu bytes at offset %lu returned error %lu", (unsigned long)len, (unsigned long)off, (unsigned long)result);
+    psync_process_api_error(result);
+    return psync_handle_api_result(result);
+  }
+  res=psync_sql_prep_statement("REPLACE INTO uploadchunk (uploadid, uploadoffset, length, filesize, filemtime) VALUES (?, ?, ?, ?, ?)");
+  psync_sql_bind_uint(res, 1, uc->uploadid);
+  psync_sql_bind_uint(res, 2, off);
+  psync_sql_bind_uint(res, 3, len);
+  psync_sql_bind_uint(res, 4, uc->filesize);
+  psync_sql_bind_uint(res, 5, uc->filemtime);
+  psync_sql_run_free(res);
+  return PSYNC_NET_OK;
+}
+
+static void upload_chunks_thread(void *ptr) {
+  upload_chunks_t *uc;
+  psync_socket *api;
+  void *buff;
+  uint64_t off, len, reported;
+  uint32_t tries;
+  int ret;
+  uc=(upload_chunks_t *)ptr;
+  psync_shaper_set_class(uc->shaperclass);
+  api=NULL;
+  buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
+  pthread_mutex_lock(&uc->mutex);
+  while (upload_chunk_next_locked(uc, &off, &len)) {
+    pthread_mutex_unlock(&uc->mutex);
+    reported=0;
+    tries=0;
+    while (1) {
+      if (!api)
+        api=psync_apipool_get();
+      if (likely(api))
+        ret=upload_chunk_write(uc, api, buff, off, len, &reported);
+      else
+        ret=PSYNC_NET_TEMPFAIL;
+      if (ret==PSYNC_NET_OK)
+        break;
+      if (api) {
+        psync_apipool_release_bad(api);
+        api=NULL;
+      }
+      if (ret==PSYNC_NET_PERMFAIL || *uc->stop || ++tries>=PSYNC_UPLOAD_CHUNK_RETRIES)
+        break;
+      log_warn("retrying chunk of %lu bytes at offset %lu of upload %lu", (unsigned long)len, (unsigned long)off, (unsigned long)uc->uploadid);
+      psync_milisleep(PSYNC_SLEEP_ON_FAILED_UPLOAD);
+    }
+    pthread_mutex_lock(&uc->mutex);
+    if (ret!=PSYNC_NET_OK && uc->ret==PSYNC_NET_OK)
+      uc->ret=ret;
+  }
+  if (--uc->running==0)
+    pthread_cond_signal(&uc->cond);
+  pthread_mutex_unlock(&uc->mutex);
+  if (api)
+    psync_apipool_release(api);
+  psync_free(buff);
+}
+
+static void upload_forget_stale_chunks(psync_uploadid_t uploadid, psync_stat_t *st) {
+  psync_sql_res *res;
+  uint32_t aff;
+  res=psync_sql_prep_statement("DELETE FROM uploadchunk WHERE uploadid=? AND (filesize IS NOT ? OR filemtime IS NOT ?)");
+  psync_sql_bind_uint(res, 1, uploadid);
+  psync_sql_bind_uint(res, 2, psync_stat_size(st));
+  psync_sql_bind_uint(res, 3, psync_stat_mtime(st));
+  psync_sql_run_free(res);
+  aff=psync_sql_affected_rows();
+  if (aff)
+    log_info("discarded %u chunks of upload %lu, the file changed since they were written", (unsigned)aff, (unsigned long)uploadid);
+}
+
+int psync_upload_chunks(psync_uploadid_t uploadid, const char *localpath, uint64_t offset, uint64_t length, const uint32_t *statuses,
+                        uint32_t statusescnt, const int *stop, psync_upload_chunks_progress progress, void *ptr) {
+  upload_chunks_t uc;
+  psync_sql_res *res;
+  psync_stat_t st;
+  uint64_t chunks;
+  uint32_t i;
+  uc.fd=psync_file_open(localpath, P_O_RDONLY, 0);
+  if (unlikely(uc.fd==INVALID_HANDLE_VALUE)) {
+    log_warn("could not open local file %s", localpath);
+    return PSYNC_NET_TEMPFAIL;
+  }
+  if (unlikely_log(psync_fstat(uc.fd, &st))) {
+    psync_file_close(uc.fd);
+    return PSYNC_NET_TEMPFAIL;
+  }
+  upload_forget_stale_chunks(uploadid, &st);
+  res=psync_sql_query_rdlock("SELECT uploadoffset, length FROM uploadchunk WHERE uploadid=? ORDER BY uploadoffset");
+  psync_sql_bind_uint(res, 1, uploadid);
+  uc.acked=psync_sql_fetchall_int(res);
+  pthread_mutex_init(&uc.mutex, NULL);
+  pthread_cond_init(&uc.cond, NULL);
+  uc.uploadid=uploadid;
+  uc.filesize=psync_stat_size(&st);
+  uc.filemtime=psync_stat_mtime(&st);
+  uc.next=offset;
+  uc.end=offset+length;
+  uc.ackedidx=0;
+  uc.statuses=statuses;
+  uc.statusescnt=statusescnt;
+  uc.stop=stop;
+  uc.progress=progress;
+  uc.ptr=ptr;
+  uc.shaperclass=psync_shaper_get_class();
+  uc.ret=PSYNC_NET_OK;
+  chunks=(length+PSYNC_UPLOAD_CHUNK_SIZE-1)/PSYNC_UPLOAD_CHUNK_SIZE;
+  if (chunks>PSYNC_UPLOAD_CHUNK_WORKERS)
+    chunks=PSYNC_UPLOAD_CHUNK_WORKERS;
+  uc.running=chunks;
+  log_info("uploading %lu bytes of %s at offset %lu over %u connections, %u chunks already acknowledged", (unsigned long)length,
+           localpath, (unsigned long)offset, (unsigned)chunks, (unsigned)uc.acked->rows);
+  for (i=1; i<chunks; i++)
+    psync_run_thread1("upload chunk", upload_chunks_thread, &uc);
+  upload_chunks_thread(&uc);
+  pthread_mutex_lock(&uc.mutex);
+  while (uc.running)
+    pthread_cond_wait(&uc.cond, &uc.mutex);
+  pthread_mutex_unlock(&uc.mutex);
+  if (uc.ret==PSYNC_NET_OK && *stop)
+    uc.ret=PSYNC_NET_TEMPFAIL;
+  pthread_cond_destroy(&uc.cond);
+  pthread_mutex_destroy(&uc.mutex);
+  psync_free(uc.acked);
+  psync_file_close(uc.fd);
+  return uc.ret;
+}
+
+int psync_upload_has_chunks(psync_uploadid_t uploadid, const char *localpath) {
+  psync_sql_res *res;
+  psync_stat_t st;
+  int ret;
+  if (psync_stat(localpath, &st))
+    return 0;
+  upload_forget_stale_chunks(uploadid, &st);
+  res=psync_sql_query_rdlock("SELECT uploadid FROM uploadchunk WHERE uploadid=? LIMIT 1");
+  psync_sql_bind_uint(res, 1, uploadid);
+  ret=psync_sql_fetch_rowint(res)!=NULL;
+  psync_sql_free_result(res);
+  return ret;
+}
+
+void psync_upload_forget_chunks(psync_uploadid_t uploadid) {
+  psync_sql_res *res;
+  res=psync_sql_prep_statement("DELETE FROM uploadchunk WHERE uploadid=?");
+  psync_sql_bind_uint(res, 1, uploadid);
+  psync_sql_run_free(res);
+}
+
 void psync_logout2(uint32_t auth_status, int doinvauth);
 
 static void logout2_thread() {
@@ -2415,6 +2893,7 @@ void psync_netlibs_init() {
   sprintf(apikey, "API:%s", apiserver);
 
   psync_timer_register(psync_netlibs_timer, 1, NULL);
+  psync_timer_register(psync_hosts_timer, PSYNC_HOSTS_SAVE_INTERVAL, NULL);
 #ifdef __APPLE__
   dispatch_semaphore_t *sem = &api_pool_sem;
   *sem = dispatch_semaphore_create(PSYNC_APIPOOL_MAXACTIVE);
@@ -16,6 +16,7 @@
 #include "psynclib.h"
 #include "plist.h"
 #include "papi.h"
+#include "psettings.h"
 
 #define psync_api_run_command(cmd, params) psync_do_api_run_command(cmd, strlen(cmd), params, sizeof(params)/sizeof(binparam))
 #define psync_run_command(cmd, params, err) psync_do_run_command_res(cmd, strlen(cmd), params, sizeof(params)/sizeof(binparam), err)
@@ -34,6 +35,8 @@ typedef struct {
   uint32_t keepalive;
   uint32_t readbuffoff;
   uint32_t readbuffsize;
+  uint32_t timed;
+  uint64_t readus;
   char cachekey[];
 } psync_http_socket;
 
@@ -73,11 +76,23 @@ struct _psync_file_lock_t;
 
 typedef struct _psync_file_lock_t psync_file_lock_t;
 
-extern char apiserver[64];
+#define PSYNC_APISERVER_LEN 64
+
+typedef struct {
+  char host[PSYNC_HOSTS_NAME_LEN];
+  uint32_t connectms;
+  uint32_t kbps;
+  uint32_t failures;
+  time_t backoffuntil;
+  time_t lastused;
+} psync_host_score_t;
 
 void psync_netlibs_init();
 
 void psync_apipool_set_server(const char *binapi);
+// copies the current API server to server, which has room for PSYNC_APISERVER_LEN bytes
+void psync_apipool_get_server(char *server);
+void psync_apipool_set_servers(const binresult *binapi);
 
 psync_socket *psync_apipool_get();
 psync_socket *psync_apipool_get_from_cache();
@@ -100,9 +115,16 @@ int psync_file_writeall_checkoverquota(psync_file_t fd, const void *buf, size_t
 
 int psync_set_default_sendbuf(psync_socket *sock);
 void psync_account_downloaded_bytes(int unsigned bytes);
+psync_socket *psync_socket_connect_download(const char *host, int unsigned port, int usessl);
 int psync_socket_readall_download(psync_socket *sock, void *buff, int num);
 int psync_socket_readall_download_thread(psync_socket *sock, void *buff, int num);
 int psync_socket_writeall_upload(psync_socket *sock, const void *buff, int num);
+int psync_socket_can_sendfile_upload(psync_socket *sock);
+int psync_socket_sendfile_upload(psync_socket *sock, psync_file_t fd, uint64_t offset, int num);
+
+uint32_t psync_hosts_order(const binresult *hosts, const char **ordered);
+uint32_t psync_hosts_order_names(const psync_host_score_t *scores, uint32_t scorecnt, time_t now,
+                                 const char *const *names, uint32_t cnt, const char **ordered);
 
 psync_http_socket *psync_http_connect(const char *host, const char *path, uint64_t from, uint64_t to, const char *addhdr);
 void psync_http_close(psync_http_socket *http);
@@ -128,6 +150,14 @@ void psync_unlock_file(psync_file_lock_t *lock);
 
 int psync_get_upload_checksum(psync_uploadid_t uploadid, unsigned char *uhash, uint64_t *usize);
 
+typedef void (*psync_upload_chunks_progress)(void *ptr, uint64_t bytes);
+
+int psync_upload_chunks(psync_uploadid_t uploadid, const char *localpath, uint64_t offset, uint64_t length, const uint32_t *statuses,
+                        uint32_t statusescnt, const int *stop, psync_upload_chunks_progress progress, void *ptr);
+/* Chunks written from a file of another size or modification time than localpath has now are discarded first. */
+int psync_upload_has_chunks(psync_uploadid_t uploadid, const char *localpath);
+void psync_upload_forget_chunks(psync_uploadid_t uploadid);
+
 void psync_process_api_error(uint64_t result);
 
 int psync_do_run_command_res(const char *cmd, size_t cmdlen, const binparam *params, size_t paramscnt, char **err);
@@ -26,6 +26,7 @@
 
 #include "pcloudcc/psync/sockets.h"
 #include "poverlay.h"
+#include "psynclib.h"
 #include "logger.h"
 
 void overlay_main_loop() {
@@ -135,6 +136,7 @@ void instance_thread(void *payload) {
   if (ret == -1) {
     log_error("failed to read request payload: %s", strerror(errno));
     close(*fd);
+    psync_free(response);
     return;
   } else if (ret == 0) {
     log_info("received message from socket");
@@ -143,7 +145,7 @@ void instance_thread(void *payload) {
 
   request = (poverlay_message_t *)chbuf;
   if (request) {
-    psync_overlay_process_request(request, response);
+    psync_overlay_process_request2(request, &response);
     if (response) {
       log_trace("got answer to request [%d]: %s", (int)response->type, response->value);
       ret = write(*fd, response, response->length);
@@ -161,6 +163,8 @@ void instance_thread(void *payload) {
       log_error("failed to close file descriptor: %s", strerror(errno));
     }
   }
+
+  psync_free(response);
 };
 
 #endif  /* P_OS_POSIX */
@@ -10,6 +10,7 @@
 
 #include "pcloudcc/psync/compat.h"
 #include "pcloudcc/psync/overlay.h"
+#include "pcloudcc/psync/sockets.h"
 
 #include "plibs.h"
 #include "poverlay.h"
@@ -67,8 +68,9 @@ void psync_start_overlay_callbacks() {
   callbacks_running = 1;
 }
 
-void psync_overlay_process_request(poverlay_message_t *request,
-                                   poverlay_message_t *response) {
+/* Fills in response, or returns the reply a callback allocated instead. */
+static poverlay_message_t *overlay_process(poverlay_message_t *request,
+                                          poverlay_message_t *response) {
   psync_path_status_t stat = PSYNC_PATH_STATUS_NOT_OURS;
   memcpy(response->value, "Ok.", 4);
   response->length = sizeof(poverlay_message_t) + 4;
@@ -94,7 +96,7 @@ void psync_overlay_process_request(poverlay_message_t *request,
         memcpy(response->value, "No.", 4);
     }
 
-    return; /* exit */
+    return NULL; /* exit */
   }
 
   max_band = callbacks_lower_band + callbacks_size;
@@ -105,12 +107,9 @@ void psync_overlay_process_request(poverlay_message_t *request,
 
     if (callbacks[ind]) {
       if ((ret = callbacks[ind](request->value, &rep)) == 0) {
-        if (rep) {
-          psync_free(response);
-          response = rep;
-        } else {
-          response->type = 0;
-        }
+        if (rep)
+          return rep;
+        response->type = 0;
       } else {
         response->type = ret;
         memcpy(response->value, "No.", 4);
@@ -121,12 +120,39 @@ void psync_overlay_process_request(poverlay_message_t *request,
       response->length = sizeof(poverlay_message_t) + 37;
     }
 
-    return;  /* exit */
+    return NULL;  /* exit */
   }
 
   response->type = 13;
   memcpy(response->value, "Invalid type.", 14);
   response->length = sizeof(poverlay_message_t) + 14;
+  return NULL;
+}
+
+void psync_overlay_process_request(poverlay_message_t *request,
+                                   poverlay_message_t *response) {
+  poverlay_message_t *rep;
+  size_t len;
+
+  rep = overlay_process(request, response);
+  if (rep) {
+    len = rep->length < POVERLAY_BUFSIZE ? rep->length : POVERLAY_BUFSIZE;
+    memcpy(response, rep, len);
+    response->length = len;
+    ((char *)response)[len - 1] = 0;
+    psync_free(rep);
+  }
+}
+
+void psync_overlay_process_request2(poverlay_message_t *request,
+                                    poverlay_message_t **response) {
+  poverlay_message_t *rep;
+
+  rep = overlay_process(request, *response);
+  if (rep) {
+    psync_free(*response);
+    *response = rep;
+  }
 }
 
 int psync_overlays_running() {
@@ -23,6 +23,7 @@
 #include "pp2p.h"
 #include "pcrypto.h"
 #include "pfolder.h"
+#include "pshaper.h"
 #include "logger.h"
 
 #define P2P_ENCTYPE_RSA_AES 0
@@ -233,6 +234,17 @@ static int socket_write_all(psync_socket_t sock, const void *buff, size_t len) {
   return 0;
 }
 
+static void p2p_shape(int dir, size_t len) {
+  int64_t limit;
+  if (dir==PSYNC_SHAPER_UPLOAD)
+    limit=psync_setting_get_int(_PS(maxuploadspeed));
+  else
+    limit=psync_setting_get_int(_PS(maxdownloadspeed));
+  if (limit>0)
+    while (len)
+      len-=psync_shaper_take(dir, PSYNC_SHAPER_CLASS_P2P, limit, len);
+}
+
 static int socket_read_all(psync_socket_t sock, void *buff, size_t len) {
   ssize_t ret;
   while (len) {
@@ -350,6 +362,7 @@ static void psync_p2p_tcphandler(void *ptr) {
     if (unlikely_log(psync_file_read(fd, buff, rd)!=rd))
       break;
     psync_crypto_aes256_ctr_encode_decode_inplace(encoder, buff, rd, off);
+    p2p_shape(PSYNC_SHAPER_UPLOAD, rd);
     if (unlikely_log(socket_write_all(sock, buff, rd)))
       break;
     off+=rd;
@@ -630,6 +643,7 @@ static int psync_p2p_download(psync_socket_t sock, psync_fileid_t fileid, const
       rd=sizeof(buff);
     else
       rd=fsize-off;
+    p2p_shape(PSYNC_SHAPER_DOWNLOAD, rd);
     if (unlikely_log(socket_read_all(sock, buff, rd)))
       goto err0;
     psync_crypto_aes256_ctr_encode_decode_inplace(decoder, buff, rd, off);
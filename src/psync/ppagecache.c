@@ -22,6 +22,7 @@
 #include "pfsupload.h"
 #include "pfscrypto.h"
 #include "pcrc32c.h"
+#include "pshaper.h"
 #include "logger.h"
 
 #define CACHE_PAGES (PSYNC_FS_MEMORY_CACHE/PSYNC_FS_PAGE_SIZE)
@@ -295,7 +296,7 @@ static int psync_pagecache_read_range_from_api(psync_request_t *request, psync_r
   psync_cache_page_t *page;
   binresult *res;
   psync_uint_t len, i, h;
-  int rb;
+  int rb, cls;
   first_page_id=range->offset/PSYNC_FS_PAGE_SIZE;
   len=range->length/PSYNC_FS_PAGE_SIZE;
   res=get_result_thread(api);
@@ -312,7 +313,9 @@ static int psync_pagecache_read_range_from_api(psync_request_t *request, psync_r
   psync_free(res);
   for (i=0; i<len; i++) {
     page=psync_pagecache_get_free_page(0);
+    cls=psync_shaper_set_class(PSYNC_SHAPER_CLASS_FS);
     rb=psync_socket_readall_download_thread(api, page->page, dlen<PSYNC_FS_PAGE_SIZE?dlen:PSYNC_FS_PAGE_SIZE);
+    psync_shaper_set_class(cls);
     if (unlikely_log(rb<=0)) {
       psync_pagecache_return_free_page(page);
       psync_timer_notify_exception();
@@ -1753,7 +1756,7 @@ static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_
   psync_page_wait_t *pw;
   psync_cache_page_t *page;
   psync_uint_t len, i, h;
-  int rb;
+  int rb, cls;
   first_page_id=range->offset/PSYNC_FS_PAGE_SIZE;
   len=range->length/PSYNC_FS_PAGE_SIZE;
   rb=psync_http_next_request(sock);
@@ -1769,7 +1772,9 @@ static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_
   }
   for (i=0; i<len; i++) {
     page=psync_pagecache_get_free_page(0);
+    cls=psync_shaper_set_class(PSYNC_SHAPER_CLASS_FS);
     rb=psync_http_request_readall(sock, page->page, PSYNC_FS_PAGE_SIZE);
+    psync_shaper_set_class(cls);
     if (unlikely_log(rb<=0)) {
       psync_pagecache_return_free_page(page);
       psync_timer_notify_exception();
@@ -1848,6 +1853,10 @@ char *psync_http_construct_range_next_header(psync_request_t *request, psync_url
   return psync_strdup((char *)memcpy(buff+off-sizeof(PSYNC_CONSTRUCT_HEADER)+3, PSYNC_CONSTRUCT_HEADER, sizeof(PSYNC_CONSTRUCT_HEADER)-1));
 }
 
+/* Runs on a thread of its own for every request and blocks in the psync_http_* and API calls. It is not on the reactor,
+ * that needs a non-blocking HTTP client with the same fallbacks to the API and to other hosts, and a way to wait for free
+ * pages without blocking the reactor thread.
+ */
 static void psync_pagecache_read_unmodified_thread(void *ptr) {
   psync_request_t *request;
   psync_http_socket *sock;
@@ -2918,21 +2927,38 @@ static void psync_pagecache_new_upload_to_cache(uint64_t taskid, uint64_t hash,
   psync_free(filename);
 }
 
-static void switch_pageids(uint64_t hash, uint64_t oldhash, uint64_t *pageids, psync_uint_t pageidcnt) {
+typedef struct {
+  uint64_t hash;
+  uint64_t oldhash;
+  uint64_t *pageids;
+  psync_uint_t pageidcnt;
+} switch_pageids_t;
+
+static int do_switch_pageids(void *ptr) {
+  switch_pageids_t *sw;
   psync_sql_res *res;
   psync_uint_t i;
+  sw=(switch_pageids_t *)ptr;
   res=psync_sql_prep_statement("UPDATE OR IGNORE pagecache SET hash=?, lastuse=? WHERE hash=? AND type=? AND pageid=?");
-  psync_sql_start_transaction();
-  psync_sql_bind_uint(res, 1, hash);
+  psync_sql_bind_uint(res, 1, sw->hash);
   psync_sql_bind_uint(res, 2, psync_timer_time());
-  psync_sql_bind_uint(res, 3, oldhash);
+  psync_sql_bind_uint(res, 3, sw->oldhash);
   psync_sql_bind_uint(res, 4, PAGE_TYPE_READ);
-  for (i=0; i<pageidcnt; i++) {
-    psync_sql_bind_uint(res, 5, pageids[i]);
+  for (i=0; i<sw->pageidcnt; i++) {
+    psync_sql_bind_uint(res, 5, sw->pageids[i]);
     psync_sql_run(res);
   }
-  psync_sql_commit_transaction();
   psync_sql_free_result(res);
+  return 0;
+}
+
+static void switch_pageids(uint64_t hash, uint64_t oldhash, uint64_t *pageids, psync_uint_t pageidcnt) {
+  switch_pageids_t sw;
+  sw.hash=hash;
+  sw.oldhash=oldhash;
+  sw.pageids=pageids;
+  sw.pageidcnt=pageidcnt;
+  psync_sql_group_commit_wait(do_switch_pageids, &sw);
 }
 
 static void psync_pagecache_modify_to_cache(uint64_t taskid, uint64_t hash, uint64_t oldhash) {
@@ -3142,11 +3168,39 @@ static void psync_pagecache_check_free_space() {
   }
 }
 
+typedef struct {
+  uint64_t id;
+  uint64_t taskid;
+  uint32_t wake;
+} delete_cache_task_t;
+
+static int do_delete_cache_task(void *ptr) {
+  delete_cache_task_t *dt;
+  psync_sql_res *res;
+  dt=(delete_cache_task_t *)ptr;
+  res=psync_sql_prep_statement("DELETE FROM fstaskdepend WHERE dependfstaskid=?");
+  psync_sql_bind_uint(res, 1, dt->taskid);
+  psync_sql_run_free(res);
+  dt->wake=psync_sql_affected_rows();
+  res=psync_sql_prep_statement("DELETE FROM fstask WHERE id=?");
+  psync_sql_bind_uint(res, 1, dt->taskid);
+  psync_sql_run_free(res);
+  if (IS_DEBUG) {
+    if (psync_sql_affected_rows())
+      log_info("deleted taskid %lu from fstask", (unsigned long)dt->taskid);
+    else
+      log_info("no affected rows for deletion of taskid %lu from fstask", (unsigned long)dt->taskid);
+  }
+  res=psync_sql_prep_statement("DELETE FROM pagecachetask WHERE id=?");
+  psync_sql_bind_uint(res, 1, dt->id);
+  return psync_sql_run_free(res);
+}
+
 static void psync_pagecache_upload_to_cache() {
+  delete_cache_task_t dt;
   psync_sql_res *res;
   psync_uint_row row;
   uint64_t id, type, taskid, hash, oldhash;
-  uint32_t wake;
   while (1) {
     res=psync_sql_query("SELECT id, type, taskid, hash, oldhash FROM pagecachetask ORDER BY id LIMIT 1");
     row=psync_sql_fetch_rowint(res);
@@ -3165,25 +3219,10 @@ static void psync_pagecache_upload_to_cache() {
       psync_pagecache_new_upload_to_cache(taskid, hash, 1);
     else if (type==PAGE_TASK_TYPE_MODIFY)
       psync_pagecache_modify_to_cache(taskid, hash, oldhash);
-    psync_sql_start_transaction();
-    res=psync_sql_prep_statement("DELETE FROM fstaskdepend WHERE dependfstaskid=?");
-    psync_sql_bind_uint(res, 1, taskid);
-    psync_sql_run_free(res);
-    wake=psync_sql_affected_rows();
-    res=psync_sql_prep_statement("DELETE FROM fstask WHERE id=?");
-    psync_sql_bind_uint(res, 1, taskid);
-    psync_sql_run_free(res);
-    if (IS_DEBUG) {
-      if (psync_sql_affected_rows())
-        log_info("deleted taskid %lu from fstask", (unsigned long)taskid);
-      else
-        log_info("no affected rows for deletion of taskid %lu from fstask", (unsigned long)taskid);
-    }
-    res=psync_sql_prep_statement("DELETE FROM pagecachetask WHERE id=?");
-    psync_sql_bind_uint(res, 1, id);
-    psync_sql_run_free(res);
-    psync_sql_commit_transaction();
-    if (wake)
+    dt.id=id;
+    dt.taskid=taskid;
+    dt.wake=0;
+    if (!psync_sql_group_commit_wait(do_delete_cache_task, &dt) && dt.wake)
       psync_fsupload_wake();
     psync_pagecache_check_free_space();
   }
@@ -32,7 +32,13 @@
 
 #define PSYNC_P2P_RSA_SIZE 2048
 
+#define PSYNC_DIFF_BULK_ROWS 32
+#define PSYNC_DIFF_BULK_CREATE 1
 #define PSYNC_DIFF_LIMIT   500000
+#define PSYNC_DIFF_MIN_LIMIT 5000
+#define PSYNC_DIFF_START_LIMIT 25000
+#define PSYNC_DIFF_APPLY_TARGET_MS 2000
+#define PSYNC_DIFF_STREAM_BATCH 5000
 
 #define PSYNC_RETRY_REQUEST 5
 
@@ -58,6 +64,10 @@
 #define PSYNC_MAX_PARALLEL_UPLOADS 32
 #define PSYNC_FSUPLOAD_NUM_TASKS_PER_RUN 128
 #define PSYNC_START_NEW_DOWNLOADS_THRESHOLD (4*1024*1024)
+#define PSYNC_START_NEW_SMALL_DOWNLOADS_THRESHOLD (16*1024*1024)
+#define PSYNC_DOWNLOAD_WORKERS 8
+#define PSYNC_DOWNLOAD_LARGE_WORKERS 2
+#define PSYNC_DOWNLOAD_QUEUE_MAX 64
 #define PSYNC_START_NEW_UPLOADS_THRESHOLD (512*1024)
 #define PSYNC_MIN_SIZE_FOR_CHECKSUMS (64*1024)
 #define PSYNC_MIN_SIZE_FOR_EXISTS_CHECK (8*1024)
@@ -66,8 +76,28 @@
 #define PSYNC_MAX_CHECKSUMS_SIZE (64*1024*1024)
 #define PSYNC_MAX_COPY_FROM_REQ  (32*1024*1024)
 #define PSYNC_MAX_PENDING_UPLOAD_REQS 16
+#define PSYNC_UPLOAD_PIPE_IDLE_SEC 30
+#define PSYNC_UPLOAD_CHUNK_SIZE (16*1024*1024)
+#define PSYNC_UPLOAD_CHUNK_MIN_SIZE (64*1024*1024)
+#define PSYNC_UPLOAD_CHUNK_WORKERS 4
+#define PSYNC_UPLOAD_CHUNK_RETRIES 3
 
 #define PSYNC_COPY_BUFFER_SIZE (256*1024)
+#define PSYNC_BLOCKSCAN_BUFFER_SIZE (1024*1024)
+#define PSYNC_BLOCKSCAN_MIN_REGION (16*1024*1024)
+#define PSYNC_BLOCKSCAN_THREADS 4
+#define PSYNC_BLOCKSCAN_FILTER_BITS 64
+#define PSYNC_BLOCKSCAN_FILTER_MAX_BITS (128*1024*1024)
+#define PSYNC_HOSTS_MAX 64
+#define PSYNC_HOSTS_MAX_ORDER 16
+#define PSYNC_HOSTS_NAME_LEN 64
+#define PSYNC_HOSTS_EWMA_WEIGHT 4
+#define PSYNC_HOSTS_MAX_BACKOFF 600
+#define PSYNC_HOSTS_SCORE_BYTES (4*1024*1024)
+#define PSYNC_HOSTS_MIN_TRANSFER (256*1024)
+#define PSYNC_HOSTS_SAVE_INTERVAL 300
+#define PSYNC_RESULT_READ_BUFFER (64*1024)
+#define PSYNC_RESULT_STACK 256
 #define PSYNC_RECV_BUFFER_SHAPED (128*1024)
 #define PSYNC_MAX_SPEED_RECV_BUFFER (1024*1024)
 
@@ -90,6 +120,8 @@
 #define PSYNC_LOCALSCAN_MIN_INTERVAL            60
 #define PSYNC_MIN_INTERVAL_RECALC_DOWNLOAD      2
 #define PSYNC_MIN_INTERVAL_RECALC_UPLOAD        5
+#define PSYNC_STATUS_RESTAT_INTERVAL            600
+#define PSYNC_STATUS_MAX_CHANGED                64
 #define PSYNC_UPLOAD_NOWRITE_TIMER              30
 
 #define PSYNC_APIPOOL_MAXIDLE    24
@@ -110,6 +142,11 @@
 #define PSYNC_DEFAULT_NTF_THUMB_DIR "ntfthumbs"
 
 #define PSYNC_DB_CHECKPOINT_AT_PAGES 2000
+#define PSYNC_DB_READ_CONNECTIONS 0
+#define PSYNC_SQL_MAX_STMT_IDS 2048
+#define PSYNC_SQL_LOCKPROF_SITES 2048
+#define PSYNC_SQL_LOCKPROF_SAMPLE 16
+#define PSYNC_SQL_GROUP_COMMIT_MAX 256
 
 #define PSYNC_DEFAULT_CACHE_FOLDER "Cache"
 #define PSYNC_DEFAULT_READ_CACHE_FILE "cached"
@@ -132,7 +169,6 @@
 #define PSYNC_SLEEP_ON_DISK_FULL       10000
 #define PSYNC_SLEEP_ON_FAILED_DOWNLOAD 2000
 #define PSYNC_SLEEP_ON_FAILED_UPLOAD   2000
-#define PSYNC_SLEEP_AUTO_SHAPER        100
 #define PSYNC_SLEEP_ON_LOCKED_FILE     2000
 #define PSYNC_SLEEP_ON_OS_LOCK         5000
 #define PSYNC_SLEEP_FILE_CHANGE        2000
@@ -144,6 +180,10 @@
 #define PSYNC_ASYNC_GROUP_REQUESTS_FOR 60
 
 #define PSYNC_ASYNC_MAX_GROUPED_REQUESTS 128
+#define PSYNC_ASYNC_MAX_UPLOAD_SIZE      (256*1024)
+#define PSYNC_ASYNC_LARGE_DOWNLOAD_SIZE  (64*1024)
+
+#define PSYNC_REACTOR_MAX_EVENTS 64
 
 #define PSYNC_CRYPTO_DEFAULT_STOP_ON_SLEEP 0
 
@@ -160,10 +200,20 @@
 #define PSYNC_CRYPTO_CACHE_DIR_ECODER_SEC   15
 #define PSYNC_CRYPTO_CACHE_FILE_SYM_KEY     300
 #define PSYNC_CRYPTO_CACHE_FILE_ECODER_SEC  15
+#define PSYNC_CRYPTO_CACHE_NAMES           65536
+
+#define PSYNC_CRYPTO_PREFETCH_MAX_KEYS      256
+#define PSYNC_CRYPTO_PREFETCH_UNWRAP_KEYS   64
+#define PSYNC_CRYPTO_PREFETCH_THREADS       4
+#define PSYNC_CRYPTO_PREFETCH_INTERVAL_SEC  120
 
 #define PSYNC_CRYPTO_MAX_LOG_SIZE          (64*1024*1024)
 #define PSYNC_CRYPTO_RUN_EXTEND_IN_THREAD_OVER (1024*1024)
 #define PSYNC_CRYPTO_EXTENDER_STEP         (512*1024)
+#define PSYNC_CRYPTO_EXTENDER_BATCH        256
+#define PSYNC_CRYPTO_WORKERS               4
+#define PSYNC_CRYPTO_MIN_SECTORS_PER_WORKER 16
+#define PSYNC_CRYPTO_REPLAY_BUFFER         (1024*1024)
 
 #define PSYNC_HTTP_RESP_BUFFER 4000
 
@@ -188,11 +238,21 @@
 #define psync_lhash_final         psync_sha512_final
 
 
-#define PSYNC_UPL_AUTO_SHAPER_INITIAL (100*1024)
-#define PSYNC_UPL_AUTO_SHAPER_MIN     (10*1024)
-#define PSYNC_UPL_AUTO_SHAPER_INC_PER 105
-#define PSYNC_UPL_AUTO_SHAPER_DEC_PER 95
-#define PSYNC_UPL_AUTO_SHAPER_BUF_PER 400
+#define PSYNC_SHAPER_QUANTUM_MS   10
+#define PSYNC_SHAPER_MIN_QUANTUM  (4*1024)
+#define PSYNC_SHAPER_BURST_MS     50
+#define PSYNC_SHAPER_IDLE_MS      1000
+#define PSYNC_SHAPER_WEIGHT_SYNC  2
+#define PSYNC_SHAPER_WEIGHT_FS    4
+#define PSYNC_SHAPER_WEIGHT_P2P   1
+
+#define PSYNC_SHAPER_AUTO_INITIAL      (512*1024)
+#define PSYNC_SHAPER_AUTO_MIN          (10*1024)
+#define PSYNC_SHAPER_AUTO_MAX          (1024*1024*1024)
+#define PSYNC_SHAPER_AUTO_TARGET_US    25000
+#define PSYNC_SHAPER_AUTO_SAMPLE_MS    100
+#define PSYNC_SHAPER_AUTO_GAIN_DIV     8
+#define PSYNC_SHAPER_AUTO_DECREASE_DIV 4
 
 #define PSYNC_DEFAULT_SEND_BUFF (4*1024*1024)
 
@@ -215,6 +275,7 @@
 
 /* defaults for database settings */
 #define PSYNC_USE_SSL_DEFAULT 1
+#define PSYNC_KTLS_DEFAULT 0
 #define PSYNC_DWL_SHAPER_DEFAULT -1
 #define PSYNC_UPL_SHAPER_DEFAULT -1
 #define PSYNC_MIN_LOCAL_FREE_SPACE ((uint64_t)2048*1024*1024)
@@ -252,6 +313,7 @@ $RECYCLE.BIN;\
 #define PSYNC_SETTING_fscachesize       9
 #define PSYNC_SETTING_fscachepath      10
 #define PSYNC_SETTING_sleepstopcrypto  11
+#define PSYNC_SETTING_ktls             12
 
 typedef int psync_settingid_t;
 
@@ -0,0 +1,197 @@
+/*
+ * This file is part of the pCloud Console Client.
+ *
+ * (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+ *
+ * For the full copyright and license information, please view
+ * the LICENSE file that was distributed with this source code.
+ */
+
+#include <pthread.h>
+
+#include "pcloudcc/psync/compat.h"
+#include "pshaper.h"
+#include "psettings.h"
+#include "plibs.h"
+
+/* Speed limits are enforced by token buckets, one for each direction and traffic class, refilled every millisecond
+ * instead of a counter reset at the start of each second. A direction's limit is split between its classes that moved
+ * data in the last PSYNC_SHAPER_IDLE_MS in proportion to their weights, so an idle class leaves its share to the others.
+ * A bucket holds at most PSYNC_SHAPER_BURST_MS worth of tokens and hands out at most PSYNC_SHAPER_QUANTUM_MS worth to a
+ * caller at a time. Callers are served in the order they arrived, the one at the head waits for the bucket to get out of
+ * debt, the others for their turn.
+ */
+
+typedef struct {
+  pthread_cond_t cond;
+  uint64_t lastrefill;
+  uint64_t lastused;
+  int64_t tokens;
+  uint32_t nextticket;
+  uint32_t serving;
+} shaper_bucket_t;
+
+#define SHAPER_BUCKET_INITIALIZER {PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0}
+
+static pthread_mutex_t shaper_mutex=PTHREAD_MUTEX_INITIALIZER;
+static shaper_bucket_t shaper_buckets[2][PSYNC_SHAPER_CLASSES]={
+  {SHAPER_BUCKET_INITIALIZER, SHAPER_BUCKET_INITIALIZER, SHAPER_BUCKET_INITIALIZER},
+  {SHAPER_BUCKET_INITIALIZER, SHAPER_BUCKET_INITIALIZER, SHAPER_BUCKET_INITIALIZER}
+};
+static const uint32_t shaper_weights[PSYNC_SHAPER_CLASSES]={
+  PSYNC_SHAPER_WEIGHT_SYNC, PSYNC_SHAPER_WEIGHT_FS, PSYNC_SHAPER_WEIGHT_P2P
+};
+static __thread int shaper_class=PSYNC_SHAPER_CLASS_SYNC;
+
+static uint64_t shaper_class_rate(int dir, int cls, uint64_t limit, uint64_t now) {
+  uint64_t weights;
+  int i;
+  weights=0;
+  for (i=0; i<PSYNC_SHAPER_CLASSES; i++)
+    if (i==cls || shaper_buckets[dir][i].lastused+PSYNC_SHAPER_IDLE_MS>=now)
+      weights+=shaper_weights[i];
+  return limit*shaper_weights[cls]/weights;
+}
+
+static int64_t shaper_quantum(uint64_t rate) {
+  int64_t quantum;
+  quantum=rate*PSYNC_SHAPER_QUANTUM_MS/1000;
+  if (quantum<PSYNC_SHAPER_MIN_QUANTUM)
+    quantum=PSYNC_SHAPER_MIN_QUANTUM;
+  return quantum;
+}
+
+static void shaper_refill(shaper_bucket_t *b, uint64_t rate, uint64_t now) {
+  int64_t add, burst;
+  if (!b->lastrefill) {
+    b->lastrefill=now;
+    b->tokens=shaper_quantum(rate);
+    return;
+  }
+  add=(now-b->lastrefill)*rate/1000;
+  // below 1000 bytes per second a millisecond adds nothing, keep the time until it does
+  if (!add)
+    return;
+  b->lastrefill=now;
+  b->tokens+=add;
+  burst=rate*PSYNC_SHAPER_BURST_MS/1000;
+  if (burst<shaper_quantum(rate))
+    burst=shaper_quantum(rate);
+  if (b->tokens>burst)
+    b->tokens=burst;
+}
+
+size_t psync_shaper_take(int dir, int cls, uint64_t limit, size_t num) {
+  shaper_bucket_t *b;
+  uint64_t now, rate, wait;
+  int64_t grant;
+  uint32_t ticket;
+  b=&shaper_buckets[dir][cls];
+  pthread_mutex_lock(&shaper_mutex);
+  ticket=b->nextticket++;
+  while (1) {
+    now=psync_millitime();
+    b->lastused=now;
+    rate=shaper_class_rate(dir, cls, limit, now);
+    if (unlikely(!rate))
+      rate=1;
+    shaper_refill(b, rate, now);
+    if (ticket!=b->serving)
+      pthread_cond_wait(&b->cond, &shaper_mutex);
+    else if (b->tokens>0)
+      break;
+    else {
+      wait=(1-b->tokens)*1000/rate+1;
+      if (wait>PSYNC_SHAPER_BURST_MS)
+        wait=PSYNC_SHAPER_BURST_MS;
+      pthread_mutex_unlock(&shaper_mutex);
+      psync_milisleep(wait);
+      pthread_mutex_lock(&shaper_mutex);
+    }
+  }
+  // the grant may take the bucket into debt, whoever is next pays it off by waiting
+  grant=shaper_quantum(rate);
+  if ((size_t)grant>num)
+    grant=num;
+  b->tokens-=grant;
+  b->serving++;
+  pthread_cond_broadcast(&b->cond);
+  pthread_mutex_unlock(&shaper_mutex);
+  return grant;
+}
+
+void psync_shaper_return(int dir, int cls, size_t bytes) {
+  pthread_mutex_lock(&shaper_mutex);
+  shaper_buckets[dir][cls].tokens+=bytes;
+  pthread_mutex_unlock(&shaper_mutex);
+}
+
+int psync_shaper_set_class(int cls) {
+  int ret;
+  ret=shaper_class;
+  shaper_class=cls;
+  return ret;
+}
+
+int psync_shaper_get_class() {
+  return shaper_class;
+}
+
+/* The auto setting has no limit to split, instead each direction paces with a rate found by a delay based controller in
+ * the spirit of LEDBAT. The queueing delay a connection adds is its smoothed RTT minus the lowest RTT seen on it, kept
+ * below PSYNC_SHAPER_AUTO_TARGET_US the rate grows in proportion to the headroom, above it shrinks in proportion to the
+ * excess at most once per base RTT, since that is how long the queue takes to show a change. Growth is scaled by the base
+ * RTT as well, so that long paths do not overshoot before the delay catches up, and stops while the senders have less to
+ * send than the rate allows. Since the controller backs off as soon as a queue builds, it leaves the link to loss based
+ * traffic sharing the bottleneck.
+ */
+
+void psync_shaper_auto_init(psync_shaper_auto_t *a) {
+  a->rate=PSYNC_SHAPER_AUTO_INITIAL;
+  a->lastupdate=0;
+  a->lastdecrease=0;
+  a->sent=0;
+  a->baserttus=0;
+  a->qdelayus=-1;
+}
+
+uint64_t psync_shaper_auto_update(psync_shaper_auto_t *a, uint64_t now, uint64_t rttus, uint64_t baserttus, uint64_t sent) {
+  uint64_t achieved, off, interval;
+  a->sent+=sent;
+  if (rttus && baserttus && rttus>=baserttus) {
+    a->baserttus=baserttus;
+    a->qdelayus=rttus-baserttus;
+  }
+  if (!a->lastupdate) {
+    a->lastupdate=now;
+    return a->rate;
+  }
+  if (now-a->lastupdate<PSYNC_SHAPER_AUTO_SAMPLE_MS)
+    return a->rate;
+  achieved=a->sent*1000/(now-a->lastupdate);
+  a->sent=0;
+  a->lastupdate=now;
+  if (a->qdelayus<0)
+    return a->rate;
+  interval=a->baserttus/1000;
+  if (interval<PSYNC_SHAPER_AUTO_SAMPLE_MS)
+    interval=PSYNC_SHAPER_AUTO_SAMPLE_MS;
+  if (a->qdelayus<PSYNC_SHAPER_AUTO_TARGET_US) {
+    if (achieved*2>=a->rate) {
+      off=PSYNC_SHAPER_AUTO_TARGET_US-a->qdelayus;
+      a->rate+=a->rate*off*PSYNC_SHAPER_AUTO_SAMPLE_MS/PSYNC_SHAPER_AUTO_TARGET_US/PSYNC_SHAPER_AUTO_GAIN_DIV/interval;
+    }
+  }
+  else if (now-a->lastdecrease>=interval) {
+    off=a->qdelayus-PSYNC_SHAPER_AUTO_TARGET_US;
+    if (off>PSYNC_SHAPER_AUTO_TARGET_US)
+      off=PSYNC_SHAPER_AUTO_TARGET_US;
+    a->rate-=a->rate*off/PSYNC_SHAPER_AUTO_TARGET_US/PSYNC_SHAPER_AUTO_DECREASE_DIV;
+    a->lastdecrease=now;
+  }
+  if (a->rate<PSYNC_SHAPER_AUTO_MIN)
+    a->rate=PSYNC_SHAPER_AUTO_MIN;
+  else if (a->rate>PSYNC_SHAPER_AUTO_MAX)
+    a->rate=PSYNC_SHAPER_AUTO_MAX;
+  return a->rate;
+}
@@ -0,0 +1,51 @@
+/*
+ * This file is part of the pCloud Console Client.
+ *
+ * (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+ *
+ * For the full copyright and license information, please view
+ * the LICENSE file that was distributed with this source code.
+ */
+
+#ifndef PCLOUD_PSYNC_PSHAPER_H_
+#define PCLOUD_PSYNC_PSHAPER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PSYNC_SHAPER_UPLOAD   0
+#define PSYNC_SHAPER_DOWNLOAD 1
+
+#define PSYNC_SHAPER_CLASS_SYNC 0
+#define PSYNC_SHAPER_CLASS_FS   1
+#define PSYNC_SHAPER_CLASS_P2P  2
+
+#define PSYNC_SHAPER_CLASSES 3
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint64_t rate;
+  uint64_t lastupdate;
+  uint64_t lastdecrease;
+  uint64_t sent;
+  uint64_t baserttus;
+  int64_t qdelayus;
+} psync_shaper_auto_t;
+
+size_t psync_shaper_take(int dir, int cls, uint64_t limit, size_t num);
+void psync_shaper_return(int dir, int cls, size_t bytes);
+
+int psync_shaper_set_class(int cls);
+int psync_shaper_get_class();
+
+void psync_shaper_auto_init(psync_shaper_auto_t *a);
+uint64_t psync_shaper_auto_update(psync_shaper_auto_t *a, uint64_t now, uint64_t rttus, uint64_t baserttus, uint64_t sent);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* PCLOUD_PSYNC_PSHAPER_H_ */
@@ -18,6 +18,7 @@
 #include <mbedtls/net_sockets.h>
 #include <mbedtls/sha256.h>
 #include <mbedtls/error.h>
+#include <mbedtls/version.h>
 
 #include "plibs.h"
 #include "pssl.h"
@@ -61,6 +62,8 @@ typedef struct {
   mbedtls_ssl_config config;
   psync_socket_t sock;
   int isbroken;
+  size_t resumeidlen;
+  unsigned char resumeid[32];
   char cachekey[];
 } ssl_connection_t;
 
@@ -175,6 +178,7 @@ static ssl_connection_t *psync_ssl_alloc_conn(const char *hostname) {
   len=strlen(hostname)+1;
   conn=(ssl_connection_t *)psync_malloc(offsetof(ssl_connection_t, cachekey)+len+4);
   conn->isbroken=0;
+  conn->resumeidlen=0;
   memcpy(conn->cachekey, "SSLS", 4);
   memcpy(conn->cachekey+4, hostname, len);
   return conn;
@@ -245,17 +249,38 @@ static void psync_ssl_free_session(void *ptr) {
 }
 
 
-static void psync_ssl_save_session(ssl_connection_t *conn) {
+/* the session fields are private since mbedTLS 3, which has accessors for the id from 3.4 on */
+static size_t psync_ssl_session_id(const mbedtls_ssl_session *sess, const unsigned char **id) {
+#if MBEDTLS_VERSION_NUMBER >= 0x03040000
+  *id = mbedtls_ssl_session_get_id(sess);
+  return mbedtls_ssl_session_get_id_len(sess);
+#else
+  *id = sess->id;
+  return sess->id_len;
+#endif
+}
+
+static void psync_ssl_connected(ssl_connection_t *conn, const char *hostname) {
   mbedtls_ssl_session *sess;
+  const unsigned char *id;
+  size_t idlen;
+  int resumed;
   sess=psync_new(mbedtls_ssl_session);
-  /* mbedtls_ssl_get_session seems to copy all elements, instead of
+  /* mbedtls_ssl_get_session copies all elements, instead of
    * referencing them, therefore it is thread safe to add session upon
    * connect */
-  memset(sess, 0, sizeof(mbedtls_ssl_session));
-  if (mbedtls_ssl_get_session(&conn->ssl, sess))
+  mbedtls_ssl_session_init(sess);
+  if (mbedtls_ssl_get_session(&conn->ssl, sess)) {
+    mbedtls_ssl_session_free(sess);
     psync_free(sess);
-  else
-    psync_cache_add(conn->cachekey, sess, PSYNC_SSL_SESSION_CACHE_TIMEOUT, psync_ssl_free_session, PSYNC_MAX_SSL_SESSIONS_PER_DOMAIN);
+    psync_ssl_handshake_done(hostname, 0);
+    return;
+  }
+  /* the server echoes the offered session id (also when accepting a ticket) only if it resumed the session */
+  idlen = psync_ssl_session_id(sess, &id);
+  resumed = conn->resumeidlen && idlen == conn->resumeidlen && !memcmp(id, conn->resumeid, idlen);
+  psync_ssl_handshake_done(hostname, resumed);
+  psync_cache_add(conn->cachekey, sess, PSYNC_SSL_SESSION_CACHE_TIMEOUT, psync_ssl_free_session, PSYNC_MAX_SSL_SESSIONS_PER_DOMAIN);
 }
 
 static int psync_ssl_check_peer_public_key(ssl_connection_t *conn) {
@@ -293,6 +318,8 @@ static int psync_ssl_check_peer_public_key(ssl_connection_t *conn) {
 int psync_ssl_connect(psync_socket_t sock, void **sslconn, const char *hostname) {
   ssl_connection_t *conn;
   mbedtls_ssl_session *sess;
+  const unsigned char *id;
+  size_t idlen;
   int ret;
 
   conn = psync_ssl_alloc_conn(hostname);
@@ -318,6 +345,11 @@ int psync_ssl_connect(psync_socket_t sock, void **sslconn, const char *hostname)
       MBEDTLS_SSL_MINOR_VERSION_3
   );
 
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  /* resume with tickets when the server supports them, falls back to session ids otherwise */
+  mbedtls_ssl_conf_session_tickets(&conn->config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
   mbedtls_ssl_conf_ca_chain(&conn->config, &psync_mbed_trusted_certs_x509, NULL);
   mbedtls_ssl_conf_ciphersuites(&conn->config, psync_mbed_ciphersuite);
   mbedtls_ssl_conf_rng(&conn->config, ctr_drbg_random_locked, &psync_mbed_rng);
@@ -350,6 +382,10 @@ int psync_ssl_connect(psync_socket_t sock, void **sslconn, const char *hostname)
     log_info("reusing cached session for %s", hostname);
     if (mbedtls_ssl_set_session(&conn->ssl, sess))
       log_warn("ssl_set_session failed");
+    else if ((idlen = psync_ssl_session_id(sess, &id)) && idlen <= sizeof(conn->resumeid)) {
+      conn->resumeidlen = idlen;
+      memcpy(conn->resumeid, id, idlen);
+    }
     mbedtls_ssl_session_free(sess);
     psync_free(sess);
   }
@@ -361,7 +397,7 @@ int psync_ssl_connect(psync_socket_t sock, void **sslconn, const char *hostname)
     if (psync_ssl_check_peer_public_key(conn))
       goto err1;
     *sslconn=conn;
-    psync_ssl_save_session(conn);
+    psync_ssl_connected(conn, hostname);
     return PSYNC_SSL_SUCCESS;
   }
 
@@ -387,7 +423,7 @@ int psync_ssl_connect_finish(void *sslconn, const char *hostname) {
   if (ret == 0) {
     if (psync_ssl_check_peer_public_key(conn))
       goto fail;
-    psync_ssl_save_session(conn);
+    psync_ssl_connected(conn, hostname);
     return PSYNC_SSL_SUCCESS;
   }
 
@@ -462,6 +498,15 @@ int psync_ssl_write(void *sslconn, const void *buf, int num) {
   return PSYNC_SSL_FAIL;
 }
 
+int psync_ssl_can_sendfile(void *sslconn) {
+  return 0;
+}
+
+int psync_ssl_sendfile(void *sslconn, psync_file_t fd, uint64_t offset, int num) {
+  psync_ssl_errno = PSYNC_SSL_ERR_UNKNOWN;
+  return PSYNC_SSL_FAIL;
+}
+
 void psync_ssl_rand_strong(unsigned char *buf, int num) {
   if (unlikely(ctr_drbg_random_locked(&psync_mbed_rng, buf, num))) {
     log_fatal("could not generate %d random bytes, exiting", num);
@@ -38,6 +38,10 @@
 #include <openssl/err.h>
 #include <pthread.h>
 
+#if OPENSSL_VERSION_NUMBER>=0x30000000L && defined(SSL_OP_ENABLE_KTLS)
+#define PSYNC_SSL_KTLS
+#endif
+
 #define SSL_CIPHERS \
   "ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES256-GCM-SHA384:"\
   "DHE-RSA-AES256-GCM-SHA384:ECDH-RSA-AES256-GCM-SHA384:"\
@@ -53,6 +57,7 @@
 typedef struct {
   SSL *ssl;
   int isbroken;
+  int sessionsaved;
   char cachekey[];
 } ssl_connection_t;
 
@@ -132,6 +137,27 @@ static int psync_ssl_detect_aes_hw(){
 }
 #endif
 
+static void psync_ssl_free_session(void *ptr){
+  SSL_SESSION_free((SSL_SESSION *)ptr);
+}
+
+/* Called by OpenSSL for every session the server hands out. For TLS 1.2 this happens during the handshake, TLS 1.3 tickets
+ * arrive after it, possibly several per connection. Storing them right away (instead of on shutdown) lets connections
+ * opened in parallel to the same host resume too. Returning 1 keeps the reference we got for the cache. */
+static int psync_ssl_new_session(SSL *ssl, SSL_SESSION *sess){
+  ssl_connection_t *conn;
+  conn=(ssl_connection_t *)SSL_get_app_data(ssl);
+  if (unlikely(!conn))
+    return 0;
+#if OPENSSL_VERSION_NUMBER>=0x10101000L
+  if (!SSL_SESSION_is_resumable(sess))
+    return 0;
+#endif
+  psync_cache_add(conn->cachekey, sess, PSYNC_SSL_SESSION_CACHE_TIMEOUT, psync_ssl_free_session, PSYNC_MAX_SSL_SESSIONS_PER_DOMAIN);
+  conn->sessionsaved=1;
+  return 1;
+}
+
 int psync_ssl_init(){
   BIO *bio;
   X509 *cert;
@@ -149,8 +175,15 @@ int psync_ssl_init(){
   OpenSSL_add_all_ciphers();
   SSL_load_error_strings();
   openssl_thread_setup();
+#if OPENSSL_VERSION_NUMBER>=0x10100000L
+  globalctx=SSL_CTX_new(TLS_client_method());
+#else
   globalctx=SSL_CTX_new(TLSv1_2_client_method());
+#endif
   if (likely_log(globalctx)){
+#if OPENSSL_VERSION_NUMBER>=0x10100000L
+    SSL_CTX_set_min_proto_version(globalctx, TLS1_2_VERSION);
+#endif
     if (unlikely_log(SSL_CTX_set_cipher_list(globalctx, SSL_CIPHERS)!=1)){
       SSL_CTX_free(globalctx);
       globalctx=NULL;
@@ -159,6 +192,7 @@ int psync_ssl_init(){
     SSL_CTX_set_verify(globalctx, SSL_VERIFY_NONE, NULL);
     SSL_CTX_set_read_ahead(globalctx, 0); // readahed breaks SSL_Pending
     SSL_CTX_set_session_cache_mode(globalctx, SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(globalctx, psync_ssl_new_session);
     SSL_CTX_set_options(globalctx, SSL_OP_NO_COMPRESSION);
     SSL_CTX_set_mode(globalctx, SSL_MODE_RELEASE_BUFFERS);
     SSL_CTX_set_mode(globalctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
@@ -263,11 +297,29 @@ static ssl_connection_t *psync_ssl_alloc_conn(SSL *ssl, const char *hostname){
   conn=(ssl_connection_t *)psync_malloc(offsetof(ssl_connection_t, cachekey)+len+4);
   conn->ssl=ssl;
   conn->isbroken=0;
+  conn->sessionsaved=0;
   memcpy(conn->cachekey, "SSLS", 4);
   memcpy(conn->cachekey+4, hostname, len);
   return conn;
 }
 
+static void psync_ssl_connected(ssl_connection_t *conn, const char *hostname){
+  SSL_SESSION *sess;
+  int reused;
+  reused=SSL_session_reused(conn->ssl);
+  psync_ssl_handshake_done(hostname, reused);
+#if defined(PSYNC_SSL_KTLS)
+  if (BIO_get_ktls_send(SSL_get_wbio(conn->ssl)))
+    debug(D_NOTICE, "kernel TLS is used for sending to %s", hostname);
+#endif
+  /* an abbreviated TLS 1.2 handshake issues no new session, put back the one we took out of the cache, TLS 1.3 tickets
+   * are single use and are replaced by the ones the server sends */
+  if (reused && !conn->sessionsaved && SSL_version(conn->ssl)<=TLS1_2_VERSION && (sess=SSL_get1_session(conn->ssl))){
+    psync_cache_add(conn->cachekey, sess, PSYNC_SSL_SESSION_CACHE_TIMEOUT, psync_ssl_free_session, PSYNC_MAX_SSL_SESSIONS_PER_DOMAIN);
+    conn->sessionsaved=1;
+  }
+}
+
 int psync_ssl_connect(psync_socket_t sock, void **sslconn, const char *hostname){
   ssl_connection_t *conn;
   SSL *ssl;
@@ -278,6 +330,12 @@ int psync_ssl_connect(psync_socket_t sock, void **sslconn, const char *hostname)
     return PSYNC_SSL_FAIL;
   SSL_set_fd(ssl, sock);
   conn=psync_ssl_alloc_conn(ssl, hostname);
+  SSL_set_app_data(ssl, conn);
+#if defined(PSYNC_SSL_KTLS)
+  // the kernel takes over record encryption only if it has the tls module and supports the negotiated cipher
+  if (psync_setting_get_bool(_PS(ktls)))
+    SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
   if ((sess=(SSL_SESSION *)psync_cache_get(conn->cachekey))){
     debug(D_NOTICE, "reusing cached session for %s", hostname);
     SSL_set_session(ssl, sess);
@@ -288,8 +346,7 @@ int psync_ssl_connect(psync_socket_t sock, void **sslconn, const char *hostname)
     if (unlikely(psync_ssl_verify_cert(ssl, hostname)))
       goto fail;
     *sslconn=conn;
-    if (IS_DEBUG && SSL_session_reused(ssl))
-      debug(D_NOTICE, "successfully reused session");
+    psync_ssl_connected(conn, hostname);
     return PSYNC_SSL_SUCCESS;
   }
   err=SSL_get_error(ssl, res);
@@ -312,8 +369,7 @@ int psync_ssl_connect_finish(void *sslconn, const char *hostname){
   if (res==1){
     if (unlikely(psync_ssl_verify_cert(conn->ssl, hostname)))
       goto fail;
-    if (IS_DEBUG && SSL_session_reused(conn->ssl))
-      debug(D_NOTICE, "successfully reused session");
+    psync_ssl_connected(conn, hostname);
     return PSYNC_SSL_SUCCESS;
   }
   err=SSL_get_error(conn->ssl, res);
@@ -326,17 +382,12 @@ fail:
   return PSYNC_SSL_FAIL;
 }
 
-static void psync_ssl_free_session(void *ptr){
-  SSL_SESSION_free((SSL_SESSION *)ptr);
-}
-
 int psync_ssl_shutdown(void *sslconn){
   ssl_connection_t *conn;
   SSL_SESSION *sess;
   int res, err;
   conn=(ssl_connection_t *)sslconn;
-  sess=SSL_get1_session(conn->ssl);
-  if (sess)
+  if (!conn->sessionsaved && (sess=SSL_get1_session(conn->ssl)))
     psync_cache_add(conn->cachekey, sess, PSYNC_SSL_SESSION_CACHE_TIMEOUT, psync_ssl_free_session, PSYNC_MAX_SSL_SESSIONS_PER_DOMAIN);
   if (conn->isbroken)
     goto noshutdown;
@@ -388,6 +439,32 @@ int psync_ssl_write(void *sslconn, const void *buf, int num){
   return PSYNC_SSL_FAIL;
 }
 
+int psync_ssl_can_sendfile(void *sslconn){
+#if defined(PSYNC_SSL_KTLS)
+  return BIO_get_ktls_send(SSL_get_wbio(((ssl_connection_t *)sslconn)->ssl))?1:0;
+#else
+  return 0;
+#endif
+}
+
+int psync_ssl_sendfile(void *sslconn, psync_file_t fd, uint64_t offset, int num){
+#if defined(PSYNC_SSL_KTLS)
+  ssl_connection_t *conn;
+  ossl_ssize_t res;
+  int err;
+  conn=(ssl_connection_t *)sslconn;
+  res=SSL_sendfile(conn->ssl, fd, offset, num, 0);
+  if (res>=0)
+    return res;
+  err=SSL_get_error(conn->ssl, res);
+  psync_set_ssl_error(conn, err);
+  return PSYNC_SSL_FAIL;
+#else
+  psync_ssl_errno=PSYNC_SSL_ERR_UNKNOWN;
+  return PSYNC_SSL_FAIL;
+#endif
+}
+
 void psync_ssl_rand_strong(unsigned char *buf, int num){
   static int seeds=0;
   int ret;
@@ -129,9 +129,13 @@ int psync_ssl_connect(psync_socket_t sock, void **sslconn, const char *hostname)
     goto err2;
   if (hostname && unlikely_log(SSLSetPeerDomainName(ref, hostname, strlen(hostname))!=noErr))
     goto err2;
+  // the peer id keys Secure Transport's own session cache, without it every connection does a full handshake
+  if (hostname && unlikely_log(SSLSetPeerID(ref, hostname, strlen(hostname))!=noErr))
+    goto err2;
   st=SSLHandshake(ref);
   if (st==noErr){
     *sslconn=ref;
+    psync_ssl_handshake_done(hostname, 0);
     return PSYNC_SSL_SUCCESS;
   }
   else if (st==errSSLWouldBlock){
@@ -151,8 +155,10 @@ int psync_ssl_connect_finish(void *sslconn, const char *hostname){
   OSStatus st;
   ref=(SSLContextRef)sslconn;
   st=SSLHandshake(ref);
-  if (st==noErr)
+  if (st==noErr){
+    psync_ssl_handshake_done(hostname, 0);
     return PSYNC_SSL_SUCCESS;
+  }
   else if (st==errSSLWouldBlock)
     return PSYNC_SSL_NEED_FINISH;
   CFRelease(ref);
@@ -225,6 +231,15 @@ int psync_ssl_write(void *sslconn, const void *buf, int num){
     return ret;
 }
 
+int psync_ssl_can_sendfile(void *sslconn){
+  return 0;
+}
+
+int psync_ssl_sendfile(void *sslconn, psync_file_t fd, uint64_t offset, int num){
+  psync_ssl_errno=PSYNC_SSL_ERR_UNKNOWN;
+  return PSYNC_SSL_FAIL;
+}
+
 void psync_ssl_rand_strong(unsigned char *buf, int num){
   ssize_t ret;
   int fd;
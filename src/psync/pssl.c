@@ -15,6 +15,9 @@
 #include "pssl.h"
 #include "psynclib.h"
 #include "pmemlock.h"
+#include "logger.h"
+
+static psync_ssl_handshake_stats_t handshake_stats={0, 0};
 
 static void psync_ssl_free_psync_encrypted_data_t(psync_encrypted_data_t e) {
   psync_ssl_memclean(e->data, e->datalen);
@@ -44,3 +47,16 @@ psync_encrypted_symmetric_key_t psync_ssl_copy_encrypted_symmetric_key(psync_enc
   memcpy(ret->data, src->data, src->datalen);
   return ret;
 }
+
+void psync_ssl_handshake_done(const char *hostname, int resumed) {
+  if (resumed)
+    __sync_fetch_and_add(&handshake_stats.resumed, 1);
+  else
+    __sync_fetch_and_add(&handshake_stats.full, 1);
+  log_debug("%s handshake with %s", resumed?"resumed":"full", hostname?hostname:"(unknown)");
+}
+
+void psync_ssl_get_handshake_stats(psync_ssl_handshake_stats_t *stats) {
+  stats->full=__sync_add_and_fetch(&handshake_stats.full, 0);
+  stats->resumed=__sync_add_and_fetch(&handshake_stats.resumed, 0);
+}
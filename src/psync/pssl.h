@@ -39,6 +39,11 @@ extern __thread int psync_ssl_errno;
 #define PSYNC_SSL_FAIL        (-1)
 #define PSYNC_SSL_SUCCESS       0
 
+typedef struct {
+  uint64_t full;
+  uint64_t resumed;
+} psync_ssl_handshake_stats_t;
+
 typedef struct {
   size_t datalen;
   unsigned char data[];
@@ -62,6 +67,11 @@ int psync_ssl_shutdown(void *sslconn);
 size_t psync_ssl_pendingdata(void *sslconn);
 int psync_ssl_read(void *sslconn, void *buf, int num);
 int psync_ssl_write(void *sslconn, const void *buf, int num);
+int psync_ssl_can_sendfile(void *sslconn);
+int psync_ssl_sendfile(void *sslconn, psync_file_t fd, uint64_t offset, int num);
+
+void psync_ssl_handshake_done(const char *hostname, int resumed);
+void psync_ssl_get_handshake_stats(psync_ssl_handshake_stats_t *stats);
 
 void psync_ssl_rand_strong(unsigned char *buf, int num);
 void psync_ssl_rand_weak(unsigned char *buf, int num);
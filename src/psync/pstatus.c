@@ -19,6 +19,8 @@
 #include "pfstasks.h"
 #include "psettings.h"
 #include "prunratelimit.h"
+#include "ptimer.h"
+#include "ptree.h"
 #include "logger.h"
 
 static uint32_t statuses[PSTATUS_NUM_STATUSES] = {
@@ -34,6 +36,46 @@ static pthread_mutex_t statusmutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t statuscond=PTHREAD_COND_INITIALIZER;
 static psync_uint_t status_waiters=0;
 
+/*
+ * Sizes of the cache files of pending fs uploads, so that recalculating the
+ * upload totals does not stat every one of them. The tree is ordered by task id
+ * and merged with the (ordered) list of pending tasks on every recalculation:
+ * new tasks are stat-ed, gone ones are dropped. Tasks whose file was written
+ * again are reported with psync_status_fstask_changed() and stat-ed on the
+ * next recalculation, finished or cancelled ones are removed right away with
+ * psync_status_fstask_removed(). As a safety net all files are stat-ed again
+ * every PSYNC_STATUS_RESTAT_INTERVAL seconds.
+ *
+ * Sync uploads are counted with running totals instead. Every task is kept by
+ * the id of its local file with the size it was counted with, so a finished or
+ * deleted task takes away exactly what it added and a task added twice counts
+ * once. The totals are read from the database the first time and again after
+ * psync_status_upload_clear().
+ *
+ * Both mutexes are taken after the sql lock, never before it.
+ */
+typedef struct {
+  psync_tree tree;
+  uint64_t id;
+  uint64_t size;
+  psync_syncid_t syncid;
+  int exists;
+} upload_size_t;
+
+static pthread_mutex_t upload_sizes_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_tree *upload_sizes=PSYNC_TREE_EMPTY;
+static time_t upload_sizes_restat=0;
+
+static pthread_mutex_t changed_mutex=PTHREAD_MUTEX_INITIALIZER;
+static uint64_t changed_tasks[PSYNC_STATUS_MAX_CHANGED];
+static uint32_t changed_cnt=0;
+
+static pthread_mutex_t upload_tasks_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_tree *upload_tasks=PSYNC_TREE_EMPTY;
+static uint64_t upload_tasks_bytes=0;
+static uint32_t upload_tasks_cnt=0;
+static int upload_tasks_loaded=0;
+
 static uint32_t psync_calc_status() {
   if (statuses[PSTATUS_TYPE_AUTH]!=PSTATUS_AUTH_PROVIDED && statuses[PSTATUS_TYPE_AUTH]!=PSTATUS_INVALID) {
     if (statuses[PSTATUS_TYPE_AUTH]==PSTATUS_AUTH_REQUIRED)
@@ -110,12 +152,16 @@ static uint32_t psync_calc_status() {
     return PSTATUS_READY;
 }
 
+static int psync_status_do_reset_run(void *ptr) {
+  return psync_sql_statement("REPLACE INTO setting (id, value) VALUES ('runstatus', " NTO_STR(PSTATUS_RUN_RUN) ")");
+}
+
 void psync_status_init() {
   memset(&psync_status, 0, sizeof(psync_status));
   statuses[PSTATUS_TYPE_RUN]=psync_sql_cellint("SELECT value FROM setting WHERE id='runstatus'", 0);
   if (statuses[PSTATUS_TYPE_RUN]<PSTATUS_RUN_RUN || statuses[PSTATUS_TYPE_RUN]>PSTATUS_RUN_STOP) {
     statuses[PSTATUS_TYPE_RUN]=PSTATUS_RUN_RUN;
-    psync_sql_statement("REPLACE INTO setting (id, value) VALUES ('runstatus', " NTO_STR(PSTATUS_RUN_RUN) ")");
+    psync_sql_group_commit(psync_status_do_reset_run, NULL, NULL);
   }
   psync_status_recalc_to_download();
   psync_status_recalc_to_upload();
@@ -142,41 +188,267 @@ void psync_status_recalc_to_download() {
   }
 }
 
-void psync_status_recalc_to_upload() {
-  char fileidhex[sizeof(psync_fsfileid_t)*2+2];
-  char *filename;
-  const char *fscpath;
+static upload_size_t *upload_size_find(psync_tree *tr, uint64_t id) {
+  upload_size_t *us;
+  while (tr) {
+    us=psync_tree_element(tr, upload_size_t, tree);
+    if (id<us->id)
+      tr=tr->left;
+    else if (id>us->id)
+      tr=tr->right;
+    else
+      return us;
+  }
+  return NULL;
+}
+
+static void upload_size_insert(psync_tree **tree, upload_size_t *us) {
+  psync_tree *tr;
+  tr=*tree;
+  if (tr)
+    while (1) {
+      if (us->id<psync_tree_element(tr, upload_size_t, tree)->id) {
+        if (tr->left)
+          tr=tr->left;
+        else {
+          tr->left=&us->tree;
+          break;
+        }
+      }
+      else {
+        if (tr->right)
+          tr=tr->right;
+        else {
+          tr->right=&us->tree;
+          break;
+        }
+      }
+    }
+  else
+    *tree=&us->tree;
+  psync_tree_added_at(tree, tr, &us->tree);
+}
+
+static void upload_sizes_free(psync_tree **tree) {
+  psync_tree_for_each_element_call_safe(*tree, upload_size_t, tree, psync_free);
+  *tree=PSYNC_TREE_EMPTY;
+}
+
+static void upload_task_set_locked(psync_syncid_t syncid, psync_fileid_t localfileid, uint64_t size) {
+  upload_size_t *us;
+  us=upload_size_find(upload_tasks, localfileid);
+  if (us)
+    upload_tasks_bytes-=us->size;
+  else {
+    us=psync_new(upload_size_t);
+    us->id=localfileid;
+    us->exists=1;
+    upload_size_insert(&upload_tasks, us);
+    upload_tasks_cnt++;
+  }
+  us->syncid=syncid;
+  us->size=size;
+  upload_tasks_bytes+=size;
+}
+
+static void upload_task_del_locked(upload_size_t *us) {
+  upload_tasks_bytes-=us->size;
+  upload_tasks_cnt--;
+  psync_tree_del(&upload_tasks, &us->tree);
+  psync_free(us);
+}
+
+static void upload_tasks_load_locked() {
   psync_sql_res *res;
   psync_uint_row row;
-  psync_stat_t st;
-  uint64_t bytestou;
-  uint32_t filestou;
-  res=psync_sql_query_rdlock("SELECT COUNT(*), SUM(f.size) FROM task t, localfile f WHERE t.type=? AND t.localitemid=f.id");
+  res=psync_sql_query_rdlock("SELECT f.id, t.syncid, f.size FROM task t, localfile f WHERE t.type=? AND t.localitemid=f.id");
   psync_sql_bind_uint(res, 1, PSYNC_UPLOAD_FILE);
+  while ((row=psync_sql_fetch_rowint(res)))
+    upload_task_set_locked(row[1], row[0], row[2]);
+  psync_sql_free_result(res);
+  upload_tasks_loaded=1;
+}
+
+void psync_status_upload_task_added(psync_syncid_t syncid, psync_fileid_t localfileid) {
+  psync_sql_res *res;
+  psync_uint_row row;
+  res=psync_sql_query_rdlock("SELECT size FROM localfile WHERE id=?");
+  psync_sql_bind_uint(res, 1, localfileid);
   if ((row=psync_sql_fetch_rowint(res))) {
-    filestou=row[0];
-    bytestou=row[1];
+    pthread_mutex_lock(&upload_tasks_mutex);
+    if (upload_tasks_loaded)
+      upload_task_set_locked(syncid, localfileid, row[0]);
+    pthread_mutex_unlock(&upload_tasks_mutex);
+  }
+  psync_sql_free_result(res);
+}
+
+void psync_status_upload_task_resized(psync_fileid_t localfileid, uint64_t size) {
+  upload_size_t *us;
+  pthread_mutex_lock(&upload_tasks_mutex);
+  if ((us=upload_size_find(upload_tasks, localfileid))) {
+    upload_tasks_bytes-=us->size;
+    upload_tasks_bytes+=size;
+    us->size=size;
+  }
+  pthread_mutex_unlock(&upload_tasks_mutex);
+}
+
+void psync_status_upload_task_removed(psync_fileid_t localfileid) {
+  upload_size_t *us;
+  pthread_mutex_lock(&upload_tasks_mutex);
+  if ((us=upload_size_find(upload_tasks, localfileid)))
+    upload_task_del_locked(us);
+  pthread_mutex_unlock(&upload_tasks_mutex);
+}
+
+void psync_status_upload_sync_removed(psync_syncid_t syncid) {
+  psync_tree *tr, *next;
+  upload_size_t *us;
+  pthread_mutex_lock(&upload_tasks_mutex);
+  tr=psync_tree_get_first(upload_tasks);
+  while (tr) {
+    next=psync_tree_get_next(tr);
+    us=psync_tree_element(tr, upload_size_t, tree);
+    if (us->syncid==syncid)
+      upload_task_del_locked(us);
+    tr=next;
+  }
+  pthread_mutex_unlock(&upload_tasks_mutex);
+}
+
+void psync_status_fstask_changed(uint64_t taskid) {
+  pthread_mutex_lock(&changed_mutex);
+  if (changed_cnt<PSYNC_STATUS_MAX_CHANGED)
+    changed_tasks[changed_cnt]=taskid;
+  // on overflow the counter stays above the limit and everything is stat-ed again
+  if (changed_cnt<=PSYNC_STATUS_MAX_CHANGED)
+    changed_cnt++;
+  pthread_mutex_unlock(&changed_mutex);
+}
+
+void psync_status_fstask_removed(uint64_t taskid) {
+  upload_size_t *us;
+  pthread_mutex_lock(&upload_sizes_mutex);
+  if ((us=upload_size_find(upload_sizes, taskid))) {
+    psync_tree_del(&upload_sizes, &us->tree);
+    psync_free(us);
+  }
+  pthread_mutex_unlock(&upload_sizes_mutex);
+}
+
+void psync_status_upload_clear() {
+  pthread_mutex_lock(&upload_tasks_mutex);
+  upload_sizes_free(&upload_tasks);
+  upload_tasks_bytes=0;
+  upload_tasks_cnt=0;
+  upload_tasks_loaded=0;
+  pthread_mutex_unlock(&upload_tasks_mutex);
+  pthread_mutex_lock(&upload_sizes_mutex);
+  upload_sizes_free(&upload_sizes);
+  upload_sizes_restat=0;
+  pthread_mutex_unlock(&upload_sizes_mutex);
+  pthread_mutex_lock(&changed_mutex);
+  changed_cnt=0;
+  pthread_mutex_unlock(&changed_mutex);
+}
+
+static int upload_size_is_changed(uint64_t taskid, const uint64_t *changed, uint32_t cnt) {
+  uint32_t i;
+  for (i=0; i<cnt; i++)
+    if (changed[i]==taskid)
+      return 1;
+  return 0;
+}
+
+static void upload_size_stat(upload_size_t *us, const char *fscpath) {
+  char fileidhex[sizeof(psync_fsfileid_t)*2+2];
+  char *filename;
+  psync_stat_t st;
+  psync_binhex(fileidhex, &us->id, sizeof(psync_fsfileid_t));
+  fileidhex[sizeof(psync_fsfileid_t)]='d';
+  fileidhex[sizeof(psync_fsfileid_t)+1]=0;
+  filename=psync_strcat(fscpath, "/", fileidhex, NULL);
+  if (!psync_stat(filename, &st)) {
+    us->exists=1;
+    us->size=psync_stat_size(&st);
   }
   else {
-    filestou=0;
-    bytestou=0;
+    us->exists=0;
+    us->size=0;
   }
-  psync_sql_free_result(res);
+  psync_free(filename);
+}
+
+void psync_status_recalc_to_upload() {
+  uint64_t changed[PSYNC_STATUS_MAX_CHANGED];
+  const char *fscpath;
+  psync_sql_res *res;
+  psync_uint_row row;
+  psync_tree *tr, *next;
+  upload_size_t *us;
+  uint64_t bytestou;
+  uint32_t filestou, changedcnt;
+  time_t now;
+  int restat;
+  psync_sql_rdlock();
+  pthread_mutex_lock(&upload_tasks_mutex);
+  if (!upload_tasks_loaded)
+    upload_tasks_load_locked();
+  filestou=upload_tasks_cnt;
+  bytestou=upload_tasks_bytes;
+  pthread_mutex_unlock(&upload_tasks_mutex);
   fscpath=psync_setting_get_string(_PS(fscachepath));
+  pthread_mutex_lock(&upload_sizes_mutex);
+  pthread_mutex_lock(&changed_mutex);
+  changedcnt=changed_cnt;
+  if (changedcnt<=PSYNC_STATUS_MAX_CHANGED)
+    memcpy(changed, changed_tasks, sizeof(uint64_t)*changedcnt);
+  changed_cnt=0;
+  pthread_mutex_unlock(&changed_mutex);
+  now=psync_timer_time();
+  restat=changedcnt>PSYNC_STATUS_MAX_CHANGED || now>=upload_sizes_restat;
+  if (restat)
+    upload_sizes_restat=now+PSYNC_STATUS_RESTAT_INTERVAL;
+  tr=psync_tree_get_first(upload_sizes);
   res=psync_sql_query_rdlock("SELECT id FROM fstask WHERE type IN ("NTO_STR(PSYNC_FS_TASK_CREAT)", "NTO_STR(PSYNC_FS_TASK_MODIFY)") AND text1 NOT LIKE '.%'"
-                             " AND status!=3");
+                             " AND status!=3 ORDER BY id");
   while ((row=psync_sql_fetch_rowint(res))) {
-    psync_binhex(fileidhex, &row[0], sizeof(psync_fsfileid_t));
-    fileidhex[sizeof(psync_fsfileid_t)]='d';
-    fileidhex[sizeof(psync_fsfileid_t)+1]=0;
-    filename=psync_strcat(fscpath, "/", fileidhex, NULL);
-    if (!psync_stat(filename, &st)) {
+    while (tr && psync_tree_element(tr, upload_size_t, tree)->id<row[0]) {
+      next=psync_tree_get_next(tr);
+      psync_tree_del(&upload_sizes, tr);
+      psync_free(psync_tree_element(tr, upload_size_t, tree));
+      tr=next;
+    }
+    if (tr && psync_tree_element(tr, upload_size_t, tree)->id==row[0]) {
+      us=psync_tree_element(tr, upload_size_t, tree);
+      tr=psync_tree_get_next(tr);
+      if (restat || upload_size_is_changed(us->id, changed, changedcnt))
+        upload_size_stat(us, fscpath);
+    }
+    else {
+      us=psync_new(upload_size_t);
+      us->id=row[0];
+      if (tr)
+        psync_tree_add_before(&upload_sizes, tr, &us->tree);
+      else
+        psync_tree_add_after(&upload_sizes, psync_tree_get_last(upload_sizes), &us->tree);
+      upload_size_stat(us, fscpath);
+    }
+    if (us->exists) {
       filestou++;
-      bytestou+=psync_stat_size(&st);
+      bytestou+=us->size;
     }
-    psync_free(filename);
   }
   psync_sql_free_result(res);
+  while (tr) {
+    next=psync_tree_get_next(tr);
+    psync_tree_del(&upload_sizes, tr);
+    psync_free(psync_tree_element(tr, upload_size_t, tree));
+    tr=next;
+  }
+  pthread_mutex_unlock(&upload_sizes_mutex);
+  psync_sql_rdunlock();
   psync_status.filestoupload=filestou;
   psync_status.bytestoupload=bytestou;
   if (!filestou)
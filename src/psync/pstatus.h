@@ -14,6 +14,8 @@
 
 #include <stdint.h>
 
+#include "psynclib.h"
+
 #define PSTATUS_NUM_STATUSES 6
 
 #define PSTATUS_TYPE_RUN       0
@@ -58,6 +60,13 @@ void psync_status_recalc_to_download();
 void psync_status_recalc_to_download_async();
 void psync_status_recalc_to_upload();
 void psync_status_recalc_to_upload_async();
+void psync_status_upload_task_added(psync_syncid_t syncid, psync_fileid_t localfileid);
+void psync_status_upload_task_resized(psync_fileid_t localfileid, uint64_t size);
+void psync_status_upload_task_removed(psync_fileid_t localfileid);
+void psync_status_upload_sync_removed(psync_syncid_t syncid);
+void psync_status_fstask_changed(uint64_t taskid);
+void psync_status_fstask_removed(uint64_t taskid);
+void psync_status_upload_clear();
 uint32_t psync_status_get(uint32_t statusid);
 void psync_set_status(uint32_t statusid, uint32_t status);
 void psync_wait_status(uint32_t statusid, uint32_t status);
@@ -146,6 +146,10 @@ void psync_set_database_path(const char *databasepath) {
   psync_database=psync_strdup(databasepath);
 }
 
+void psync_set_database_read_connections(uint32_t cnt) {
+  psync_sql_set_read_connections(cnt);
+}
+
 void psync_set_alloc(psync_malloc_t malloc_call, psync_realloc_t realloc_call, psync_free_t free_call) {
   psync_real_malloc=malloc_call;
   psync_real_realloc=realloc_call;
@@ -193,7 +197,7 @@ int psync_init() {
       pthread_mutex_unlock(&psync_libstate_mutex);
     return_error(PERROR_DATABASE_OPEN);
   }
-  psync_sql_statement("UPDATE task SET inprogress=0 WHERE inprogress=1");
+  psync_sql_statement("UPDATE task SET inprogress=0 WHERE inprogress!=0");
   psync_timer_init();
   if (unlikely_log(psync_ssl_init())) {  /* OK */
     if (IS_DEBUG)
@@ -392,6 +396,7 @@ void psync_unlink() {
   psync_sql_lock();
   log_info("clearing database, locked");
   psync_cache_clean_all();
+  psync_status_upload_clear();
   ret=psync_sql_close();
   psync_file_delete(psync_database);
   if (ret) {
@@ -1832,3 +1837,18 @@ char *psync_get_token() {
     return psync_strdup(psync_my_auth);
   return NULL;
 }
+
+void psync_set_lock_profiling(int enable) {
+  psync_sql_lockprof_enable(enable);
+}
+
+char *psync_get_lock_profile(uint32_t topn) {
+  return psync_sql_lockprof_dump(topn);
+}
+
+void psync_get_ssl_handshake_counts(uint64_t *full, uint64_t *resumed) {
+  psync_ssl_handshake_stats_t stats;
+  psync_ssl_get_handshake_stats(&stats);
+  *full=stats.full;
+  *resumed=stats.resumed;
+}
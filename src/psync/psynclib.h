@@ -531,9 +531,16 @@ typedef void (*pnotification_callback_t)(uint32_t notificationcnt, uint32_t newn
  * underlying database is in fact SQLite, so any other options that work for SQLite will
  * work here.
  *
+ * psync_set_database_read_connections can make the library open cnt read-only
+ * connections to the database, to be called before psync_init if ever. Queries
+ * that only read then run on them in parallel instead of one at a time on the
+ * main connection. The database is no longer locked exclusively in this mode,
+ * which makes single threaded lookups slower, so it is off (0) by default.
+ *
  */
 
 void psync_set_database_path(const char *databasepath);
+void psync_set_database_read_connections(uint32_t cnt);
 void psync_set_alloc(psync_malloc_t malloc_call, psync_realloc_t realloc_call, psync_free_t free_call);
 
 int psync_init();
@@ -1139,6 +1146,23 @@ psync_folderid_t psync_check_and_create_folder (const char * path);
 
 char * psync_get_token();
 
+/* Database lock profiling.
+ *
+ * psync_set_lock_profiling() - enables (resetting all counters) or disables sampling of database lock acquisitions. Profiling is off
+ * by default and costs a thread local counter increment per lock when on.
+ *
+ * psync_get_lock_profile() - returns a text report, one line per call site, of the topn call sites that made other threads wait
+ * the most for the database lock, with estimated acquisition counts and total wait and hold times for read and write locks. The
+ * returned string is to be freed with psync_free.
+ */
+void psync_set_lock_profiling(int enable);
+char *psync_get_lock_profile(uint32_t topn);
+
+/* psync_get_ssl_handshake_counts() - stores the number of full and of resumed TLS handshakes made since the start, resumed ones
+ * reused a cached session and skipped the key exchange.
+ */
+void psync_get_ssl_handshake_counts(uint64_t *full, uint64_t *resumed);
+
 #ifdef __cplusplus
 }
 #endif
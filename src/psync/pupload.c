@@ -34,7 +34,11 @@ typedef struct {
   uint64_t taskid;
   psync_syncid_t syncid;
   int stop;
+  int hasprehash;
+  uint64_t prehashsize;
+  time_t prehashmtime;
   unsigned char hash[PSYNC_HASH_DIGEST_HEXLEN];
+  unsigned char prehash[PSYNC_HASH_DIGEST_HEXLEN];
 } upload_list_t;
 
 typedef struct {
@@ -441,10 +445,13 @@ static int copy_file_if_exists(const unsigned char *hashhex, uint64_t fsize, psy
   return ret;
 }
 
+static int upload_can_start_locked() {
+  return psync_status.filesuploading<PSYNC_MAX_PARALLEL_UPLOADS &&
+         psync_status.bytestouploadcurrent-psync_status.bytesuploaded<=PSYNC_START_NEW_UPLOADS_THRESHOLD;
+}
+
 static void wake_upload_when_ready() {
-  if (current_uploads_waiters && psync_status.filesuploading<PSYNC_MAX_PARALLEL_UPLOADS &&
-      psync_status.bytestouploadcurrent-psync_status.bytesuploaded<=
-          PSYNC_START_NEW_UPLOADS_THRESHOLD)
+  if (current_uploads_waiters && upload_can_start_locked())
     pthread_cond_signal(&current_uploads_cond);
 }
 
@@ -456,80 +463,102 @@ static void add_bytes_uploaded(uint64_t bytes) {
   psync_send_status_update();
 }
 
-static int upload_file(const char *localpath, const unsigned char *hashhex, uint64_t fsize, psync_folderid_t folderid, const char *name,
-                       psync_fileid_t localfileid, psync_syncid_t syncid, upload_list_t *upload, psync_stat_t *st, binparam pr) {
-  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("folderid", folderid), P_STR("filename", name), P_BOOL("nopartial", 1), P_STR("timeformat", "timestamp"),
+/* Files small enough to be sent in a single uploadfile call are pipelined on one API connection: upload threads queue
+ * the request and sleep, the pipeline thread writes up to PSYNC_MAX_PENDING_UPLOAD_REQS requests before it waits for the
+ * oldest result, so a directory of small files no longer costs a roundtrip per file. */
+
+typedef struct {
+  psync_list list;
+  pthread_cond_t cond;
+  const char *localpath;
+  const unsigned char *hashhex;
+  uint64_t fsize;
+  psync_folderid_t folderid;
+  const char *name;
+  psync_fileid_t localfileid;
+  upload_list_t *upload;
+  psync_stat_t *st;
+  binparam pr;
+  int ret;
+  int done;
+} upload_pipe_req_t;
+
+static pthread_mutex_t upload_pipe_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upload_pipe_cond=PTHREAD_COND_INITIALIZER;
+static psync_list upload_pipe_queue=PSYNC_LIST_STATIC_INIT(upload_pipe_queue);
+static int upload_pipe_running=0;
+
+// returns 0 on success, -1 if nothing was sent and -2 if the connection is left in an unknown state
+static int upload_file_send(psync_socket *api, upload_pipe_req_t *req) {
+  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("folderid", req->folderid), P_STR("filename", req->name), P_BOOL("nopartial", 1), P_STR("timeformat", "timestamp"),
 #if defined(PSYNC_HAS_BIRTHTIME)
-                     P_NUM("ctime", psync_stat_birthtime(st)),
+                     P_NUM("ctime", psync_stat_birthtime(req->st)),
 #endif
-                     P_NUM("mtime", psync_stat_mtime(st)), {pr.paramtype, pr.paramnamelen, pr.opts, pr.paramname, {pr.num}} /* specially for Visual Studio compiler */};
-  psync_socket *api;
+                     P_NUM("mtime", psync_stat_mtime(req->st)), {req->pr.paramtype, req->pr.paramnamelen, req->pr.opts, req->pr.paramname, {req->pr.num}} /* specially for Visual Studio compiler */};
   void *buff;
-  binresult *res;
-  const binresult *meta;
-  const char *hashhexsrv;
-  psync_sql_res *sres;
-  uint64_t bw, result, fileid, rsize, hash;
+  uint64_t bw;
   size_t rd;
   ssize_t rrd;
   psync_file_t fd;
-  fd=psync_file_open(localpath, P_O_RDONLY, 0);
+  fd=psync_file_open(req->localpath, P_O_RDONLY, 0);
   if (fd==INVALID_HANDLE_VALUE) {
-    log_warn("could not open local file %s", localpath);
+    log_warn("could not open local file %s", req->localpath);
     return -1;
   }
-  api=psync_apipool_get();
-  if (unlikely(!api))
-    goto err0;
-  if (unlikely_log(!do_send_command(api, "uploadfile", strlen("uploadfile"), params, ARRAY_SIZE(params), fsize, 0)))
+  if (unlikely_log(!do_send_command(api, "uploadfile", strlen("uploadfile"), params, ARRAY_SIZE(params), req->fsize, 0)))
     goto err1;
   bw=0;
   buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
-  while (bw<fsize) {
-    if (unlikely(upload->stop)) {
-      log_debug("upload of %s stopped", localpath);
+  while (bw<req->fsize) {
+    if (unlikely(req->upload->stop)) {
+      log_debug("upload of %s stopped", req->localpath);
       goto err2;
     }
     psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
-    if (fsize-bw>PSYNC_COPY_BUFFER_SIZE)
+    if (req->fsize-bw>PSYNC_COPY_BUFFER_SIZE)
       rd=PSYNC_COPY_BUFFER_SIZE;
     else
-      rd=fsize-bw;
+      rd=req->fsize-bw;
     rrd=psync_file_read(fd, buff, rd);
     if (unlikely_log(rrd<=0))
       goto err2;
     if (unlikely_log(psync_socket_writeall_upload(api, buff, rrd)!=rrd))
       goto err2;
     bw+=rrd;
-    if (bw==fsize && psync_file_read(fd, buff, 1)!=0) {
-      log_warn("file %s has grown while uploading, retrying", localpath);
+    if (bw==req->fsize && psync_file_read(fd, buff, 1)!=0) {
+      log_warn("file %s has grown while uploading, retrying", req->localpath);
       goto err2;
     }
-    upload->uploaded+=rrd;
+    req->upload->uploaded+=rrd;
     add_bytes_uploaded(rrd);
   }
   psync_free(buff);
   psync_file_close(fd);
   psync_set_default_sendbuf(api);
-  psync_diff_lock();
-  res=get_result(api);
-  if (likely(res))
-    psync_apipool_release(api);
-  else {
-    psync_apipool_release_bad(api);
-    goto err00;
-  }
+  return 0;
+err2:
+  psync_free(buff);
+err1:
+  psync_file_close(fd);
+  return -2;
+}
+
+// called with the diff lock held, releases it
+static int upload_file_result(binresult *res, upload_pipe_req_t *req) {
+  const binresult *meta;
+  const char *hashhexsrv;
+  psync_sql_res *sres;
+  uint64_t result, fileid, rsize, hash;
   result=psync_find_result(res, "result", PARAM_NUM)->num;
   if (unlikely(result)) {
     psync_free(res);
     log_warn("command uploadfile returned code %u", (unsigned)result);
     psync_process_api_error(result);
+    psync_diff_unlock();
     if (psync_handle_api_result(result)==PSYNC_NET_TEMPFAIL)
-      goto err00;
-    else {
-      psync_diff_unlock();
+      return -1;
+    else
       return 0;
-    }
   }
   meta=psync_find_result(res, "metadata", PARAM_ARRAY)->array[0];
   fileid=psync_find_result(meta, "fileid", PARAM_NUM)->num;
@@ -544,33 +573,139 @@ static int upload_file(const char *localpath, const unsigned char *hashhex, uint
   psync_sql_run_free(sres);
   if (psync_check_result(meta, "conflicted", PARAM_BOOL)) {
     psync_sql_commit_transaction();
-    set_local_file_conflicted(localfileid, fileid, hash, localpath, psync_find_result(meta, "name", PARAM_STR)->str, upload->taskid);
+    set_local_file_conflicted(req->localfileid, fileid, hash, req->localpath, psync_find_result(meta, "name", PARAM_STR)->str, req->upload->taskid);
   }
   else {
-    set_local_file_remote_id(localfileid, fileid, hash);
+    set_local_file_remote_id(req->localfileid, fileid, hash);
     psync_sql_commit_transaction();
   }
   psync_diff_unlock();
-  if (rsize!=fsize || memcmp(hashhexsrv, hashhex, PSYNC_HASH_DIGEST_HEXLEN)) {
+  if (rsize!=req->fsize || memcmp(hashhexsrv, req->hashhex, PSYNC_HASH_DIGEST_HEXLEN)) {
     log_warn("uploaded file differs localsize=%lu, remotesize=%lu, localhash=%s, remotehash=%s",
-          (unsigned long)fsize, (unsigned long)rsize, hashhex, hashhexsrv);
+          (unsigned long)req->fsize, (unsigned long)rsize, req->hashhex, hashhexsrv);
     psync_free(res);
     return -1;
   }
   psync_free(res);
   psync_diff_wake();
-  log_debug("file %s uploaded to %lu/%s", localpath, (long unsigned)folderid, name);
+  log_debug("file %s uploaded to %lu/%s", req->localpath, (long unsigned)req->folderid, req->name);
   return 0;
-err2:
-  psync_free(buff);
-err1:
-  psync_apipool_release_bad(api);
-err0:
-  psync_file_close(fd);
-return -1;
-err00:
-  psync_diff_unlock();
-  return -1;
+}
+
+static void upload_pipe_finish(upload_pipe_req_t *req, int ret) {
+  pthread_mutex_lock(&upload_pipe_mutex);
+  req->ret=ret;
+  req->done=1;
+  pthread_cond_signal(&req->cond);
+  pthread_mutex_unlock(&upload_pipe_mutex);
+}
+
+static void upload_pipe_fail_all(psync_list *inflight) {
+  upload_pipe_req_t *req;
+  while (!psync_list_isempty(inflight)) {
+    req=psync_list_remove_head_element(inflight, upload_pipe_req_t, list);
+    upload_pipe_finish(req, -1);
+  }
+}
+
+static void upload_pipe_thread() {
+  psync_list inflight, batch;
+  upload_pipe_req_t *req;
+  psync_socket *api;
+  binresult *res;
+  struct timespec tm;
+  uint32_t cnt;
+  int ret;
+  psync_list_init(&inflight);
+  api=NULL;
+  cnt=0;
+  while (1) {
+    pthread_mutex_lock(&upload_pipe_mutex);
+    if (!cnt)
+      while (psync_list_isempty(&upload_pipe_queue)) {
+        tm.tv_sec=psync_current_time+PSYNC_UPLOAD_PIPE_IDLE_SEC;
+        tm.tv_nsec=0;
+        if (pthread_cond_timedwait(&upload_pipe_cond, &upload_pipe_mutex, &tm) && psync_list_isempty(&upload_pipe_queue)) {
+          upload_pipe_running=0;
+          pthread_mutex_unlock(&upload_pipe_mutex);
+          if (api)
+            psync_apipool_release(api);
+          return;
+        }
+      }
+    psync_list_init(&batch);
+    while (cnt<PSYNC_MAX_PENDING_UPLOAD_REQS && !psync_list_isempty(&upload_pipe_queue)) {
+      req=psync_list_remove_head_element(&upload_pipe_queue, upload_pipe_req_t, list);
+      psync_list_add_tail(&batch, &req->list);
+      cnt++;
+    }
+    pthread_mutex_unlock(&upload_pipe_mutex);
+    while (!psync_list_isempty(&batch)) {
+      req=psync_list_remove_head_element(&batch, upload_pipe_req_t, list);
+      if (!api && !(api=psync_apipool_get()))
+        ret=-1;
+      else
+        ret=upload_file_send(api, req);
+      if (ret==0)
+        psync_list_add_tail(&inflight, &req->list);
+      else {
+        cnt--;
+        upload_pipe_finish(req, -1);
+        if (ret==-2) {
+          cnt=0;
+          upload_pipe_fail_all(&inflight);
+          psync_apipool_release_bad(api);
+          api=NULL;
+        }
+      }
+    }
+    if (!cnt)
+      continue;
+    req=psync_list_remove_head_element(&inflight, upload_pipe_req_t, list);
+    cnt--;
+    psync_diff_lock();
+    res=get_result(api);
+    if (likely(res))
+      upload_pipe_finish(req, upload_file_result(res, req));
+    else {
+      psync_diff_unlock();
+      upload_pipe_finish(req, -1);
+      cnt=0;
+      upload_pipe_fail_all(&inflight);
+      psync_apipool_release_bad(api);
+      api=NULL;
+    }
+  }
+}
+
+static int upload_file(const char *localpath, const unsigned char *hashhex, uint64_t fsize, psync_folderid_t folderid, const char *name,
+                       psync_fileid_t localfileid, psync_syncid_t syncid, upload_list_t *upload, psync_stat_t *st, binparam pr) {
+  upload_pipe_req_t req;
+  req.localpath=localpath;
+  req.hashhex=hashhex;
+  req.fsize=fsize;
+  req.folderid=folderid;
+  req.name=name;
+  req.localfileid=localfileid;
+  req.upload=upload;
+  req.st=st;
+  req.pr=pr;
+  req.ret=-1;
+  req.done=0;
+  pthread_cond_init(&req.cond, NULL);
+  pthread_mutex_lock(&upload_pipe_mutex);
+  psync_list_add_tail(&upload_pipe_queue, &req.list);
+  if (upload_pipe_running)
+    pthread_cond_signal(&upload_pipe_cond);
+  else {
+    upload_pipe_running=1;
+    psync_run_thread("upload pipeline", upload_pipe_thread);
+  }
+  while (!req.done)
+    pthread_cond_wait(&req.cond, &upload_pipe_mutex);
+  pthread_mutex_unlock(&upload_pipe_mutex);
+  pthread_cond_destroy(&req.cond);
+  return req.ret;
 }
 
 static int upload_range(psync_socket *api, psync_upload_range_list_t *r, upload_list_t *upload, psync_uploadid_t uploadid, psync_file_t fd) {
@@ -579,9 +714,11 @@ static int upload_range(psync_socket *api, psync_upload_range_list_t *r, upload_
   uint64_t bw;
   size_t rd;
   ssize_t rrd;
+  int zerocopy;
   if (unlikely_log(psync_file_seek(fd, r->off, P_SEEK_SET)==-1) ||
       unlikely_log(!do_send_command(api, "upload_write", strlen("upload_write"), params, ARRAY_SIZE(params), r->len, 0)))
     return PSYNC_NET_TEMPFAIL;
+  zerocopy=psync_socket_can_sendfile_upload(api);
   bw=0;
 
   buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
@@ -595,12 +732,20 @@ static int upload_range(psync_socket *api, psync_upload_range_list_t *r, upload_
       rd=PSYNC_COPY_BUFFER_SIZE;
     else
       rd=r->len-bw;
-    rrd=psync_file_read(fd, buff, rd);
-    if (unlikely_log(rrd<=0))
-      goto err0;
-    bw+=rrd;
-    if (unlikely_log(psync_socket_writeall_upload(api, buff, rrd)!=rrd))
-      goto err0;
+    if (zerocopy) {
+      rrd=psync_socket_sendfile_upload(api, fd, r->off+bw, rd);
+      if (unlikely_log(rrd!=rd))
+        goto err0;
+      bw+=rrd;
+    }
+    else {
+      rrd=psync_file_read(fd, buff, rd);
+      if (unlikely_log(rrd<=0))
+        goto err0;
+      bw+=rrd;
+      if (unlikely_log(psync_socket_writeall_upload(api, buff, rrd)!=rrd))
+        goto err0;
+    }
     upload->uploaded+=rrd;
     add_bytes_uploaded(rrd);
   }
@@ -635,6 +780,13 @@ static int upload_from_upload(psync_socket *api, psync_upload_range_list_t *r, p
   }
 }
 
+static void upload_chunks_progress(void *ptr, uint64_t bytes) {
+  upload_list_t *upload;
+  upload=(upload_list_t *)ptr;
+  upload->uploaded+=bytes;
+  add_bytes_uploaded(bytes);
+}
+
 static int upload_get_checksum(psync_socket *api, psync_uploadid_t uploadid, uint32_t id) {
   binparam params[]={P_STR("auth", psync_my_auth), P_NUM("uploadid", uploadid), P_NUM("id", id)};
   if (unlikely_log(!send_command_no_res(api, "upload_info", params)))
@@ -704,8 +856,8 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
   psync_str_row srow;
   psync_full_result_int *fr;
   psync_upload_range_list_t *le, *le2;
-  psync_list rlist;
-  uint64_t result;
+  psync_list rlist, *l1, *l2;
+  uint64_t result, upllen;
   uint32_t rid, respwait, id;
   psync_file_t fd;
   int ret;
@@ -848,13 +1000,44 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
       le2->len-=PSYNC_MAX_COPY_FROM_REQ;
       psync_list_add_after(&le->list, &le2->list);
     }
+  upllen=0;
+  psync_list_for_each_element(le, &rlist, psync_upload_range_list_t, list) {
+    le->uploadoffset=uploadoffset;
+    uploadoffset+=le->len;
+    if (le->type==PSYNC_URANGE_UPLOAD)
+      upllen+=le->len;
+  }
+  ret=PSYNC_NET_OK;
+  if (upllen>=PSYNC_UPLOAD_CHUNK_MIN_SIZE) {
+    // the ranges to upload go out in parallel chunks, only the copy requests are left for this connection
+    psync_apipool_release(api);
+    psync_list_for_each_safe(l1, l2, &rlist) {
+      le=psync_list_element(l1, psync_upload_range_list_t, list);
+      if (le->type!=PSYNC_URANGE_UPLOAD)
+        continue;
+      ret=psync_upload_chunks(uploadid, localpath, le->uploadoffset, le->len, requiredstatuses, ARRAY_SIZE(requiredstatuses),
+                              &upload->stop, upload_chunks_progress, upload);
+      if (ret!=PSYNC_NET_OK)
+        break;
+      psync_list_del(l1);
+      psync_free(le);
+    }
+    if (ret==PSYNC_NET_OK)
+      api=psync_apipool_get();
+    else if (ret==PSYNC_NET_PERMFAIL)
+      psync_upload_forget_chunks(uploadid);
+    if (ret!=PSYNC_NET_OK || unlikely(!api)) {
+      psync_file_close(fd);
+      psync_list_for_each_element_call(&rlist, psync_upload_range_list_t, list, psync_free);
+      return -1;
+    }
+  }
   le=psync_new(psync_upload_range_list_t);
   le->type=PSYNC_URANGE_LAST;
   psync_list_add_tail(&rlist, &le->list);
   psync_list_for_each_element(le, &rlist, psync_upload_range_list_t, list) {
     if (upload->stop)
       goto err1;
-    le->uploadoffset=uploadoffset;
     le->id=++rid;
     if (le->type==PSYNC_URANGE_LAST) {
       if (upload_get_checksum(api, uploadid, le->id))
@@ -891,7 +1074,6 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
             else {
               log_warn("range of type %u failed with error %lu, restarting as upload range", (unsigned)le2->type, (unsigned long)result);
               le2->type=PSYNC_URANGE_UPLOAD;
-              uploadoffset=le2->uploadoffset;
               le2->off=le2->uploadoffset;
               le=le2;
               goto restart;
@@ -901,6 +1083,8 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
         goto err1;
       }
       else if (le->type==PSYNC_URANGE_LAST && le->id==psync_find_result(res, "id", PARAM_NUM)->num) {
+        // from here on the upload is either complete or has to start over, either way the chunks are of no use
+        psync_upload_forget_chunks(uploadid);
         if (unlikely(psync_find_result(res, "size", PARAM_NUM)->num!=fsize)) {
           log_warn("file size mismatch after upload, expected: %lu, got: %lu", (unsigned long)fsize,
                 (unsigned long)psync_find_result(res, "size", PARAM_NUM)->num);
@@ -948,7 +1132,6 @@ restart:
         goto errp;
     }
     respwait++;
-    uploadoffset+=le->len;
   }
   psync_list_for_each_element_call(&rlist, psync_upload_range_list_t, list, psync_free);
   if (psync_file_size(fd)!=fsize) {
@@ -996,8 +1179,10 @@ static void delete_uploadids(psync_fileid_t localfileid) {
   psync_sql_bind_uint(res, 1, localfileid);
   rows=psync_sql_fetchall_int(res);
   if (rows->rows) {
-    for (i=0; i<rows->rows; i++)
+    for (i=0; i<rows->rows; i++) {
       delete_uploadid(psync_get_result_cell(rows, i, 0));
+      psync_upload_forget_chunks(psync_get_result_cell(rows, i, 0));
+    }
     res=psync_sql_prep_statement("DELETE FROM localfileupload WHERE localfileid=?");
     psync_sql_bind_uint(res, 1, localfileid);
     psync_sql_run_free(res);
@@ -1035,7 +1220,7 @@ static int task_uploadfile(psync_syncid_t syncid, psync_folderid_t localfileid,
   psync_stat_t st;
   unsigned char hashhex[PSYNC_HASH_DIGEST_HEXLEN], uhashhex[PSYNC_HASH_DIGEST_HEXLEN], phashhex[PSYNC_HASH_DIGEST_HEXLEN];
   binparam pr;
-  int ret;
+  int ret, chunked;
   psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
   if (upload->stop)
     return -1;
@@ -1090,7 +1275,10 @@ static int task_uploadfile(psync_syncid_t syncid, psync_folderid_t localfileid,
     uploadid=0;
   psync_sql_free_result(res);
   ufsize=0;
-  if (uploadid) {
+  chunked=uploadid && psync_upload_has_chunks(uploadid, localpath);
+  if (chunked)
+    log_debug("resuming chunked upload %lu", (unsigned long)uploadid);
+  else if (uploadid) {
     ret=psync_get_upload_checksum(uploadid, uhashhex, &ufsize);
     if (ret==PSYNC_NET_TEMPFAIL) {
       psync_unlock_file(lock);
@@ -1102,6 +1290,12 @@ static int task_uploadfile(psync_syncid_t syncid, psync_folderid_t localfileid,
   }
   if (uploadid)
     ret=psync_get_local_file_checksum_part(localpath, hashhex, &fsize, phashhex, ufsize);
+  else if (upload->hasprehash && !psync_stat(localpath, &st) && psync_stat_size(&st)==upload->prehashsize &&
+           psync_stat_mtime(&st)==upload->prehashmtime) {
+    memcpy(hashhex, upload->prehash, PSYNC_HASH_DIGEST_HEXLEN);
+    fsize=upload->prehashsize;
+    ret=0;
+  }
   else
     ret=psync_get_local_file_checksum(localpath, hashhex, &fsize);
   if (unlikely(ret)) {
@@ -1123,6 +1317,7 @@ static int task_uploadfile(psync_syncid_t syncid, psync_folderid_t localfileid,
   psync_sql_bind_lstring(res, 2, (char *)hashhex, PSYNC_HASH_DIGEST_HEXLEN);
   psync_sql_bind_uint(res, 3, localfileid);
   psync_sql_run_free(res);
+  psync_status_upload_task_resized(localfileid, fsize);
   res=psync_sql_query_rdlock("SELECT s.folderid FROM localfile f, syncedfolder s WHERE f.id=? AND f.localparentfolderid=s.localfolderid AND s.syncid=?");
   psync_sql_bind_uint(res, 1, localfileid);
   psync_sql_bind_uint(res, 2, syncid);
@@ -1188,7 +1383,9 @@ static int task_uploadfile(psync_syncid_t syncid, psync_folderid_t localfileid,
   if (fsize<=PSYNC_MIN_SIZE_FOR_CHECKSUMS)
     ret=upload_file(localpath, hashhex, fsize, folderid, name, localfileid, syncid, upload, &st, pr);
   else {
-    if (uploadid && !memcmp(phashhex, uhashhex, PSYNC_HASH_DIGEST_HEXLEN))
+    if (chunked)
+      ret=upload_big_file(localpath, hashhex, fsize, folderid, name, localfileid, syncid, upload, uploadid, 0, &st, pr);
+    else if (uploadid && !memcmp(phashhex, uhashhex, PSYNC_HASH_DIGEST_HEXLEN))
       ret=upload_big_file(localpath, hashhex, fsize, folderid, name, localfileid, syncid, upload, uploadid, ufsize, &st, pr);
     else {
       if (uploadid && memcmp(phashhex, uhashhex, PSYNC_HASH_DIGEST_HEXLEN))
@@ -1212,6 +1409,7 @@ static void delete_upload_task(uint64_t taskid, psync_fileid_t localfileid) {
   res=psync_sql_prep_statement("DELETE FROM task WHERE id=?");
   psync_sql_bind_uint(res, 1, taskid);
   psync_sql_run_free(res);
+  psync_status_upload_task_removed(localfileid);
   res=psync_sql_query_nolock("SELECT syncid, localparentfolderid FROM localfile WHERE id=?");
   psync_sql_bind_uint(res, 1, localfileid);
   if ((row=psync_sql_fetch_rowint(res)))
@@ -1248,6 +1446,90 @@ static void task_run_upload_file_thread(void *ptr) {
   psync_free(ut);
 }
 
+static int upload_prehash_abandoned(upload_list_t *upload) {
+  int ret;
+  if (upload->stop)
+    return 1;
+  pthread_mutex_lock(&current_uploads_mutex);
+  ret=upload_can_start_locked();
+  pthread_mutex_unlock(&current_uploads_mutex);
+  return ret;
+}
+
+/* Hashes the file while the dispatcher would otherwise just wait for the uploads in progress to drain, the upload
+ * thread uses the result if the file did not change in the meantime. Hashing is abandoned as soon as the upload is
+ * stopped or can start, the dispatcher is not held up by a large file. */
+static void upload_prehash(upload_list_t *upload) {
+  psync_stat_t st1, st2;
+  psync_hash_ctx hctx;
+  char *localpath;
+  void *buff;
+  uint64_t rsz;
+  size_t rs;
+  ssize_t rrs;
+  psync_file_t fd;
+  unsigned char hashbin[PSYNC_HASH_DIGEST_LEN];
+  localpath=psync_local_path_for_local_file(upload->localfileid, NULL);
+  if (!localpath)
+    return;
+  fd=psync_file_open(localpath, P_O_RDONLY, 0);
+  psync_free(localpath);
+  if (fd==INVALID_HANDLE_VALUE)
+    return;
+  if (psync_fstat(fd, &st1) || psync_stat_mtime(&st1)>=psync_timer_time()-PSYNC_UPLOAD_OLDER_THAN_SEC) {
+    psync_file_close(fd);
+    return;
+  }
+  buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
+  psync_hash_init(&hctx);
+  rsz=psync_stat_size(&st1);
+  while (rsz) {
+    if (upload_prehash_abandoned(upload)) {
+      log_debug("abandoned hashing of localfileid %lu", (unsigned long)upload->localfileid);
+      break;
+    }
+    if (rsz>PSYNC_COPY_BUFFER_SIZE)
+      rs=PSYNC_COPY_BUFFER_SIZE;
+    else
+      rs=rsz;
+    rrs=psync_file_read(fd, buff, rs);
+    if (rrs<=0)
+      break;
+    psync_hash_update(&hctx, buff, rrs);
+    rsz-=rrs;
+  }
+  psync_hash_final(hashbin, &hctx);
+  if (!rsz && !psync_fstat(fd, &st2) && psync_stat_size(&st1)==psync_stat_size(&st2) &&
+      psync_stat_mtime(&st1)==psync_stat_mtime(&st2)) {
+    psync_binhex(upload->prehash, hashbin, PSYNC_HASH_DIGEST_LEN);
+    upload->prehashsize=psync_stat_size(&st2);
+    upload->prehashmtime=psync_stat_mtime(&st2);
+    upload->hasprehash=1;
+  }
+  psync_free(buff);
+  psync_file_close(fd);
+}
+
+int psync_upload_file_task(uint64_t taskid, psync_syncid_t syncid, psync_fileid_t localfileid, const char *filename) {
+  upload_list_t upload;
+  int ret;
+  memset(&upload, 0, sizeof(upload));
+  upload.taskid=taskid;
+  upload.localfileid=localfileid;
+  upload.syncid=syncid;
+  pthread_mutex_lock(&current_uploads_mutex);
+  psync_list_add_tail(&uploads, &upload.list);
+  pthread_mutex_unlock(&current_uploads_mutex);
+  ret=task_uploadfile(syncid, localfileid, filename, &upload);
+  pthread_mutex_lock(&current_uploads_mutex);
+  psync_status.bytestouploadcurrent-=upload.filesize;
+  psync_status.bytesuploaded-=upload.uploaded;
+  psync_list_del(&upload.list);
+  wake_upload_when_ready();
+  pthread_mutex_unlock(&current_uploads_mutex);
+  return ret;
+}
+
 static int task_run_uploadfile(uint64_t taskid, psync_syncid_t syncid, psync_folderid_t localfileid, const char *filename) {
   psync_sql_res *res;
   upload_task_t *ut;
@@ -1278,14 +1560,18 @@ static int task_run_uploadfile(uint64_t taskid, psync_syncid_t syncid, psync_fol
   ut->upllist.uploaded=0;
   ut->upllist.syncid=syncid;
   ut->upllist.stop=0;
+  ut->upllist.hasprehash=0;
   ut->upllist.hash[0]=0;
   memcpy(ut->filename, filename, len+1);
   stop=0;
   pthread_mutex_lock(&current_uploads_mutex);
   psync_list_add_tail(&uploads, &ut->upllist.list);
-  while (!ut->upllist.stop && (psync_status.filesuploading>=PSYNC_MAX_PARALLEL_UPLOADS ||
-         psync_status.bytestouploadcurrent-psync_status.bytesuploaded>
-              PSYNC_START_NEW_UPLOADS_THRESHOLD)) {
+  if (!upload_can_start_locked()) {
+    pthread_mutex_unlock(&current_uploads_mutex);
+    upload_prehash(&ut->upllist);
+    pthread_mutex_lock(&current_uploads_mutex);
+  }
+  while (!ut->upllist.stop && !upload_can_start_locked()) {
     current_uploads_waiters++;
     pthread_cond_wait(&current_uploads_cond, &current_uploads_mutex);
     current_uploads_waiters--;
@@ -1391,7 +1677,7 @@ static void upload_thread() {
                          psync_get_string_or_null(row[6]),
                          psync_get_number_or_null(row[7]))) {
         if (type==PSYNC_UPLOAD_FILE) {
-          delete_upload_task(taskid, psync_get_number(row[3]));
+          delete_upload_task(taskid, psync_get_number(row[4]));
           psync_status_recalc_to_upload_async();
         }
         else {
@@ -1433,8 +1719,10 @@ void psync_delete_upload_tasks_for_file(psync_fileid_t localfileid) {
   psync_sql_bind_uint(res, 1, PSYNC_UPLOAD_FILE);
   psync_sql_bind_uint(res, 2, localfileid);
   psync_sql_run(res);
-  if (psync_sql_affected_rows())
+  if (psync_sql_affected_rows()) {
+    psync_status_upload_task_removed(localfileid);
     psync_status_recalc_to_upload_async();
+  }
   psync_sql_free_result(res);
   pthread_mutex_lock(&current_uploads_mutex);
   psync_list_for_each_element(upl, &uploads, upload_list_t, list)
@@ -1449,6 +1737,7 @@ void psync_stop_sync_upload(psync_syncid_t syncid) {
   res=psync_sql_prep_statement("DELETE FROM task WHERE syncid=? AND type&"NTO_STR(PSYNC_TASK_DWLUPL_MASK)"="NTO_STR(PSYNC_TASK_UPLOAD));
   psync_sql_bind_uint(res, 1, syncid);
   psync_sql_run_free(res);
+  psync_status_upload_sync_removed(syncid);
   pthread_mutex_lock(&current_uploads_mutex);
   psync_list_for_each_element(upl, &uploads, upload_list_t, list)
     if (upl->syncid==syncid)
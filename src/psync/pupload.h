@@ -24,5 +24,8 @@ void psync_wake_upload();
 void psync_delete_upload_tasks_for_file(psync_fileid_t localfileid);
 void psync_stop_sync_upload(psync_syncid_t syncid);
 void psync_stop_all_upload();
+/* Uploads the file of an upload task in the calling thread, without waiting for a free upload slot. The task row is
+ * left alone. Returns 0 when the file is uploaded or needs no upload and -1 when it should be retried later. */
+int psync_upload_file_task(uint64_t taskid, psync_syncid_t syncid, psync_fileid_t localfileid, const char *filename);
 
 #endif /* PCLOUD_PSYNC_PUPLOAD_H_ */
@@ -0,0 +1,144 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "psync/papi.h"
+#include "psync/plibs.h"
+}
+
+namespace {
+
+const char *const kMetaKeys[] = {"fileid", "parentfolderid", "ismine",
+                                 "size",   "hash",           "name",
+                                 "created", "modified",      "category",
+                                 "thumb",  "icon"};
+const size_t kMetaKeyCnt = sizeof(kMetaKeys) / sizeof(kMetaKeys[0]);
+
+// A hash with a number value for every key, the value is the position of the
+// key in keys.
+class Hash {
+ public:
+  explicit Hash(const std::vector<size_t> &order) {
+    hash_ = static_cast<binresult *>(calloc(1, sizeof(binresult)));
+    values_ =
+        static_cast<binresult *>(calloc(order.size(), sizeof(binresult)));
+    pairs_ = static_cast<hashpair *>(calloc(order.size(), sizeof(hashpair)));
+    for (size_t i = 0; i < order.size(); i++) {
+      values_[i].type = PARAM_NUM;
+      values_[i].num = order[i];
+      pairs_[i].key = kMetaKeys[order[i]];
+      pairs_[i].value = &values_[i];
+    }
+    hash_->type = PARAM_HASH;
+    hash_->length = order.size();
+    hash_->hash = pairs_;
+  }
+
+  ~Hash() {
+    free(hash_);
+    free(values_);
+    free(pairs_);
+  }
+
+  const binresult *Get() const { return hash_; }
+
+ private:
+  binresult *hash_;
+  binresult *values_;
+  hashpair *pairs_;
+};
+
+std::vector<size_t> InOrder() {
+  std::vector<size_t> ret;
+  for (size_t i = 0; i < kMetaKeyCnt; i++)
+    ret.push_back(i);
+  return ret;
+}
+
+uint64_t FindHinted(const binresult *res, size_t key) {
+  return psync_find_result(res, kMetaKeys[key], PARAM_NUM)->num;
+}
+
+uint64_t FindScan(const binresult *res, size_t key) {
+  return psync_do_find_result(res, kMetaKeys[key], PARAM_NUM, __FILENAME__,
+                              __FUNCTION__, __LINE__)
+      ->num;
+}
+
+}  // namespace
+
+// One call site, so one hint, sees hashes with the keys in different orders
+// and with fewer keys than the hinted position.
+TEST(ApiTest, FindsKeysWithAStaleHint) {
+  Hash ordered(InOrder());
+  std::vector<size_t> order = InOrder();
+  std::reverse(order.begin(), order.end());
+  Hash reversed(order);
+  Hash shorter({5, 0});
+  for (int round = 0; round < 3; round++) {
+    for (size_t key = 0; key < kMetaKeyCnt; key++) {
+      EXPECT_EQ(FindHinted(ordered.Get(), key), key);
+      EXPECT_EQ(FindHinted(reversed.Get(), key), key);
+    }
+    EXPECT_EQ(FindHinted(shorter.Get(), 0), 0u);
+    EXPECT_EQ(FindHinted(shorter.Get(), 5), 5u);
+  }
+  EXPECT_EQ(psync_check_result(shorter.Get(), "size", PARAM_NUM), nullptr);
+  EXPECT_EQ(psync_check_result(shorter.Get(), "name", PARAM_STR), nullptr);
+  EXPECT_EQ(psync_check_result(shorter.Get(), "name", PARAM_NUM)->num, 5u);
+}
+
+// Every key of a file metadata hash is looked up from its own call site, as
+// the diff and listing code do.
+TEST(ApiTest, DISABLED_BenchmarkFindResult) {
+  const uint64_t kObjects = 2000000;
+  Hash meta(InOrder());
+  for (bool hinted : {false, true}) {
+    uint64_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < kObjects; i++) {
+      const binresult *res = meta.Get();
+      if (hinted) {
+        sum += psync_find_result(res, "fileid", PARAM_NUM)->num;
+        sum += psync_find_result(res, "parentfolderid", PARAM_NUM)->num;
+        sum += psync_find_result(res, "size", PARAM_NUM)->num;
+        sum += psync_find_result(res, "hash", PARAM_NUM)->num;
+        sum += psync_find_result(res, "created", PARAM_NUM)->num;
+        sum += psync_find_result(res, "modified", PARAM_NUM)->num;
+        sum += psync_find_result(res, "icon", PARAM_NUM)->num;
+      } else {
+        sum += FindScan(res, 0);
+        sum += FindScan(res, 1);
+        sum += FindScan(res, 3);
+        sum += FindScan(res, 4);
+        sum += FindScan(res, 6);
+        sum += FindScan(res, 7);
+        sum += FindScan(res, 10);
+      }
+    }
+    double ns = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    EXPECT_EQ(sum, kObjects * (0 + 1 + 3 + 4 + 6 + 7 + 10));
+    printf("%-6s %6.1f ns/lookup\n", hinted ? "hinted" : "scan",
+           ns / kObjects / 7);
+  }
+}
@@ -0,0 +1,301 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <malloc.h>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "psync/papi.h"
+#include "psync/plibs.h"
+}
+
+namespace {
+
+// Encodes responses the way the server does, strings already sent are
+// referred to by their number.
+class Response {
+ public:
+  Response &Hash() { return Byte(16); }
+  Response &Array() { return Byte(17); }
+  Response &End() { return Byte(255); }
+  Response &Bool(bool val) { return Byte(val ? 19 : 18); }
+
+  Response &Num(uint64_t num) {
+    if (num < 20)
+      return Byte(200 + num);
+    Byte(15);
+    return Raw(&num, 8);
+  }
+
+  Response &Str(const std::string &str) {
+    auto it = strings_.find(str);
+    if (it != strings_.end()) {
+      if (it->second < 50)
+        return Byte(150 + it->second);
+      uint32_t id = it->second;
+      Byte(7);
+      return Raw(&id, 4);
+    }
+    strings_.emplace(str, strings_.size());
+    if (str.size() < 50) {
+      Byte(100 + str.size());
+    } else {
+      uint32_t len = str.size();
+      Byte(3);
+      Raw(&len, 4);
+    }
+    return Raw(str.data(), str.size());
+  }
+
+  Response &Byte(unsigned char b) { return Raw(&b, 1); }
+
+  // The response with its length in front, len overrides the length.
+  std::string Get(int64_t len = -1) const {
+    uint32_t l = len < 0 ? data_.size() : len;
+    return std::string(reinterpret_cast<const char *>(&l), 4) + data_;
+  }
+
+ private:
+  Response &Raw(const void *data, size_t len) {
+    data_.append(static_cast<const char *>(data), len);
+    return *this;
+  }
+
+  std::string data_;
+  std::map<std::string, uint32_t> strings_;
+};
+
+class ResultTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds_), 0);
+    memset(&sock_, 0, sizeof(sock_));
+    sock_.sock = fds_[0];
+  }
+
+  void TearDown() override {
+    close(fds_[0]);
+    if (fds_[1] != -1)
+      close(fds_[1]);
+  }
+
+  void Send(const std::string &data) {
+    ASSERT_EQ(write(fds_[1], data.data(), data.size()),
+              static_cast<ssize_t>(data.size()));
+  }
+
+  void CloseWriter() {
+    close(fds_[1]);
+    fds_[1] = -1;
+  }
+
+  static std::string Str(const binresult *res) {
+    EXPECT_EQ(res->type, PARAM_STR);
+    return std::string(res->str, res->length);
+  }
+
+  static const binresult *Key(const binresult *res, const char *key) {
+    EXPECT_EQ(res->type, PARAM_HASH);
+    for (uint32_t i = 0; i < res->length; i++)
+      if (!strcmp(res->hash[i].key, key))
+        return res->hash[i].value;
+    ADD_FAILURE() << "no key " << key;
+    return res;
+  }
+
+  static int Collect(void *ptr, binresult *batch) {
+    ResultTest *t = static_cast<ResultTest *>(ptr);
+    t->batches_.push_back(batch);
+    return t->abortafter_ && t->batches_.size() == t->abortafter_;
+  }
+
+  void FreeBatches() {
+    for (binresult *b : batches_)
+      psync_free(b);
+    batches_.clear();
+  }
+
+  int fds_[2];
+  psync_socket sock_;
+  std::vector<binresult *> batches_;
+  size_t abortafter_ = 0;
+};
+
+std::string LongString(char c) { return std::string(300, c); }
+
+}  // namespace
+
+TEST_F(ResultTest, ParsesNestedArraysAndHashes) {
+  Response r;
+  r.Hash()
+      .Str("result").Num(0)
+      .Str("list").Array()
+          .Hash()
+              .Str("a").Array().Num(1).Num(70000).Array().Num(3).End().End()
+              .Str("b").Hash().Str("c").Str(LongString('x')).End()
+          .End()
+          .Bool(true).Bool(false).Num(123456789)
+          .Str(LongString('x'))
+          .Str("a")
+      .End()
+      .Str("empty").Array().End()
+      .Str("emptyhash").Hash().End()
+  .End();
+  Send(r.Get());
+  binresult *res = get_result(&sock_);
+  ASSERT_NE(res, nullptr);
+  EXPECT_EQ(Key(res, "result")->num, 0u);
+  const binresult *list = Key(res, "list");
+  ASSERT_EQ(list->type, PARAM_ARRAY);
+  ASSERT_EQ(list->length, 6u);
+  const binresult *a = Key(list->array[0], "a");
+  ASSERT_EQ(a->type, PARAM_ARRAY);
+  ASSERT_EQ(a->length, 3u);
+  EXPECT_EQ(a->array[0]->num, 1u);
+  EXPECT_EQ(a->array[1]->num, 70000u);
+  ASSERT_EQ(a->array[2]->type, PARAM_ARRAY);
+  ASSERT_EQ(a->array[2]->length, 1u);
+  EXPECT_EQ(a->array[2]->array[0]->num, 3u);
+  EXPECT_EQ(Str(Key(Key(list->array[0], "b"), "c")), LongString('x'));
+  EXPECT_EQ(list->array[1]->type, PARAM_BOOL);
+  EXPECT_EQ(list->array[1]->num, 1u);
+  EXPECT_EQ(list->array[2]->num, 0u);
+  EXPECT_EQ(list->array[3]->num, 123456789u);
+  EXPECT_EQ(Str(list->array[4]), LongString('x'));
+  EXPECT_EQ(Str(list->array[5]), "a");
+  EXPECT_EQ(Key(res, "empty")->type, PARAM_ARRAY);
+  EXPECT_EQ(Key(res, "empty")->length, 0u);
+  EXPECT_EQ(Key(res, "emptyhash")->type, PARAM_HASH);
+  EXPECT_EQ(Key(res, "emptyhash")->length, 0u);
+  psync_free(res);
+}
+
+// Strings defined in one batch and reused in later ones are copied into each
+// batch, which has to stay valid after the earlier ones are freed.
+TEST_F(ResultTest, StreamsBatchesWithReusedStrings) {
+  const uint32_t kEntries = 10;
+  Response r;
+  r.Hash().Str("result").Num(0).Str("entries").Array();
+  for (uint32_t i = 0; i < kEntries; i++)
+    r.Hash()
+        .Str("event").Str(i % 2 ? "createfile" : LongString('e'))
+        .Str("name").Str("file" + std::to_string(i / 4))
+        .End();
+  r.End().Str("diffid").Num(77).Str("last").Str(LongString('e')).End();
+  Send(r.Get());
+  binresult *res = get_result_stream(&sock_, "entries", 3, Collect, this);
+  ASSERT_NE(res, nullptr);
+  EXPECT_EQ(Key(res, "diffid")->num, 77u);
+  EXPECT_EQ(Str(Key(res, "last")), LongString('e'));
+  EXPECT_EQ(Key(res, "entries")->type, PARAM_ARRAY);
+  EXPECT_EQ(Key(res, "entries")->length, 0u);
+  psync_free(res);
+  ASSERT_EQ(batches_.size(), 4u);
+  uint32_t n = 0;
+  for (const binresult *batch : batches_) {
+    ASSERT_EQ(batch->type, PARAM_ARRAY);
+    EXPECT_EQ(batch->length, batch == batches_.back() ? 1u : 3u);
+    const char *begin = reinterpret_cast<const char *>(batch);
+    const char *end = begin + malloc_usable_size(const_cast<binresult *>(batch));
+    for (uint32_t i = 0; i < batch->length; i++, n++) {
+      const binresult *event = Key(batch->array[i], "event");
+      EXPECT_EQ(Str(event), n % 2 ? "createfile" : LongString('e'));
+      EXPECT_EQ(Str(Key(batch->array[i], "name")),
+                "file" + std::to_string(n / 4));
+      // no references to the strings of other batches
+      EXPECT_GE(event->str, begin);
+      EXPECT_LT(event->str, end);
+    }
+  }
+  EXPECT_EQ(n, kEntries);
+  FreeBatches();
+}
+
+TEST_F(ResultTest, StopsStreamingWhenTheCallbackAborts) {
+  Response r;
+  r.Hash().Str("entries").Array();
+  for (uint32_t i = 0; i < 10; i++)
+    r.Num(i);
+  r.End().End();
+  Send(r.Get());
+  abortafter_ = 2;
+  EXPECT_EQ(get_result_stream(&sock_, "entries", 3, Collect, this), nullptr);
+  ASSERT_EQ(batches_.size(), 2u);
+  EXPECT_EQ(batches_[1]->array[0]->num, 3u);
+  FreeBatches();
+}
+
+// A malformed response is dropped whole, so the next one on the connection
+// is still parsed.
+TEST_F(ResultTest, RejectsMalformedResponses) {
+  Response unknown;
+  unknown.Hash().Str("result").Byte(99).Str("more").Num(1).End();
+  Response badref;
+  badref.Hash().Str("result").Byte(150 + 40).End();
+  Response unterminated;
+  unterminated.Hash().Str("result").Num(0);
+  Response trailing;
+  trailing.Hash().Str("result").Num(0).End().Num(5).Num(6);
+  Response good;
+  good.Hash().Str("result").Num(0).End();
+  for (const Response *bad : {&unknown, &badref, &unterminated}) {
+    Send(bad->Get());
+    Send(good.Get());
+    EXPECT_EQ(get_result(&sock_), nullptr);
+    binresult *res = get_result(&sock_);
+    ASSERT_NE(res, nullptr);
+    EXPECT_EQ(Key(res, "result")->num, 0u);
+    psync_free(res);
+  }
+  Send(trailing.Get());
+  Send(good.Get());
+  binresult *res = get_result(&sock_);
+  ASSERT_NE(res, nullptr);
+  psync_free(res);
+  res = get_result(&sock_);
+  ASSERT_NE(res, nullptr);
+  EXPECT_EQ(Key(res, "result")->num, 0u);
+  psync_free(res);
+}
+
+TEST_F(ResultTest, RejectsTruncatedResponses) {
+  Response r;
+  r.Hash().Str("result").Num(0).Str("name").Str(LongString('t')).End();
+  std::string data = r.Get();
+  // the connection is closed in the middle of a string
+  Send(data.substr(0, data.size() - 100));
+  CloseWriter();
+  EXPECT_EQ(get_result(&sock_), nullptr);
+}
+
+// The length is all that is read, whatever follows belongs to the next
+// response.
+TEST_F(ResultTest, RejectsValuesLongerThanTheResponse) {
+  Response r;
+  r.Hash().Str("result").Num(0).Str("name").Str(LongString('t')).End();
+  Response good;
+  good.Hash().Str("result").Num(0).End();
+  std::string data = r.Get(20);
+  Send(data.substr(0, 24));
+  Send(good.Get());
+  EXPECT_EQ(get_result(&sock_), nullptr);
+  binresult *res = get_result(&sock_);
+  ASSERT_NE(res, nullptr);
+  EXPECT_EQ(Key(res, "result")->num, 0u);
+  psync_free(res);
+}
@@ -0,0 +1,623 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "psync/upload/apistub.h"
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "psync/pasyncnet.h"
+#include "psync/pcache.h"
+#include "psync/pcompression.h"
+#include "psync/plibs.h"
+#include "psync/pnetlibs.h"
+#include "psync/psettings.h"
+#include "psync/psynclib.h"
+#include "psync/pssl.h"
+#include "psync/ptimer.h"
+}
+
+namespace {
+
+using std::chrono::milliseconds;
+
+const uint64_t kFolderId = 30;
+
+// The packets the server sends in front of the data, as pasyncnet reads them.
+struct DownloadHeader {
+  uint32_t error;
+  uint32_t errorflags;
+  uint64_t size;
+  uint64_t hash;
+  uint64_t mtime;
+  uint64_t oldhash;
+  uint64_t oldmtime;
+  unsigned char sha1hex[PSYNC_SHA1_DIGEST_HEXLEN];
+};
+
+struct UploadHeader {
+  uint32_t error;
+  uint32_t errorflags;
+  uint64_t fileid;
+  uint64_t hash;
+  uint64_t size;
+};
+
+struct ChecksumHeader {
+  uint32_t error;
+  uint32_t errorflags;
+  uint64_t size;
+  uint64_t hash;
+  unsigned char sha1hex[PSYNC_SHA1_DIGEST_HEXLEN];
+};
+
+struct MetaHeader {
+  uint32_t error;
+  uint32_t errorflags;
+  uint64_t fileid;
+  uint64_t parentfolderid;
+  uint64_t size;
+  uint64_t hash;
+  uint64_t ctime;
+  uint64_t mtime;
+};
+
+struct ReadHeader {
+  uint32_t error;
+  uint32_t errorflags;
+  uint64_t size;
+};
+
+std::string Sha1(const std::string &data) {
+  unsigned char bin[PSYNC_SHA1_DIGEST_LEN], hex[PSYNC_SHA1_DIGEST_HEXLEN];
+  psync_sha1(reinterpret_cast<const unsigned char *>(data.data()), data.size(),
+             bin);
+  psync_binhex(hex, bin, PSYNC_SHA1_DIGEST_LEN);
+  return std::string(reinterpret_cast<char *>(hex), sizeof(hex));
+}
+
+std::string Content(size_t len, char seed) {
+  std::string data(len, '\0');
+  for (size_t i = 0; i < len; i++)
+    data[i] = static_cast<char>(seed + i * 7 + i / 251);
+  return data;
+}
+
+// A request as it came over an async connection.
+struct AsyncRequest {
+  uint32_t connection;
+  std::map<std::string, std::string> params;
+  std::string name;
+  std::string data;
+
+  uint64_t Num(const std::string &key) const {
+    return std::stoull(params.at(key));
+  }
+};
+
+// The server end of async connections: answers asynctransfer, then reads the
+// compressed requests and sends the compressed stream packets back.
+class AsyncServer {
+ public:
+  void AddFile(uint64_t fileid, const std::string &data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    files_[fileid] = data;
+  }
+
+  // Downloads of the file are answered only after Release(), the connection
+  // they came on answers nothing else until then.
+  void Hold(uint64_t fileid) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    held_.insert(fileid);
+  }
+
+  void Release() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    held_.clear();
+    cond_.notify_all();
+  }
+
+  std::vector<AsyncRequest> Requests() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return requests_;
+  }
+
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    requests_.clear();
+    files_.clear();
+  }
+
+  static std::string Method(const Request &req) {
+    std::string offered = req.str.at("compression");
+    return offered.substr(0, offered.find(','));
+  }
+
+  static std::string Accept(const Request &req) {
+    Response r;
+    if (req.cmd != "asynctransfer")
+      return std::string();
+    r.Hash()
+        .Key("result").Num(0)
+        .Key("compression").Str(Method(req))
+    .End();
+    return r.Get();
+  }
+
+  void Session(int fd, const Request &req) {
+    int method = psync_compressor_find(Method(req).c_str());
+    psync_compressor_t *enc =
+        psync_compressor_init(method, PSYNC_DEFLATE_COMP_FAST);
+    psync_compressor_t *dec =
+        psync_compressor_init(method, PSYNC_DEFLATE_DECOMPRESS);
+    uint32_t connection;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      connection = ++connections_;
+    }
+    std::string in;
+    char buff[4096];
+    while (true) {
+      ssize_t rd = read(fd, buff, sizeof(buff));
+      if (rd <= 0 || !Pump(dec, buff, rd, PSYNC_DEFLATE_FLUSH, &in))
+        break;
+      AsyncRequest areq;
+      areq.connection = connection;
+      bool ok = true;
+      while (ok && Parse(&in, &areq)) {
+        std::string out;
+        Answer(areq, &out);
+        ok = Pump(enc, out.data(), out.size(), PSYNC_DEFLATE_NOFLUSH, &out) &&
+             Pump(enc, "", 0, PSYNC_DEFLATE_FLUSH, &out) && WriteAll(fd, out);
+        areq = AsyncRequest();
+        areq.connection = connection;
+      }
+      if (!ok)
+        break;
+    }
+    psync_compressor_destroy(enc);
+    psync_compressor_destroy(dec);
+  }
+
+ private:
+  // Runs data through the (de)compressor, its output replaces data in out
+  // when both are the same string.
+  static bool Pump(psync_compressor_t *comp, const char *data, size_t len,
+                   int flush, std::string *out) {
+    std::string src(data, len), res;
+    const char *p = src.data();
+    char buff[4096];
+    do {
+      int wr = psync_compressor_write(comp, p, len, flush);
+      if (wr > 0) {
+        p += wr;
+        len -= wr;
+      } else if (wr != 0 && wr != PSYNC_DEFLATE_FULL) {
+        return false;
+      }
+      int rd;
+      while ((rd = psync_compressor_read(comp, buff, sizeof(buff))) > 0)
+        res.append(buff, rd);
+      if (rd != PSYNC_DEFLATE_NODATA && rd != PSYNC_DEFLATE_EOF)
+        return false;
+    } while (len);
+    if (out->data() == data)
+      *out = res;
+    else
+      out->append(res);
+    return true;
+  }
+
+  static bool WriteAll(int fd, const std::string &data) {
+    size_t off = 0;
+    while (off < data.size()) {
+      ssize_t wr = write(fd, data.data() + off, data.size() - off);
+      if (wr <= 0)
+        return false;
+      off += wr;
+    }
+    return true;
+  }
+
+  // Takes a complete request off the front of in.
+  bool Parse(std::string *in, AsyncRequest *req) {
+    size_t eol = in->find('\n');
+    if (eol == std::string::npos)
+      return false;
+    std::stringstream line(in->substr(0, eol));
+    std::string item;
+    while (std::getline(line, item, ',')) {
+      size_t eq = item.find('=');
+      req->params[item.substr(0, eq)] = item.substr(eq + 1);
+    }
+    size_t used = eol + 1;
+    if (req->params["act"] == "upl") {
+      size_t namelen = req->Num("namelen"), size = req->Num("size");
+      if (in->size() < used + namelen + size)
+        return false;
+      req->name = in->substr(used, namelen);
+      req->data = in->substr(used + namelen, size);
+      used += namelen + size;
+    }
+    in->erase(0, used);
+    std::unique_lock<std::mutex> lock(mutex_);
+    requests_.push_back(*req);
+    if (req->params["act"] == "dwl")
+      cond_.wait(lock, [&] { return !held_.count(req->Num("fileid")); });
+    return true;
+  }
+
+  static void Packet(uint32_t streamid, const void *data, size_t len,
+                     std::string *out) {
+    const char *p = static_cast<const char *>(data);
+    do {
+      uint16_t plen = len > 65536 ? 65535 : len - 1;
+      out->append(reinterpret_cast<const char *>(&streamid), 4);
+      out->append(reinterpret_cast<const char *>(&plen), 2);
+      out->append(p, plen + 1);
+      p += plen + 1;
+      len -= plen + 1;
+    } while (len);
+  }
+
+  void Answer(const AsyncRequest &req, std::string *out) {
+    std::string act = req.params.at("act"), content;
+    uint32_t strm = req.Num("strm");
+    bool found = false;
+    if (req.params.count("fileid")) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = files_.find(req.Num("fileid"));
+      if (it != files_.end()) {
+        found = true;
+        content = it->second;
+      }
+    }
+    if (act == "dwl" || act == "dwlnm") {
+      DownloadHeader h;
+      memset(&h, 0, sizeof(h));
+      if (!found)
+        h.error = 2;
+      else if (act == "dwlnm" && req.params.at("sha1") == Sha1(content))
+        h.error = PSYNC_SERVER_ERROR_NOT_MOD - 100;
+      h.size = content.size();
+      h.hash = req.Num("fileid") * 7;
+      h.mtime = 1600000000;
+      memcpy(h.sha1hex, Sha1(content).data(), sizeof(h.sha1hex));
+      Packet(strm, &h, sizeof(h), out);
+      if (!h.error && !content.empty())
+        Packet(strm, content.data(), content.size(), out);
+    } else if (act == "upl") {
+      UploadHeader h;
+      memset(&h, 0, sizeof(h));
+      if (req.params.at("sha1") != Sha1(req.data)) {
+        h.error = 2;
+      } else {
+        h.fileid = 500 + req.data.size();
+        h.hash = h.fileid * 7;
+        h.size = req.data.size();
+      }
+      Packet(strm, &h, sizeof(h), out);
+    } else if (act == "sum") {
+      ChecksumHeader h;
+      memset(&h, 0, sizeof(h));
+      h.error = found ? 0 : 2;
+      h.size = content.size();
+      h.hash = req.Num("fileid") * 7;
+      memcpy(h.sha1hex, Sha1(content).data(), sizeof(h.sha1hex));
+      Packet(strm, &h, sizeof(h), out);
+    } else if (act == "meta") {
+      MetaHeader h;
+      memset(&h, 0, sizeof(h));
+      h.error = found ? 0 : 2;
+      h.fileid = req.Num("fileid");
+      h.parentfolderid = kFolderId;
+      h.size = content.size();
+      h.hash = h.fileid * 7;
+      h.ctime = 1500000000;
+      h.mtime = 1600000000;
+      Packet(strm, &h, sizeof(h), out);
+    } else if (act == "read") {
+      ReadHeader h;
+      memset(&h, 0, sizeof(h));
+      uint64_t off = req.Num("offset");
+      std::string part = found && off < content.size()
+                             ? content.substr(off, req.Num("length"))
+                             : std::string();
+      h.error = found ? 0 : 2;
+      h.size = part.size();
+      Packet(strm, &h, sizeof(h), out);
+      if (!part.empty())
+        Packet(strm, part.data(), part.size(), out);
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::map<uint64_t, std::string> files_;
+  std::set<uint64_t> held_;
+  std::vector<AsyncRequest> requests_;
+  uint32_t connections_ = 0;
+};
+
+// The result of one async call.
+class Result {
+ public:
+  static void Done(void *ptr, psync_async_result_t *res) {
+    Result *self = static_cast<Result *>(ptr);
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    self->res_ = *res;
+    self->done_ = true;
+    self->cond_.notify_all();
+  }
+
+  bool Wait(milliseconds timeout = milliseconds(5000)) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cond_.wait_for(lock, timeout, [this] { return done_; });
+  }
+
+  bool Done() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return done_;
+  }
+
+  const psync_async_result_t &Get() { return res_; }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  psync_async_result_t res_;
+  bool done_ = false;
+};
+
+ApiStub *stub;
+AsyncServer *server;
+
+// A database for the downloads to record their checksums in and a stub
+// server for the async connections.
+class AsyncTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    if (stub)
+      return;
+    psync_timer_init();
+    psync_cache_init();
+    psync_netlibs_init();
+    psync_apipool_set_server("stub.test");
+    server = new AsyncServer();
+    // one connection for each kind of request
+    stub = new ApiStub(4);
+    stub->SetHandler(AsyncServer::Accept);
+    stub->SetUpgrade("asynctransfer", [](int fd, const Request &req) {
+      server->Session(fd, req);
+    });
+  }
+
+  void SetUp() override {
+    char dir[] = "/tmp/psyncasyncXXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+    ASSERT_EQ(psync_sql_connect((dir_ + "/data.db").c_str()), 0);
+    // the stub connections are plain sockets
+    psync_setting_set_bool(_PS(usessl), 0);
+    // the revisions of downloaded files refer to them
+    ASSERT_EQ(psync_sql_statement("INSERT INTO file (id, parentfolderid, "
+                                  "name) VALUES (10, 30, 'a'), (11, 30, 'b')"),
+              0);
+  }
+
+  void TearDown() override {
+    server->Release();
+    psync_async_stop();
+    // the connections are closed by the reactor thread
+    std::this_thread::sleep_for(milliseconds(100));
+    server->Clear();
+    psync_sql_close();
+    for (const std::string &name : files_)
+      unlink(Path(name).c_str());
+    for (const char *suffix : {"", "-wal", "-shm"})
+      unlink((Path("data.db") + suffix).c_str());
+    rmdir(dir_.c_str());
+  }
+
+  std::string Path(const std::string &name) {
+    if (std::find(files_.begin(), files_.end(), name) == files_.end())
+      files_.push_back(name);
+    return dir_ + "/" + name;
+  }
+
+  static std::string Read(const std::string &path) {
+    std::string data;
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+      return data;
+    char buff[4096];
+    size_t rd;
+    while ((rd = fread(buff, 1, sizeof(buff), f)) > 0)
+      data.append(buff, rd);
+    fclose(f);
+    return data;
+  }
+
+  static void Write(const std::string &path, const std::string &data) {
+    FILE *f = fopen(path.c_str(), "wb");
+    ASSERT_NE(f, nullptr);
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+  }
+
+  std::string dir_;
+  std::vector<std::string> files_;
+};
+
+}  // namespace
+
+TEST_F(AsyncTest, DownloadsAFile) {
+  std::string content = Content(200000, 'a');
+  std::string path = Path("file");
+  server->AddFile(10, content);
+  Result res;
+  ASSERT_EQ(psync_async_download_file(10, content.size(), path.c_str(),
+                                      Result::Done, &res),
+            0);
+  ASSERT_TRUE(res.Wait());
+  EXPECT_EQ(res.Get().error, 0u);
+  EXPECT_EQ(res.Get().file.size, content.size());
+  EXPECT_EQ(std::string(reinterpret_cast<const char *>(res.Get().file.sha1hex),
+                        PSYNC_SHA1_DIGEST_HEXLEN),
+            Sha1(content));
+  EXPECT_TRUE(Read(path) == content);
+  EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM hashchecksum WHERE hash=70",
+                              0),
+            1);
+}
+
+TEST_F(AsyncTest, LeavesUnchangedFilesAlone) {
+  std::string content = Content(1000, 'b');
+  std::string path = Path("file");
+  server->AddFile(10, content);
+  Result res;
+  ASSERT_EQ(psync_async_download_file_if_changed(
+                10, content.size(), path.c_str(), content.size(),
+                Sha1(content).data(), Result::Done, &res),
+            0);
+  ASSERT_TRUE(res.Wait());
+  EXPECT_EQ(res.Get().error, static_cast<uint32_t>(PSYNC_SERVER_ERROR_NOT_MOD));
+  std::vector<AsyncRequest> reqs = server->Requests();
+  ASSERT_EQ(reqs.size(), 1u);
+  EXPECT_EQ(reqs[0].params.at("act"), "dwlnm");
+  EXPECT_EQ(reqs[0].params.at("sha1"), Sha1(content));
+}
+
+TEST_F(AsyncTest, UploadsAFile) {
+  std::string content = Content(5000, 'c');
+  std::string path = Path("upload");
+  Write(path, content);
+  Result res;
+  ASSERT_EQ(psync_async_upload_file(kFolderId, "name.txt", path.c_str(),
+                                    Result::Done, &res),
+            0);
+  ASSERT_TRUE(res.Wait());
+  EXPECT_EQ(res.Get().error, 0u);
+  EXPECT_EQ(res.Get().upload.fileid, 500 + content.size());
+  EXPECT_EQ(res.Get().upload.size, content.size());
+  std::vector<AsyncRequest> reqs = server->Requests();
+  ASSERT_EQ(reqs.size(), 1u);
+  EXPECT_EQ(reqs[0].Num("folderid"), kFolderId);
+  EXPECT_EQ(reqs[0].name, "name.txt");
+  EXPECT_TRUE(reqs[0].data == content);
+}
+
+TEST_F(AsyncTest, DoesNotUploadLargeFiles) {
+  std::string path = Path("upload");
+  Write(path, std::string(PSYNC_ASYNC_MAX_UPLOAD_SIZE + 1, 'x'));
+  Result res;
+  EXPECT_EQ(psync_async_upload_file(kFolderId, "name.txt", path.c_str(),
+                                    Result::Done, &res),
+            -1);
+  EXPECT_FALSE(res.Done());
+}
+
+TEST_F(AsyncTest, GetsChecksumsAndMetadata) {
+  std::string content = Content(3000, 'd');
+  server->AddFile(10, content);
+  Result sum, meta, missing;
+  ASSERT_EQ(psync_async_file_checksum(10, Result::Done, &sum), 0);
+  ASSERT_EQ(psync_async_file_meta(10, Result::Done, &meta), 0);
+  ASSERT_EQ(psync_async_file_meta(11, Result::Done, &missing), 0);
+  ASSERT_TRUE(sum.Wait());
+  ASSERT_TRUE(meta.Wait());
+  ASSERT_TRUE(missing.Wait());
+  EXPECT_EQ(sum.Get().error, 0u);
+  EXPECT_EQ(sum.Get().file.size, content.size());
+  EXPECT_EQ(sum.Get().file.hash, 70u);
+  EXPECT_EQ(std::string(reinterpret_cast<const char *>(sum.Get().file.sha1hex),
+                        PSYNC_SHA1_DIGEST_HEXLEN),
+            Sha1(content));
+  EXPECT_EQ(meta.Get().error, 0u);
+  EXPECT_EQ(meta.Get().meta.fileid, 10u);
+  EXPECT_EQ(meta.Get().meta.parentfolderid, kFolderId);
+  EXPECT_EQ(meta.Get().meta.size, content.size());
+  EXPECT_EQ(meta.Get().meta.ctime, 1500000000u);
+  EXPECT_EQ(meta.Get().meta.mtime, 1600000000u);
+  EXPECT_EQ(missing.Get().error, 102u);
+}
+
+TEST_F(AsyncTest, ReadsARange) {
+  std::string content = Content(100000, 'e');
+  server->AddFile(10, content);
+  std::string buff(70000, '\0'), tail(1000, '\0');
+  Result res, end;
+  ASSERT_EQ(psync_async_read_range(10, 70, 20000, buff.size(), &buff[0],
+                                   Result::Done, &res),
+            0);
+  // past the end of the file only the rest of it comes
+  ASSERT_EQ(psync_async_read_range(10, 70, 99500, tail.size(), &tail[0],
+                                   Result::Done, &end),
+            0);
+  ASSERT_TRUE(res.Wait());
+  ASSERT_TRUE(end.Wait());
+  EXPECT_EQ(res.Get().error, 0u);
+  EXPECT_EQ(res.Get().read.offset, 20000u);
+  EXPECT_EQ(res.Get().read.size, buff.size());
+  EXPECT_TRUE(buff == content.substr(20000, buff.size()));
+  EXPECT_EQ(end.Get().error, 0u);
+  EXPECT_EQ(end.Get().read.size, 500u);
+  EXPECT_TRUE(tail.substr(0, 500) == content.substr(99500));
+}
+
+// A large download the server is slow to answer holds back neither the small
+// downloads nor the other requests.
+TEST_F(AsyncTest, SmallRequestsDoNotWaitForLargeDownloads) {
+  std::string large = Content(PSYNC_ASYNC_LARGE_DOWNLOAD_SIZE * 2, 'f');
+  std::string small = Content(1000, 'g');
+  server->AddFile(10, large);
+  server->AddFile(11, small);
+  server->Hold(10);
+  std::string largepath = Path("large"), smallpath = Path("small");
+  Result lres, sres, meta;
+  ASSERT_EQ(psync_async_download_file(10, large.size(), largepath.c_str(),
+                                      Result::Done, &lres),
+            0);
+  ASSERT_EQ(psync_async_download_file(11, small.size(), smallpath.c_str(),
+                                      Result::Done, &sres),
+            0);
+  ASSERT_EQ(psync_async_file_meta(10, Result::Done, &meta), 0);
+  ASSERT_TRUE(sres.Wait());
+  ASSERT_TRUE(meta.Wait());
+  EXPECT_EQ(sres.Get().error, 0u);
+  EXPECT_TRUE(Read(smallpath) == small);
+  EXPECT_FALSE(lres.Done());
+  server->Release();
+  ASSERT_TRUE(lres.Wait());
+  EXPECT_EQ(lres.Get().error, 0u);
+  EXPECT_TRUE(Read(largepath) == large);
+
+  std::map<uint64_t, uint32_t> connection;
+  for (const AsyncRequest &req : server->Requests())
+    if (req.params.at("act") == "dwl")
+      connection[req.Num("fileid")] = req.connection;
+  ASSERT_EQ(connection.size(), 2u);
+  EXPECT_NE(connection[10], connection[11]);
+}
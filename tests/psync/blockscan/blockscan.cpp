@@ -0,0 +1,224 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+#include "psync/pblockscan.h"
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+
+std::string RandomData(size_t size, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::string ret(size, '\0');
+  for (size_t i = 0; i < size; i++)
+    ret[i] = static_cast<char>(rng());
+  return ret;
+}
+
+// The blocks of a file the server has, looked up the way pnetlibs does it:
+// by adler32 first, then by comparing the data.
+class Blocks {
+ public:
+  Blocks(const std::string &data, uint32_t blocksize)
+      : data_(data), blocksize_(blocksize) {
+    for (uint32_t i = 0; i * blocksize_ + blocksize_ <= data_.size(); i++)
+      byadler_.emplace(Adler(i), i + 1);
+    bs_ = psync_blockscan_create(blocksize_, byadler_.size(), Check, this);
+    for (const auto &e : byadler_)
+      psync_blockscan_add(bs_, e.first);
+  }
+
+  ~Blocks() { psync_blockscan_destroy(bs_); }
+
+  uint32_t Count() const { return byadler_.size(); }
+  uint64_t Checked() const { return checked_; }
+  double Seconds() const { return seconds_; }
+
+  // Recomputing the checksum of every window passed to the callback is
+  // expensive, only small tests do it.
+  void SetVerify(bool verify) { verify_ = verify; }
+
+  std::vector<psync_blockscan_match_t> Scan(const std::string &file,
+                                            uint64_t off, uint64_t len,
+                                            int flags) {
+    char path[] = "/tmp/blockscanXXXXXX";
+    int fd = mkstemp(path);
+    EXPECT_NE(fd, -1);
+    unlink(path);
+    EXPECT_EQ(write(fd, file.data(), file.size()),
+              static_cast<ssize_t>(file.size()));
+    psync_blockscan_match_t *matches;
+    uint32_t cnt;
+    checked_ = 0;
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(psync_blockscan_file(bs_, fd, off, len, flags, &matches, &cnt),
+              0);
+    seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                             start)
+                   .count();
+    close(fd);
+    std::vector<psync_blockscan_match_t> ret(matches, matches + cnt);
+    free(matches);
+    return ret;
+  }
+
+ private:
+  uint32_t Adler(uint32_t i) const {
+    return psync_adler32(
+        PSYNC_ADLER32_INITIAL,
+        reinterpret_cast<const unsigned char *>(data_.data()) + i * blocksize_,
+        blocksize_);
+  }
+
+  static uint32_t Check(void *ptr, uint32_t adler, const unsigned char *data) {
+    Blocks *b = static_cast<Blocks *>(ptr);
+    __sync_fetch_and_add(&b->checked_, 1);
+    if (b->verify_)
+      EXPECT_EQ(adler,
+                psync_adler32(PSYNC_ADLER32_INITIAL, data, b->blocksize_));
+    auto range = b->byadler_.equal_range(adler);
+    for (auto it = range.first; it != range.second; ++it)
+      if (!memcmp(b->data_.data() + (it->second - 1) * b->blocksize_, data,
+                  b->blocksize_))
+        return it->second;
+    return 0;
+  }
+
+  const std::string &data_;
+  uint32_t blocksize_;
+  std::unordered_multimap<uint32_t, uint32_t> byadler_;
+  psync_blockscan_t *bs_;
+  uint64_t checked_ = 0;
+  double seconds_ = 0;
+  bool verify_ = true;
+};
+
+// The original with some bytes inserted at the start, so every block moved.
+std::string Shifted(const std::string &data, size_t shift) {
+  return RandomData(shift, 99) + data;
+}
+
+// The original with a byte changed every step bytes.
+std::string Edited(const std::string &data, size_t step) {
+  std::string ret(data);
+  for (size_t i = step / 2; i < ret.size(); i += step)
+    ret[i] = static_cast<char>(ret[i] + 1);
+  return ret;
+}
+
+}  // namespace
+
+TEST(BlockScanTest, FindsShiftedBlocks) {
+  const uint32_t bs = 4096;
+  std::string data = RandomData(256 * bs, 1);
+  Blocks blocks(data, bs);
+  std::string file = Shifted(data, 1234);
+  auto matches = blocks.Scan(file, 0, file.size(), PSYNC_BLOCKSCAN_GREEDY);
+  ASSERT_EQ(matches.size(), blocks.Count());
+  for (uint32_t i = 0; i < matches.size(); i++) {
+    EXPECT_EQ(matches[i].off, 1234 + static_cast<uint64_t>(i) * bs);
+    EXPECT_EQ(matches[i].idx, i + 1);
+  }
+}
+
+TEST(BlockScanTest, SkipsEditedBlocks) {
+  const uint32_t bs = 4096;
+  std::string data = RandomData(256 * bs, 2);
+  Blocks blocks(data, bs);
+  std::string file = Edited(data, 3 * bs);
+  auto matches = blocks.Scan(file, 0, file.size(), PSYNC_BLOCKSCAN_GREEDY);
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < blocks.Count(); i++) {
+    if (i % 3 == 1)
+      continue;
+    ASSERT_LT(n, matches.size());
+    EXPECT_EQ(matches[n].off, static_cast<uint64_t>(i) * bs);
+    EXPECT_EQ(matches[n].idx, i + 1);
+    n++;
+  }
+  EXPECT_EQ(n, matches.size());
+}
+
+TEST(BlockScanTest, ScansOnlyTheRange) {
+  const uint32_t bs = 4096;
+  std::string data = RandomData(64 * bs, 3);
+  Blocks blocks(data, bs);
+  auto matches = blocks.Scan(data, 10 * bs + 1, 20 * bs, 0);
+  ASSERT_EQ(matches.size(), 20u);
+  EXPECT_EQ(matches.front().off, 11u * bs);
+  // a window starting in the range may end past it
+  EXPECT_EQ(matches.back().off, 30u * bs);
+}
+
+TEST(BlockScanTest, PadsTheLastWindow) {
+  const uint32_t bs = 4096;
+  std::string data = RandomData(8 * bs, 4);
+  data.replace(7 * bs + 100, bs - 100, bs - 100, '\0');
+  Blocks blocks(data, bs);
+  auto matches = blocks.Scan(data.substr(0, 7 * bs + 100), 0, 8 * bs,
+                             PSYNC_BLOCKSCAN_GREEDY);
+  ASSERT_EQ(matches.size(), 8u);
+  EXPECT_EQ(matches.back().off, 7u * bs);
+}
+
+// Big enough to be split between threads, every block straddles a region
+// boundary and most windows are not copies of anything.
+TEST(BlockScanTest, SplitsLargeFilesBetweenThreads) {
+  const uint32_t bs = 16384;
+  std::string data = RandomData(48 * 1024 * 1024, 5);
+  Blocks blocks(data, bs);
+  blocks.SetVerify(false);
+  std::string file = Shifted(Edited(data, 7 * bs), 777);
+  for (int flags : {0, PSYNC_BLOCKSCAN_GREEDY}) {
+    auto matches = blocks.Scan(file, 0, file.size(), flags);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < blocks.Count(); i++) {
+      if (i % 7 == 3)
+        continue;
+      ASSERT_LT(n, matches.size());
+      EXPECT_EQ(matches[n].off, 777 + static_cast<uint64_t>(i) * bs);
+      EXPECT_EQ(matches[n].idx, i + 1);
+      n++;
+    }
+    EXPECT_EQ(n, matches.size());
+    EXPECT_LT(blocks.Checked(), file.size() / 16);
+  }
+}
+
+TEST(BlockScanTest, DISABLED_Benchmark) {
+  for (uint32_t bs : {4096u, 65536u, 1048576u}) {
+    std::string data = RandomData(256 * 1024 * 1024, 6);
+    Blocks blocks(data, bs);
+    blocks.SetVerify(false);
+    struct {
+      const char *name;
+      std::string file;
+    } samples[] = {
+        {"shifted", Shifted(data, 1)},
+        {"edited", Edited(data, 8 * bs + 1)},
+    };
+    for (const auto &s : samples) {
+      for (int flags : {0, PSYNC_BLOCKSCAN_GREEDY}) {
+        auto matches = blocks.Scan(s.file, 0, s.file.size(), flags);
+        printf("blocksize %7u %-8s %-6s %6.0f MB/s, %u of %u blocks\n", bs,
+               s.name, flags ? "greedy" : "all",
+               s.file.size() / blocks.Seconds() / 1e6,
+               static_cast<unsigned>(matches.size()), blocks.Count());
+      }
+    }
+  }
+}
@@ -0,0 +1,326 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "pcloudcc/psync/compat.h"
+#include "psync/plibs.h"
+}
+
+namespace {
+
+using std::chrono::milliseconds;
+
+// A socket pair with a watch on one end, the events the callback got are
+// recorded for the test thread.
+class Watched {
+ public:
+  explicit Watched(bool rearm = false) : rearm_(rearm) {
+    EXPECT_EQ(psync_socket_pair(fds_), 0);
+  }
+
+  ~Watched() {
+    if (watch_)
+      psync_reactor_del(watch_);
+    // the watch is freed by the reactor thread, give it a moment to drop the
+    // descriptors before they are reused
+    std::this_thread::sleep_for(milliseconds(20));
+    close(fds_[0]);
+    close(fds_[1]);
+  }
+
+  void Add(uint32_t events, int64_t timeoutms) {
+    watch_ = psync_reactor_add(fds_[1], events, timeoutms, Event, this);
+    ASSERT_NE(watch_, nullptr);
+  }
+
+  void Rearm(uint32_t events, int64_t timeoutms) {
+    psync_reactor_rearm(watch_, events, timeoutms);
+  }
+
+  void Del() {
+    psync_reactor_del(watch_);
+    watch_ = nullptr;
+  }
+
+  // Deleted by the callback itself at the next event.
+  void DelOnEvent() { delonevent_ = true; }
+
+  void Send() { ASSERT_EQ(write(fds_[0], "x", 1), 1); }
+
+  void Drain() {
+    char buff[64];
+    while (read(fds_[1], buff, sizeof(buff)) == sizeof(buff)) {
+    }
+  }
+
+  void HangUp() {
+    close(fds_[0]);
+    fds_[0] = -1;
+  }
+
+  // Waits for the count-th event and returns its flags, 0 on timeout.
+  uint32_t Wait(size_t count, milliseconds timeout = milliseconds(2000)) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!cond_.wait_for(lock, timeout,
+                        [&] { return events_.size() >= count; }))
+      return 0;
+    return events_[count - 1];
+  }
+
+  size_t Count() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return events_.size();
+  }
+
+ private:
+  static void Event(psync_reactor_watch *w, void *ptr, uint32_t events) {
+    Watched *self = static_cast<Watched *>(ptr);
+    EXPECT_EQ(w, self->watch_);
+    if (self->delonevent_) {
+      psync_reactor_del(w);
+      self->watch_ = nullptr;
+    } else if (self->rearm_) {
+      self->Drain();
+      psync_reactor_rearm(w, PSYNC_REACTOR_READ, -1);
+    }
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    self->events_.push_back(events);
+    self->cond_.notify_all();
+  }
+
+  psync_socket_t fds_[2];
+  psync_reactor_watch *watch_ = nullptr;
+  bool rearm_;
+  bool delonevent_ = false;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<uint32_t> events_;
+};
+
+const milliseconds kQuiet(150);
+
+}  // namespace
+
+TEST(ReactorTest, FiresOnceUntilRearmed) {
+  Watched w;
+  w.Add(PSYNC_REACTOR_READ, -1);
+  w.Send();
+  EXPECT_EQ(w.Wait(1), static_cast<uint32_t>(PSYNC_REACTOR_READ));
+  // the data is still unread, but the watch is disarmed
+  w.Send();
+  std::this_thread::sleep_for(kQuiet);
+  EXPECT_EQ(w.Count(), 1u);
+  w.Rearm(PSYNC_REACTOR_READ, -1);
+  EXPECT_EQ(w.Wait(2), static_cast<uint32_t>(PSYNC_REACTOR_READ));
+}
+
+TEST(ReactorTest, AddsDisarmedWatches) {
+  Watched w;
+  w.Add(0, -1);
+  w.Send();
+  std::this_thread::sleep_for(kQuiet);
+  EXPECT_EQ(w.Count(), 0u);
+  w.Rearm(PSYNC_REACTOR_READ, -1);
+  EXPECT_EQ(w.Wait(1), static_cast<uint32_t>(PSYNC_REACTOR_READ));
+}
+
+TEST(ReactorTest, RearmsFromTheCallback) {
+  Watched w(true);
+  w.Add(PSYNC_REACTOR_READ, -1);
+  for (size_t i = 1; i <= 5; i++) {
+    w.Send();
+    EXPECT_EQ(w.Wait(i), static_cast<uint32_t>(PSYNC_REACTOR_READ));
+  }
+}
+
+TEST(ReactorTest, RearmingChangesTheEvents) {
+  Watched w;
+  w.Add(PSYNC_REACTOR_READ, -1);
+  std::this_thread::sleep_for(kQuiet);
+  EXPECT_EQ(w.Count(), 0u);
+  // a socket with an empty send buffer is writable at once
+  w.Rearm(PSYNC_REACTOR_WRITE, -1);
+  EXPECT_EQ(w.Wait(1), static_cast<uint32_t>(PSYNC_REACTOR_WRITE));
+}
+
+TEST(ReactorTest, TimesOut) {
+  Watched w;
+  auto start = std::chrono::steady_clock::now();
+  w.Add(PSYNC_REACTOR_READ, 50);
+  EXPECT_EQ(w.Wait(1), static_cast<uint32_t>(PSYNC_REACTOR_TIMEOUT));
+  EXPECT_GE(std::chrono::steady_clock::now() - start, milliseconds(50));
+  // the timeout disarmed the watch for I/O too
+  w.Send();
+  std::this_thread::sleep_for(kQuiet);
+  EXPECT_EQ(w.Count(), 1u);
+}
+
+TEST(ReactorTest, EventsCancelTheTimeout) {
+  Watched w;
+  w.Add(PSYNC_REACTOR_READ, 100);
+  w.Send();
+  EXPECT_EQ(w.Wait(1), static_cast<uint32_t>(PSYNC_REACTOR_READ));
+  std::this_thread::sleep_for(milliseconds(200));
+  EXPECT_EQ(w.Count(), 1u);
+}
+
+TEST(ReactorTest, RearmingReplacesTheTimeout) {
+  Watched w;
+  w.Add(PSYNC_REACTOR_READ, 100);
+  w.Rearm(PSYNC_REACTOR_READ, -1);
+  std::this_thread::sleep_for(milliseconds(250));
+  EXPECT_EQ(w.Count(), 0u);
+}
+
+TEST(ReactorTest, ReportsHangups) {
+  Watched w;
+  w.Add(PSYNC_REACTOR_READ, -1);
+  w.HangUp();
+  EXPECT_NE(w.Wait(1) & PSYNC_REACTOR_READ, 0u);
+}
+
+TEST(ReactorTest, DeletedWatchesGetNoEvents) {
+  Watched w;
+  w.Add(PSYNC_REACTOR_READ, 50);
+  w.Del();
+  w.Send();
+  std::this_thread::sleep_for(kQuiet);
+  EXPECT_EQ(w.Count(), 0u);
+}
+
+TEST(ReactorTest, DeletesFromTheCallback) {
+  Watched w;
+  w.DelOnEvent();
+  w.Add(PSYNC_REACTOR_READ, -1);
+  w.Send();
+  EXPECT_EQ(w.Wait(1), static_cast<uint32_t>(PSYNC_REACTOR_READ));
+  std::this_thread::sleep_for(kQuiet);
+  EXPECT_EQ(w.Count(), 1u);
+}
+
+namespace {
+
+// One side of an exchange of requests and responses: the server end answers
+// every byte, the client end sends the next request when the response came.
+struct Exchange {
+  psync_socket_t fds[2];
+  psync_reactor_watch *client;
+  psync_reactor_watch *server;
+  uint32_t left;
+  std::mutex *mutex;
+  std::condition_variable *cond;
+  uint32_t *running;
+};
+
+void ServerEvent(psync_reactor_watch *w, void *ptr, uint32_t events) {
+  Exchange *e = static_cast<Exchange *>(ptr);
+  char ch;
+  if (read(e->fds[1], &ch, 1) == 1 && write(e->fds[1], &ch, 1) == 1)
+    psync_reactor_rearm(w, PSYNC_REACTOR_READ, -1);
+}
+
+void ClientEvent(psync_reactor_watch *w, void *ptr, uint32_t events) {
+  Exchange *e = static_cast<Exchange *>(ptr);
+  char ch;
+  if (read(e->fds[0], &ch, 1) != 1)
+    return;
+  if (--e->left && write(e->fds[0], &ch, 1) == 1) {
+    psync_reactor_rearm(w, PSYNC_REACTOR_READ, -1);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(*e->mutex);
+  if (!--*e->running)
+    e->cond->notify_all();
+}
+
+}  // namespace
+
+// 1000 connections each making a number of small fetches, all multiplexed on
+// the reactor thread, against the same fetches made by a thread per
+// connection with blocking reads. The connections are socket pairs like the
+// async transfer connection, page cache range fetches are not on the reactor
+// and not measured here.
+TEST(ReactorTest, DISABLED_Benchmark) {
+  const uint32_t kConns = 1000, kFetches = 100;
+  std::vector<Exchange> ex(kConns);
+  std::mutex mutex;
+  std::condition_variable cond;
+  uint32_t running = kConns;
+  for (Exchange &e : ex) {
+    ASSERT_EQ(psync_socket_pair(e.fds), 0);
+    e.left = kFetches;
+    e.mutex = &mutex;
+    e.cond = &cond;
+    e.running = &running;
+    e.server = psync_reactor_add(e.fds[1], PSYNC_REACTOR_READ, -1,
+                                 ServerEvent, &e);
+    e.client = psync_reactor_add(e.fds[0], PSYNC_REACTOR_READ, -1,
+                                 ClientEvent, &e);
+    ASSERT_NE(e.server, nullptr);
+    ASSERT_NE(e.client, nullptr);
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (Exchange &e : ex)
+    ASSERT_EQ(write(e.fds[0], "x", 1), 1);
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&] { return running == 0; });
+  }
+  double reactor = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  for (Exchange &e : ex) {
+    psync_reactor_del(e.client);
+    psync_reactor_del(e.server);
+  }
+  std::this_thread::sleep_for(milliseconds(100));
+
+  // the servers still answer on the reactor, only the clients change
+  for (Exchange &e : ex) {
+    e.server = psync_reactor_add(e.fds[1], PSYNC_REACTOR_READ, -1,
+                                 ServerEvent, &e);
+    ASSERT_NE(e.server, nullptr);
+  }
+  start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (Exchange &e : ex)
+    threads.emplace_back([&e] {
+      char ch = 'x';
+      for (uint32_t i = 0; i < kFetches; i++)
+        if (write(e.fds[0], &ch, 1) != 1 || read(e.fds[0], &ch, 1) != 1)
+          break;
+    });
+  for (auto &th : threads)
+    th.join();
+  double threaded = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  for (Exchange &e : ex) {
+    psync_reactor_del(e.server);
+  }
+  std::this_thread::sleep_for(milliseconds(100));
+  for (Exchange &e : ex) {
+    close(e.fds[0]);
+    close(e.fds[1]);
+  }
+  printf("%u connections x %u fetches: reactor %.3f s, thread per connection "
+         "%.3f s\n",
+         kConns, kFetches, reactor, threaded);
+}
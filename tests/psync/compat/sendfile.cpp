@@ -0,0 +1,191 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "pcloudcc/psync/compat.h"
+#include "psync/plibs.h"
+}
+
+namespace {
+
+// A temporary file and a plain socket pair, whatever is sent
+// on the psync_socket end is read back on the other.
+class SendfileTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char path[] = "/tmp/psyncsendfileXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    path_ = path;
+    ASSERT_EQ(psync_socket_pair(fds_), 0);
+    memset(&sock_, 0, sizeof(sock_));
+    sock_.sock = fds_[0];
+  }
+
+  void TearDown() override {
+    if (fd_ != INVALID_HANDLE_VALUE)
+      psync_file_close(fd_);
+    close(fds_[0]);
+    close(fds_[1]);
+    unlink(path_.c_str());
+  }
+
+  void Create(const std::string &data) {
+    FILE *f = fopen(path_.c_str(), "w");
+    ASSERT_NE(f, nullptr);
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+    fd_ = psync_file_open(path_.c_str(), P_O_RDONLY, 0);
+    ASSERT_NE(fd_, INVALID_HANDLE_VALUE);
+  }
+
+  // Reads up to len bytes from the other end in a thread while send runs, the
+  // socket buffer is smaller than what the tests send. Sending is over once
+  // send returns.
+  template <typename Send>
+  std::string Receive(size_t len, Send send) {
+    std::string got(len, '\0');
+    size_t rd = 0;
+    std::thread reader([&] {
+      while (rd < len) {
+        ssize_t r = read(fds_[1], &got[rd], len - rd);
+        if (r <= 0)
+          break;
+        rd += r;
+      }
+    });
+    send();
+    shutdown(fds_[0], SHUT_WR);
+    reader.join();
+    got.resize(rd);
+    return got;
+  }
+
+  static std::string Content(size_t len) {
+    std::string data(len, '\0');
+    uint32_t x = 1;
+    for (char &ch : data) {
+      x = x * 1103515245 + 12345;
+      ch = static_cast<char>(x >> 16);
+    }
+    return data;
+  }
+
+  std::string path_;
+  psync_file_t fd_ = INVALID_HANDLE_VALUE;
+  psync_socket_t fds_[2];
+  psync_socket sock_;
+};
+
+}  // namespace
+
+TEST_F(SendfileTest, CanSendFromPlainSockets) {
+#if defined(P_OS_LINUX)
+  EXPECT_EQ(psync_socket_can_sendfile(&sock_), 1);
+#else
+  EXPECT_EQ(psync_socket_can_sendfile(&sock_), 0);
+#endif
+}
+
+TEST_F(SendfileTest, SendsTheRangeOfTheFile) {
+  if (!psync_socket_can_sendfile(&sock_))
+    GTEST_SKIP() << "no sendfile on this platform";
+  const size_t kOffset = 1000, kLen = 4 * 1024 * 1024;
+  std::string data = Content(kOffset + kLen + 1000);
+  Create(data);
+  std::string got = Receive(kLen, [&] {
+    EXPECT_EQ(psync_socket_sendfile(&sock_, fd_, kOffset, kLen),
+              static_cast<int>(kLen));
+  });
+  ASSERT_EQ(got.size(), kLen);
+  EXPECT_TRUE(got == data.substr(kOffset, kLen));
+}
+
+// A range past the end of the file sends what there is.
+TEST_F(SendfileTest, StopsAtTheEndOfTheFile) {
+  if (!psync_socket_can_sendfile(&sock_))
+    GTEST_SKIP() << "no sendfile on this platform";
+  std::string data = Content(100000);
+  Create(data);
+  std::string got = Receive(data.size() - 5000, [&] {
+    EXPECT_EQ(psync_socket_sendfile(&sock_, fd_, 5000, 200000),
+              static_cast<int>(data.size() - 5000));
+  });
+  EXPECT_TRUE(got == data.substr(5000));
+}
+
+// CPU time per GB sent with sendfile against reading the file into a buffer
+// and writing that to the socket. The reader on the other end is counted in
+// both.
+TEST_F(SendfileTest, DISABLED_BenchmarkCpuPerGb) {
+  if (!psync_socket_can_sendfile(&sock_))
+    GTEST_SKIP() << "no sendfile on this platform";
+  const size_t kFile = 64 * 1024 * 1024, kBuff = 64 * 1024;
+  const int kPasses = 16;
+  Create(Content(kFile));
+  auto cpu = [] {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  };
+  auto drain = [this](size_t len) {
+    std::string buff(kBuff, '\0');
+    while (len) {
+      ssize_t r = read(fds_[1], &buff[0], len < kBuff ? len : kBuff);
+      if (r <= 0)
+        break;
+      len -= r;
+    }
+  };
+  double gb = static_cast<double>(kFile) * kPasses / (1024 * 1024 * 1024);
+
+  // a failed send hangs up, so the reader does not wait for the rest
+  std::thread reader(drain, kFile * kPasses);
+  double start = cpu();
+  bool ok = true;
+  for (int i = 0; ok && i < kPasses; i++)
+    for (size_t off = 0; ok && off < kFile; off += kBuff)
+      ok = psync_socket_sendfile(&sock_, fd_, off, kBuff) ==
+           static_cast<int>(kBuff);
+  if (!ok)
+    shutdown(fds_[0], SHUT_WR);
+  reader.join();
+  double zerocopy = cpu() - start;
+  ASSERT_TRUE(ok);
+
+  reader = std::thread(drain, kFile * kPasses);
+  std::string buff(kBuff, '\0');
+  start = cpu();
+  for (int i = 0; ok && i < kPasses; i++)
+    for (size_t off = 0; ok && off < kFile; off += kBuff)
+      ok = psync_file_pread(fd_, &buff[0], kBuff, off) ==
+               static_cast<ssize_t>(kBuff) &&
+           psync_socket_writeall(&sock_, buff.data(), kBuff) ==
+               static_cast<int>(kBuff);
+  if (!ok)
+    shutdown(fds_[0], SHUT_WR);
+  reader.join();
+  double copied = cpu() - start;
+  ASSERT_TRUE(ok);
+  printf("CPU per GB: sendfile %.3f s, read and write %.3f s\n",
+         zerocopy / gb, copied / gb);
+}
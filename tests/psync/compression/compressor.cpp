@@ -0,0 +1,194 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+#include "psync/pcompression.h"
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Lines like the ones the async connection carries: requests and metadata.
+std::string MetadataSample(size_t size) {
+  std::mt19937 rng(42);
+  std::string ret;
+  char line[256];
+  while (ret.size() < size) {
+    snprintf(line, sizeof(line),
+             "act=dwlnm,strm=%u,fileid=%u,sha1=%08x%08x%08x%08x%08x,"
+             "name=IMG_%04u.jpg,size=%u,modified=%u\n",
+             static_cast<unsigned>(ret.size() / 64),
+             static_cast<unsigned>(rng() % 100000000),
+             static_cast<unsigned>(rng()), static_cast<unsigned>(rng()),
+             static_cast<unsigned>(rng()), static_cast<unsigned>(rng()),
+             static_cast<unsigned>(rng()),
+             static_cast<unsigned>(rng() % 10000),
+             static_cast<unsigned>(rng() % 10000000),
+             static_cast<unsigned>(1600000000 + rng() % 100000000));
+    ret += line;
+  }
+  ret.resize(size);
+  return ret;
+}
+
+// File content: runs of repeated text between blocks of random bytes.
+std::string FileContentSample(size_t size) {
+  static const char text[] =
+      "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+      "eiusmod tempor incididunt ut labore et dolore magna aliqua. ";
+  std::mt19937 rng(7);
+  std::string ret;
+  while (ret.size() < size) {
+    size_t run = rng() % 4096;
+    if (rng() % 2) {
+      for (size_t i = 0; i < run; i++)
+        ret += text[(ret.size() + i) % (sizeof(text) - 1)];
+    } else {
+      for (size_t i = 0; i < run; i++)
+        ret += static_cast<char>(rng());
+    }
+  }
+  ret.resize(size);
+  return ret;
+}
+
+// Moves everything the stream has ready into out.
+int Drain(psync_compressor_t *comp, std::string *out) {
+  char buff[4096];
+  int ret;
+  while ((ret = psync_compressor_read(comp, buff, sizeof(buff))) > 0)
+    out->append(buff, ret);
+  return ret == PSYNC_DEFLATE_NODATA || ret == PSYNC_DEFLATE_EOF ? 0 : ret;
+}
+
+// Writes data in chunks of up to chunk bytes the way the async connection
+// does, draining the stream whenever it is full.
+int Feed(psync_compressor_t *comp, const std::string &data, size_t chunk,
+         int flush, std::string *out) {
+  size_t off = 0;
+  while (off < data.size()) {
+    int len = static_cast<int>(std::min(chunk, data.size() - off));
+    int wr = psync_compressor_write(comp, data.data() + off, len, flush);
+    if (wr == PSYNC_DEFLATE_ERROR)
+      return -1;
+    if (wr > 0)
+      off += wr;
+    if (Drain(comp, out))
+      return -1;
+  }
+  return 0;
+}
+
+int Flush(psync_compressor_t *comp, std::string *out) {
+  if (psync_compressor_write(comp, "", 0, PSYNC_DEFLATE_FLUSH))
+    return -1;
+  return Drain(comp, out);
+}
+
+class CompressorTest : public ::testing::TestWithParam<int> {
+ protected:
+  void SetUp() override {
+    if (!psync_compressor_available(GetParam()))
+      GTEST_SKIP() << psync_compressor_name(GetParam()) << " is not built in";
+    enc_ = psync_compressor_init(GetParam(), PSYNC_DEFLATE_COMP_FAST);
+    dec_ = psync_compressor_init(GetParam(), PSYNC_DEFLATE_DECOMPRESS);
+    ASSERT_NE(nullptr, enc_);
+    ASSERT_NE(nullptr, dec_);
+  }
+
+  void TearDown() override {
+    if (enc_)
+      psync_compressor_destroy(enc_);
+    if (dec_)
+      psync_compressor_destroy(dec_);
+  }
+
+  // Sends data in requests of the given size, flushing every few of them,
+  // and checks that whatever was flushed decompresses in full.
+  void RoundTrip(const std::string &data, size_t request) {
+    std::string compressed, decompressed;
+    size_t off = 0, n = 0;
+    while (off < data.size()) {
+      std::string req = data.substr(off, request);
+      off += req.size();
+      ASSERT_EQ(0, Feed(enc_, req, req.size(), PSYNC_DEFLATE_NOFLUSH,
+                        &compressed));
+      if (++n % 16 && off < data.size())
+        continue;
+      ASSERT_EQ(0, Flush(enc_, &compressed));
+      ASSERT_EQ(0, Feed(dec_, compressed, 4096, PSYNC_DEFLATE_FLUSH,
+                        &decompressed));
+      compressed.clear();
+      ASSERT_EQ(off, decompressed.size());
+    }
+    EXPECT_TRUE(data == decompressed);
+  }
+
+  psync_compressor_t *enc_ = nullptr;
+  psync_compressor_t *dec_ = nullptr;
+};
+
+TEST_P(CompressorTest, RoundTripsMetadata) {
+  RoundTrip(MetadataSample(1024 * 1024), 100);
+}
+
+TEST_P(CompressorTest, RoundTripsFileContent) {
+  RoundTrip(FileContentSample(4 * 1024 * 1024), 64 * 1024);
+}
+
+TEST_P(CompressorTest, RoundTripsHighlyCompressibleData) {
+  // expands far beyond the stream buffers when decompressed
+  RoundTrip(std::string(8 * 1024 * 1024, 'a'), 1024 * 1024);
+}
+
+TEST_P(CompressorTest, FindsItselfByName) {
+  EXPECT_EQ(GetParam(), psync_compressor_find(psync_compressor_name(GetParam())));
+  EXPECT_EQ(GetParam(), psync_compressor_method(enc_));
+}
+
+// Throughput and ratio on the samples, run with
+// --gtest_also_run_disabled_tests.
+TEST_P(CompressorTest, DISABLED_Benchmark) {
+  struct {
+    const char *name;
+    std::string data;
+  } samples[] = {{"metadata", MetadataSample(16 * 1024 * 1024)},
+                 {"file content", FileContentSample(64 * 1024 * 1024)}};
+  for (const auto &sample : samples) {
+    std::string compressed, decompressed;
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_EQ(0, Feed(enc_, sample.data, 4096, PSYNC_DEFLATE_NOFLUSH,
+                      &compressed));
+    ASSERT_EQ(0, Flush(enc_, &compressed));
+    auto mid = std::chrono::steady_clock::now();
+    ASSERT_EQ(0, Feed(dec_, compressed, 4096, PSYNC_DEFLATE_FLUSH,
+                      &decompressed));
+    auto end = std::chrono::steady_clock::now();
+    ASSERT_TRUE(sample.data == decompressed);
+    double mb = sample.data.size() / (1024.0 * 1024.0);
+    printf("%-8s %-13s ratio %5.2f  compress %7.1f MB/s  decompress %7.1f MB/s\n",
+           psync_compressor_name(GetParam()), sample.name,
+           static_cast<double>(sample.data.size()) / compressed.size(),
+           mb / std::chrono::duration<double>(mid - start).count(),
+           mb / std::chrono::duration<double>(end - mid).count());
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(Methods, CompressorTest,
+                         ::testing::Values(PSYNC_COMPRESSOR_DEFLATE,
+                                           PSYNC_COMPRESSOR_ZSTD),
+                         [](const ::testing::TestParamInfo<int> &info) {
+                           return std::string(psync_compressor_name(info.param));
+                         });
+
+}  // namespace
@@ -0,0 +1,237 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "psync/pcache.h"
+#include "psync/pdiff.h"
+#include "psync/plibs.h"
+#include "psync/psettings.h"
+#include "psync/pstatus.h"
+#include "psync/ptimer.h"
+}
+
+namespace {
+
+// Builds the parsed form of diff responses, everything is freed with the
+// builder.
+class Builder {
+ public:
+  ~Builder() {
+    for (void *p : allocs_)
+      free(p);
+  }
+
+  binresult *Num(uint64_t num) {
+    binresult *r = New(sizeof(binresult));
+    r->type = PARAM_NUM;
+    r->num = num;
+    return r;
+  }
+
+  binresult *Bool(bool val) {
+    binresult *r = Num(val);
+    r->type = PARAM_BOOL;
+    return r;
+  }
+
+  binresult *Str(const std::string &str) {
+    binresult *r = New(sizeof(binresult) + str.size() + 1);
+    r->type = PARAM_STR;
+    r->length = str.size();
+    memcpy(const_cast<char *>(r->str), str.c_str(), str.size() + 1);
+    return r;
+  }
+
+  binresult *Hash(const std::vector<std::pair<const char *, binresult *>> &h) {
+    binresult *r = New(sizeof(binresult));
+    hashpair *pairs = static_cast<hashpair *>(Alloc(sizeof(hashpair) * h.size()));
+    for (size_t i = 0; i < h.size(); i++) {
+      pairs[i].key = h[i].first;
+      pairs[i].value = h[i].second;
+    }
+    r->type = PARAM_HASH;
+    r->length = h.size();
+    r->hash = pairs;
+    return r;
+  }
+
+  binresult *Array(const std::vector<binresult *> &a) {
+    binresult *r = New(sizeof(binresult));
+    binresult **items =
+        static_cast<binresult **>(Alloc(sizeof(binresult *) * a.size()));
+    for (size_t i = 0; i < a.size(); i++)
+      items[i] = a[i];
+    r->type = PARAM_ARRAY;
+    r->length = a.size();
+    r->array = items;
+    return r;
+  }
+
+  binresult *FileEvent(const char *event, uint64_t fileid,
+                       const std::string &name, uint64_t size) {
+    binresult *meta = Hash({{"fileid", Num(fileid)},
+                            {"parentfolderid", Num(0)},
+                            {"ismine", Bool(true)},
+                            {"size", Num(size)},
+                            {"hash", Num(fileid * 1000 + size)},
+                            {"name", Str(name)},
+                            {"created", Num(1600000000)},
+                            {"modified", Num(1600000000 + size)},
+                            {"category", Num(0)},
+                            {"thumb", Bool(false)},
+                            {"icon", Str("file")}});
+    return Hash({{"event", Str(event)}, {"metadata", meta}});
+  }
+
+ private:
+  void *Alloc(size_t size) {
+    void *p = calloc(1, size);
+    allocs_.push_back(p);
+    return p;
+  }
+
+  binresult *New(size_t size) { return static_cast<binresult *>(Alloc(size)); }
+
+  std::vector<void *> allocs_;
+};
+
+class DiffTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    psync_timer_init();
+    psync_cache_init();
+  }
+
+  void SetUp() override {
+    char dir[] = "/tmp/psyncdiffXXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+    path_ = dir_ + "/data.db";
+    ASSERT_EQ(psync_sql_connect(path_.c_str()), 0);
+    psync_set_status(PSTATUS_TYPE_AUTH, PSTATUS_AUTH_PROVIDED);
+  }
+
+  void TearDown() override {
+    psync_sql_close();
+    for (const char *suffix : {"", "-wal", "-shm"})
+      unlink((path_ + suffix).c_str());
+    rmdir(dir_.c_str());
+  }
+
+  static int64_t FileCell(const char *col, uint64_t fileid) {
+    std::string sql = std::string("SELECT ") + col +
+                      " FROM file WHERE id=" + std::to_string(fileid);
+    return psync_sql_cellint(sql.c_str(), -1);
+  }
+
+  static std::string FileName(uint64_t fileid) {
+    std::string sql =
+        "SELECT name FROM file WHERE id=" + std::to_string(fileid);
+    char *name = psync_sql_cellstr(sql.c_str());
+    std::string ret = name ? name : "";
+    psync_free(name);
+    return ret;
+  }
+
+  std::string dir_;
+  std::string path_;
+};
+
+// pfsxattr keys the attributes of files by fileid*8+1
+void AddXattr(uint64_t fileid) {
+  std::string sql =
+      "INSERT INTO fsxattr (objectid, name, value) VALUES (" +
+      std::to_string(fileid * 8 + 1) + ", 'user.test', 'x')";
+  ASSERT_EQ(psync_sql_statement(sql.c_str()), 0);
+}
+
+}  // namespace
+
+// Runs of each type interleaved with the others: the bulk inserts of a
+// createfile run have to be done before a following event looks at the files,
+// and deletes of extended attributes are deferred to the end of their run.
+TEST_F(DiffTest, AppliesAMixedBatch) {
+  const uint64_t kFirstRun = PSYNC_DIFF_BULK_ROWS + 3;
+  Builder b;
+  std::vector<binresult *> events;
+  for (uint64_t id = 1; id <= kFirstRun; id++)
+    events.push_back(
+        b.FileEvent("createfile", id, "file" + std::to_string(id), id));
+  events.push_back(b.FileEvent("modifyfile", 2, "renamed", 999));
+  events.push_back(b.FileEvent("deletefile", 3, "file3", 3));
+  events.push_back(b.FileEvent("deletefile", 4, "file4", 4));
+  for (uint64_t id = kFirstRun + 1; id <= kFirstRun + 5; id++)
+    events.push_back(
+        b.FileEvent("createfile", id, "file" + std::to_string(id), id));
+  events.push_back(b.FileEvent("deletefile", kFirstRun + 1,
+                               "file" + std::to_string(kFirstRun + 1),
+                               kFirstRun + 1));
+  // a modify of an unknown file is applied as a create
+  events.push_back(b.FileEvent("modifyfile", 500, "late", 5));
+  events.push_back(b.FileEvent("unknownevent", 600, "ignored", 6));
+  for (uint64_t id : {3, 4, 5})
+    AddXattr(id);
+
+  EXPECT_EQ(psync_diff_apply_entries(b.Array(events), 77), 77u);
+
+  EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM file", 0),
+            static_cast<int64_t>(kFirstRun + 5 - 3 + 1));
+  EXPECT_EQ(FileName(1), "file1");
+  EXPECT_EQ(FileName(2), "renamed");
+  EXPECT_EQ(FileCell("size", 2), 999);
+  EXPECT_EQ(FileCell("mtime", 2), 1600000999);
+  EXPECT_EQ(FileCell("id", 3), -1);
+  EXPECT_EQ(FileCell("id", 4), -1);
+  EXPECT_EQ(FileCell("id", kFirstRun + 1), -1);
+  EXPECT_EQ(FileName(kFirstRun), "file" + std::to_string(kFirstRun));
+  EXPECT_EQ(FileName(kFirstRun + 5), "file" + std::to_string(kFirstRun + 5));
+  EXPECT_EQ(FileName(500), "late");
+  EXPECT_EQ(FileCell("id", 600), -1);
+  EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM filerevision WHERE "
+                              "fileid=2 AND hash=2999",
+                              0),
+            1);
+  EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM fsxattr", 0), 1);
+  EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM fsxattr WHERE objectid=41",
+                              0),
+            1);
+  EXPECT_EQ(psync_sql_cellint("SELECT value FROM setting WHERE id='diffid'", 0),
+            77);
+  EXPECT_EQ(psync_sql_cellint("SELECT value FROM setting WHERE id='usedquota'",
+                              0),
+            psync_sql_cellint("SELECT SUM(size) FROM file", 0));
+}
+
+// Files created again in a later batch are updated in place, also when they
+// are part of a full bulk insert.
+TEST_F(DiffTest, RecreatesExistingFiles) {
+  Builder b;
+  std::vector<binresult *> first, second;
+  for (uint64_t id = 1; id <= PSYNC_DIFF_BULK_ROWS; id++) {
+    first.push_back(b.FileEvent("createfile", id, "old", id));
+    second.push_back(
+        b.FileEvent("createfile", id, "new" + std::to_string(id), id + 1));
+  }
+  EXPECT_EQ(psync_diff_apply_entries(b.Array(first), 1), 1u);
+  EXPECT_EQ(psync_diff_apply_entries(b.Array(second), 2), 2u);
+  EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM file", 0),
+            PSYNC_DIFF_BULK_ROWS);
+  EXPECT_EQ(FileName(7), "new7");
+  EXPECT_EQ(FileCell("size", 7), 8);
+}
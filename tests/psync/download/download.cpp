@@ -0,0 +1,218 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "psync/pcache.h"
+#include "psync/pdownload.h"
+#include "psync/plibs.h"
+#include "psync/pnetlibs.h"
+#include "psync/psettings.h"
+#include "psync/psyncer.h"
+#include "psync/psynclib.h"
+#include "psync/pstatus.h"
+#include "psync/ptasks.h"
+#include "psync/ptimer.h"
+}
+
+namespace {
+
+const uint64_t kTaskId = 10, kFileId = 20, kFolderId = 30, kHash = 40;
+const psync_syncid_t kSyncId = 1;
+const char kContent[] = "the content of the downloaded file";
+
+// A sync folder in a temporary directory with a file task whose local copy is
+// already complete, so finishing the task needs no network.
+class DownloadTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    psync_timer_init();
+    psync_cache_init();
+  }
+
+  void SetUp() override {
+    char dir[] = "/tmp/psyncdownloadXXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+    path_ = dir_ + "/data.db";
+    local_ = dir_ + "/file.txt";
+    ASSERT_EQ(psync_sql_connect(path_.c_str()), 0);
+
+    FILE *f = fopen(local_.c_str(), "w");
+    ASSERT_NE(f, nullptr);
+    fputs(kContent, f);
+    fclose(f);
+    unsigned char checksum[PSYNC_HASH_DIGEST_HEXLEN];
+    uint64_t size;
+    ASSERT_EQ(psync_get_local_file_checksum(local_.c_str(), checksum, &size),
+              PSYNC_NET_OK);
+    ASSERT_EQ(size, sizeof(kContent) - 1);
+
+    Run("INSERT INTO syncfolder (id, folderid, localpath, synctype, flags) "
+        "VALUES (" + std::to_string(kSyncId) + ", NULL, '" + dir_ + "', " +
+        std::to_string(PSYNC_DOWNLOAD_ONLY) + ", 0)");
+    Run("INSERT INTO file (id, parentfolderid, userid, size, hash, name, "
+        "ctime, mtime) VALUES (" + std::to_string(kFileId) + ", " +
+        std::to_string(kFolderId) + ", 0, " + std::to_string(size) + ", " +
+        std::to_string(kHash) + ", 'file.txt', 1600000000, 1600000000)");
+    Run("INSERT INTO hashchecksum (hash, size, checksum) VALUES (" +
+        std::to_string(kHash) + ", " + std::to_string(size) + ", '" +
+        std::string(reinterpret_cast<char *>(checksum), sizeof(checksum)) +
+        "')");
+    psync_add_folder_to_downloadlist(kFolderId);
+  }
+
+  void TearDown() override {
+    // a completed task recalculates the status in a thread, it has to be done
+    // with the database before it is closed
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    psync_clear_downloadlist();
+    psync_sql_close();
+    for (const char *suffix : {"", "-wal", "-shm"})
+      unlink((path_ + suffix).c_str());
+    unlink(local_.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  static void Run(const std::string &sql) {
+    ASSERT_EQ(psync_sql_statement(sql.c_str()), 0);
+  }
+
+  static void AddTask(int inprogress) {
+    Run("INSERT INTO task (id, type, syncid, itemid, localitemid, inprogress, "
+        "name) VALUES (" + std::to_string(kTaskId) + ", " +
+        std::to_string(PSYNC_DOWNLOAD_FILE) + ", " + std::to_string(kSyncId) +
+        ", " + std::to_string(kFileId) + ", 0, " + std::to_string(inprogress) +
+        ", 'file.txt')");
+  }
+
+  static int64_t TaskInProgress() {
+    return psync_sql_cellint(
+        ("SELECT inprogress FROM task WHERE id=" + std::to_string(kTaskId))
+            .c_str(),
+        -1);
+  }
+
+  static int64_t LocalFiles() {
+    return psync_sql_cellint("SELECT COUNT(*) FROM localfile", -1);
+  }
+
+  static int Download() {
+    return psync_download_queued_file(kTaskId, kSyncId, kFileId, 0,
+                                      "file.txt");
+  }
+
+  std::string dir_;
+  std::string path_;
+  std::string local_;
+};
+
+}  // namespace
+
+TEST_F(DownloadTest, FinishesAQueuedTask) {
+  AddTask(2);
+  EXPECT_EQ(Download(), 0);
+  EXPECT_EQ(TaskInProgress(), -1);
+  EXPECT_EQ(LocalFiles(), 1);
+  EXPECT_EQ(psync_sql_cellint("SELECT fileid FROM localfile", 0),
+            static_cast<int64_t>(kFileId));
+}
+
+// The file got deleted remotely while the task waited in the queue, the local
+// copy is neither recorded nor deleted.
+TEST_F(DownloadTest, SkipsTasksDeletedWhileQueued) {
+  EXPECT_EQ(Download(), -1);
+  EXPECT_EQ(LocalFiles(), 0);
+  EXPECT_EQ(access(local_.c_str(), F_OK), 0);
+}
+
+TEST_F(DownloadTest, SkipsTasksClaimedByAnotherWorker) {
+  AddTask(1);
+  EXPECT_EQ(Download(), -1);
+  EXPECT_EQ(TaskInProgress(), 1);
+  EXPECT_EQ(LocalFiles(), 0);
+}
+
+// A file that is moved out of the download folders is deleted locally once
+// the task is claimed.
+TEST_F(DownloadTest, DeletesFilesNoLongerInTheDownloadList) {
+  AddTask(2);
+  psync_clear_downloadlist();
+  EXPECT_EQ(Download(), 0);
+  EXPECT_EQ(TaskInProgress(), -1);
+  EXPECT_EQ(LocalFiles(), 0);
+  EXPECT_NE(access(local_.c_str(), F_OK), 0);
+}
+
+// A task that can not start now is given back to the dispatcher.
+TEST_F(DownloadTest, GivesBackTasksThatCanNotStart) {
+  AddTask(2);
+  Run("UPDATE file SET size=size+1 WHERE id=" + std::to_string(kFileId));
+  psync_file_lock_t *lock = psync_lock_file(local_.c_str());
+  ASSERT_NE(lock, nullptr);
+  EXPECT_EQ(Download(), -1);
+  psync_unlock_file(lock);
+  EXPECT_EQ(TaskInProgress(), 0);
+  EXPECT_EQ(LocalFiles(), 0);
+}
+
+// Large files that can not start yet wait in workers of their own, a small file
+// queued behind many of them is still downloaded.
+TEST_F(DownloadTest, SmallFilesDoNotWaitForLargeOnes) {
+  const int kLarge = 3 * PSYNC_DOWNLOAD_WORKERS;
+  const uint64_t kLargeSize = 16 * 1024 * 1024, kSmallTaskId = 1000;
+  // more is pending than PSYNC_START_NEW_DOWNLOADS_THRESHOLD, so no large
+  // file is admitted
+  psync_status.bytestodownloadcurrent += 4 * PSYNC_START_NEW_DOWNLOADS_THRESHOLD;
+  for (int i = 0; i < kLarge; i++) {
+    std::string id = std::to_string(100 + i), name = "'large" + id + "'";
+    Run("INSERT INTO file (id, parentfolderid, userid, size, hash, name, "
+        "ctime, mtime) VALUES (" + id + ", " + std::to_string(kFolderId) +
+        ", 0, " + std::to_string(kLargeSize) + ", " + id + ", " + name +
+        ", 1600000000, 1600000000)");
+    Run("INSERT INTO task (id, type, syncid, itemid, localitemid, inprogress, "
+        "name) VALUES (" + id + ", " + std::to_string(PSYNC_DOWNLOAD_FILE) +
+        ", " + std::to_string(kSyncId) + ", " + id + ", 0, 0, " + name + ")");
+  }
+  Run("INSERT INTO task (id, type, syncid, itemid, localitemid, inprogress, "
+      "name) VALUES (" + std::to_string(kSmallTaskId) + ", " +
+      std::to_string(PSYNC_DOWNLOAD_FILE) + ", " + std::to_string(kSyncId) +
+      ", " + std::to_string(kFileId) + ", 0, 0, 'file.txt')");
+  psync_set_status(PSTATUS_TYPE_RUN, PSTATUS_RUN_RUN);
+  psync_set_status(PSTATUS_TYPE_ONLINE, PSTATUS_ONLINE_ONLINE);
+  psync_set_status(PSTATUS_TYPE_AUTH, PSTATUS_AUTH_PROVIDED);
+  psync_download_init();
+  std::string small =
+      "SELECT COUNT(*) FROM task WHERE id=" + std::to_string(kSmallTaskId);
+  for (int i = 0; i < 100 && psync_sql_cellint(small.c_str(), -1); i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(psync_sql_cellint(small.c_str(), -1), 0);
+  EXPECT_EQ(LocalFiles(), 1);
+  EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM task WHERE id>=100 AND "
+                              "id<1000 AND inprogress!=1",
+                              -1),
+            kLarge);
+
+  // the dispatcher and the workers wait for the run status before they touch
+  // the database again
+  psync_set_status(PSTATUS_TYPE_RUN, PSTATUS_RUN_STOP);
+  psync_stop_all_download();
+  psync_wake_download();
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  psync_status.bytestodownloadcurrent -= 4 * PSYNC_START_NEW_DOWNLOADS_THRESHOLD;
+}
@@ -0,0 +1,237 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "pcloudcc/psync/compat.h"
+#include "psync/pcrypto.h"
+#include "psync/pfscrypto.h"
+#include "psync/plibs.h"
+#include "psync/pmemlock.h"
+#include "psync/psettings.h"
+#include "psync/ptimer.h"
+}
+
+namespace {
+
+const size_t kSector = PSYNC_CRYPTO_SECTOR_SIZE;
+
+// A new encrypted file with its data and log in a temporary cache directory,
+// written and read the way the file system does with the file locked.
+class FsCryptoTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    psync_locked_init();
+    psync_compat_init();
+    psync_timer_init();
+  }
+
+  void SetUp() override {
+    char dir[] = "/tmp/psyncfscryptoXXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+    ASSERT_EQ(psync_sql_connect((dir_ + "/data.db").c_str()), 0);
+    ASSERT_EQ(psync_sql_statement(
+                  ("REPLACE INTO setting (id, value) VALUES ('fscachepath', '" +
+                   dir_ + "')").c_str()),
+              0);
+    psync_settings_init();
+
+    of_ = static_cast<psync_openfile_t *>(psync_malloc(sizeof(psync_openfile_t)));
+    memset(of_, 0, sizeof(psync_openfile_t));
+    pthread_mutex_init(&of_->mutex, NULL);
+    of_->fileid = -1;
+    of_->currentname = psync_strdup("file");
+    of_->newfile = 1;
+    of_->encrypted = 1;
+    of_->indexfile = INVALID_HANDLE_VALUE;
+    psync_symmetric_key_t key = psync_crypto_aes256_sector_gen_key();
+    of_->encoder = psync_crypto_aes256_sector_encoder_decoder_create(key);
+    psync_ssl_free_symmetric_key(key);
+    ASSERT_NE(of_->encoder, nullptr);
+
+    // the log is named after the file id the way finalizing expects it
+    psync_fsfileid_t fileid = -of_->fileid;
+    char hex[sizeof(psync_fsfileid_t) * 2 + 1];
+    psync_binhex(hex, &fileid, sizeof(psync_fsfileid_t));
+    data_ = dir_ + "/" + std::string(hex, sizeof(psync_fsfileid_t)) + "d";
+    log_ = dir_ + "/" + std::string(hex, sizeof(psync_fsfileid_t)) + "l";
+    of_->datafile = psync_file_open(data_.c_str(), P_O_RDWR, P_O_CREAT | P_O_TRUNC);
+    ASSERT_NE(of_->datafile, INVALID_HANDLE_VALUE);
+    of_->logfile = psync_file_open(log_.c_str(), P_O_RDWR, P_O_CREAT | P_O_TRUNC);
+    ASSERT_NE(of_->logfile, INVALID_HANDLE_VALUE);
+    ASSERT_EQ(psync_fs_crypto_init_log(of_), 0);
+  }
+
+  void TearDown() override {
+    if (of_) {
+      psync_tree_for_each_element_call_safe(of_->sectorsinlog, psync_sector_inlog_t,
+                                            tree, psync_free);
+      psync_interval_tree_free(of_->writeintervals);
+      if (of_->logfile != INVALID_HANDLE_VALUE)
+        psync_file_close(of_->logfile);
+      if (of_->datafile != INVALID_HANDLE_VALUE)
+        psync_file_close(of_->datafile);
+      psync_crypto_aes256_sector_encoder_decoder_free(of_->encoder);
+      pthread_mutex_destroy(&of_->mutex);
+      psync_free(of_->currentname);
+      psync_free(of_);
+    }
+    psync_sql_close();
+    for (const char *name : {"/data.db", "/data.db-wal", "/data.db-shm"})
+      unlink((dir_ + name).c_str());
+    unlink(data_.c_str());
+    unlink(log_.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  int Write(const std::string &data, uint64_t offset) {
+    pthread_mutex_lock(&of_->mutex);
+    return psync_fs_crypto_write_newfile_locked(of_, data.data(), data.size(),
+                                                offset);
+  }
+
+  std::string Read(uint64_t size, uint64_t offset) {
+    std::string buff(size, '\0');
+    pthread_mutex_lock(&of_->mutex);
+    int rd = psync_fs_crypto_read_newfile_locked(of_, &buff[0], size, offset);
+    buff.resize(rd > 0 ? rd : 0);
+    return buff;
+  }
+
+  // Writes the auth tree and applies the log to the data file.
+  int Flush() {
+    pthread_mutex_lock(&of_->mutex);
+    int ret = psync_fs_crypto_flush_file(of_);
+    pthread_mutex_unlock(&of_->mutex);
+    return ret;
+  }
+
+  std::string ReadData(uint64_t offset, uint32_t size) {
+    std::string buff(size, '\0');
+    EXPECT_EQ(psync_file_pread(of_->datafile, &buff[0], size, offset),
+              static_cast<ssize_t>(size));
+    return buff;
+  }
+
+  // Checks that every auth sector in the data file is signed in its parent and
+  // the top one in the master auth.
+  void ExpectValidTree() {
+    psync_crypto_offsets_t offsets;
+    psync_fs_crypto_offsets_by_plainsize(
+        psync_fs_crypto_plain_size(psync_file_size(of_->datafile)), &offsets);
+    ASSERT_TRUE(offsets.needmasterauth);
+    uint64_t sectors = (offsets.plainsize + kSector - 1) / kSector;
+    uint64_t step = 1;
+    for (uint32_t level = 0; level < offsets.treelevels; level++) {
+      step *= PSYNC_CRYPTO_HASH_TREE_SECTORS;
+      for (uint64_t id = 0; id < sectors; id += step) {
+        uint64_t off, poff;
+        uint32_t size, psize, authid, pauthid;
+        psync_crypto_sector_auth_t auth;
+        psync_fs_crypto_get_auth_sector_off(id, level, &offsets, &off, &size,
+                                            &authid);
+        std::string sector = ReadData(off, size);
+        psync_crypto_sign_auth_sector(
+            of_->encoder, reinterpret_cast<const unsigned char *>(sector.data()),
+            size, auth);
+        if (level + 1 < offsets.treelevels) {
+          psync_fs_crypto_get_auth_sector_off(id, level + 1, &offsets, &poff,
+                                              &psize, &pauthid);
+          poff += pauthid * PSYNC_CRYPTO_AUTH_SIZE;
+        } else {
+          poff = offsets.masterauthoff;
+        }
+        ASSERT_EQ(ReadData(poff, PSYNC_CRYPTO_AUTH_SIZE),
+                  std::string(reinterpret_cast<char *>(auth), sizeof(auth)))
+            << "level " << level << " sector " << id;
+      }
+    }
+  }
+
+  static std::string Content(size_t len, uint32_t seed) {
+    std::string data(len, '\0');
+    uint32_t x = seed;
+    for (char &ch : data) {
+      x = x * 1103515245 + 12345;
+      ch = static_cast<char>(x >> 16);
+    }
+    return data;
+  }
+
+  std::string dir_;
+  std::string data_;
+  std::string log_;
+  psync_openfile_t *of_ = nullptr;
+};
+
+}  // namespace
+
+// More than one level 1 auth sector, so level 0 signatures are handed to the
+// workers across several parents.
+TEST_F(FsCryptoTest, WritesAValidAuthTree) {
+  const size_t kSize = (PSYNC_CRYPTO_HASH_TREE_SECTORS + 3) *
+                           PSYNC_CRYPTO_HASH_TREE_SECTORS * kSector + 1234;
+  std::string data = Content(kSize, 1);
+  for (size_t off = 0; off < kSize; off += 256 * 1024) {
+    std::string part = data.substr(off, 256 * 1024);
+    ASSERT_EQ(Write(part, off), static_cast<int>(part.size()));
+  }
+  ASSERT_EQ(Flush(), 0);
+  ExpectValidTree();
+  EXPECT_TRUE(Read(kSize, 0) == data);
+}
+
+// A write past the end fills the gap with zero sectors encoded by the workers
+// in several batches.
+TEST_F(FsCryptoTest, FillsAGapWithZeroes) {
+  const size_t kGap = PSYNC_CRYPTO_EXTENDER_BATCH * 3 * kSector + 100;
+  std::string head = Content(5000, 2), tail = Content(7000, 3);
+  ASSERT_EQ(Write(head, 0), static_cast<int>(head.size()));
+  ASSERT_EQ(Write(tail, head.size() + kGap), static_cast<int>(tail.size()));
+  std::string expect = head + std::string(kGap, '\0') + tail;
+  EXPECT_TRUE(Read(expect.size(), 0) == expect);
+  ASSERT_EQ(Flush(), 0);
+  ExpectValidTree();
+  EXPECT_TRUE(Read(expect.size(), 0) == expect);
+}
+
+// Writes 1 GB in 128 KB calls and flushes it, then extends the file by
+// another 1 GB of zeroes.
+TEST_F(FsCryptoTest, DISABLED_BenchmarkWrite1Gb) {
+  const size_t kChunk = 128 * 1024;
+  const uint64_t kSize = 1024ULL * 1024 * 1024;
+  std::string chunk = Content(kChunk, 4);
+  auto now = [] { return std::chrono::steady_clock::now(); };
+  auto secs = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+  };
+
+  auto start = now();
+  for (uint64_t off = 0; off < kSize; off += kChunk)
+    ASSERT_EQ(Write(chunk, off), static_cast<int>(kChunk));
+  auto written = now();
+  ASSERT_EQ(Flush(), 0);
+  auto flushed = now();
+  ASSERT_EQ(Write("x", 2 * kSize - 1), 1);
+  ASSERT_EQ(Flush(), 0);
+  auto extended = now();
+  printf("write %.0f MB/s, flush %.3f s, 1 GB of zeroes %.0f MB/s\n",
+         1024 / secs(written - start), secs(flushed - written),
+         1024 / secs(extended - flushed));
+}
@@ -0,0 +1,94 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "psync/plibs.h"
+#include "psync/pnetlibs.h"
+}
+
+namespace {
+
+const time_t kNow = 1600000000;
+
+psync_host_score_t Score(const char *host, uint32_t connectms, uint32_t kbps,
+                         time_t backoffuntil = 0) {
+  psync_host_score_t hs;
+  memset(&hs, 0, sizeof(hs));
+  strcpy(hs.host, host);
+  hs.connectms = connectms;
+  hs.kbps = kbps;
+  hs.backoffuntil = backoffuntil;
+  hs.lastused = kNow;
+  return hs;
+}
+
+std::vector<std::string> Order(const std::vector<psync_host_score_t> &scores,
+                               const std::vector<const char *> &names) {
+  const char *ordered[PSYNC_HOSTS_MAX_ORDER];
+  uint32_t cnt = psync_hosts_order_names(scores.data(), scores.size(), kNow,
+                                         names.data(), names.size(), ordered);
+  return std::vector<std::string>(ordered, ordered + cnt);
+}
+
+}  // namespace
+
+TEST(HostsTest, PutsUnmeasuredHostsFirst) {
+  std::vector<psync_host_score_t> scores = {Score("a", 50, 10000),
+                                            Score("b", 0, 0)};
+  EXPECT_EQ(Order(scores, {"a", "b", "c"}),
+            std::vector<std::string>({"b", "c", "a"}));
+}
+
+// The time to download PSYNC_HOSTS_SCORE_BYTES counts, not only the connect
+// time.
+TEST(HostsTest, OrdersByExpectedDownloadTime) {
+  std::vector<psync_host_score_t> scores = {
+      Score("fastconnect", 10, 1000), Score("fastlink", 100, 100000),
+      Score("slow", 200, 500)};
+  EXPECT_EQ(Order(scores, {"slow", "fastconnect", "fastlink"}),
+            std::vector<std::string>({"fastlink", "fastconnect", "slow"}));
+}
+
+TEST(HostsTest, PutsBackedOffHostsLast) {
+  std::vector<psync_host_score_t> scores = {
+      Score("down", 1, 100000, kNow + 60), Score("expired", 300, 1000, kNow),
+      Score("up", 500, 1000)};
+  EXPECT_EQ(Order(scores, {"down", "up", "expired"}),
+            std::vector<std::string>({"expired", "up", "down"}));
+}
+
+TEST(HostsTest, KeepsTheServerOrderForTies) {
+  std::vector<psync_host_score_t> scores = {Score("a", 20, 1000),
+                                            Score("b", 20, 1000)};
+  EXPECT_EQ(Order(scores, {"b", "x", "a", "y"}),
+            std::vector<std::string>({"x", "y", "b", "a"}));
+  EXPECT_EQ(Order({}, {"p", "q", "r"}),
+            std::vector<std::string>({"p", "q", "r"}));
+}
+
+TEST(HostsTest, SortsAtMostMaxOrderNames) {
+  std::vector<std::string> storage;
+  std::vector<const char *> names;
+  for (int i = 0; i < PSYNC_HOSTS_MAX_ORDER + 4; i++)
+    storage.push_back("host" + std::to_string(i));
+  for (const std::string &s : storage)
+    names.push_back(s.c_str());
+  std::vector<psync_host_score_t> scores = {Score("host0", 900, 100)};
+  auto ordered = Order(scores, names);
+  ASSERT_EQ(ordered.size(), static_cast<size_t>(PSYNC_HOSTS_MAX_ORDER));
+  EXPECT_EQ(ordered.front(), "host1");
+  EXPECT_EQ(ordered.back(), "host0");
+}
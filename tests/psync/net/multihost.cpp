@@ -0,0 +1,241 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "psync/papi.h"
+#include "psync/pcache.h"
+#include "psync/plibs.h"
+#include "psync/pnetlibs.h"
+#include "psync/psettings.h"
+#include "psync/ptimer.h"
+}
+
+namespace {
+
+const size_t kBody = 512 * 1024;
+const size_t kChunk = 32 * 1024;
+
+// Binds a socket to a free port on the loopback, returns the socket and sets
+// the port.
+int Bind(int *port) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd, reinterpret_cast<struct sockaddr *>(&addr), len) ||
+      getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr), &len))
+    return -1;
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+// An HTTP server on the loopback that answers every request with kBody bytes,
+// sent in kChunk pieces with delay between them. Connections are served one
+// at a time.
+class Listener {
+ public:
+  explicit Listener(int delayms) : delayms_(delayms) {
+    fd_ = Bind(&port_);
+    if (fd_ >= 0 && !listen(fd_, 16))
+      thread_ = std::thread(&Listener::Serve, this);
+  }
+
+  ~Listener() {
+    shutdown(fd_, SHUT_RDWR);
+    if (thread_.joinable())
+      thread_.join();
+    close(fd_);
+  }
+
+  std::string Host() const { return "127.0.0.1:" + std::to_string(port_); }
+
+ private:
+  void Serve() {
+    int fd;
+    while ((fd = accept(fd_, nullptr, nullptr)) >= 0) {
+      std::string req;
+      char buff[1024];
+      ssize_t rd;
+      while (req.find("\r\n\r\n") == std::string::npos &&
+             (rd = read(fd, buff, sizeof(buff))) > 0)
+        req.append(buff, rd);
+      if (req.find("\r\n\r\n") != std::string::npos) {
+        std::string head = "HTTP/1.1 200 OK\r\nContent-Length: " +
+                           std::to_string(kBody) + "\r\n\r\n";
+        std::string chunk(kChunk, 'x');
+        bool ok = write(fd, head.data(), head.size()) ==
+                  static_cast<ssize_t>(head.size());
+        for (size_t sent = 0; ok && sent < kBody; sent += kChunk) {
+          if (delayms_)
+            std::this_thread::sleep_for(std::chrono::milliseconds(delayms_));
+          ok = write(fd, chunk.data(), kChunk) == static_cast<ssize_t>(kChunk);
+        }
+      }
+      close(fd);
+    }
+  }
+
+  int delayms_;
+  int fd_;
+  int port_ = 0;
+  std::thread thread_;
+};
+
+// A port on the loopback nobody listens on, connections to it are refused.
+std::string DeadHost() {
+  int port = 0;
+  int fd = Bind(&port);
+  close(fd);
+  return "127.0.0.1:" + std::to_string(port);
+}
+
+// An array of host names the way the servers send them.
+class Hosts {
+ public:
+  explicit Hosts(const std::vector<std::string> &names) {
+    for (const std::string &name : names) {
+      binresult *res = static_cast<binresult *>(
+          calloc(1, offsetof(binresult, str) + name.size() + 1));
+      res->type = PARAM_STR;
+      res->length = name.size();
+      memcpy(const_cast<char *>(res->str), name.c_str(), name.size() + 1);
+      items_.push_back(res);
+    }
+    array_ = static_cast<binresult *>(calloc(1, sizeof(binresult)));
+    array_->type = PARAM_ARRAY;
+    array_->length = items_.size();
+    array_->array = items_.data();
+  }
+
+  ~Hosts() {
+    for (binresult *res : items_)
+      free(res);
+    free(array_);
+  }
+
+  const binresult *Get() const { return array_; }
+
+ private:
+  std::vector<binresult *> items_;
+  binresult *array_;
+};
+
+// The scoreboard is shared by the whole process, so every test uses listeners
+// of its own.
+class MultihostTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    psync_timer_init();
+    psync_cache_init();
+    psync_netlibs_init();
+  }
+
+  void SetUp() override {
+    char dir[] = "/tmp/psyncmultihostXXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+    ASSERT_EQ(psync_sql_connect((dir_ + "/data.db").c_str()), 0);
+    // the listeners speak plain HTTP
+    psync_setting_set_bool(_PS(usessl), 0);
+  }
+
+  void TearDown() override {
+    psync_sql_close();
+    for (const char *name : {"/data.db", "/data.db-wal", "/data.db-shm"})
+      unlink((dir_ + name).c_str());
+    rmdir(dir_.c_str());
+  }
+
+  // Downloads the file from host the way range requests do, which measures
+  // the throughput of the host. Returns the number of bytes read.
+  static size_t Fetch(const std::string &host) {
+    std::string buff(kChunk, '\0');
+    size_t total = 0;
+    int rd;
+    psync_http_socket *http =
+        psync_http_connect(host.c_str(), "/file", 0, 0, NULL);
+    if (!http)
+      return 0;
+    while ((rd = psync_http_readall(http, &buff[0], buff.size())) > 0)
+      total += rd;
+    psync_http_close(http);
+    return total;
+  }
+
+  // The host psync_http_connect_multihost() connects to, empty if none.
+  static std::string Connect(const Hosts &hosts) {
+    const char *host = nullptr;
+    psync_http_socket *http =
+        psync_http_connect_multihost(hosts.Get(), &host);
+    if (!http)
+      return std::string();
+    std::string ret = host;
+    psync_http_close(http);
+    return ret;
+  }
+
+  // The server the API pool picks from servers.
+  static std::string PickApiServer(const Hosts &servers) {
+    char server[PSYNC_APISERVER_LEN];
+    psync_apipool_set_servers(servers.Get());
+    psync_apipool_get_server(server);
+    return server;
+  }
+
+  std::string dir_;
+};
+
+}  // namespace
+
+// Once both are measured the host with the faster downloads wins, whatever
+// the order of the servers.
+TEST_F(MultihostTest, PrefersTheFastestHost) {
+  Listener slow(10), fast(0);
+  ASSERT_EQ(Fetch(slow.Host()), kBody);
+  ASSERT_EQ(Fetch(fast.Host()), kBody);
+
+  EXPECT_EQ(Connect(Hosts({slow.Host(), fast.Host()})), fast.Host());
+  EXPECT_EQ(PickApiServer(Hosts({slow.Host(), fast.Host()})), fast.Host());
+}
+
+// A host that refuses connections is skipped and then backed off, so neither
+// new connections nor the API pool try it first anymore.
+TEST_F(MultihostTest, BacksOffHostsThatRefuseConnections) {
+  Listener live(0);
+  std::string dead = DeadHost();
+  EXPECT_EQ(Connect(Hosts({dead, live.Host()})), live.Host());
+
+  EXPECT_EQ(PickApiServer(Hosts({dead, live.Host()})), live.Host());
+  EXPECT_EQ(Connect(Hosts({dead, live.Host()})), live.Host());
+}
+
+// Hosts never measured go first, so that a new host gets its chance.
+TEST_F(MultihostTest, TriesHostsNeverMeasuredFirst) {
+  Listener known(0), fresh(10);
+  ASSERT_EQ(Fetch(known.Host()), kBody);
+
+  EXPECT_EQ(Connect(Hosts({known.Host(), fresh.Host()})), fresh.Host());
+}
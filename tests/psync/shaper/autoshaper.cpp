@@ -0,0 +1,148 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+#include "psync/pshaper.h"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <vector>
+
+// A sender paced by the auto shaper behind a single bottleneck, simulated in
+// steps of one millisecond. The RTT a sample reports left the queue one base
+// RTT earlier and is smoothed the way the kernel does it.
+class Bottleneck {
+ public:
+  Bottleneck(double capacity, uint64_t basertt)
+      : capacity_(capacity), basertt_(basertt), history_(basertt + 1, 0) {
+    psync_shaper_auto_init(&shaper_);
+  }
+
+  // Cross traffic sending at a fixed rate, regardless of the queue.
+  void SetCrossRate(double rate) { crossrate_ = rate; }
+
+  // Cross traffic that keeps a standing queue of the given delay, like a loss
+  // based flow filling the bottleneck buffer.
+  void SetCrossQueue(double ms) { crossqueue_ = ms; }
+
+  // The most the application has to send each second.
+  void SetAppRate(double rate) { apprate_ = rate; }
+
+  void Run(uint64_t ms, bool measure) {
+    for (uint64_t end = now_ + ms; now_ < end;) {
+      now_++;
+      double send = std::min<double>(shaper_.rate, apprate_) / 1000.0;
+      double cross = crossrate_ / 1000.0;
+      if (crossqueue_ > 0)
+        cross = std::max(0.0, capacity_ / 1000.0 * (crossqueue_ + 1.0) - queue_ - send);
+      queue_ += send + cross;
+      double drained = std::min(queue_, capacity_ / 1000.0);
+      double ours = send + cross > 0 ? drained * send / (send + cross) : 0;
+      queue_ -= drained;
+      double qdelay = queue_ / capacity_ * 1000.0;
+      history_[now_ % history_.size()] = (basertt_ + qdelay) * 1000.0;
+      double observed = history_[(now_ + 1) % history_.size()];
+      if (observed == 0)
+        observed = basertt_ * 1000.0;
+      srtt_ = srtt_ ? srtt_ * 7 / 8 + observed / 8 : observed;
+      if (!minrtt_ || srtt_ < minrtt_)
+        minrtt_ = srtt_;
+      psync_shaper_auto_update(&shaper_, now_, static_cast<uint64_t>(srtt_),
+                               static_cast<uint64_t>(minrtt_),
+                               static_cast<uint64_t>(send));
+      if (measure) {
+        delivered_ += ours;
+        qdelaysum_ += qdelay;
+        maxqdelay_ = std::max(maxqdelay_, qdelay);
+        measured_++;
+      }
+    }
+  }
+
+  // Share of the capacity delivered for the sender while measuring.
+  double Utilization() const {
+    return delivered_ / (measured_ / 1000.0) / capacity_;
+  }
+  double AverageQueueDelay() const { return qdelaysum_ / measured_; }
+  double MaxQueueDelay() const { return maxqdelay_; }
+  uint64_t Rate() const { return shaper_.rate; }
+
+ private:
+  psync_shaper_auto_t shaper_;
+  double capacity_;
+  uint64_t basertt_;
+  std::vector<double> history_;
+  double crossrate_ = 0;
+  double crossqueue_ = 0;
+  double apprate_ = 1e12;
+  double queue_ = 0;
+  double srtt_ = 0;
+  double minrtt_ = 0;
+  uint64_t now_ = 0;
+  double delivered_ = 0;
+  double qdelaysum_ = 0;
+  double maxqdelay_ = 0;
+  uint64_t measured_ = 0;
+};
+
+TEST(AutoShaperTest, ConvergesOnShortPath) {
+  Bottleneck link(1.25e6, 20);
+  link.Run(30000, false);
+  link.Run(30000, true);
+  EXPECT_GT(link.Utilization(), 0.9);
+  EXPECT_LT(link.AverageQueueDelay(), 50.0);
+}
+
+TEST(AutoShaperTest, ConvergesOnFastPath) {
+  Bottleneck link(12.5e6, 20);
+  link.Run(30000, false);
+  link.Run(30000, true);
+  EXPECT_GT(link.Utilization(), 0.9);
+  EXPECT_LT(link.AverageQueueDelay(), 50.0);
+}
+
+TEST(AutoShaperTest, ConvergesOnLongPath) {
+  Bottleneck link(12.5e6, 300);
+  link.Run(30000, false);
+  link.Run(30000, true);
+  EXPECT_GT(link.Utilization(), 0.7);
+  EXPECT_LT(link.AverageQueueDelay(), 50.0);
+  EXPECT_LT(link.MaxQueueDelay(), 300.0);
+}
+
+TEST(AutoShaperTest, DoesNotCollapseOnSlowLongPath) {
+  Bottleneck link(125e3, 600);
+  link.Run(60000, false);
+  link.Run(60000, true);
+  EXPECT_GT(link.Utilization(), 0.7);
+  EXPECT_LT(link.AverageQueueDelay(), 100.0);
+}
+
+TEST(AutoShaperTest, UsesCapacityLeftByCrossTraffic) {
+  Bottleneck link(1.25e6, 50);
+  link.SetCrossRate(0.75e6);
+  link.Run(30000, false);
+  link.Run(30000, true);
+  EXPECT_GT(link.Utilization(), 0.3);
+  EXPECT_LT(link.AverageQueueDelay(), 50.0);
+}
+
+TEST(AutoShaperTest, YieldsToQueueFillingTraffic) {
+  Bottleneck link(1.25e6, 20);
+  link.Run(10000, false);
+  link.SetCrossQueue(100);
+  link.Run(10000, false);
+  link.Run(10000, true);
+  EXPECT_LT(link.Utilization(), 0.05);
+}
+
+TEST(AutoShaperTest, DoesNotGrowPastApplicationRate) {
+  Bottleneck link(12.5e6, 20);
+  link.SetAppRate(100e3);
+  link.Run(30000, false);
+  EXPECT_LT(link.Rate(), 1e6);
+}
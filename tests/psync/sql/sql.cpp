@@ -0,0 +1,471 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "psync/pcache.h"
+#include "psync/pfstasks.h"
+#include "psync/plibs.h"
+#include "psync/plocks.h"
+#include "psync/psettings.h"
+#include "psync/ptimer.h"
+
+// the primary connection, not declared in the headers
+extern sqlite3 *psync_db;
+}
+
+namespace {
+
+const int kAccounts = 16;
+const int kBalance = 100;
+const uint32_t kReaders = 4;
+
+class SqlTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    psync_timer_init();
+    psync_cache_init();
+  }
+
+  void SetUp() override {
+    char dir[] = "/tmp/psyncsqlXXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+    path_ = dir_ + "/data.db";
+  }
+
+  void TearDown() override {
+    if (connected_)
+      psync_sql_close();
+    for (const char *suffix : {"", "-wal", "-shm"})
+      unlink((path_ + suffix).c_str());
+    rmdir(dir_.c_str());
+  }
+
+  void Connect(uint32_t readers = PSYNC_DB_READ_CONNECTIONS) {
+    psync_sql_set_read_connections(readers);
+    ASSERT_EQ(psync_sql_connect(path_.c_str()), 0);
+    connected_ = true;
+  }
+
+  // Tries to take the lock of another instance on the database file.
+  bool OtherInstanceCanLock() const {
+    int fd = open(path_.c_str(), O_RDONLY);
+    if (fd == -1)
+      return false;
+    bool ret = !flock(fd, LOCK_EX | LOCK_NB);
+    close(fd);
+    return ret;
+  }
+
+  std::string dir_;
+  std::string path_;
+  bool connected_ = false;
+};
+
+int64_t Lookup(uint64_t id, bool primary) {
+  psync_sql_res *res;
+  psync_uint_row row;
+  int64_t ret = -1;
+  if (primary) {
+    psync_sql_rdlock();
+    res = psync_sql_query_nolock(
+        "SELECT name, size, ctime, mtime, id, parentfolderid FROM file "
+        "WHERE id=?");
+  } else {
+    res = psync_sql_query_rdlock(
+        "SELECT name, size, ctime, mtime, id, parentfolderid FROM file "
+        "WHERE id=?");
+  }
+  psync_sql_bind_uint(res, 1, id);
+  if ((row = psync_sql_fetch_rowint(res)))
+    ret = row[1];
+  psync_sql_free_result(res);
+  if (primary)
+    psync_sql_rdunlock();
+  return ret;
+}
+
+}  // namespace
+
+// Without read connections another client can not even read the database.
+TEST_F(SqlTest, LocksTheDatabaseExclusivelyByDefault) {
+  sqlite3 *other;
+  Connect();
+  ASSERT_EQ(psync_sql_statement("DELETE FROM setting WHERE id='nothing'"), 0);
+  EXPECT_NE(access((path_ + "-shm").c_str(), F_OK), 0);
+  ASSERT_EQ(sqlite3_open(path_.c_str(), &other), SQLITE_OK);
+  EXPECT_EQ(sqlite3_exec(other, "SELECT COUNT(*) FROM setting", NULL, NULL,
+                         NULL),
+            SQLITE_BUSY);
+  sqlite3_close(other);
+}
+
+// With read connections the database is shared with them and another
+// instance is kept out with a lock on the file instead.
+TEST_F(SqlTest, LocksTheDatabaseOfAFreshInstall) {
+  ASSERT_NE(access(path_.c_str(), F_OK), 0);
+  Connect(kReaders);
+  EXPECT_FALSE(OtherInstanceCanLock());
+  psync_sql_close();
+  connected_ = false;
+  EXPECT_TRUE(OtherInstanceCanLock());
+}
+
+TEST_F(SqlTest, RefusesADatabaseLockedByAnotherInstance) {
+  int fd = open(path_.c_str(), O_RDWR | O_CREAT, 0600);
+  ASSERT_NE(fd, -1);
+  ASSERT_EQ(flock(fd, LOCK_EX | LOCK_NB), 0);
+  psync_sql_set_read_connections(kReaders);
+  EXPECT_EQ(psync_sql_connect(path_.c_str()), -1);
+  close(fd);
+  Connect(kReaders);
+}
+
+// Transfers between accounts never change the total, a reader that sees a
+// different total saw half of a transaction.
+TEST_F(SqlTest, ReadersSeeConsistentSnapshots) {
+  const int kTransactions = 2000;
+  psync_sql_res *res;
+  Connect(kReaders);
+  ASSERT_EQ(psync_sql_statement("CREATE TABLE account (id INTEGER PRIMARY "
+                                "KEY, balance INTEGER, generation INTEGER)"),
+            0);
+  for (int i = 0; i < kAccounts; i++) {
+    res = psync_sql_prep_statement(
+        "INSERT INTO account (id, balance, generation) VALUES (?, ?, 0)");
+    psync_sql_bind_uint(res, 1, i);
+    psync_sql_bind_uint(res, 2, kBalance);
+    psync_sql_run_free(res);
+  }
+  // the database is not locked exclusively, so the read connections are used
+  EXPECT_EQ(access((path_ + "-shm").c_str(), F_OK), 0);
+  std::atomic<bool> done(false);
+  std::atomic<int> bad(0), reads(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++)
+    readers.emplace_back([&] {
+      int64_t lastgen = 0;
+      while (!done) {
+        psync_sql_res *r = psync_sql_query_rdlock(
+            "SELECT SUM(balance), MAX(generation) FROM account");
+        psync_uint_row row = psync_sql_fetch_rowint(r);
+        if (!row || row[0] != kAccounts * kBalance ||
+            (int64_t)row[1] < lastgen)
+          bad++;
+        else
+          lastgen = row[1];
+        psync_sql_free_result(r);
+        reads++;
+      }
+    });
+  for (int i = 1; i <= kTransactions; i++) {
+    psync_sql_start_transaction();
+    res = psync_sql_prep_statement(
+        "UPDATE account SET balance=balance-1, generation=? WHERE id=?");
+    psync_sql_bind_uint(res, 1, i);
+    psync_sql_bind_uint(res, 2, i % kAccounts);
+    psync_sql_run_free(res);
+    // the half-done transfer is visible to the writer itself
+    EXPECT_EQ(psync_sql_cellint("SELECT SUM(balance) FROM account", 0),
+              kAccounts * kBalance - 1);
+    res = psync_sql_prep_statement(
+        "UPDATE account SET balance=balance+1, generation=? WHERE id=?");
+    psync_sql_bind_uint(res, 1, i);
+    psync_sql_bind_uint(res, 2, (i * 7 + 3) % kAccounts);
+    psync_sql_run_free(res);
+    ASSERT_EQ(psync_sql_commit_transaction(), 0);
+  }
+  done = true;
+  for (auto &t : readers)
+    t.join();
+  EXPECT_EQ(bad, 0);
+  EXPECT_GT(reads, 0);
+  EXPECT_EQ(psync_sql_cellint("SELECT MAX(generation) FROM account", 0),
+            kTransactions);
+}
+
+// Lookups of files by id the way getattr does them, with the read lock held
+// on the primary connection locked exclusively as by default, on the primary
+// sharing the database with read connections and on the read connections.
+TEST_F(SqlTest, DISABLED_BenchmarkParallelGetattr) {
+  const int kFiles = 100000;
+  const int kLookups = 200000;
+  Connect();
+  psync_sql_start_transaction();
+  for (int i = 1; i <= kFiles; i++) {
+    psync_sql_res *res = psync_sql_prep_statement(
+        "INSERT INTO file (id, parentfolderid, userid, size, hash, name, "
+        "ctime, mtime, category, thumb) VALUES (?, 0, 0, ?, 0, ?, 0, 0, 0, 0)");
+    std::string name = "file" + std::to_string(i);
+    psync_sql_bind_uint(res, 1, i);
+    psync_sql_bind_uint(res, 2, i);
+    psync_sql_bind_string(res, 3, name.c_str());
+    psync_sql_run_free(res);
+  }
+  ASSERT_EQ(psync_sql_commit_transaction(), 0);
+  struct {
+    const char *name;
+    uint32_t readers;
+    bool primary;
+  } modes[] = {
+      {"exclusive", 0, true},
+      {"shared primary", kReaders, true},
+      {"read connections", kReaders, false},
+  };
+  for (auto &m : modes) {
+    psync_sql_close();
+    connected_ = false;
+    Connect(m.readers);
+    bool primary = m.primary;
+    for (int threads : {1, 2, 4, 8}) {
+      std::atomic<int> bad(0);
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::thread> workers;
+      for (int t = 0; t < threads; t++)
+        workers.emplace_back([&, t] {
+          uint64_t id = t * 7919 + 1;
+          for (int i = 0; i < kLookups / threads; i++) {
+            id = (id * 48271) % kFiles + 1;
+            if (Lookup(id, primary) != (int64_t)id)
+              bad++;
+          }
+        });
+      for (auto &w : workers)
+        w.join();
+      double secs = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+      EXPECT_EQ(bad, 0);
+      printf("%-17s %u threads %9.0f lookups/s\n", m.name, threads,
+             kLookups / secs);
+    }
+  }
+}
+
+// Getting a prepared statement through the call site id, through the SQL keyed
+// cache used before the ids and for sites past PSYNC_SQL_MAX_STMT_IDS, and
+// preparing it every time.
+TEST_F(SqlTest, DISABLED_BenchmarkStatementCache) {
+  const int kQueries = 200000;
+  const char *sql = "SELECT value FROM setting WHERE id=?";
+  Connect();
+  struct {
+    const char *name;
+    uint32_t id;
+    bool cached;
+  } modes[] = {
+      {"call site id", 0, true},
+      {"sql keyed cache", PSYNC_SQL_MAX_STMT_IDS, true},
+      {"no cache", 0, false},
+  };
+  for (auto &m : modes) {
+    psync_sql_rdlock();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kQueries; i++) {
+      psync_sql_res *res;
+      if (m.cached)
+        res = psync_sql_do_query_nolock(sql, &m.id, __FILE__, __LINE__);
+      else
+        res = psync_sql_query_nolock_nocache(sql);
+      psync_sql_bind_string(res, 1, "dbversion");
+      psync_sql_fetch_rowint(res);
+      if (m.cached)
+        psync_sql_free_result(res);
+      else
+        psync_sql_free_result_nocache(res);
+    }
+    double secs = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    psync_sql_rdunlock();
+    printf("%-16s %6.0f ns/query\n", m.name, secs * 1e9 / kQueries);
+  }
+}
+
+// One in PSYNC_SQL_LOCKPROF_SAMPLE acquisitions of a thread is timed and
+// counted for its call site, scaled back up in the report.
+TEST_F(SqlTest, ProfilesLockCallSites) {
+  const unsigned kLine = 12345;
+  const int kAcquisitions = 100 * PSYNC_SQL_LOCKPROF_SAMPLE;
+  Connect();
+  psync_sql_lockprof_enable(1);
+  std::thread([&] {
+    for (int i = 0; i < kAcquisitions; i++) {
+      psync_sql_do_rdlock("profiled.c", kLine);
+      psync_sql_rdunlock();
+    }
+  }).join();
+  psync_sql_lockprof_enable(0);
+  char *report = psync_sql_lockprof_dump(10);
+  std::string expected = "profiled.c:" + std::to_string(kLine) +
+                         " rd n=" + std::to_string(kAcquisitions) + " ";
+  EXPECT_NE(std::string(report).find(expected), std::string::npos) << report;
+  psync_free(report);
+}
+
+// A thread that took the lock while profiling and released it after profiling
+// was disabled is sampled again once profiling is enabled again.
+TEST_F(SqlTest, ProfilesAgainAfterDisablingUnderALock) {
+  const unsigned kLine = 23456;
+  const int kAcquisitions = 10 * PSYNC_SQL_LOCKPROF_SAMPLE;
+  Connect();
+  std::thread([&] {
+    psync_sql_lockprof_enable(1);
+    psync_sql_do_rdlock("profiled.c", kLine - 1);
+    psync_sql_lockprof_enable(0);
+    psync_sql_rdunlock();
+    psync_sql_lockprof_enable(1);
+    for (int i = 0; i < kAcquisitions; i++) {
+      psync_sql_do_rdlock("profiled.c", kLine);
+      psync_sql_rdunlock();
+    }
+    psync_sql_lockprof_enable(0);
+  }).join();
+  char *report = psync_sql_lockprof_dump(10);
+  std::string expected = "profiled.c:" + std::to_string(kLine) +
+                         " rd n=" + std::to_string(kAcquisitions) + " ";
+  EXPECT_NE(std::string(report).find(expected), std::string::npos) << report;
+  psync_free(report);
+}
+
+// Cost of an uncontended read lock with the profiler off and on, against the
+// bare lock without the profiler hooks.
+TEST_F(SqlTest, DISABLED_BenchmarkLockProfiler) {
+  const int kAcquisitions = 10000000;
+  Connect();
+  psync_rwlock_t bare;
+  psync_rwlock_init(&bare);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kAcquisitions; i++) {
+    psync_rwlock_rdlock(&bare);
+    psync_rwlock_unlock(&bare);
+  }
+  printf("bare lock     %5.1f ns/acquisition\n",
+         std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                 .count() *
+             1e9 / kAcquisitions);
+  psync_rwlock_destroy(&bare);
+  for (int enable : {0, 1, 0}) {
+    psync_sql_lockprof_enable(enable);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kAcquisitions; i++) {
+      psync_sql_rdlock();
+      psync_sql_rdunlock();
+    }
+    double secs = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    printf("profiling %-3s %5.1f ns/acquisition\n", enable ? "on" : "off",
+           secs * 1e9 / kAcquisitions);
+  }
+  psync_sql_lockprof_enable(0);
+}
+
+// While the committer waits for the lock, the updates of all threads queue up
+// and are committed together, not one transaction each.
+TEST_F(SqlTest, GroupsConcurrentMtimeUpdates) {
+  const int kThreads = 16;
+  std::atomic<int> commits(0), failed(0);
+  Connect();
+  psync_sql_start_transaction();
+  for (int i = 1; i <= kThreads; i++) {
+    psync_sql_res *res = psync_sql_prep_statement(
+        "INSERT INTO file (id, parentfolderid, userid, size, hash, name, "
+        "ctime, mtime, category, thumb) VALUES (?, 0, 0, 0, 0, ?, 0, 0, 0, 0)");
+    std::string name = "file" + std::to_string(i);
+    psync_sql_bind_uint(res, 1, i);
+    psync_sql_bind_string(res, 2, name.c_str());
+    psync_sql_run_free(res);
+  }
+  ASSERT_EQ(psync_sql_commit_transaction(), 0);
+  sqlite3_commit_hook(
+      psync_db,
+      [](void *ptr) {
+        (*static_cast<std::atomic<int> *>(ptr))++;
+        return 0;
+      },
+      &commits);
+  psync_sql_lock();
+  std::vector<std::thread> threads;
+  for (int i = 1; i <= kThreads; i++)
+    threads.emplace_back([&, i] {
+      if (psync_fstask_set_mtime(i, 0, 1000 + i, 0))
+        failed++;
+    });
+  // give every thread time to queue its update behind the lock
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  psync_sql_unlock();
+  for (auto &t : threads)
+    t.join();
+  sqlite3_commit_hook(psync_db, nullptr, nullptr);
+  EXPECT_EQ(failed, 0);
+  // the committer may have taken the first update before the others queued
+  EXPECT_LE(commits, 2);
+  EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM file WHERE mtime=1000+id",
+                              0),
+            kThreads);
+  EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM fstask", 0), kThreads);
+}
+
+TEST_F(SqlTest, GroupCommitRunsInPlaceUnderTheWriteLock) {
+  Connect();
+  psync_sql_lock();
+  EXPECT_EQ(psync_sql_group_commit_wait(
+                [](void *) {
+                  return psync_sql_statement(
+                      "INSERT INTO setting (id, value) VALUES ('t', 1)");
+                },
+                nullptr),
+            0);
+  psync_sql_unlock();
+  EXPECT_EQ(psync_sql_cellint("SELECT value FROM setting WHERE id='t'", 0), 1);
+  psync_sql_rdlock();
+  EXPECT_EQ(psync_sql_group_commit_wait([](void *) { return 0; }, nullptr),
+            -1);
+  psync_sql_rdunlock();
+}
+
+// Closing the database with the write lock held, as psync_destroy() does, runs
+// what is queued instead of waiting for the committer, which waits for the
+// lock itself.
+TEST_F(SqlTest, CloseUnderTheWriteLockCommitsTheQueue) {
+  std::atomic<int> result(1);
+  Connect();
+  psync_sql_lock();
+  psync_sql_group_commit(
+      [](void *) {
+        return psync_sql_statement(
+            "INSERT INTO setting (id, value) VALUES ('t', 1)");
+      },
+      [](void *ptr, int res) { *static_cast<std::atomic<int> *>(ptr) = res; },
+      &result);
+  // the committer is woken up and waits for the lock
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  ASSERT_EQ(psync_sql_close(), 0);
+  connected_ = false;
+  psync_sql_unlock();
+  EXPECT_EQ(result, 0);
+  Connect();
+  EXPECT_EQ(psync_sql_cellint("SELECT value FROM setting WHERE id='t'", 0), 1);
+}
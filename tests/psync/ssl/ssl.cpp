@@ -0,0 +1,51 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "psync/plibs.h"
+#include "psync/pssl.h"
+#include "psync/psynclib.h"
+}
+
+// Connections are made from many threads, none of the handshakes may be lost.
+TEST(SslTest, CountsHandshakesFromManyThreads) {
+  const int kThreads = 4, kPerThread = 10000;
+  uint64_t full, resumed, full2, resumed2;
+  psync_get_ssl_handshake_counts(&full, &resumed);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++)
+    threads.emplace_back([t] {
+      for (int i = 0; i < kPerThread; i++)
+        psync_ssl_handshake_done(nullptr, (i + t) % 4 == 0);
+    });
+  for (auto &th : threads)
+    th.join();
+  psync_get_ssl_handshake_counts(&full2, &resumed2);
+  EXPECT_EQ(full2 - full, kThreads * kPerThread * 3 / 4u);
+  EXPECT_EQ(resumed2 - resumed, kThreads * kPerThread / 4u);
+}
+
+TEST(SslTest, ReportsTheSameCountsAsTheLibrary) {
+  psync_ssl_handshake_stats_t stats;
+  uint64_t full, resumed;
+  psync_ssl_handshake_done("example.com", 1);
+  psync_ssl_handshake_done("example.com", 0);
+  psync_ssl_get_handshake_stats(&stats);
+  psync_get_ssl_handshake_counts(&full, &resumed);
+  EXPECT_EQ(full, stats.full);
+  EXPECT_EQ(resumed, stats.resumed);
+  EXPECT_GE(full, 1u);
+  EXPECT_GE(resumed, 1u);
+}
@@ -0,0 +1,132 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <string>
+#include <unistd.h>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "psync/pcache.h"
+#include "psync/plibs.h"
+#include "psync/psettings.h"
+#include "psync/pstatus.h"
+#include "psync/ptasks.h"
+#include "psync/ptimer.h"
+}
+
+namespace {
+
+class StatusTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    psync_timer_init();
+    psync_cache_init();
+  }
+
+  void SetUp() override {
+    char dir[] = "/tmp/psyncstatusXXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+    path_ = dir_ + "/data.db";
+    ASSERT_EQ(psync_sql_connect(path_.c_str()), 0);
+    psync_settings_init();
+    psync_set_status(PSTATUS_TYPE_RUN, PSTATUS_RUN_RUN);
+    psync_status_upload_clear();
+    for (int syncid : {1, 2})
+      Sql("INSERT INTO syncfolder (id, localpath, synctype, flags) VALUES (" +
+          std::to_string(syncid) + ", '/tmp/sync" + std::to_string(syncid) +
+          "', 3, 0)");
+  }
+
+  void TearDown() override {
+    psync_status_upload_clear();
+    psync_sql_close();
+    for (const char *suffix : {"", "-wal", "-shm"})
+      unlink((path_ + suffix).c_str());
+    rmdir(dir_.c_str());
+  }
+
+  static void Sql(const std::string &sql) {
+    ASSERT_EQ(psync_sql_statement(sql.c_str()), 0) << sql;
+  }
+
+  static void AddFile(uint64_t id, uint32_t syncid, uint64_t size) {
+    Sql("INSERT INTO localfile (id, syncid, size, name) VALUES (" +
+        std::to_string(id) + ", " + std::to_string(syncid) + ", " +
+        std::to_string(size) + ", 'file" + std::to_string(id) + "')");
+  }
+
+  // The totals after a recalculation, which must match what counting the
+  // tasks in the database gives.
+  static void ExpectTotals(uint32_t files, uint64_t bytes) {
+    psync_status_recalc_to_upload();
+    EXPECT_EQ(psync_status.filestoupload, files);
+    EXPECT_EQ(psync_status.bytestoupload, bytes);
+    EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM task t, localfile f "
+                                "WHERE t.type=" NTO_STR(PSYNC_UPLOAD_FILE)
+                                " AND t.localitemid=f.id",
+                                -1),
+              files);
+    EXPECT_EQ(psync_sql_cellint("SELECT IFNULL(SUM(f.size), 0) FROM task t, "
+                                "localfile f WHERE t.type=" NTO_STR(
+                                    PSYNC_UPLOAD_FILE) " AND t.localitemid=f.id",
+                                -1),
+              static_cast<int64_t>(bytes));
+  }
+
+  std::string dir_;
+  std::string path_;
+};
+
+}  // namespace
+
+TEST_F(StatusTest, CountsUploadTasksIncrementally) {
+  ExpectTotals(0, 0);
+  for (uint64_t id = 1; id <= 4; id++) {
+    AddFile(id, id == 4 ? 2 : 1, id * 10);
+    psync_task_upload_file_silent(id == 4 ? 2 : 1, id, "file");
+  }
+  ExpectTotals(4, 100);
+
+  Sql("DELETE FROM task WHERE localitemid=1");
+  psync_status_upload_task_removed(1);
+  // a task that is not counted changes nothing
+  psync_status_upload_task_removed(1);
+  psync_status_upload_task_removed(99);
+  ExpectTotals(3, 90);
+
+  Sql("UPDATE localfile SET size=25 WHERE id=2");
+  psync_status_upload_task_resized(2, 25);
+  ExpectTotals(3, 95);
+
+  Sql("DELETE FROM task WHERE syncid=1");
+  psync_status_upload_sync_removed(1);
+  ExpectTotals(1, 40);
+}
+
+// Tasks created behind the counters' back are only seen once they are
+// cleared, the database is not counted again on every recalculation.
+TEST_F(StatusTest, ReloadsTheCountersAfterAClear) {
+  AddFile(1, 1, 10);
+  psync_task_upload_file_silent(1, 1, "file");
+  ExpectTotals(1, 10);
+  AddFile(2, 1, 20);
+  Sql("INSERT INTO task (type, syncid, localitemid) VALUES (" NTO_STR(
+      PSYNC_UPLOAD_FILE) ", 1, 2)");
+  psync_status_recalc_to_upload();
+  EXPECT_EQ(psync_status.filestoupload, 1u);
+  psync_status_upload_clear();
+  ExpectTotals(2, 30);
+  // the task is already counted, adding it again must not count it twice
+  psync_status_upload_task_added(1, 2);
+  ExpectTotals(2, 30);
+}
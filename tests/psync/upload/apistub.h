@@ -0,0 +1,241 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#ifndef PCLOUD_TESTS_PSYNC_UPLOAD_APISTUB_H_
+#define PCLOUD_TESTS_PSYNC_UPLOAD_APISTUB_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "psync/papi.h"
+#include "psync/pcache.h"
+#include "psync/plibs.h"
+#include "psync/pnetlibs.h"
+}
+
+// Encodes responses the way the server does. Keys and values are appended in
+// order, hashes and arrays are closed with End().
+class Response {
+ public:
+  Response &Hash() { return Byte(16); }
+  Response &Array() { return Byte(17); }
+  Response &End() { return Byte(255); }
+  Response &Bool(bool val) { return Byte(val ? 19 : 18); }
+
+  Response &Num(uint64_t num) {
+    if (num < 20)
+      return Byte(200 + num);
+    Byte(15);
+    return Raw(&num, 8);
+  }
+
+  Response &Str(const std::string &str) {
+    if (str.size() < 50) {
+      Byte(100 + str.size());
+    } else {
+      uint32_t len = str.size();
+      Byte(3);
+      Raw(&len, 4);
+    }
+    return Raw(str.data(), str.size());
+  }
+
+  Response &Key(const std::string &key) { return Str(key); }
+
+  // The response with its length in front.
+  std::string Get() const {
+    uint32_t l = data_.size();
+    return std::string(reinterpret_cast<const char *>(&l), 4) + data_;
+  }
+
+ private:
+  Response &Byte(unsigned char b) { return Raw(&b, 1); }
+
+  Response &Raw(const void *data, size_t len) {
+    data_.append(static_cast<const char *>(data), len);
+    return *this;
+  }
+
+  std::string data_;
+};
+
+// A request as the stub got it.
+struct Request {
+  std::string cmd;
+  std::map<std::string, std::string> str;
+  std::map<std::string, uint64_t> num;
+  std::string data;
+};
+
+// An API server on the other end of socket pairs. The client ends are put in
+// the connection pool of the current API server, so psync_apipool_get()
+// returns them. Every request is answered by the handler, an empty answer
+// hangs up the connection. A connection that is closed by either side is
+// replaced, the pool keeps the given number of connections.
+class ApiStub {
+ public:
+  using Handler = std::function<std::string(const Request &)>;
+  using Upgrade = std::function<void(int fd, const Request &)>;
+
+  explicit ApiStub(uint32_t connections = 1) {
+    for (uint32_t i = 0; i < connections; i++)
+      Connect();
+  }
+
+  void SetHandler(Handler handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    handler_ = std::move(handler);
+  }
+
+  // Once the answer to a request for cmd is sent, the connection is given to
+  // upgrade, which speaks whatever the protocol becomes until it returns.
+  void SetUpgrade(const std::string &cmd, Upgrade upgrade) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    upgradecmd_ = cmd;
+    upgrade_ = std::move(upgrade);
+  }
+
+  std::vector<Request> Requests() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return requests_;
+  }
+
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    requests_.clear();
+  }
+
+  // Number of connections made so far.
+  uint32_t Connections() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return connections_;
+  }
+
+ private:
+  static void CloseSocket(void *ptr) {
+    psync_socket_close(static_cast<psync_socket *>(ptr));
+  }
+
+  void Connect() {
+    int fds[2];
+    char server[PSYNC_APISERVER_LEN];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+      return;
+    // the client end is non-blocking like a connected API socket
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    psync_socket *sock =
+        static_cast<psync_socket *>(psync_malloc(sizeof(psync_socket)));
+    memset(sock, 0, sizeof(psync_socket));
+    sock->sock = fds[0];
+    psync_apipool_get_server(server);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      connections_++;
+    }
+    psync_cache_add((std::string("API:") + server).c_str(), sock, 600,
+                    CloseSocket, 16);
+    std::thread(&ApiStub::Serve, this, fds[1]).detach();
+  }
+
+  static bool ReadAll(int fd, void *buff, size_t len) {
+    char *p = static_cast<char *>(buff);
+    while (len) {
+      ssize_t rd = read(fd, p, len);
+      if (rd <= 0)
+        return false;
+      p += rd;
+      len -= rd;
+    }
+    return true;
+  }
+
+  static bool ReadRequest(int fd, Request *req) {
+    uint16_t len;
+    uint64_t datalen = 0;
+    if (!ReadAll(fd, &len, 2))
+      return false;
+    std::string body(len, '\0');
+    if (!ReadAll(fd, &body[0], len))
+      return false;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(body.data());
+    size_t cmdlen = *p & 0x7f;
+    if (*p++ & 0x80) {
+      memcpy(&datalen, p, 8);
+      p += 8;
+    }
+    req->cmd.assign(reinterpret_cast<const char *>(p), cmdlen);
+    p += cmdlen;
+    size_t cnt = *p++;
+    for (size_t i = 0; i < cnt; i++) {
+      int type = *p >> 6;
+      std::string name(reinterpret_cast<const char *>(p + 1), *p & 0x3f);
+      p += 1 + name.size();
+      if (type == PARAM_STR) {
+        uint32_t slen;
+        memcpy(&slen, p, 4);
+        req->str[name].assign(reinterpret_cast<const char *>(p + 4), slen);
+        p += 4 + slen;
+      } else if (type == PARAM_NUM) {
+        memcpy(&req->num[name], p, 8);
+        p += 8;
+      } else {
+        req->num[name] = *p++;
+      }
+    }
+    req->data.resize(datalen);
+    return !datalen || ReadAll(fd, &req->data[0], datalen);
+  }
+
+  void Serve(int fd) {
+    Request req;
+    while (ReadRequest(fd, &req)) {
+      Handler handler;
+      Upgrade upgrade;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        requests_.push_back(req);
+        handler = handler_;
+        if (req.cmd == upgradecmd_)
+          upgrade = upgrade_;
+      }
+      std::string resp = handler ? handler(req) : std::string();
+      if (resp.empty() ||
+          write(fd, resp.data(), resp.size()) != static_cast<ssize_t>(resp.size()))
+        break;
+      if (upgrade) {
+        upgrade(fd, req);
+        break;
+      }
+      req = Request();
+    }
+    // the replacement is in the pool before the client sees the hangup
+    Connect();
+    close(fd);
+  }
+
+  std::mutex mutex_;
+  Handler handler_;
+  std::string upgradecmd_;
+  Upgrade upgrade_;
+  std::vector<Request> requests_;
+  uint32_t connections_ = 0;
+};
+
+#endif  // PCLOUD_TESTS_PSYNC_UPLOAD_APISTUB_H_
@@ -0,0 +1,449 @@
+// This file is part of the pCloud Console Client.
+//
+// (c) 2021 Serghei Iakovlev <egrep@protonmail.ch>
+//
+// For the full copyright and license information, please view
+// the LICENSE file that was distributed with this source code.
+
+#include "config.h"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "apistub.h"
+
+// plibs.h wraps the pthread mutex calls in macros, it goes after the headers
+// that use them.
+extern "C" {
+#include "psync/pcache.h"
+#include "psync/plibs.h"
+#include "psync/pnetlibs.h"
+#include "psync/psettings.h"
+#include "psync/pssl.h"
+#include "psync/psynclib.h"
+#include "psync/pstatus.h"
+#include "psync/ptimer.h"
+#include "psync/pupload.h"
+}
+
+namespace {
+
+const psync_syncid_t kSyncId = 1;
+const uint64_t kFolderId = 30;
+
+ApiStub *stub;
+
+// The checksum of a file with the given content, as the server reports it.
+std::string Checksum(const std::string &data) {
+  psync_hash_ctx hctx;
+  unsigned char bin[PSYNC_HASH_DIGEST_LEN], hex[PSYNC_HASH_DIGEST_HEXLEN];
+  psync_hash_init(&hctx);
+  psync_hash_update(&hctx, data.data(), data.size());
+  psync_hash_final(bin, &hctx);
+  psync_binhex(hex, bin, PSYNC_HASH_DIGEST_LEN);
+  return std::string(reinterpret_cast<char *>(hex), sizeof(hex));
+}
+
+// Answers uploadfile the way the server does, the file gets an id from its
+// name and the checksum of the data received.
+std::string UploadFileResponse(const Request &req, bool goodchecksum = true) {
+  std::string name = req.str.at("filename");
+  uint64_t fileid = 1000 + std::stoul(name.substr(4));
+  Response r;
+  r.Hash()
+      .Key("result").Num(0)
+      .Key("metadata").Array()
+          .Hash()
+              .Key("fileid").Num(fileid)
+              .Key("parentfolderid").Num(req.num.at("folderid"))
+              .Key("name").Str(name)
+              .Key("size").Num(req.data.size())
+              .Key("hash").Num(fileid * 7)
+              .Key("conflicted").Bool(false)
+          .End()
+      .End()
+      .Key("checksums").Array()
+          .Hash()
+              .Key(PSYNC_CHECKSUM)
+              .Str(Checksum(goodchecksum ? req.data : req.data + "x"))
+          .End()
+      .End()
+  .End();
+  return r.Get();
+}
+
+const uint64_t kChunk = PSYNC_UPLOAD_CHUNK_SIZE;
+const uint64_t kHangUp = UINT64_MAX;
+
+// Content for a file of four full chunks and a short one, big enough to be
+// uploaded in chunks.
+std::string BigContent(uint32_t seed) {
+  std::string data(4 * kChunk + 1000, '\0');
+  uint32_t x = seed;
+  for (char &ch : data) {
+    x = x * 1103515245 + 12345;
+    ch = static_cast<char>(x >> 16);
+  }
+  return data;
+}
+
+// The server side of big uploads, the data written to every upload is kept.
+// The result of each upload_write comes from the write function, kHangUp
+// hangs up instead of answering.
+class UploadServer {
+ public:
+  using WriteResult = std::function<uint64_t(uint64_t offset)>;
+
+  explicit UploadServer(WriteResult write = nullptr)
+      : write_(std::move(write)) {}
+
+  // An upload the server got before the test.
+  void Seed(uint64_t uploadid, const std::string &data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uploads_[uploadid] = data;
+  }
+
+  // The data of the upload that was saved as a file.
+  std::string Saved() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return saved_;
+  }
+
+  std::string Handle(const Request &req) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Response r;
+    if (req.cmd == "getfilesbychecksum") {
+      r.Hash().Key("result").Num(0).Key("metadata").Array().End().End();
+    } else if (req.cmd == "upload_create") {
+      uint64_t uploadid = nextid_++;
+      uploads_[uploadid].clear();
+      r.Hash().Key("result").Num(0).Key("uploadid").Num(uploadid).End();
+    } else if (req.cmd == "upload_write") {
+      uint64_t off = req.num.at("uploadoffset");
+      uint64_t result = write_ ? write_(off) : 0;
+      if (result == kHangUp)
+        return std::string();
+      if (!result) {
+        std::string &data = uploads_[req.num.at("uploadid")];
+        if (data.size() < off + req.data.size())
+          data.resize(off + req.data.size());
+        data.replace(off, req.data.size(), req.data);
+      }
+      r.Hash().Key("result").Num(result).End();
+    } else if (req.cmd == "upload_info") {
+      const std::string &data = uploads_[req.num.at("uploadid")];
+      r.Hash().Key("result").Num(0);
+      if (req.num.count("id"))
+        r.Key("id").Num(req.num.at("id"));
+      r.Key("size").Num(data.size())
+          .Key(PSYNC_CHECKSUM).Str(Checksum(data))
+      .End();
+    } else if (req.cmd == "upload_blockchecksums") {
+      // older uploads of the file have no blocks to copy from
+      r.Hash().Key("result").Num(2009).End();
+    } else if (req.cmd == "upload_save") {
+      saved_ = uploads_[req.num.at("uploadid")];
+      r.Hash()
+          .Key("result").Num(0)
+          .Key("metadata").Hash()
+              .Key("fileid").Num(2000)
+              .Key("name").Str(req.str.at("name"))
+              .Key("hash").Num(2001)
+              .Key("conflicted").Bool(false)
+          .End()
+      .End();
+    } else {
+      return std::string();
+    }
+    return r.Get();
+  }
+
+ private:
+  std::mutex mutex_;
+  WriteResult write_;
+  std::map<uint64_t, std::string> uploads_;
+  std::string saved_;
+  uint64_t nextid_ = 100;
+};
+
+// The offsets of the upload_write requests the stub got.
+std::vector<uint64_t> WriteOffsets() {
+  std::vector<uint64_t> offsets;
+  for (const Request &req : stub->Requests())
+    if (req.cmd == "upload_write")
+      offsets.push_back(req.num.at("uploadoffset"));
+  std::sort(offsets.begin(), offsets.end());
+  return offsets;
+}
+
+size_t CountRequests(const std::string &cmd) {
+  size_t cnt = 0;
+  for (const Request &req : stub->Requests())
+    if (req.cmd == cmd)
+      cnt++;
+  return cnt;
+}
+
+// A sync folder in a temporary directory with files older than
+// PSYNC_UPLOAD_OLDER_THAN_SEC, uploaded to a stub API server.
+class UploadTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    // shared by the tests, the upload pipeline keeps its connection
+    if (stub)
+      return;
+    psync_timer_init();
+    psync_cache_init();
+    psync_netlibs_init();
+    psync_apipool_set_server("stub.test");
+    psync_set_status(PSTATUS_TYPE_RUN, PSTATUS_RUN_RUN);
+    psync_set_status(PSTATUS_TYPE_ONLINE, PSTATUS_ONLINE_ONLINE);
+    psync_set_status(PSTATUS_TYPE_ACCFULL, PSTATUS_ACCFULL_QUOTAOK);
+    // the chunk workers of a big upload each take a connection
+    stub = new ApiStub(PSYNC_UPLOAD_CHUNK_WORKERS + 1);
+  }
+
+  void SetUp() override {
+    char dir[] = "/tmp/psyncuploadXXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+    path_ = dir_ + "/data.db";
+    ASSERT_EQ(psync_sql_connect(path_.c_str()), 0);
+    psync_setting_set_bool(_PS(usessl), 0);
+    Run("INSERT INTO syncfolder (id, folderid, localpath, synctype, flags) "
+        "VALUES (" + std::to_string(kSyncId) + ", NULL, '" + dir_ + "', " +
+        std::to_string(PSYNC_UPLOAD_ONLY) + ", 0)");
+    Run("INSERT INTO syncedfolder (syncid, folderid, localfolderid, synctype) "
+        "VALUES (" + std::to_string(kSyncId) + ", " +
+        std::to_string(kFolderId) + ", 0, " +
+        std::to_string(PSYNC_UPLOAD_ONLY) + ")");
+    stub->Clear();
+  }
+
+  void TearDown() override {
+    stub->SetHandler(nullptr);
+    psync_sql_close();
+    for (const char *suffix : {"", "-wal", "-shm"})
+      unlink((path_ + suffix).c_str());
+    for (const std::string &name : files_)
+      unlink((dir_ + "/" + name).c_str());
+    rmdir(dir_.c_str());
+  }
+
+  static void Run(const std::string &sql) {
+    ASSERT_EQ(psync_sql_statement(sql.c_str()), 0);
+  }
+
+  // Creates file<id> with the content and its localfile row.
+  void AddFile(uint64_t localfileid, const std::string &data) {
+    std::string name = "file" + std::to_string(localfileid);
+    std::string path = dir_ + "/" + name;
+    FILE *f = fopen(path.c_str(), "w");
+    ASSERT_NE(f, nullptr);
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+    struct utimbuf times;
+    times.actime = times.modtime = time(nullptr) - 60;
+    ASSERT_EQ(utime(path.c_str(), &times), 0);
+    files_.push_back(name);
+    Run("INSERT INTO localfile (id, localparentfolderid, syncid, size, "
+        "inode, mtime, mtimenative, name) VALUES (" +
+        std::to_string(localfileid) + ", 0, " + std::to_string(kSyncId) +
+        ", " + std::to_string(data.size()) + ", 0, 0, 0, '" + name + "')");
+  }
+
+  // The size and modification time of file<id>.
+  void Stat(uint64_t localfileid, uint64_t *size, uint64_t *mtime) {
+    struct stat st;
+    ASSERT_EQ(stat((dir_ + "/file" + std::to_string(localfileid)).c_str(), &st),
+              0);
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+  }
+
+  // An interrupted chunked upload of file<id> with the chunks at the offsets
+  // acknowledged, recorded for a file of the size and modification time.
+  static void AddChunks(uint64_t localfileid, uint64_t uploadid,
+                        const std::vector<uint64_t> &offsets, uint64_t size,
+                        uint64_t mtime) {
+    Run("INSERT INTO localfileupload (localfileid, uploadid) VALUES (" +
+        std::to_string(localfileid) + ", " + std::to_string(uploadid) + ")");
+    for (uint64_t off : offsets)
+      Run("INSERT INTO uploadchunk (uploadid, uploadoffset, length, filesize, "
+          "filemtime) VALUES (" + std::to_string(uploadid) + ", " +
+          std::to_string(off) + ", " + std::to_string(kChunk) + ", " +
+          std::to_string(size) + ", " + std::to_string(mtime) + ")");
+  }
+
+  static int64_t Chunks(uint64_t uploadid) {
+    return psync_sql_cellint(
+        ("SELECT COUNT(*) FROM uploadchunk WHERE uploadid=" +
+         std::to_string(uploadid))
+            .c_str(),
+        -1);
+  }
+
+  static int Upload(uint64_t localfileid) {
+    return psync_upload_file_task(localfileid, kSyncId, localfileid,
+                                  ("file" + std::to_string(localfileid)).c_str());
+  }
+
+  static int64_t RemoteId(uint64_t localfileid) {
+    return psync_sql_cellint(
+        ("SELECT fileid FROM localfile WHERE id=" + std::to_string(localfileid))
+            .c_str(),
+        -1);
+  }
+
+  std::string dir_;
+  std::string path_;
+  std::vector<std::string> files_;
+};
+
+}  // namespace
+
+// Uploads from several threads share the pipelined connection, every result
+// goes to the upload it belongs to.
+TEST_F(UploadTest, UploadsSmallFilesThroughThePipeline) {
+  const uint64_t kFiles = 6;
+  std::vector<std::string> content;
+  for (uint64_t id = 1; id <= kFiles; id++) {
+    content.push_back(std::string(id * 1000, 'a' + id));
+    AddFile(id, content.back());
+  }
+  uint32_t connections = stub->Connections();
+  stub->SetHandler([](const Request &req) { return UploadFileResponse(req); });
+  std::vector<std::thread> threads;
+  std::atomic<int> failed(0);
+  for (uint64_t id = 1; id <= kFiles; id++)
+    threads.emplace_back([id, &failed] {
+      if (Upload(id))
+        failed++;
+    });
+  for (auto &th : threads)
+    th.join();
+  EXPECT_EQ(failed, 0);
+  EXPECT_EQ(stub->Connections(), connections);
+  for (uint64_t id = 1; id <= kFiles; id++)
+    EXPECT_EQ(RemoteId(id), static_cast<int64_t>(1000 + id));
+  EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM hashchecksum", 0),
+            static_cast<int64_t>(kFiles));
+  std::vector<Request> reqs = stub->Requests();
+  ASSERT_EQ(reqs.size(), kFiles);
+  for (const Request &req : reqs) {
+    EXPECT_EQ(req.cmd, "uploadfile");
+    EXPECT_EQ(req.num.at("folderid"), kFolderId);
+    EXPECT_EQ(req.num.at("nopartial"), 1u);
+    EXPECT_EQ(req.str.at("ifhash"), "new");
+    uint64_t id = std::stoul(req.str.at("filename").substr(4));
+    EXPECT_EQ(req.data, content[id - 1]);
+  }
+}
+
+// The server got different data than the file has, the upload is retried.
+TEST_F(UploadTest, RetriesWhenTheServerChecksumDiffers) {
+  AddFile(1, "some content");
+  stub->SetHandler(
+      [](const Request &req) { return UploadFileResponse(req, false); });
+  EXPECT_EQ(Upload(1), -1);
+}
+
+// Every request on a connection that breaks fails, the next upload gets a new
+// connection.
+TEST_F(UploadTest, FailsTheRequestsOfABrokenConnection) {
+  AddFile(1, "first");
+  AddFile(2, "second");
+  uint32_t connections = stub->Connections();
+  stub->SetHandler([](const Request &req) { return std::string(); });
+  EXPECT_EQ(Upload(1), -1);
+  EXPECT_GT(stub->Connections(), connections);
+  stub->SetHandler([](const Request &req) { return UploadFileResponse(req); });
+  EXPECT_EQ(Upload(2), 0);
+  EXPECT_EQ(RemoteId(2), 1002);
+}
+
+// A chunk whose connection breaks is written again, the others are not.
+TEST_F(UploadTest, RetriesAFailedChunk) {
+  std::string content = BigContent(1);
+  AddFile(1, content);
+  std::atomic<bool> failed(false);
+  UploadServer server([&failed](uint64_t off) {
+    return off == kChunk && !failed.exchange(true) ? kHangUp : 0;
+  });
+  stub->SetHandler([&server](const Request &req) { return server.Handle(req); });
+  EXPECT_EQ(Upload(1), 0);
+  EXPECT_EQ(Checksum(server.Saved()), Checksum(content));
+  EXPECT_EQ(RemoteId(1), 2000);
+  EXPECT_EQ(WriteOffsets(), std::vector<uint64_t>(
+                                {0, kChunk, kChunk, 2 * kChunk, 3 * kChunk,
+                                 4 * kChunk}));
+  EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM uploadchunk", -1), 0);
+}
+
+// The chunks the server acknowledged before the upload was interrupted are
+// not written again.
+TEST_F(UploadTest, ResumesWithoutTheAcknowledgedChunks) {
+  const uint64_t kUploadId = 77;
+  std::string content = BigContent(2);
+  uint64_t size, mtime;
+  AddFile(1, content);
+  Stat(1, &size, &mtime);
+  AddChunks(1, kUploadId, {0, kChunk}, size, mtime);
+  UploadServer server;
+  server.Seed(kUploadId, content.substr(0, 2 * kChunk));
+  stub->SetHandler([&server](const Request &req) { return server.Handle(req); });
+  EXPECT_EQ(Upload(1), 0);
+  EXPECT_EQ(Checksum(server.Saved()), Checksum(content));
+  EXPECT_EQ(CountRequests("upload_create"), 0u);
+  EXPECT_EQ(WriteOffsets(),
+            std::vector<uint64_t>({2 * kChunk, 3 * kChunk, 4 * kChunk}));
+  EXPECT_EQ(Chunks(kUploadId), 0);
+}
+
+// The file changed after the chunks were written, the upload starts over
+// instead of keeping the old data.
+TEST_F(UploadTest, DiscardsTheChunksOfAChangedFile) {
+  const uint64_t kUploadId = 77;
+  std::string content = BigContent(3);
+  uint64_t size, mtime;
+  AddFile(1, content);
+  Stat(1, &size, &mtime);
+  AddChunks(1, kUploadId, {0, kChunk}, size, mtime - 1);
+  UploadServer server;
+  server.Seed(kUploadId, BigContent(4).substr(0, 2 * kChunk));
+  stub->SetHandler([&server](const Request &req) { return server.Handle(req); });
+  EXPECT_EQ(Upload(1), 0);
+  EXPECT_EQ(Checksum(server.Saved()), Checksum(content));
+  EXPECT_EQ(Chunks(kUploadId), 0);
+  EXPECT_EQ(CountRequests("upload_create"), 1u);
+  EXPECT_EQ(WriteOffsets(), std::vector<uint64_t>({0, kChunk, 2 * kChunk,
+                                                   3 * kChunk, 4 * kChunk}));
+}
+
+// A chunk the server refuses for good is not retried and the chunks written
+// so far are forgotten.
+TEST_F(UploadTest, ForgetsTheChunksOnPermanentFailure) {
+  AddFile(1, BigContent(5));
+  UploadServer server(
+      [](uint64_t off) -> uint64_t { return off == 3 * kChunk ? 2005 : 0; });
+  stub->SetHandler([&server](const Request &req) { return server.Handle(req); });
+  EXPECT_EQ(Upload(1), -1);
+  std::vector<uint64_t> offsets = WriteOffsets();
+  EXPECT_EQ(std::count(offsets.begin(), offsets.end(), 3 * kChunk), 1);
+  EXPECT_EQ(CountRequests("upload_save"), 0u);
+  EXPECT_EQ(psync_sql_cellint("SELECT COUNT(*) FROM uploadchunk", -1), 0);
+}